@@ -0,0 +1,21 @@
+# Attribute reads and writes, method calls and dict lookups on string keys
+print("=== Benchmark: attributes ===")
+class Point:
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+    def norm2(self):
+        return self.x * self.x + self.y * self.y
+
+p = Point(3, 4)
+d = {"alpha": 1, "beta": 2}
+
+start = time()
+i = 0
+t = 0
+while i < 200000:
+    t = p.norm2() + d["beta"]
+    p.x = p.y
+    i = i + 1
+print("t =", t)
+print("elapsed:", time() - start)
@@ -0,0 +1,11 @@
+# Small function called from a counted while loop
+print("=== Benchmark: function calls ===")
+def step(x):
+    return x + 1
+
+start = time()
+i = 0
+while i < 300000:
+    i = step(i)
+print("i =", i)
+print("elapsed:", time() - start)
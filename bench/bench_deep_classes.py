@@ -0,0 +1,41 @@
+# Instances of a class eight levels deep built in a loop, and a method
+# inherited from the root called at a site that sees six classes
+print("=== Benchmark: deep classes ===")
+class L0:
+    def __init__(self, v):
+        self.v = v
+    def get(self):
+        return self.v
+class L1(L0):
+    def one(self):
+        return 1
+class L2(L1):
+    def two(self):
+        return 2
+class L3(L2):
+    def three(self):
+        return 3
+class L4(L3):
+    def four(self):
+        return 4
+class L5(L4):
+    def five(self):
+        return 5
+class L6(L5):
+    def six(self):
+        return 6
+class L7(L6):
+    def seven(self):
+        return 7
+
+objs = [L2(2), L3(3), L4(4), L5(5), L6(6), L7(7)]
+
+start = time()
+total = 0
+for i in range(100000):
+    leaf = L7(i)
+    total = total + leaf.get()
+    for o in objs:
+        total = total + o.get()
+print("total =", total)
+print("elapsed:", time() - start)
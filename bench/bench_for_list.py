@@ -0,0 +1,15 @@
+# for loops over a list and a tuple, nested to get enough iterations
+print("=== Benchmark: for over list ===")
+row = [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20]
+cols = (1, 2, 3, 4, 5, 6, 7, 8, 9, 10)
+
+start = time()
+total = 0
+i = 0
+while i < 5000:
+    for x in row:
+        for c in cols:
+            total = total + x
+    i = i + 1
+print("total =", total)
+print("elapsed:", time() - start)
@@ -0,0 +1,8 @@
+# Counted for loop over range(): the counter never leaves the stack
+print("=== Benchmark: for range ===")
+start = time()
+total = 0
+for i in range(2000000):
+    total = total + 3
+print("total =", total)
+print("elapsed:", time() - start)
@@ -0,0 +1,30 @@
+# Small numeric functions called many times: hot enough for --jit
+print("=== Benchmark: numeric functions ===")
+def collatz_steps(n):
+    steps = 0
+    while n > 1:
+        half = n / 2
+        if half * 2 == n:
+            n = half
+        else:
+            n = 3 * n + 1
+        steps = steps + 1
+    return steps
+
+def sum_squares(n):
+    total = 0
+    for i in range(n):
+        total = total + i * i
+    return total
+
+start = time()
+longest = 0
+for k in range(1, 20000):
+    steps = collatz_steps(k)
+    if steps > longest:
+        longest = steps
+total = 0
+for k in range(3000):
+    total = total + sum_squares(100)
+print("longest =", longest, "total =", total)
+print("elapsed:", time() - start)
@@ -0,0 +1,27 @@
+# Method calls and attribute reads through a class hierarchy, two classes per site
+print("=== Benchmark: methods ===")
+class Shape:
+    def __init__(self, w, h):
+        self.w = w
+        self.h = h
+    def area(self):
+        return self.w * self.h
+    def scaled(self, k):
+        return self.area() * k
+class Square(Shape):
+    def __init__(self, side):
+        self.w = side
+        self.h = side
+class Box(Square):
+    def depth(self):
+        return self.w
+
+shapes = [Shape(2, 3), Box(4), Square(5), Box(2)]
+
+start = time()
+total = 0
+for i in range(50000):
+    for s in shapes:
+        total = total + s.scaled(2) + s.w
+print("total =", total)
+print("elapsed:", time() - start)
@@ -0,0 +1,14 @@
+# Nested while loops with a branch in the inner body
+print("=== Benchmark: nested loops ===")
+start = time()
+hits = 0
+i = 0
+while i < 1000:
+    j = 0
+    while j < 1000:
+        if j < i:
+            hits = hits + 1
+        j = j + 1
+    i = i + 1
+print("hits =", hits)
+print("elapsed:", time() - start)
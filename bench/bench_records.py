@@ -0,0 +1,17 @@
+# Many small records built, read once and dropped
+print("=== Benchmark: records ===")
+class Record:
+    def __init__(self, key, value):
+        self.key = key
+        self.value = value
+        self.count = 1
+
+start = time()
+i = 0
+t = 0
+while i < 200000:
+    r = Record(i, i * 2)
+    t = t + r.key + r.value + r.count
+    i = i + 1
+print("t =", t)
+print("elapsed:", time() - start)
@@ -0,0 +1,28 @@
+# Two-dimensional vectors added, scaled and compared through special methods
+print("=== Benchmark: vectors ===")
+class Vec:
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+    def __add__(self, other):
+        return Vec(self.x + other.x, self.y + other.y)
+    def __mul__(self, k):
+        return Vec(self.x * k, self.y * k)
+    def __eq__(self, other):
+        return self.x == other.x
+    def __getitem__(self, i):
+        return self.x
+
+start = time()
+i = 0
+v = Vec(0, 0)
+step = Vec(1, 2)
+hits = 0
+while i < 100000:
+    v = v + step * 2
+    if v == step:
+        hits = hits + 1
+    hits = hits + v[0] - v[1] + len([i])
+    i = i + 1
+print("v =", v.x, v.y, hits)
+print("elapsed:", time() - start)
@@ -0,0 +1,10 @@
+# Counted while loop: compare, add and store on every iteration
+print("=== Benchmark: while loop ===")
+start = time()
+i = 0
+total = 0
+while i < 2000000:
+    total = total + 3
+    i = i + 1
+print("total =", total)
+print("elapsed:", time() - start)
@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Benchmark runner for NanoPython
+# Builds the VM with switch dispatch and with computed-goto dispatch,
+# then runs every bench_*.py with both, and with the computed-goto build
+# plus --jit, and reports the best of RUNS wall-clock times (default 3).
+
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+NC='\033[0m' # No Color
+
+ROOT_DIR=".."
+OUTPUT="$ROOT_DIR/bench_output.txt"
+
+build() {
+    local dir=$1
+    shift
+    cmake -S "$ROOT_DIR" -B "$dir" -DCMAKE_BUILD_TYPE=Release "$@" > /dev/null || exit 1
+    cmake --build "$dir" --target NanoPython -j > /dev/null || exit 1
+}
+
+RUNS=${RUNS:-3}
+
+# Run a benchmark RUNS times and print the best wall-clock seconds
+run_timed() {
+    local exe=$1
+    local script=$2
+    shift 2
+    local best=""
+    local start end elapsed
+    for ((run = 0; run < RUNS; run++)); do
+        start=$(date +%s.%N)
+        "$exe" "$@" "$script" > /dev/null 2>&1
+        end=$(date +%s.%N)
+        elapsed=$(awk -v s="$start" -v e="$end" 'BEGIN { printf "%.3f", e - s }')
+        if [ -z "$best" ] || awk -v a="$elapsed" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+            best=$elapsed
+        fi
+    done
+    echo "$best"
+}
+
+echo "======================================="
+echo "   NanoPython Benchmarks"
+echo "======================================="
+echo
+
+build "$ROOT_DIR/build_bench_switch" -DNP_COMPUTED_GOTO=OFF
+build "$ROOT_DIR/build_bench_goto" -DNP_COMPUTED_GOTO=ON
+
+printf "%-28s %12s %12s %9s %12s\n" "benchmark" "switch (s)" "goto (s)" "speedup" "jit (s)" | tee "$OUTPUT"
+for bench_file in bench_*.py; do
+    t_switch=$(run_timed "$ROOT_DIR/build_bench_switch/NanoPython" "$bench_file")
+    t_goto=$(run_timed "$ROOT_DIR/build_bench_goto/NanoPython" "$bench_file")
+    t_jit=$(run_timed "$ROOT_DIR/build_bench_goto/NanoPython" "$bench_file" --jit)
+    speedup=$(awk -v a="$t_switch" -v b="$t_goto" 'BEGIN { printf "%.2f", a / b }')
+    printf "%-28s %12.3f %12.3f %8sx %12.3f\n" "$bench_file" "$t_switch" "$t_goto" "$speedup" "$t_jit" | tee -a "$OUTPUT"
+done
+
+echo
+echo -e "${GREEN}Results written to $OUTPUT${NC}"
@@ -149,6 +149,7 @@ typedef struct Ast {
             char* parent;  // Base class name (can be NULL)
             struct Ast** methods;  // Array of FuncDef nodes
             int method_count;
+            struct Ast* slots;     // Value assigned to __slots__, NULL if none
         }ClassDef;
 
         struct {
@@ -9,6 +9,14 @@ int bytecode_serialize(Bytecode* bytecode, const char* filename);
 // Load Bytecode instructions and constants from a file
 Bytecode* bytecode_deserialize(const char* filename);
 
+// Check the code from start on before it runs: every path from the module
+// entry at start and from each function defined there keeps the operand
+// stack balanced, never pops below its frame and stays within the code, and
+// every operand names a valid constant, global or local slot. Records the
+// deepest stack of each function in max_stack and of the module code in
+// bytecode->max_stack. Prints the first problem and returns 0 if any.
+int bytecode_verify(Bytecode* bytecode, int start);
+
 // Disassemble Bytecode instructions and constants to a file
 int bytecode_disasm(Bytecode* bytecode, const char* filename);
 
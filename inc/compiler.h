@@ -5,6 +5,8 @@
 #include "vm.h"
 #include "hashmap.h"
 
+#include "stdio.h"
+
 typedef struct {
     int loop_start;
     int* break_jumps;
@@ -14,16 +16,90 @@ typedef struct {
 
 #define MAX_LOOP_NESTING 16
 
+// Local variables of the function being compiled, resolved to frame slots
+typedef struct {
+    char** locals;      // Slot names, parameters first
+    int local_count;
+    int local_capacity;
+    int uses_scope;     // Body needs a Scope hashmap, locals are not slotted
+    int nested;         // Defined inside another function, free names go through the Scope chain
+} FunctionContext;
+
+// Top-level function whose calls may be expanded in place: its name is
+// bound by its def alone and its body has no loops, definitions, imports or
+// calls to itself
+typedef struct {
+    Ast* def;
+    FunctionContext context; // Its locals, parameters first
+    int size;                // AST nodes in the body
+    Ast* expression;         // Returned expression when that is the whole body, else NULL
+    int defined;             // Module code compiled from here on runs after the def
+} InlineCandidate;
+
+// Call the direct AST walk is expanding at module level. The parameters
+// live in hidden globals, the only locals module code has.
+typedef struct InlineSite {
+    InlineCandidate* callee;
+    int* param_slots;
+    struct InlineSite* caller;
+} InlineSite;
+
+// Inlining heuristic: bodies up to INLINE_MAX_SIZE AST nodes are expanded
+// at every call site, bigger ones up to INLINE_MAX_SIZE_IN_LOOP only in a
+// loop where the saved call pays off. INLINE_BUDGET caps the nodes
+// inlined into one function, or into the module code.
+#define INLINE_MAX_SIZE         (12)
+#define INLINE_MAX_SIZE_IN_LOOP (40)
+#define INLINE_MAX_DEPTH        (4)
+#define INLINE_BUDGET           (200)
+
+// Builtins whose results the type inference knows
+typedef enum {
+    BUILTIN_INT = 1,
+    BUILTIN_FLOAT = 2,
+    BUILTIN_RANGE = 4,
+} Builtin;
+
 typedef struct {
     Bytecode* bytecode;
     LoopContext loop_stack[MAX_LOOP_NESTING];
     int loop_count;
+    FunctionContext* function; // Function being compiled, NULL at module level
     HashMap imported_modules;  // Track imported modules to avoid duplicates
     HashMap string_constants; // Map string values to their constant pool indices
+    HashMap global_slots;     // Map global names to their slot indices
+    int opt_level;            // 0: emit the AST as is, 1: SSA IR for functions and the peephole optimizer
+    FILE* ir_dump;            // --emit-ir: the IR of every function lowered from it goes here
+    int whole_program;        // compile is given the entire program, not one REPL line
+    int fixed_builtins;       // Builtin bits of the names no code in the program assigns
+    int inline_calls;         // Expand calls to small functions, --no-inline clears it
+    InlineCandidate* inline_candidates; // Found when compile is given the whole program
+    int inline_candidate_count;
+    InlineSite* inline_site;  // Innermost call expanded by the direct walk
+    int inline_growth;        // AST nodes inlined into the module code so far
 } Compiler;
 
 void compiler_init(Compiler* compiler);
 Bytecode* compile(Compiler* compiler, Ast* node);
 void compiler_free(Compiler* compiler);
 
+// Index of value in the constant pool, appended if not there yet
+int add_constant(Compiler* compiler, Value value);
+
+// Frame slot of a local of the function being compiled, -1 if it is not one
+int resolve_local(Compiler* compiler, const char* name);
+
+// Global slot of a name, allocated on first use
+int resolve_global(Compiler* compiler, const char* name);
+
+// Whether global slot always holds the builtin while the program runs
+int is_fixed_builtin(Compiler* compiler, int slot, Builtin builtin);
+
+// Candidate for inlining a call to name, NULL if there is none
+InlineCandidate* find_inline_candidate(Compiler* compiler, const char* name);
+
+// Opcode of a binary or unary operator token
+Opcode binary_opcode(TokenType op);
+Opcode unary_opcode(TokenType op);
+
 #endif // INC_COMPILER_H
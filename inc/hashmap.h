@@ -6,26 +6,38 @@
 #include "stdint.h"
 
 #define HASH_MAX_LOAD_FACTOR 0.75
+#define HASH_EMPTY -1
 
-typedef struct HashNode {
+// Key/value pair stored in insertion order
+typedef struct HashEntry {
     ObjString* key;
     Value value;
-    struct HashNode* next;
-} HashNode;
+} HashEntry;
 
+// Compact ordered hash table: an open-addressing index array of
+// `capacity` slots (power of two) points into a dense entries array.
+// Iterate with `for (i = 0; i < map->count; i++) map->entries[i]`.
 typedef struct HashMap {
-    HashNode* nodes;
-    int capacity;
-    int count;
+    int32_t* indices;   // Entry index per slot, HASH_EMPTY if unused
+    HashEntry* entries; // Dense, insertion ordered
+    int capacity;       // Number of index slots
+    int count;          // Number of entries
 } HashMap;
 
 void hash_init(HashMap* map, int initial_capacity);
 void hash_set(HashMap* map, ObjString* key, Value value);
 int hash_get(HashMap* map, ObjString* key, Value* out_value);
 
+// Find a key by its characters and precomputed hash, returns the entry
+// index or -1. For callers that have raw chars rather than an ObjString.
+int hash_find_string(HashMap* map, const char* chars, int length, uint32_t hash);
+
+// Bytes held by the index and entries arrays
+int hash_bytes(HashMap* map);
+
 uint32_t hash_string(const char* str);
 
 void hash_print(HashMap* map);
 void hash_free(HashMap* map);
 
-#endif // __HASHMAP_H__
\ No newline at end of file
+#endif // __HASHMAP_H__
@@ -0,0 +1,142 @@
+#ifndef INC_IR_H
+#define INC_IR_H
+
+#include "compiler.h"
+
+// SSA form of a function body, built from the AST and lowered back to
+// bytecode. Every instruction defines at most one value, named by its index
+// in IrFunction.instrs, and operands are value indices. A block keeps its
+// phis apart from the rest of its code, which ends with one terminator:
+// JUMP, BRANCH, FOR_RANGE, FOR_ITER or RETURN.
+typedef enum {
+    IR_CONST,        // arg: constant index
+    IR_PARAM,        // arg: parameter index, already in that frame slot
+    IR_GLOBAL,       // arg: global slot
+    IR_PHI,          // One operand per predecessor, in predecessor order
+    IR_COPY,         // operand 0, removed by copy propagation
+    IR_BINARY,       // left, right; arg: OP_ADD .. OP_NE
+    IR_UNARY,        // value; arg: OP_NEG or OP_NOT
+    IR_CALL,         // args..., callee; arg: argc
+    IR_CALL_METHOD,  // object, args...; arg: method name constant
+    IR_GET_ATTR,     // object; arg: name constant
+    IR_SET_ATTR,     // object, value; arg: name constant
+    IR_INDEX_GET,    // container, index
+    IR_INDEX_SET,    // container, index, value
+    IR_RANGE_PREP,   // range args..., callee; arg: argc. Pushes the loop state
+    IR_GET_ITER,     // iterable. Pushes the iterator as the loop state
+    IR_LOOP_POP,     // arg: size of the loop state, first in a loop exit
+    IR_JUMP,         // succ[0]
+    IR_BRANCH,       // condition; succ[0] if true, succ[1] if false
+    IR_FOR_RANGE,    // Next counter into succ[0], or succ[1] when done; arg: its RANGE_PREP
+    IR_FOR_ITER,     // Next item into succ[0], or succ[1] when done
+    IR_RETURN,       // value
+} IrOpcode;
+
+// What the optimizer knows about the runtime type of a value
+typedef enum {
+    IR_TYPE_UNSET,   // Not computed yet, the analysis starts optimistic
+    IR_TYPE_INT,
+    IR_TYPE_FLOAT,
+    IR_TYPE_BOOL,
+    IR_TYPE_STRING,
+    IR_TYPE_NONE,
+    IR_TYPE_ANY,
+} IrType;
+
+// Where the lowering keeps a value
+typedef enum {
+    IR_DISCARD,      // Unused, popped right after it is computed
+    IR_ON_STACK,     // Left on the operand stack for its only user
+    IR_REMAT,        // Constant or global, pushed again at every use
+    IR_IN_SLOT,      // Stored to a frame slot
+} IrPlace;
+
+typedef struct {
+    IrOpcode op;
+    int arg;
+    int block;
+    int* operands;
+    int operand_count;
+    int operand_capacity;
+    int var;         // Local it was first assigned to, -1 for temporaries
+    IrType type;
+    int dead;        // Removed by a pass, still indexed
+    int uses;        // Set by the lowering, like the fields below
+    int user;        // Last instruction that uses it
+    int pos;         // Position in its block
+    int start;       // Position where computing it and its stacked operands begins
+    IrPlace place;
+    int slot;
+} IrInstr;
+
+typedef struct {
+    int* phis;
+    int phi_count;
+    int phi_capacity;
+    int* code;       // Ends with the terminator
+    int code_count;
+    int code_capacity;
+    int* preds;
+    int pred_count;
+    int pred_capacity;
+    int succ[2];
+    int succ_count;
+    int dead;
+    int idom;        // Immediate dominator, the entry block is its own
+    int split_for;   // Block this one was split off an edge into, -1 if none
+    int sealed;      // Builder: all predecessors are known
+    int* defs;       // Builder: current value of each variable, -1 if none yet
+    int def_count;
+    int* incomplete; // Builder: phis waiting for the block to be sealed
+    int incomplete_count;
+    int incomplete_capacity;
+    int address;     // Lowering: bytecode position of the first instruction
+} IrBlock;
+
+// A loop entered only through pre, which jumps straight to header
+typedef struct {
+    int pre;
+    int header;
+} IrLoop;
+
+typedef struct {
+    Compiler* compiler;
+    FunctionContext* context;
+    ObjFunction* function;
+    IrInstr* instrs;
+    int count;
+    int capacity;
+    IrBlock* blocks;
+    int block_count;
+    int block_capacity;
+    int* layout;     // Blocks in source order, the order they are lowered in
+    int layout_count;
+    int layout_capacity;
+    IrLoop* loops;   // Outer loops before the loops nested in them
+    int loop_count;
+    int loop_capacity;
+    int* rpo;        // Live blocks in reverse postorder
+    int rpo_count;
+    char** var_names; // The locals, then the locals of inlined calls as "callee.name"
+    int var_count;
+    int var_capacity;
+    int undef;       // None, the value of a local before its first assignment
+    int slot_count;
+    // Statistics for the dump
+    int copies;
+    int common;
+    int hoisted;
+    int dead_values;
+    int typed_ops;   // Binary ops lowered to a statically typed opcode
+    int binary_ops;
+    int inlined_calls;
+    int inlined_size; // AST nodes inlined, limited by INLINE_BUDGET
+} IrFunction;
+
+// Build the SSA form of a slotted function body, optimize it and lower it
+// to bytecode at the current position, ending with the implicit
+// "return None". Returns 0 without emitting anything when the body cannot
+// go through the IR; the caller then compiles it straight from the AST.
+int ir_compile_function(Compiler* compiler, Ast* def, ObjFunction* fn);
+
+#endif // INC_IR_H
@@ -5,4 +5,8 @@
 
 #define NP_DEBUG 1
 
+// Default compiler optimization level, -O0 on the command line turns the
+// peephole optimizer off
+#define NP_OPT_LEVEL 1
+
 #endif /* __INC_NP_CONFIG_H__ */
\ No newline at end of file
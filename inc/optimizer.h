@@ -0,0 +1,17 @@
+#ifndef INC_OPTIMIZER_H
+#define INC_OPTIMIZER_H
+
+#include "compiler.h"
+
+// Peephole pass over the instructions compiled from `start` on, run before
+// the closing OP_HALT is emitted:
+//   - constant folding of arithmetic, compares, NEG, NOT and string +
+//   - CONST / LOAD_LOCAL / LOAD_GLOBAL followed by POP is dropped
+//   - CONST followed by JUMP_IF_ZERO becomes a JUMP or nothing
+//   - jumps to jumps go straight to the final target
+//   - code after JUMP / RET that nothing jumps to is removed
+//   - frequent sequences are fused into superinstructions at the end
+// Jump operands and function addresses are renumbered afterwards.
+void optimize_bytecode(Compiler* compiler, int start);
+
+#endif // INC_OPTIMIZER_H
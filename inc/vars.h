@@ -3,6 +3,9 @@
 
 #include "ast.h"
 
+#include "stdint.h"
+#include "string.h"
+
 typedef struct Ast Ast; // forward declaration
 typedef struct Scope Scope; // forward declaration
 
@@ -27,7 +30,8 @@ typedef enum {
     OBJ_NATIVE_FUNCTION,
     OBJ_CLASS,
     OBJ_INSTANCE,
-    OBJ_ITERATOR
+    OBJ_ITERATOR,
+    OBJ_RANGE
 }ObjectType;
 
 typedef struct Obj {
@@ -36,6 +40,73 @@ typedef struct Obj {
     struct Obj* next;
 }Obj;
 
+// Build with -DNP_NAN_BOXING=ON to pack every Value into 64 bits. Code
+// outside this header must only touch a Value through the IS_*, AS_*,
+// *_VAL and VALUE_TYPE macros below, which work with either layout.
+#ifndef VM_NAN_BOXING
+#define VM_NAN_BOXING (0)
+#endif
+
+#if VM_NAN_BOXING
+
+// A double is stored as itself. Everything else is a quiet NaN payload:
+//   None/False/True  QNAN | 1/2/3
+//   int              QNAN | NAN_TAG_INT | 48-bit two's complement value
+//   object           SIGN | QNAN | 48-bit pointer
+typedef uint64_t Value;
+
+#define NAN_SIGN_BIT    ((uint64_t)0x8000000000000000)
+#define NAN_QNAN        ((uint64_t)0x7ffc000000000000)
+#define NAN_TAG_INT     ((uint64_t)0x0001000000000000)
+#define NAN_PAYLOAD     ((uint64_t)0x0000ffffffffffff)
+#define NAN_TAG_NONE    1
+#define NAN_TAG_FALSE   2
+#define NAN_TAG_TRUE    3
+
+static inline Value value_from_double(double d) {
+    Value v;
+    memcpy(&v, &d, sizeof(double));
+    return v;
+}
+
+static inline double value_to_double(Value v) {
+    double d;
+    memcpy(&d, &v, sizeof(double));
+    return d;
+}
+
+#define NONE_VAL        ((Value)(NAN_QNAN | NAN_TAG_NONE))
+#define BOOL_VAL(b)     ((Value)(NAN_QNAN | ((b) ? NAN_TAG_TRUE : NAN_TAG_FALSE)))
+#define INT_VAL(i)      ((Value)(NAN_QNAN | NAN_TAG_INT | ((uint64_t)(int64_t)(i) & NAN_PAYLOAD)))
+#define FLOAT_VAL(d)    value_from_double(d)
+#define OBJ_VAL(o)      ((Value)(NAN_SIGN_BIT | NAN_QNAN | (uint64_t)(uintptr_t)(o)))
+
+#define IS_NONE(v)      ((v) == NONE_VAL)
+#define IS_BOOL(v)      (((v) | 1) == (NAN_QNAN | NAN_TAG_TRUE))
+#define IS_INT(v)       (((v) & (NAN_SIGN_BIT | NAN_QNAN | NAN_TAG_INT)) == (NAN_QNAN | NAN_TAG_INT))
+#define IS_FLOAT(v)     (((v) & NAN_QNAN) != NAN_QNAN)
+#define IS_OBJ(v)       (((v) & (NAN_SIGN_BIT | NAN_QNAN)) == (NAN_SIGN_BIT | NAN_QNAN))
+
+#define AS_BOOL(v)      ((v) == (NAN_QNAN | NAN_TAG_TRUE))
+#define AS_INT(v)       ((long)((int64_t)((v) << 16) >> 16))
+#define AS_FLOAT(v)     value_to_double(v)
+#define AS_OBJ(v)       ((Obj*)(uintptr_t)((v) & ~(NAN_SIGN_BIT | NAN_QNAN)))
+
+static inline ValueType value_type(Value v) {
+    if (IS_FLOAT(v)) return VAL_FLOAT;
+    if (IS_OBJ(v)) return VAL_OBJ;
+    if (IS_INT(v)) return VAL_INT;
+    if (IS_BOOL(v)) return VAL_BOOL;
+    return VAL_NONE;
+}
+#define VALUE_TYPE(v)   value_type(v)
+
+// A declared slot nobody assigned yet, never seen by user code
+#define UNASSIGNED_VAL  ((Value)NAN_QNAN)
+#define IS_UNASSIGNED(v) ((v) == UNASSIGNED_VAL)
+
+#else
+
 typedef struct Value {
     ValueType type;
     union {
@@ -46,10 +117,37 @@ typedef struct Value {
     }as;
 } Value;
 
+#define NONE_VAL        ((Value){.type = VAL_NONE})
+#define BOOL_VAL(b)     ((Value){.type = VAL_BOOL, .as.boolean = (b)})
+#define INT_VAL(i)      ((Value){.type = VAL_INT, .as.integer = (i)})
+#define FLOAT_VAL(d)    ((Value){.type = VAL_FLOAT, .as.floating = (d)})
+#define OBJ_VAL(o)      ((Value){.type = VAL_OBJ, .as.object = (Obj*)(o)})
+
+#define IS_NONE(v)      ((v).type == VAL_NONE)
+#define IS_BOOL(v)      ((v).type == VAL_BOOL)
+#define IS_INT(v)       ((v).type == VAL_INT)
+#define IS_FLOAT(v)     ((v).type == VAL_FLOAT)
+#define IS_OBJ(v)       ((v).type == VAL_OBJ)
+
+#define AS_BOOL(v)      ((v).as.boolean)
+#define AS_INT(v)       ((v).as.integer)
+#define AS_FLOAT(v)     ((v).as.floating)
+#define AS_OBJ(v)       ((v).as.object)
+
+#define VALUE_TYPE(v)   ((v).type)
+
+// A declared slot nobody assigned yet, never seen by user code
+#define UNASSIGNED_VAL  ((Value){.type = VAL_NONE, .as.integer = 1})
+#define IS_UNASSIGNED(v) ((v).type == VAL_NONE && (v).as.integer == 1)
+
+#endif // VM_NAN_BOXING
+
 typedef struct ObjString{
     Obj obj;
     int length;
     char* chars;
+    uint32_t hash; // hash_string(chars), computed once at creation
+    int interned;  // Unique in vm->strings, equal contents imply the same pointer
 } ObjString;
 
 typedef struct ObjList {
@@ -61,9 +159,7 @@ typedef struct ObjList {
 
 typedef struct ObjDict {
     Obj obj;
-    int count;
-    int capacity;
-    HashMap* map;
+    HashMap* map; // Holds the entry count, use map->count
 } ObjDict;
 
 typedef struct ObjTuple {
@@ -74,9 +170,7 @@ typedef struct ObjTuple {
 
 typedef struct ObjSet {
     Obj obj;
-    int count;
-    int capacity;
-    HashMap* map;
+    HashMap* map; // Element repr -> element, use map->count
 } ObjSet;
 
 typedef struct ObjFunction {
@@ -85,16 +179,38 @@ typedef struct ObjFunction {
     char* name;
     char** params;
     int param_count;
+    int local_count; // Frame slots for params and locals, params first
+    int uses_scope;  // Locals live in a Scope hashmap instead of frame slots
+    int call_count;  // Calls so far, the JIT compiles at VM_JIT_THRESHOLD
+    int max_stack;   // Deepest operand stack above the locals, from bytecode_verify
     // Ast* body;
     Scope* scope; // Closure scope
 } ObjFunction;
 
 typedef Value (*NativeFn)(int arg_count, Value* args, VM* vm);
 
+// Methods the VM calls on instances itself, for operators, builtins and
+// loops. Each class keeps the nearest definition of each in ObjClass.special.
+typedef enum {
+    SPECIAL_INIT,     // __init__, called by instantiation
+    SPECIAL_ADD,      // __add__, a + b, a += b
+    SPECIAL_SUB,      // __sub__, a - b
+    SPECIAL_MUL,      // __mul__, a * b
+    SPECIAL_EQ,       // __eq__, a == b and a != b, tried on b when a has none
+    SPECIAL_LT,       // __lt__, a < b and b > a
+    SPECIAL_HASH,     // __hash__, hash(a)
+    SPECIAL_LEN,      // __len__, len(a)
+    SPECIAL_GETITEM,  // __getitem__, a[i]
+    SPECIAL_ITER,     // __iter__, for x in a
+    SPECIAL_NEXT,     // __next__, each step of a loop over an iterator
+    SPECIAL_COUNT,
+} SpecialMethod;
+
 typedef struct ObjNativeFunction { 
     Obj obj;
     NativeFn function;
     char* name;
+    int special; // SpecialMethod an instance argument calls instead, -1 for none
 } ObjNativeFunction;
 
 typedef struct ObjClass {
@@ -102,25 +218,58 @@ typedef struct ObjClass {
     char* name;
     HashMap* methods;  // Map of method name -> ObjFunction
     struct ObjClass* parent;  // Base class for inheritance
+    HashMap* table;    // Own and inherited methods, nearest first, NULL until used
+    int table_epoch;   // vm->class_epoch when table was built
+    int version;       // Bumped when an attribute of a class without subclasses changes
+    int subclassed;    // Some class names this one as its parent
+    int slot_hint;     // Most fields an instance has had, sizes new slot arrays
+    struct Shape* base_shape; // Shape instances start in, laid out by __slots__
+    int closed;        // __slots__ on the class and every parent, no other field may be added
+    struct ObjFunction* special[SPECIAL_COUNT]; // From table, NULL where undefined
 } ObjClass;
 
+// Field layout shared by every instance that was given the same fields in
+// the same order. Shapes form a tree under vm->root_shape: assigning a new
+// field moves an instance to the child for that name, which keeps the
+// field in the next slot. Shapes belong to the VM and live as long as it.
+typedef struct Shape {
+    struct Shape* parent;
+    ObjString* name;          // Field this shape adds, NULL for the root
+    int slot_count;           // The field added here is in slot_count - 1
+    struct Shape** children;  // Transitions, one per name added next
+    int child_count;
+    int child_capacity;
+    struct Shape* next;       // Every shape of the VM, for freeing
+} Shape;
+
 typedef struct ObjInstance {
     Obj obj;
     ObjClass* klass;
-    HashMap* fields;  // Map of field name -> Value
+    Shape* shape;     // NULL once the instance is in dictionary mode
+    Value* slots;     // Field values in the order of shape, inline_slots until it outgrows them
+    int slot_capacity;
+    int inline_capacity;
+    HashMap* fields;  // Map of field name -> Value, only in dictionary mode
+    Value inline_slots[]; // Sized by klass->slot_hint when the instance is made
 } ObjInstance;
 
 typedef struct ObjIterator {
     Obj obj;
     Value iterable;
-    Value current;
-    int index;
+    int index; // Next item; for dicts and sets an index into map->entries
+    int size;  // Dict/set entry count when iteration started
 } ObjIterator;
 
+typedef struct ObjRange {
+    Obj obj;
+    long start;
+    long stop;
+    long step; // Never zero
+} ObjRange;
+
 typedef struct Scope {
     const char * name;
     HashMap * vars;
-    Value return_value;
     struct Scope* parent;
 }Scope;
 
@@ -143,6 +292,8 @@ Value make_native_function(const char* name, NativeFn function);
 
 Value make_none();
 
+long range_length(ObjRange* range);
+
 void print_value(Value v);
 
 int value_equals(Value* a, Value* b);
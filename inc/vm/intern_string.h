@@ -7,4 +7,8 @@
 ObjString* intern_string(VM* vm, char* chars, int length);
 ObjString* intern_const_string(VM* vm, const char* chars, int length);
 
+// Intern an existing string without copying it. Returns the already
+// interned string with the same contents, or str itself, now marked interned.
+ObjString* intern_adopt_string(VM* vm, ObjString* str);
+
 #endif // __INC_INTERN_STRING_H__
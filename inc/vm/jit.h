@@ -0,0 +1,39 @@
+#ifndef __INC_JIT_H__
+#define __INC_JIT_H__
+
+#include "vm.h"
+
+// Baseline template JIT. Once a function has been called VM_JIT_THRESHOLD
+// times its bytecode range is translated instruction by instruction into
+// x86-64 code: simple stack, local and integer ops get inline templates,
+// everything else calls the interpreter's handler (vm_op_handler). Jumps
+// inside the function become native jumps; calls and returns look the next
+// ip up in vm->jit_entries and either continue in native code or return to
+// vm_run. Unsupported opcodes always return to vm_run.
+//
+// The tracing tier (jit_trace.c) handles hot loops in any code, including
+// the module level: a loop header that sees VM_TRACE_THRESHOLD back-edges
+// has one iteration recorded with the operand types it saw, and that
+// linear trace is compiled with type and branch guards. A failing guard
+// side-exits to the interpreter at the instruction it guarded.
+
+// Turn the JIT on. When dump_path is not NULL every compiled function and
+// trace is appended to it as a hex listing per bytecode instruction.
+void jit_enable(VM* vm, const char* dump_path);
+
+// Unmap all compiled code and free the JIT, if it was enabled
+void jit_free(VM* vm);
+
+// Compile fn, returns 0 if it cannot be compiled (it keeps interpreting)
+int jit_compile(VM* vm, ObjFunction* fn);
+
+// Run native code from vm->ip, which must have a jit_entries address, until
+// it reaches an instruction that was not compiled
+void jit_run(VM* vm);
+
+// Called after a backward OP_JUMP at jump_ip set vm->ip to the loop header.
+// Counts the back-edge, records and compiles hot loops and runs their trace,
+// leaving vm->ip wherever the trace exited.
+void jit_loop_edge(VM* vm, int jump_ip);
+
+#endif // __INC_JIT_H__
@@ -0,0 +1,157 @@
+#ifndef __INC_JIT_INTERNAL_H__
+#define __INC_JIT_INTERNAL_H__
+
+// Shared by the baseline JIT (jit.c) and the tracing tier (jit_trace.c)
+
+#include "vm.h"
+
+#include "stdarg.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Generated code keeps the VM* in rbx. The entry stub also saves r12-r15
+// for the tracing tier, which leaves rsp 16-byte aligned for helper calls.
+// rax, rcx, rdx and xmm0 are scratch everywhere.
+
+#define OFF_SP          ((int32_t)offsetof(VM, sp))
+#define OFF_IP          ((int32_t)offsetof(VM, ip))
+#define OFF_FP          ((int32_t)offsetof(VM, fp))
+#define OFF_STACK       ((int32_t)offsetof(VM, stack))
+#define OFF_BYTECODE    ((int32_t)offsetof(VM, bytecode))
+#define OFF_GLOBALS     ((int32_t)offsetof(VM, globals))
+#define OFF_ENTRIES     ((int32_t)offsetof(VM, jit_entries))
+#define OFF_ENTRY_COUNT ((int32_t)offsetof(VM, jit_entry_count))
+#define OFF_CONSTANTS   ((int32_t)offsetof(Bytecode, constants))
+
+// Jcc / SETcc condition codes
+#define CC_B    (0x2)
+#define CC_AE   (0x3)
+#define CC_E    (0x4)
+#define CC_NE   (0x5)
+#define CC_BE   (0x6)
+#define CC_A    (0x7)
+#define CC_S    (0x8)
+#define CC_L    (0xC)
+#define CC_GE   (0xD)
+#define CC_LE   (0xE)
+#define CC_G    (0xF)
+
+// Pages mapped by jit_map_code, unmapped when the JIT is freed
+typedef struct CodeRegion {
+    void* code;
+    int size;
+} CodeRegion;
+
+typedef struct Jit {
+    void (*enter)(VM* vm, void* code); // Saves rbx and r12-r15, rbx = vm, jumps to code
+    FILE* dump;
+    CodeRegion* regions; // Entry stub, functions and traces
+    int region_count;
+    int region_capacity;
+
+    // Tracing tier, indexed by loop header ip
+    int* loop_hits;   // Back-edges taken, -1 once the loop gave up on tracing
+    int* loop_aborts; // Recordings that did not produce a trace
+    void** traces;    // Compiled trace per header, NULL if none
+    int loop_count;   // Length of the three arrays
+} Jit;
+
+typedef struct CodeBuffer {
+    uint8_t* code;
+    int count;
+    int capacity;
+} CodeBuffer;
+
+static inline void emit8(CodeBuffer* buf, uint8_t byte) {
+    if (buf->count >= buf->capacity) {
+        buf->capacity = buf->capacity ? buf->capacity * 2 : 256;
+        buf->code = realloc(buf->code, buf->capacity);
+    }
+    buf->code[buf->count++] = byte;
+}
+
+static inline void emit(CodeBuffer* buf, int count, ...) {
+    va_list args;
+    va_start(args, count);
+    for (int i = 0; i < count; i++) {
+        emit8(buf, (uint8_t)va_arg(args, int));
+    }
+    va_end(args);
+}
+
+static inline void emit32(CodeBuffer* buf, int32_t value) {
+    for (int i = 0; i < 4; i++) {
+        emit8(buf, (uint8_t)((uint32_t)value >> (i * 8)));
+    }
+}
+
+static inline void emit64(CodeBuffer* buf, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        emit8(buf, (uint8_t)(value >> (i * 8)));
+    }
+}
+
+// jmp rel32, returns the offset of the rel32 to patch
+static inline int emit_jmp(CodeBuffer* buf) {
+    emit8(buf, 0xE9);
+    emit32(buf, 0);
+    return buf->count - 4;
+}
+
+// jcc rel32, returns the offset of the rel32 to patch
+static inline int emit_jcc(CodeBuffer* buf, int cc) {
+    emit(buf, 2, 0x0F, 0x80 | cc);
+    emit32(buf, 0);
+    return buf->count - 4;
+}
+
+static inline void patch_to(CodeBuffer* buf, int at, int dest) {
+    int32_t rel = dest - (at + 4);
+    memcpy(buf->code + at, &rel, sizeof(rel));
+}
+
+static inline void patch_here(CodeBuffer* buf, int at) {
+    patch_to(buf, at, buf->count);
+}
+
+// Every code region starts with the exit back to jit_run's caller:
+// pop r15; pop r14; pop r13; pop r12; pop rbx; ret
+#define EXIT_STUB_SIZE (10)
+
+static inline void emit_exit_stub(CodeBuffer* buf) {
+    emit(buf, EXIT_STUB_SIZE, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);
+}
+
+// Jump to the exit stub at offset 0
+static inline void emit_exit(CodeBuffer* buf) {
+    patch_to(buf, emit_jmp(buf), 0);
+}
+
+// mov dword [rbx + ip], ip
+static inline void emit_set_ip(CodeBuffer* buf, int ip) {
+    emit(buf, 2, 0xC7, 0x83);
+    emit32(buf, OFF_IP);
+    emit32(buf, ip);
+}
+
+// fn(vm, arg) through rax
+static inline void emit_call_vm(CodeBuffer* buf, void* fn, int arg) {
+    emit(buf, 3, 0x48, 0x89, 0xDF);           // mov rdi, rbx
+    emit8(buf, 0xBE);                         // mov esi, arg
+    emit32(buf, arg);
+    emit(buf, 2, 0x48, 0xB8);                 // mov rax, fn
+    emit64(buf, (uint64_t)(uintptr_t)fn);
+    emit(buf, 2, 0xFF, 0xD0);                 // call rax
+}
+
+// Copy code into fresh pages and make them executable, NULL on failure.
+// The pages belong to jit until jit_free.
+void* jit_map_code(Jit* jit, const uint8_t* code, int size);
+
+// Loop header arrays in Jit, grown to the bytecode length
+void jit_ensure_loops(Jit* jit, int count);
+
+#endif // __INC_JIT_INTERNAL_H__
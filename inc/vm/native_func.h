@@ -9,6 +9,7 @@ void register_native_functions(VM* vm);
 
 Value native_print(int arg_count, Value* args, VM* vm);
 Value native_len(int arg_count, Value* args, VM* vm);
+Value native_hash(int arg_count, Value* args, VM* vm);
 Value native_clock(int arg_count, Value* args, VM* vm);
 Value native_exit(int arg_count, Value* args, VM* vm);
 Value native_input(int arg_count, Value* args, VM* vm);
@@ -18,16 +19,22 @@ Value native_float(int arg_count, Value* args, VM* vm);
 Value native_str(int arg_count, Value* args, VM* vm);
 
 Value native_type(int arg_count, Value* args, VM* vm);
+// True if the instance has the field or it or the class has the method
+Value native_hasattr(int arg_count, Value* args, VM* vm);
+
+// Validate range(stop) / range(start, stop[, step]) arguments
+void range_bounds(int arg_count, Value* args, long* start, long* stop, long* step);
+Value native_range(int arg_count, Value* args, VM* vm);
 
 Value native_gc_collect(int arg_count, Value* args, VM* vm);
 Value native_gc_stats(int arg_count, Value* args, VM* vm);
+// Dict with the VM's quickened and deoptimized instruction counts
+Value native_quicken_stats(int arg_count, Value* args, VM* vm);
 
 Value native_make_list(int arg_count, Value* args, VM* vm);
 Value native_make_dict(int arg_count, Value* args, VM* vm);
 Value native_make_set(int arg_count, Value* args, VM* vm);
 Value native_make_tuple(int arg_count, Value* args, VM* vm);
 
-Value native_make_iterator(int arg_count, Value* args, VM* vm);
-Value native_iterator_next(int arg_count, Value* args, VM* vm);
 
 #endif // __INC_NATIVE_FUNC_H__
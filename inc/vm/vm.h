@@ -11,11 +11,17 @@ typedef enum {
 
     OP_LOAD,
     OP_STORE,
+    OP_LOAD_LOCAL,
+    OP_STORE_LOCAL,
+    OP_LOAD_GLOBAL,
+    OP_STORE_GLOBAL,
 
     OP_ADD,
     OP_SUB,
     OP_MUL,
     OP_DIV,
+    OP_NEG,
+    OP_NOT,
 
     OP_EQ,
     OP_LT,
@@ -24,13 +30,77 @@ typedef enum {
     OP_LE,
     OP_NE,
 
+    // Quickened forms: the VM writes these over a generic arithmetic or
+    // compare opcode once it has seen the operand types at that site. A
+    // type guard miss rewrites the generic opcode back with operand 1,
+    // which marks the site as polymorphic so it is never quickened again.
+    OP_ADD_INT,
+    OP_ADD_FLOAT,
+    OP_SUB_INT,
+    OP_SUB_FLOAT,
+    OP_MUL_INT,
+    OP_MUL_FLOAT,
+    OP_DIV_FLOAT,
+    OP_EQ_INT,
+    OP_LT_INT,
+    OP_GT_INT,
+    OP_GE_INT,
+    OP_LE_INT,
+    OP_NE_INT,
+    OP_LT_FLOAT,
+    OP_GT_FLOAT,
+    OP_GE_FLOAT,
+    OP_LE_FLOAT,
+
+    // Statically typed forms: the compiler emits these where its type
+    // inference proved the operand types, so they run without a guard and
+    // are never rewritten. Same order as the quickened forms above.
+    OP_ADD_INT_STATIC,
+    OP_ADD_FLOAT_STATIC,
+    OP_SUB_INT_STATIC,
+    OP_SUB_FLOAT_STATIC,
+    OP_MUL_INT_STATIC,
+    OP_MUL_FLOAT_STATIC,
+    OP_DIV_FLOAT_STATIC,
+    OP_EQ_INT_STATIC,
+    OP_LT_INT_STATIC,
+    OP_GT_INT_STATIC,
+    OP_GE_INT_STATIC,
+    OP_LE_INT_STATIC,
+    OP_NE_INT_STATIC,
+    OP_LT_FLOAT_STATIC,
+    OP_GT_FLOAT_STATIC,
+    OP_GE_FLOAT_STATIC,
+    OP_LE_FLOAT_STATIC,
+
     OP_JUMP,
     OP_JUMP_IF_ZERO,
 
+    // Superinstructions the optimizer fuses from the most frequent
+    // sequences. A compare followed by JUMP_IF_ZERO jumps to the operand
+    // when the compare is false; INC_* is LOAD x; CONST k; ADD; STORE x with
+    // an int k, the operand packs x and k with SUPER_OPERAND; ADD_CONST is
+    // CONST k; ADD.
+    OP_EQ_JUMP_IF_FALSE,
+    OP_NE_JUMP_IF_FALSE,
+    OP_LT_JUMP_IF_FALSE,
+    OP_GT_JUMP_IF_FALSE,
+    OP_LE_JUMP_IF_FALSE,
+    OP_GE_JUMP_IF_FALSE,
+    OP_INC_LOCAL,
+    OP_INC_GLOBAL,
+    OP_ADD_CONST,
+
     OP_CONST,
     OP_POP,
 
+    OP_GET_ITER,
+    OP_FOR_ITER,
+    OP_FOR_RANGE_PREP,
+    OP_FOR_RANGE,
+
     OP_CALL,
+    OP_TAIL_CALL, // CALL whose result the function returns, a RET follows
     OP_RET,
 
     OP_IDX_GET,
@@ -50,6 +120,18 @@ typedef struct {
     int operand;
 } Instruction;
 
+#define IS_COMPARE_JUMP(op) ((op) >= OP_EQ_JUMP_IF_FALSE && (op) <= OP_GE_JUMP_IF_FALSE)
+
+#define IS_STATIC_TYPED(op) ((op) >= OP_ADD_INT_STATIC && (op) <= OP_LE_FLOAT_STATIC)
+// Quickened form of a statically typed opcode, same result for the same operands
+#define STATIC_TO_QUICK(op) ((Opcode)((op) - OP_ADD_INT_STATIC + OP_ADD_INT))
+
+// Slot and constant index of INC_LOCAL / INC_GLOBAL, both at most SUPER_MAX
+#define SUPER_MAX               (0x7FFF)
+#define SUPER_OPERAND(slot, k)  (((k) << 16) | (slot))
+#define SUPER_SLOT(operand)     ((operand) & 0xFFFF)
+#define SUPER_CONST(operand)    ((operand) >> 16)
+
 typedef struct {
     Instruction* instructions;
     int count;
@@ -57,27 +139,108 @@ typedef struct {
 
     Value* constants;
     int const_count;
+    int const_capacity;
+
+    int* globals;     // Constant index of each global slot's name
+    int global_count;
+    int global_capacity;
+
+    int max_stack;    // Deepest operand stack of the module-level code, from bytecode_verify
 } Bytecode;
 
+// What op_return does with the result of a frame. Calls made by CALL and
+// CALL_METHOD push it; special methods run for an instruction finish that
+// instruction's work instead, with CallFrame.target as its operand.
+typedef enum {
+    RETURN_VALUE,          // Push the result
+    RETURN_NOT,            // Push its negation, for != through __eq__
+    RETURN_JUMP_IF_FALSE,  // Jump to target if the result is false
+    RETURN_JUMP_IF_TRUE,   // Jump to target if it is true
+    RETURN_STORE_LOCAL,    // Store it in local slot target
+    RETURN_STORE_GLOBAL,   // Store it in global slot target
+    RETURN_ITER,           // Push an iterator over it, the result of __iter__
+    RETURN_NEXT,           // Push it, or jump to target if it is StopIteration
+} ReturnAction;
+
 typedef struct CallFrame {
     int return_address;
-    int base_sp;
+    int base_sp; // Stack height restored on return
+    int fp;      // Caller's frame pointer
     Scope* scope;
+    Value init_instance; // Instance returned from __init__, None for other calls
+    ReturnAction on_return;
+    int target;
 } CallFrame;
 
+// Inline cache of one GET_ATTR, SET_ATTR or CALL_METHOD site. An entry
+// says where instances of klass with the given shape have the attribute:
+// the slot of the field, or the method found on the class chain, which no
+// field of that shape hides. A SET_ATTR entry with new_shape set adds the
+// field in that slot and moves the instance to new_shape. CALL_METHOD
+// entries match on klass alone. An entry also records klass->version:
+// assigning an attribute of a class without subclasses after its methods
+// were first looked up bumps only that version, so only entries for that
+// class miss. The same change to a class with subclasses, or collecting a
+// class, bumps vm->class_epoch instead, which empties every cache filled
+// before and makes each class rebuild its method table.
+typedef struct InlineCacheEntry {
+    ObjClass* klass;
+    int version;      // klass->version when the entry was added
+    Shape* shape;
+    int field;        // Slot in ObjInstance.slots, -1 for a method
+    Shape* new_shape; // Shape after a SET_ATTR that adds the field, else NULL
+    Value method;
+} InlineCacheEntry;
+
+typedef struct InlineCache {
+    int epoch;
+    int count;    // Entries in use, lookups past a full cache are not cached
+    InlineCacheEntry entries[VM_INLINE_CACHE_SIZE];
+} InlineCache;
+
 typedef struct VM{
     Bytecode* bytecode;
-    Value stack[VM_STACK_SIZE];
+    Value* stack;   // Grows at frame entry, see VM_STACK_INITIAL
+    int stack_capacity;
     int sp; // Stack pointer
     int ip; // Instruction pointer
+    int fp; // Frame pointer: stack index of local slot 0
 
-    CallFrame call_stack[VM_CALL_STACK_SIZE];
+    CallFrame* call_stack;
     int frame_count;
-    Scope* scope;
+    int frame_capacity;
+    Scope* scope;    // Innermost Scope of a scope-based function, NULL at module level
     HashMap strings; // For string interning
+    int interned_const_count; // Leading constants already adopted into strings
+
+    Value* globals;        // Module-level variables indexed by global slot
+    int global_count;      // Slots linked from bytecode->globals so far
+    int global_capacity;
+    HashMap global_slots;  // Global name -> slot index
+    HashMap named_globals; // Natives and globals that have no compiled slot
 
     int bytes_allocated;
 
+    int quickened_sites;   // Generic instructions rewritten to a typed form
+    int deoptimized_sites; // Typed instructions that hit a guard and went back
+
+    int* cache_sites;      // Index into caches per instruction, -1 if it has none
+    int cache_site_count;  // Instructions given their cache so far
+    InlineCache* caches;
+    int cache_count;
+    int cache_capacity;
+    int class_epoch;
+    int cache_misses;      // Attribute lookups that went through the hash maps
+    ObjString* special_names[SPECIAL_COUNT]; // Interned "__init__", "__add__", ...
+    Value stop_iteration;  // The StopIteration class, what __next__ returns at the end
+
+    Shape* root_shape;     // Shape of an instance without fields
+    Shape* shapes;         // Every shape, linked through Shape.next
+
+    struct Jit* jit;      // Baseline JIT state (see jit.h), NULL unless enabled
+    void** jit_entries;   // Native code address per instruction, NULL if not compiled
+    int jit_entry_count;
+
 #if VM_USE_GC
     Obj* objects; // Linked list of all allocated objects for GC
     int next_gc; // Threshold to trigger next GC
@@ -86,6 +249,8 @@ typedef struct VM{
 
 void vm_run(VM* vm);
 void vm_init(VM* vm, Bytecode* bytecode);
+void vm_free(VM* vm);
+void vm_reserve_stack(VM* vm, int count);
 
 void vm_debug_scope(VM* vm);
 void vm_debug_stack(VM* vm);
@@ -94,5 +259,28 @@ void vm_push(VM* vm, Value value);
 Value vm_pop(VM* vm);
 
 void vm_register_native_functions(VM* vm, const char* name, NativeFn function);
+// Register a native that calls the given SpecialMethod of an instance
+// passed as its only argument, like len() and __len__
+void vm_register_special_native(VM* vm, const char* name, NativeFn function, SpecialMethod special);
+
+const char* get_opcode_name(Opcode opcode);
+
+// Execute one instruction outside vm_run: vm->ip must already point past it.
+// Jumps, calls and returns leave the next instruction in vm->ip. Returns NULL
+// for opcodes that only vm_run can execute. Used as the JIT's slow paths.
+typedef void (*VmOpHandler)(VM* vm, int operand);
+VmOpHandler vm_op_handler(Opcode op);
+
+// Whether the handler of op may run a special method of an instance
+// operand: it then enters the method's frame and leaves its address in
+// vm->ip, like a CALL
+int vm_op_may_call(Opcode op);
+
+// Resolve globals added to the bytecode since the last call to VM slots
+void vm_link_globals(VM* vm);
+
+// Name-based variable access: the current Scope chain first, then globals
+Value vm_get_name(VM* vm, ObjString* name);
+void vm_set_name(VM* vm, ObjString* name, Value value);
 
 #endif /* __INC_VM_H__ */
@@ -3,8 +3,73 @@
 
 #define VM_DEBUG                (0) // Set to 1 to enable basic debug output, 2 for more verbose debug output
 
-#define VM_STACK_SIZE           (1024)
-#define VM_CALL_STACK_SIZE      (64)
+// The value stack and the call stack start small and double when a frame
+// needs more room, up to the hard caps. Override any of them with -D.
+// Frames reserve the stack depth bytecode_verify computed for them.
+#ifndef VM_STACK_INITIAL
+#define VM_STACK_INITIAL        (256)
+#endif
+#ifndef VM_STACK_MAX
+#define VM_STACK_MAX            (1 << 22) // Values
+#endif
+#ifndef VM_CALL_STACK_INITIAL
+#define VM_CALL_STACK_INITIAL   (16)
+#endif
+#ifndef VM_CALL_STACK_MAX
+#define VM_CALL_STACK_MAX       (1 << 18) // Frames
+#endif
+
+// Dispatch vm_run through a table of label addresses (GCC/Clang "labels as values")
+// instead of a switch. Other compilers always use the portable switch.
+#ifndef VM_USE_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_USE_COMPUTED_GOTO    (1)
+#else
+#define VM_USE_COMPUTED_GOTO    (0)
+#endif
+#endif
+
+// Rewrite generic arithmetic and compare instructions in place into
+// type-specialized forms after the first execution (see vm.h)
+#ifndef VM_USE_QUICKENING
+#define VM_USE_QUICKENING       (1)
+#endif
+
+// Remember at each GET_ATTR, SET_ATTR and CALL_METHOD site where the
+// receiver's class keeps the attribute, for up to VM_INLINE_CACHE_SIZE
+// classes per site (see InlineCache in vm.h)
+#ifndef VM_USE_INLINE_CACHES
+#define VM_USE_INLINE_CACHES    (1)
+#endif
+#ifndef VM_INLINE_CACHE_SIZE
+#define VM_INLINE_CACHE_SIZE    (4)
+#endif
+
+// Fields an instance keeps in shape slots before it moves its fields to a
+// hashmap of its own (dictionary mode)
+#ifndef VM_SHAPE_MAX_FIELDS
+#define VM_SHAPE_MAX_FIELDS     (32)
+#endif
+
+// Baseline JIT (jit.c, enabled with --jit) emits x86-64 System V code,
+// other targets always interpret
+#ifndef VM_JIT_SUPPORTED
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define VM_JIT_SUPPORTED        (1)
+#else
+#define VM_JIT_SUPPORTED        (0)
+#endif
+#endif
+
+// Calls a function takes before the JIT compiles it
+#ifndef VM_JIT_THRESHOLD
+#define VM_JIT_THRESHOLD        (100)
+#endif
+
+// Back-edges a loop takes before the JIT records and compiles a trace of it
+#ifndef VM_TRACE_THRESHOLD
+#define VM_TRACE_THRESHOLD      (50)
+#endif
 
 #define VM_USE_GC               (1)
 #define VM_GC_THRESHOLD         (1024 * 8) // 8 KB
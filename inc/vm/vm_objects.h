@@ -16,5 +16,22 @@ Value vm_make_set(VM* vm);
 Value vm_make_class(VM* vm, const char* name, ObjClass* parent);
 Value vm_make_instance(VM* vm, ObjClass* klass);
 Value vm_make_iterator(VM* vm, Value iterable);
+Value vm_make_range(VM* vm, long start, long stop, long step);
+
+// Instance fields live in slots laid out by a shared Shape (see vars.h)
+void vm_init_shapes(VM* vm);
+void vm_free_shapes(VM* vm);
+// Slot of the field name in shape, -1 if it has none
+int shape_slot(Shape* shape, ObjString* name);
+// Field of instance in either mode, NULL if it has none
+Value* instance_field(ObjInstance* instance, ObjString* name);
+// Assign a field, moving the instance to a new shape or to dictionary
+// mode when it is new. Returns its slot, -1 in dictionary mode.
+int instance_set_field(VM* vm, ObjInstance* instance, ObjString* name, Value value);
+// Lay out the instances of klass from the names in slots: a string, or a
+// tuple or list of them. Only allowed before the class is first used.
+void class_set_slots(VM* vm, ObjClass* klass, Value slots);
+// Bytes held by instance, counted like bytes_allocated
+int instance_bytes(ObjInstance* instance);
 
 #endif // __INC_VM_OBJECTS_H__
@@ -195,6 +195,7 @@ Ast* ast_new_classdef(const char* name, const char* parent, Ast** methods, int m
     node->ClassDef.parent = parent ? strdup(parent) : NULL;
     node->ClassDef.methods = methods;
     node->ClassDef.method_count = method_count;
+    node->ClassDef.slots = NULL;
     return node;
 }
 
@@ -442,6 +443,11 @@ static void ast_fprint(Ast* node, FILE* f, int indent) {
                 print_indent(f, indent);
                 fprintf(f, "Parent Class: %s\n", node->ClassDef.parent);
             }
+            if (node->ClassDef.slots) {
+                print_indent(f, indent);
+                fprintf(f, "Slots:\n");
+                ast_fprint(node->ClassDef.slots, f, indent + 1);
+            }
             print_indent(f, indent);
             fprintf(f, "Methods:\n");
             for (int i = 0; i < node->ClassDef.method_count; i++) {
@@ -613,6 +619,7 @@ void ast_free(Ast* node) {
                 ast_free(node->ClassDef.methods[i]);
             }
             free(node->ClassDef.methods);
+            if (node->ClassDef.slots) ast_free(node->ClassDef.slots);
         break;
         case AST_METHOD_CALL:
             ast_free(node->MethodCall.object);
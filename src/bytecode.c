@@ -10,25 +10,42 @@ static void bytecode_init(Bytecode* bytecode) {
     bytecode->capacity = 0;
     bytecode->constants = NULL;
     bytecode->const_count = 0;
-    bytecode->capacity = 0;
+    bytecode->const_capacity = 0;
+    bytecode->globals = NULL;
+    bytecode->global_count = 0;
+    bytecode->global_capacity = 0;
+    bytecode->max_stack = 0;
 }
 
+// Scalars are written as a type byte plus a fixed 8-byte payload, the same
+// file format whichever Value layout the VM was built with
+#define SCALAR_PAYLOAD_SIZE 8
+
 static int serialize_value(char* data, Value val) {
     int offset = 0;
-    data[0] = val.type;
+    data[0] = VALUE_TYPE(val);
     offset += 1;
 
-    switch(val.type) {
+    switch(VALUE_TYPE(val)) {
         case VAL_NONE:
         case VAL_BOOL:
         case VAL_INT:
-        case VAL_FLOAT:
-            memcpy(data + offset, &val.as, sizeof(val.as));
-            return offset + sizeof(val.as);
-            break;
+        case VAL_FLOAT: {
+            int64_t payload = 0;
+            if (IS_INT(val)) {
+                payload = AS_INT(val);
+            } else if (IS_FLOAT(val)) {
+                double d = AS_FLOAT(val);
+                memcpy(&payload, &d, sizeof(double));
+            } else if (IS_BOOL(val)) {
+                payload = AS_BOOL(val);
+            }
+            memcpy(data + offset, &payload, SCALAR_PAYLOAD_SIZE);
+            return offset + SCALAR_PAYLOAD_SIZE;
+        }
             
         case VAL_OBJ: {
-            Obj* obj = val.as.object;
+            Obj* obj = AS_OBJ(val);
             memcpy(data + offset, &obj->type, sizeof(ObjectType));
             offset += sizeof(ObjectType);
             
@@ -55,6 +72,10 @@ static int serialize_value(char* data, Value val) {
 
                     memcpy(data + offset, &fn->param_count, sizeof(int));
                     offset += sizeof(int);
+                    memcpy(data + offset, &fn->local_count, sizeof(int));
+                    offset += sizeof(int);
+                    memcpy(data + offset, &fn->uses_scope, sizeof(int));
+                    offset += sizeof(int);
 
                     // For simplicity, we won't serialize the function body or closure scope
                     // Just serialize the function address and parameter count, along with parameter names
@@ -77,88 +98,465 @@ static int serialize_value(char* data, Value val) {
     return 0;
 }
 
-static int deserialize_value(char* data, Value* val) {
+// Int at data + *offset, advancing past it. Fails when it does not fit in size.
+static int read_int(char* data, int size, int* offset, int* value) {
+    if (*offset + (int)sizeof(int) > size) {
+        return 0;
+    }
+    memcpy(value, data + *offset, sizeof(int));
+    *offset += sizeof(int);
+    return 1;
+}
+
+// Length prefix, which fails as well when the bytes it counts do not fit
+static int read_length(char* data, int size, int* offset, int* length) {
+    return read_int(data, size, offset, length) && *length >= 0 && *length <= size - *offset;
+}
+
+static char* read_chars(char* data, int* offset, int length) {
+    char* chars = malloc(length + 1);
+    memcpy(chars, data + *offset, length);
+    chars[length] = '\0';
+    *offset += length;
+    return chars;
+}
+
+// Returns the bytes read, 0 when the value is truncated or of a type
+// constants never have
+static int deserialize_value(char* data, int size, Value* val) {
     int offset = 0;
-    val->type = data[0];
+    if (size < 1) {
+        return 0;
+    }
+    ValueType type = data[0];
     offset += 1;
     
-    switch(val->type) {
+    switch(type) {
         case VAL_NONE:
         case VAL_BOOL:
         case VAL_INT:
-        case VAL_FLOAT:
-            memcpy(&val->as, data + offset, sizeof(val->as));
-            offset += sizeof(val->as);
+        case VAL_FLOAT: {
+            if (offset + SCALAR_PAYLOAD_SIZE > size) {
+                return 0;
+            }
+            int64_t payload;
+            memcpy(&payload, data + offset, SCALAR_PAYLOAD_SIZE);
+            offset += SCALAR_PAYLOAD_SIZE;
+            if (type == VAL_INT) {
+                *val = INT_VAL(payload);
+            } else if (type == VAL_FLOAT) {
+                double d;
+                memcpy(&d, &payload, sizeof(double));
+                *val = FLOAT_VAL(d);
+            } else if (type == VAL_BOOL) {
+                *val = BOOL_VAL((int)payload != 0);
+            } else {
+                *val = NONE_VAL;
+            }
             return offset;
-            break;
+        }
             
         case VAL_OBJ: {
             ObjectType obj_type;
+            if (offset + (int)sizeof(ObjectType) > size) {
+                return 0;
+            }
             memcpy(&obj_type, data + offset, sizeof(ObjectType));
             offset += sizeof(ObjectType);
             
             switch(obj_type) {
                 case OBJ_STRING: {
                     int length;
-                    memcpy(&length, data + offset, sizeof(int));
-                    offset += sizeof(int);
-                    char* chars = malloc(length + 1);
-                    memcpy(chars, data + offset, length);
-                    offset += length;
-                    chars[length] = '\0';
+                    if (!read_length(data, size, &offset, &length)) {
+                        return 0;
+                    }
+                    char* chars = read_chars(data, &offset, length);
                     
                     ObjString* str = malloc(sizeof(ObjString));
                     str->obj.type = OBJ_STRING;
                     str->length = length;
                     str->chars = chars;
+                    str->hash = hash_string(chars);
+                    str->interned = 0;
                     
-                    val->as.object = (Obj*)str;
+                    *val = OBJ_VAL(str);
                     return offset;
                     break;
                 }
 
                 case OBJ_FUNCTION: {
-                    ObjFunction* fn = malloc(sizeof(ObjFunction));
-                    memcpy(&fn->addr, data + offset, sizeof(int));
-                    offset += sizeof(int);
-
+                    int addr;
                     int name_len;
-                    memcpy(&name_len, data + offset, sizeof(int));
-                    offset += sizeof(int);
-                    char* name = malloc(name_len + 1);
-                    memcpy(name, data + offset, name_len);
-                    offset += name_len;
-                    name[name_len] = '\0';
-                    fn->name = name;
+                    if (!read_int(data, size, &offset, &addr) || !read_length(data, size, &offset, &name_len)) {
+                        return 0;
+                    }
+                    // The address is checked against the code by bytecode_verify
+                    ObjFunction* fn = malloc(sizeof(ObjFunction));
+                    fn->addr = addr;
+                    fn->name = read_chars(data, &offset, name_len);
 
-                    memcpy(&fn->param_count, data + offset, sizeof(int));
-                    offset += sizeof(int);
+                    if (!read_int(data, size, &offset, &fn->param_count) ||
+                        !read_int(data, size, &offset, &fn->local_count) ||
+                        !read_int(data, size, &offset, &fn->uses_scope)) {
+                        return 0;
+                    }
+                    fn->call_count = 0;
+                    fn->max_stack = 0;
+                    if (fn->param_count < 0 || fn->param_count > size - offset) {
+                        return 0;
+                    }
 
                     // For simplicity, we won't deserialize the function body or closure scope
                     // Just deserialize the function address and parameter count, along with parameter names
                     fn->params = malloc(sizeof(char*) * fn->param_count);
                     for (int i = 0; i < fn->param_count; i++) {
                         int param_len;
-                        memcpy(&param_len, data + offset, sizeof(int));
-                        offset += sizeof(int);
-                        char* param_name = malloc(param_len + 1);
-                        memcpy(param_name, data + offset, param_len);
-                        offset += param_len;
-                        param_name[param_len] = '\0';
-                        fn->params[i] = param_name;
+                        if (!read_length(data, size, &offset, &param_len)) {
+                            return 0;
+                        }
+                        fn->params[i] = read_chars(data, &offset, param_len);
                     }
 
                     fn->obj.type = OBJ_FUNCTION;
                     fn->scope = NULL; // Closure scope will be set during execution
-                    val->as.object = (Obj*)fn;
+                    *val = OBJ_VAL(fn);
                     return offset;
                 }
                 
                 // No other object types compiled in constants for now
+                default:
+                    break;
             }
             break;
         }
+
+        default:
+            break;
     }
+    return 0;
+}
+
+// How an instruction changes the operand stack: it needs `pops` values,
+// leaves `pushes` in their place and may hold up to `scratch` above the
+// popped ones while it runs (the slow paths of the superinstructions push
+// their operands again). `taken` is the height left above the popped
+// values when it jumps to its operand, -1 if it never does.
+typedef struct {
+    int pops;
+    int pushes;
+    int scratch;
+    int taken;
+    int width;    // Instructions it occupies, CALL_METHOD and FOR_RANGE_PREP read a NOP
+    int falls;    // Continues with the next instruction
+} StackEffect;
+
+static StackEffect stack_effect(Instruction instr, int argc) {
+    StackEffect e = {0, 0, 0, -1, 1, 1};
+    Opcode op = instr.opcode;
+    if ((op >= OP_ADD && op <= OP_DIV) || (op >= OP_EQ && op <= OP_LE_FLOAT_STATIC) || op == OP_IDX_GET) {
+        e.pops = 2;
+        e.pushes = 1;
+    } else if (IS_COMPARE_JUMP(op)) {
+        e.pops = 2;
+        e.taken = 0;
+    }
+    switch (op) {
+        case OP_LOAD:
+        case OP_LOAD_LOCAL:
+        case OP_LOAD_GLOBAL:
+        case OP_CONST:
+            e.pushes = 1;
+            break;
+        case OP_STORE:
+        case OP_STORE_LOCAL:
+        case OP_STORE_GLOBAL:
+        case OP_POP:
+            e.pops = 1;
+            break;
+        case OP_NEG:
+        case OP_NOT:
+        case OP_GET_ITER:
+        case OP_MAKE_CLASS:
+        case OP_MAKE_INSTANCE:
+        case OP_GET_ATTR:
+            e.pops = 1;
+            e.pushes = 1;
+            break;
+        case OP_ADD_CONST:
+            e.pops = 1;
+            e.pushes = 1;
+            e.scratch = 2;
+            break;
+        case OP_INC_LOCAL:
+        case OP_INC_GLOBAL:
+            e.scratch = 2;
+            break;
+        case OP_JUMP:
+            e.taken = 0;
+            e.falls = 0;
+            break;
+        case OP_JUMP_IF_ZERO:
+            e.pops = 1;
+            e.taken = 0;
+            break;
+        case OP_FOR_ITER:
+            // [iterator] -> [iterator, item], or [iterator] at the exit
+            e.pops = 1;
+            e.pushes = 2;
+            e.taken = 1;
+            break;
+        case OP_FOR_RANGE:
+            e.pops = 3;
+            e.pushes = 4;
+            e.taken = 3;
+            break;
+        case OP_FOR_RANGE_PREP:
+            // [args..., callee] stays for the generic path, or becomes
+            // the loop state at the FOR_RANGE
+            e.pops = argc + 1;
+            e.pushes = argc + 1;
+            e.taken = 3;
+            e.width = 2;
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            e.pops = instr.operand + 1;
+            e.pushes = 1;
+            break;
+        case OP_CALL_METHOD:
+            e.pops = argc + 1;
+            e.pushes = 1;
+            e.width = 2;
+            break;
+        case OP_IDX_SET:
+            e.pops = 3;
+            break;
+        case OP_SET_ATTR:
+            e.pops = 2;
+            break;
+        case OP_RET:
+            e.pops = 1;
+            e.falls = 0;
+            break;
+        case OP_HALT:
+            e.falls = 0;
+            break;
+        default:
+            break;
+    }
+    return e;
+}
+
+static int reject(int ip, const char* problem) {
+    printf("Invalid bytecode at %04d: %s\n", ip, problem);
+    return 0;
+}
+
+static int is_string_constant(Bytecode* bytecode, int index) {
+    if (index < 0 || index >= bytecode->const_count) {
+        return 0;
+    }
+    Value constant = bytecode->constants[index];
+    return IS_OBJ(constant) && AS_OBJ(constant)->type == OBJ_STRING;
+}
+
+static int is_jump(Opcode op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_ZERO || op == OP_FOR_ITER ||
+           op == OP_FOR_RANGE_PREP || op == OP_FOR_RANGE || IS_COMPARE_JUMP(op);
+}
+
+// Operands of one instruction, wherever it is: constants, globals and jump
+// targets exist and names are strings
+static int check_operands(Bytecode* bytecode, int ip) {
+    Instruction instr = bytecode->instructions[ip];
+    int operand = instr.operand;
+    if ((unsigned)instr.opcode > OP_HALT) {
+        return reject(ip, "unknown opcode");
+    }
+    switch (instr.opcode) {
+        case OP_CONST:
+        case OP_ADD_CONST:
+            if (operand < 0 || operand >= bytecode->const_count) {
+                return reject(ip, "constant index out of range");
+            }
+            break;
+        case OP_LOAD:
+        case OP_STORE:
+        case OP_MAKE_CLASS:
+        case OP_GET_ATTR:
+        case OP_SET_ATTR:
+        case OP_CALL_METHOD:
+            if (!is_string_constant(bytecode, operand)) {
+                return reject(ip, "name operand is not a string constant");
+            }
+            break;
+        case OP_LOAD_GLOBAL:
+        case OP_STORE_GLOBAL:
+            if (operand < 0 || operand >= bytecode->global_count) {
+                return reject(ip, "global slot out of range");
+            }
+            break;
+        case OP_INC_LOCAL:
+        case OP_INC_GLOBAL:
+            if (operand < 0 || SUPER_CONST(operand) >= bytecode->const_count ||
+                (instr.opcode == OP_INC_GLOBAL && SUPER_SLOT(operand) >= bytecode->global_count)) {
+                return reject(ip, "increment operand out of range");
+            }
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            if (operand < 0) {
+                return reject(ip, "negative argument count");
+            }
+            break;
+        default:
+            break;
+    }
+    if (is_jump(instr.opcode) && (operand < 0 || operand >= bytecode->count)) {
+        return reject(ip, "jump target out of range");
+    }
+    if (instr.opcode == OP_CALL_METHOD || instr.opcode == OP_FOR_RANGE_PREP) {
+        if (ip + 1 >= bytecode->count || bytecode->instructions[ip + 1].opcode != OP_NOP ||
+            bytecode->instructions[ip + 1].operand < 0) {
+            return reject(ip, "missing the NOP holding the argument count");
+        }
+    }
+    return 1;
+}
+
+// Walk every path from entry, where the operand stack is empty. depth[ip]
+// is -1 for instructions not reached yet; the ones reached are listed in
+// order, which doubles as the work queue, and reset to -1 before
+// returning. fn is NULL for module-level code. Returns the deepest stack,
+// or -1 when the code is rejected.
+static int verify_code(Bytecode* bytecode, ObjFunction* fn, int entry, int* depth, int* order) {
+    Instruction* code = bytecode->instructions;
+    int local_count = fn && !fn->uses_scope ? fn->local_count : 0;
+    int max = 0;
+    int reached = 1;
+    int ok = 1;
+    depth[entry] = 0;
+    order[0] = entry;
+
+    for (int next = 0; next < reached && ok; next++) {
+        int ip = order[next];
+        int d = depth[ip];
+        Instruction instr = code[ip];
+        int argc = instr.opcode == OP_CALL_METHOD || instr.opcode == OP_FOR_RANGE_PREP ? code[ip + 1].operand : 0;
+        StackEffect e = stack_effect(instr, argc);
+
+        if (d < e.pops) {
+            ok = reject(ip, "stack underflow");
+            break;
+        }
+        int local = instr.opcode == OP_INC_LOCAL ? SUPER_SLOT(instr.operand) : instr.operand;
+        if ((instr.opcode == OP_LOAD_LOCAL || instr.opcode == OP_STORE_LOCAL || instr.opcode == OP_INC_LOCAL) &&
+            (local < 0 || local >= local_count)) {
+            ok = reject(ip, "local slot out of range");
+            break;
+        }
+        if (instr.opcode == OP_RET && !fn) {
+            ok = reject(ip, "RET outside a function");
+            break;
+        }
+        if (instr.opcode == OP_HALT && fn) {
+            ok = reject(ip, "HALT inside a function");
+            break;
+        }
+
+        int peak = d - e.pops + (e.scratch > e.pushes ? e.scratch : e.pushes);
+        if (peak > max) {
+            max = peak;
+        }
+        if (d - e.pops + e.taken > max) {
+            max = d - e.pops + e.taken;
+        }
+
+        int targets[2];
+        int heights[2];
+        int count = 0;
+        if (e.falls) {
+            targets[count] = ip + e.width;
+            heights[count++] = d - e.pops + e.pushes;
+        }
+        if (e.taken >= 0) {
+            targets[count] = instr.operand;
+            heights[count++] = d - e.pops + e.taken;
+        }
+        for (int k = 0; k < count && ok; k++) {
+            int target = targets[k];
+            if (target >= bytecode->count) {
+                ok = reject(ip, "runs past the end of the code");
+            } else if (depth[target] < 0) {
+                depth[target] = heights[k];
+                order[reached++] = target;
+            } else if (depth[target] != heights[k]) {
+                ok = reject(target, "reached with different stack heights");
+            }
+        }
+    }
+
+    for (int i = 0; i < reached; i++) {
+        depth[order[i]] = -1;
+    }
+    return ok ? max : -1;
+}
+
+int bytecode_verify(Bytecode* bytecode, int start) {
+    if (start < 0 || start >= bytecode->count) {
+        return reject(start, "no code to run");
+    }
+    for (int i = 0; i < bytecode->global_count; i++) {
+        if (!is_string_constant(bytecode, bytecode->globals[i])) {
+            printf("Invalid bytecode: global slot %d has no name\n", i);
+            return 0;
+        }
+    }
+    for (int ip = start; ip < bytecode->count; ip++) {
+        if (!check_operands(bytecode, ip)) {
+            return 0;
+        }
+    }
+
+    int* depth = malloc(sizeof(int) * bytecode->count);
+    int* order = malloc(sizeof(int) * bytecode->count);
+    for (int ip = 0; ip < bytecode->count; ip++) {
+        depth[ip] = -1;
+    }
+
+    int max = verify_code(bytecode, NULL, start, depth, order);
+    if (max > bytecode->max_stack) {
+        bytecode->max_stack = max;
+    }
+    // Functions compiled since start, earlier ones were checked with their code
+    for (int i = 0; i < bytecode->const_count && max >= 0; i++) {
+        Value constant = bytecode->constants[i];
+        if (!IS_OBJ(constant) || AS_OBJ(constant)->type != OBJ_FUNCTION) {
+            continue;
+        }
+        ObjFunction* fn = (ObjFunction*)AS_OBJ(constant);
+        if (fn->addr >= 0 && fn->addr < start) {
+            continue;
+        }
+        if (fn->addr < 0 || fn->addr >= bytecode->count || fn->param_count < 0 || fn->local_count < fn->param_count) {
+            printf("Invalid bytecode: function '%s' is malformed\n", fn->name);
+            max = -1;
+            break;
+        }
+        max = verify_code(bytecode, fn, fn->addr, depth, order);
+        fn->max_stack = max;
+    }
+
+    free(depth);
+    free(order);
+    return max >= 0;
+}
+
+static void bytecode_free(Bytecode* bytecode) {
+    free(bytecode->instructions);
+    free(bytecode->constants);
+    free(bytecode->globals);
+    free(bytecode);
 }
 
 Bytecode* bytecode_deserialize(const char* filename) {
@@ -177,11 +575,20 @@ Bytecode* bytecode_deserialize(const char* filename) {
     Bytecode* bytecode = malloc(sizeof(Bytecode));
     bytecode_init(bytecode);
 
+    // Every section is checked against the file size before it is read
+    int size = (int)file_size;
     int offset = 0;
-    int instruction_count = *(int*)(bytecode_data + offset);
-    offset += sizeof(int);
-    int constant_count = *(int*)(bytecode_data + offset);
-    offset += sizeof(int);
+    int instruction_count;
+    int constant_count;
+    if (!read_int(bytecode_data, size, &offset, &instruction_count) ||
+        !read_int(bytecode_data, size, &offset, &constant_count) ||
+        instruction_count < 0 || instruction_count > (size - offset) / (int)sizeof(Instruction) ||
+        constant_count < 0) {
+        printf("Bytecode file '%s' is truncated\n", filename);
+        free(bytecode_data);
+        bytecode_free(bytecode);
+        return NULL;
+    }
 
     bytecode->count = instruction_count;
     bytecode->capacity = instruction_count;
@@ -192,14 +599,45 @@ Bytecode* bytecode_deserialize(const char* filename) {
 
     for (int i = 0; i < constant_count; i++) {
         Value val;
-        int size = deserialize_value(bytecode_data + offset, &val);
+        int value_size = deserialize_value(bytecode_data + offset, size - offset, &val);
+        if (value_size == 0) {
+            printf("Bytecode file '%s' has a bad constant %d\n", filename, i);
+            free(bytecode_data);
+            bytecode->const_count = i;
+            bytecode_free(bytecode);
+            return NULL;
+        }
         bytecode->constants = realloc(bytecode->constants, sizeof(Value) * (i + 1));
         bytecode->constants[i] = val;
-        offset += size;
+        offset += value_size;
     }
 
     bytecode->const_count = constant_count;
-    bytecode->capacity = constant_count;
+    bytecode->const_capacity = constant_count;
+
+    int global_count;
+    if (!read_int(bytecode_data, size, &offset, &global_count) ||
+        global_count < 0 || global_count > (size - offset) / (int)sizeof(int)) {
+        printf("Bytecode file '%s' is truncated\n", filename);
+        free(bytecode_data);
+        bytecode_free(bytecode);
+        return NULL;
+    }
+    bytecode->globals = malloc(sizeof(int) * global_count);
+    memcpy(bytecode->globals, bytecode_data + offset, sizeof(int) * global_count);
+    offset += sizeof(int) * global_count;
+    bytecode->global_count = global_count;
+    bytecode->global_capacity = global_count;
+
+    free(bytecode_data);
+
+    // Reject bad code before anything runs, this also records the stack
+    // depth of every function
+    if (!bytecode_verify(bytecode, 0)) {
+        printf("Bytecode file '%s' failed verification\n", filename);
+        bytecode_free(bytecode);
+        return NULL;
+    }
 
     return bytecode;
 }
@@ -208,25 +646,25 @@ static int get_constants_size(Bytecode* bytecode) {
     int size = 0;
     for (int i = 0; i < bytecode->const_count; i++) {
         Value val = bytecode->constants[i];
-        switch(val.type) {
+        switch(VALUE_TYPE(val)) {
             case VAL_NONE:
             case VAL_BOOL:
             case VAL_INT:
             case VAL_FLOAT:
-                size += 1 + sizeof(val.as);
+                size += 1 + SCALAR_PAYLOAD_SIZE;
                 break;
             case VAL_OBJ:
                 size += 1 + sizeof(ObjectType);
-                if (val.as.object->type == OBJ_STRING) {
-                    ObjString* str = (ObjString*)val.as.object;
+                if (AS_OBJ(val)->type == OBJ_STRING) {
+                    ObjString* str = (ObjString*)AS_OBJ(val);
                     size += sizeof(int) + str->length;
                 }
-                else if (val.as.object->type == OBJ_FUNCTION) {
-                    ObjFunction* fn = (ObjFunction*)val.as.object;
+                else if (AS_OBJ(val)->type == OBJ_FUNCTION) {
+                    ObjFunction* fn = (ObjFunction*)AS_OBJ(val);
                     size += sizeof(int);
                     int name_len = strlen(fn->name);
                     size += sizeof(int) + name_len;
-                    size += sizeof(int);
+                    size += sizeof(int) * 3; // param_count, local_count, uses_scope
                     for (int j = 0; j < fn->param_count; j++) {
                         size += sizeof(int) + strlen(fn->params[j]);
                     }
@@ -241,7 +679,8 @@ static int get_constants_size(Bytecode* bytecode) {
 
 int bytecode_serialize(Bytecode* bytecode, const char* filename) {
     int constants_size = get_constants_size(bytecode);
-    int data_size = sizeof(int) * 2 + sizeof(Instruction) * bytecode->count + constants_size;
+    int data_size = sizeof(int) * 2 + sizeof(Instruction) * bytecode->count + constants_size
+                  + sizeof(int) * (1 + bytecode->global_count);
     char* data = malloc(data_size);
     int offset = 0;
 
@@ -257,6 +696,12 @@ int bytecode_serialize(Bytecode* bytecode, const char* filename) {
         offset += serialize_value(data + offset, bytecode->constants[i]);
     }
 
+    // Global slot table: constant index of each slot's name
+    *(int*)(data + offset) = bytecode->global_count;
+    offset += sizeof(int);
+    memcpy(data + offset, bytecode->globals, sizeof(int) * bytecode->global_count);
+    offset += sizeof(int) * bytecode->global_count;
+
     FILE* file = fopen(filename, "wb");
     if (!file) {
         free(data);
@@ -282,7 +727,8 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
     // Find jumps addresses
     for (int i = 0; i < bytecode->count; i++) {
         Instruction instr = bytecode->instructions[i];
-        if (instr.opcode == OP_JUMP || instr.opcode == OP_JUMP_IF_ZERO) {
+        if (instr.opcode == OP_JUMP || instr.opcode == OP_JUMP_IF_ZERO || instr.opcode == OP_FOR_ITER ||
+            instr.opcode == OP_FOR_RANGE_PREP || instr.opcode == OP_FOR_RANGE || IS_COMPARE_JUMP(instr.opcode)) {
             jump_addresses[instr.operand] = 1;
         }
     }
@@ -291,8 +737,8 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
     memset(functions, 0, sizeof(uint8_t) * bytecode->count);
     for (int i = 0; i < bytecode->const_count; i++) {
         Value constant = bytecode->constants[i];
-        if (constant.type == VAL_OBJ && constant.as.object->type == OBJ_FUNCTION) {
-            ObjFunction* fn = (ObjFunction*)constant.as.object;
+        if (IS_OBJ(constant) && AS_OBJ(constant)->type == OBJ_FUNCTION) {
+            ObjFunction* fn = (ObjFunction*)AS_OBJ(constant);
             if (fn->addr >= 0 && fn->addr < bytecode->count) {
                 functions[fn->addr] = i;
             }
@@ -306,8 +752,8 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
         }
         if (functions[i]) {
             Value constant = bytecode->constants[functions[i]];
-            if (constant.type == VAL_OBJ && constant.as.object->type == OBJ_FUNCTION) {
-                ObjFunction* fn = (ObjFunction*)constant.as.object;
+            if (IS_OBJ(constant) && AS_OBJ(constant)->type == OBJ_FUNCTION) {
+                ObjFunction* fn = (ObjFunction*)AS_OBJ(constant);
                 fprintf(file, "FUNC_%04d %s(", i, fn->name);
                 if (fn->param_count > 0) {
                     for (int j = 0; j < fn->param_count - 1; j++) {
@@ -325,25 +771,76 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
             case OP_SUB:         fprintf(file, "SUB\n"); break;
             case OP_MUL:         fprintf(file, "MUL\n"); break;
             case OP_DIV:         fprintf(file, "DIV\n"); break;
+            case OP_NEG:         fprintf(file, "NEG\n"); break;
+            case OP_NOT:         fprintf(file, "NOT\n"); break;
             case OP_EQ:          fprintf(file, "EQ\n"); break;
             case OP_LT:          fprintf(file, "LT\n"); break;
             case OP_GT:          fprintf(file, "GT\n"); break;
+            case OP_ADD_INT_STATIC: fprintf(file, "ADD_INT_STATIC\n"); break;
+            case OP_ADD_FLOAT_STATIC: fprintf(file, "ADD_FLOAT_STATIC\n"); break;
+            case OP_SUB_INT_STATIC: fprintf(file, "SUB_INT_STATIC\n"); break;
+            case OP_SUB_FLOAT_STATIC: fprintf(file, "SUB_FLOAT_STATIC\n"); break;
+            case OP_MUL_INT_STATIC: fprintf(file, "MUL_INT_STATIC\n"); break;
+            case OP_MUL_FLOAT_STATIC: fprintf(file, "MUL_FLOAT_STATIC\n"); break;
+            case OP_DIV_FLOAT_STATIC: fprintf(file, "DIV_FLOAT_STATIC\n"); break;
+            case OP_EQ_INT_STATIC: fprintf(file, "EQ_INT_STATIC\n"); break;
+            case OP_LT_INT_STATIC: fprintf(file, "LT_INT_STATIC\n"); break;
+            case OP_GT_INT_STATIC: fprintf(file, "GT_INT_STATIC\n"); break;
+            case OP_GE_INT_STATIC: fprintf(file, "GE_INT_STATIC\n"); break;
+            case OP_LE_INT_STATIC: fprintf(file, "LE_INT_STATIC\n"); break;
+            case OP_NE_INT_STATIC: fprintf(file, "NE_INT_STATIC\n"); break;
+            case OP_LT_FLOAT_STATIC: fprintf(file, "LT_FLOAT_STATIC\n"); break;
+            case OP_GT_FLOAT_STATIC: fprintf(file, "GT_FLOAT_STATIC\n"); break;
+            case OP_GE_FLOAT_STATIC: fprintf(file, "GE_FLOAT_STATIC\n"); break;
+            case OP_LE_FLOAT_STATIC: fprintf(file, "LE_FLOAT_STATIC\n"); break;
             case OP_JUMP:        fprintf(file, "JUMP LABEL_%04d\n", instr.operand); break;
             case OP_JUMP_IF_ZERO:fprintf(file, "JUMP_IF_ZERO LABEL_%04d\n", instr.operand); break;
+            case OP_EQ_JUMP_IF_FALSE: fprintf(file, "EQ_JUMP_IF_FALSE LABEL_%04d\n", instr.operand); break;
+            case OP_NE_JUMP_IF_FALSE: fprintf(file, "NE_JUMP_IF_FALSE LABEL_%04d\n", instr.operand); break;
+            case OP_LT_JUMP_IF_FALSE: fprintf(file, "LT_JUMP_IF_FALSE LABEL_%04d\n", instr.operand); break;
+            case OP_GT_JUMP_IF_FALSE: fprintf(file, "GT_JUMP_IF_FALSE LABEL_%04d\n", instr.operand); break;
+            case OP_LE_JUMP_IF_FALSE: fprintf(file, "LE_JUMP_IF_FALSE LABEL_%04d\n", instr.operand); break;
+            case OP_GE_JUMP_IF_FALSE: fprintf(file, "GE_JUMP_IF_FALSE LABEL_%04d\n", instr.operand); break;
+            case OP_INC_LOCAL:
+            case OP_INC_GLOBAL: {
+                int slot = SUPER_SLOT(instr.operand);
+                int k = SUPER_CONST(instr.operand);
+                if (instr.opcode == OP_INC_LOCAL) {
+                    fprintf(file, "INC_LOCAL %d", slot);
+                } else {
+                    ObjString* name = (ObjString*)AS_OBJ(bytecode->constants[bytecode->globals[slot]]);
+                    fprintf(file, "INC_GLOBAL [%d]=\"%s\"", slot, name->chars);
+                }
+                fprintf(file, " [%d]=(INT)%d\n", k, (int)AS_INT(bytecode->constants[k]));
+                break;
+            }
+            case OP_ADD_CONST: {
+                Value constant = bytecode->constants[instr.operand];
+                if (IS_INT(constant)) {
+                    fprintf(file, "ADD_CONST [%d]=(INT)%d\n", instr.operand, (int)AS_INT(constant));
+                } else if (IS_FLOAT(constant)) {
+                    fprintf(file, "ADD_CONST [%d]=(FLOAT)%f\n", instr.operand, AS_FLOAT(constant));
+                } else if (IS_OBJ(constant) && AS_OBJ(constant)->type == OBJ_STRING) {
+                    fprintf(file, "ADD_CONST [%d]=(OBJ->Str) \"%s\"\n", instr.operand, ((ObjString*)AS_OBJ(constant))->chars);
+                } else {
+                    fprintf(file, "ADD_CONST [%d]\n", instr.operand);
+                }
+                break;
+            }
             case OP_CONST:      {
                 Value constant = bytecode->constants[instr.operand];
-                if (constant.type == VAL_INT) {
-                    fprintf(file, "CONST [%d]=(INT)%d\n", instr.operand, (int)constant.as.integer);
-                } else if (constant.type == VAL_FLOAT) {
-                    fprintf(file, "CONST [%d]=(FLOAT)%f\n", instr.operand, constant.as.floating);
-                } else if (constant.type == VAL_BOOL) {
-                    fprintf(file, "CONST [%d]=(BOOL)%s\n", instr.operand, constant.as.boolean ? "True" : "False");
-                } else if (constant.type == VAL_NONE) {
+                if (IS_INT(constant)) {
+                    fprintf(file, "CONST [%d]=(INT)%d\n", instr.operand, (int)AS_INT(constant));
+                } else if (IS_FLOAT(constant)) {
+                    fprintf(file, "CONST [%d]=(FLOAT)%f\n", instr.operand, AS_FLOAT(constant));
+                } else if (IS_BOOL(constant)) {
+                    fprintf(file, "CONST [%d]=(BOOL)%s\n", instr.operand, AS_BOOL(constant) ? "True" : "False");
+                } else if (IS_NONE(constant)) {
                     fprintf(file, "CONST None\n");
-                } else if (constant.type == VAL_OBJ) {
+                } else if (IS_OBJ(constant)) {
                     fprintf(file, "CONST [%d]=(OBJ->", instr.operand);
-                    if (constant.as.object->type == OBJ_FUNCTION) {
-                        ObjFunction* fn = (ObjFunction*)constant.as.object;
+                    if (AS_OBJ(constant)->type == OBJ_FUNCTION) {
+                        ObjFunction* fn = (ObjFunction*)AS_OBJ(constant);
                         fprintf(file, "Func@%04d) %s(", fn->addr, fn->name);
                         if (fn->param_count > 0) {
                             for (int j = 0; j < fn->param_count - 1; j++) {
@@ -352,19 +849,23 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
                             fprintf(file, "%s", fn->params[fn->param_count - 1]);
                         }
                         fprintf(file, ")\n");
-                    } else if (constant.as.object->type == OBJ_STRING) {
-                        fprintf(file, "Str) \"%s\"\n", ((ObjString*)constant.as.object)->chars);
+                    } else if (AS_OBJ(constant)->type == OBJ_STRING) {
+                        fprintf(file, "Str) \"%s\"\n", ((ObjString*)AS_OBJ(constant))->chars);
                     } else {
-                        fprintf(file, "->Unknown Object Type %d\n", constant.as.object->type);
+                        fprintf(file, "->Unknown Object Type %d\n", AS_OBJ(constant)->type);
                     }
                 }
                 break;
             }
             case OP_POP:        fprintf(file, "POP\n"); break;
+            case OP_GET_ITER:   fprintf(file, "GET_ITER\n"); break;
+            case OP_FOR_ITER:   fprintf(file, "FOR_ITER LABEL_%04d\n", instr.operand); break;
+            case OP_FOR_RANGE_PREP: fprintf(file, "FOR_RANGE_PREP LABEL_%04d\n", instr.operand); break;
+            case OP_FOR_RANGE:  fprintf(file, "FOR_RANGE LABEL_%04d\n", instr.operand); break;
             case OP_STORE: {
                 Value name = bytecode->constants[instr.operand];
-                if (name.type == VAL_OBJ && name.as.object->type == OBJ_STRING) {
-                    fprintf(file, "STORE [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)name.as.object)->chars);
+                if (IS_OBJ(name) && AS_OBJ(name)->type == OBJ_STRING) {
+                    fprintf(file, "STORE [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)AS_OBJ(name))->chars);
                 } else {
                     fprintf(file, "STORE %d\n", instr.operand);
                 }
@@ -372,15 +873,28 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
             }
             case OP_LOAD: {
                 Value name = bytecode->constants[instr.operand];
-                if (name.type == VAL_OBJ && name.as.object->type == OBJ_STRING) {
-                    fprintf(file, "LOAD [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)name.as.object)->chars);
+                if (IS_OBJ(name) && AS_OBJ(name)->type == OBJ_STRING) {
+                    fprintf(file, "LOAD [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)AS_OBJ(name))->chars);
                 } else {
                     fprintf(file, "LOAD %d\n", instr.operand);
                 }
                 break;
             }
+            case OP_LOAD_LOCAL:  fprintf(file, "LOAD_LOCAL %d\n", instr.operand); break;
+            case OP_STORE_LOCAL: fprintf(file, "STORE_LOCAL %d\n", instr.operand); break;
+            case OP_LOAD_GLOBAL: {
+                ObjString* name = (ObjString*)AS_OBJ(bytecode->constants[bytecode->globals[instr.operand]]);
+                fprintf(file, "LOAD_GLOBAL [%d]=\"%s\"\n", instr.operand, name->chars);
+                break;
+            }
+            case OP_STORE_GLOBAL: {
+                ObjString* name = (ObjString*)AS_OBJ(bytecode->constants[bytecode->globals[instr.operand]]);
+                fprintf(file, "STORE_GLOBAL [%d]=\"%s\"\n", instr.operand, name->chars);
+                break;
+            }
             case OP_HALT:        fprintf(file, "HALT\n"); break;
             case OP_CALL:        fprintf(file, "CALL %d\n", instr.operand); break;
+            case OP_TAIL_CALL:   fprintf(file, "TAIL_CALL %d\n", instr.operand); break;
             case OP_RET:         fprintf(file, "RET\n"); break;
 
             case OP_IDX_GET:     fprintf(file, "INDEX_GET\n"); break;
@@ -388,8 +902,8 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
             
             case OP_MAKE_CLASS:  {
                 Value name = bytecode->constants[instr.operand];
-                if (name.type == VAL_OBJ && name.as.object->type == OBJ_STRING) {
-                    fprintf(file, "MAKE_CLASS [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)name.as.object)->chars);
+                if (IS_OBJ(name) && AS_OBJ(name)->type == OBJ_STRING) {
+                    fprintf(file, "MAKE_CLASS [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)AS_OBJ(name))->chars);
                 } else {
                     fprintf(file, "MAKE_CLASS %d\n", instr.operand);
                 }
@@ -398,8 +912,8 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
             case OP_MAKE_INSTANCE: fprintf(file, "MAKE_INSTANCE\n"); break;
             case OP_GET_ATTR:    {
                 Value name = bytecode->constants[instr.operand];
-                if (name.type == VAL_OBJ && name.as.object->type == OBJ_STRING) {
-                    fprintf(file, "GET_ATTR [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)name.as.object)->chars);
+                if (IS_OBJ(name) && AS_OBJ(name)->type == OBJ_STRING) {
+                    fprintf(file, "GET_ATTR [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)AS_OBJ(name))->chars);
                 } else {
                     fprintf(file, "GET_ATTR %d\n", instr.operand);
                 }
@@ -407,8 +921,8 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
             }
             case OP_SET_ATTR:    {
                 Value name = bytecode->constants[instr.operand];
-                if (name.type == VAL_OBJ && name.as.object->type == OBJ_STRING) {
-                    fprintf(file, "SET_ATTR [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)name.as.object)->chars);
+                if (IS_OBJ(name) && AS_OBJ(name)->type == OBJ_STRING) {
+                    fprintf(file, "SET_ATTR [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)AS_OBJ(name))->chars);
                 } else {
                     fprintf(file, "SET_ATTR %d\n", instr.operand);
                 }
@@ -416,8 +930,8 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
             }
             case OP_CALL_METHOD: {
                 Value name = bytecode->constants[instr.operand];
-                if (name.type == VAL_OBJ && name.as.object->type == OBJ_STRING) {
-                    fprintf(file, "CALL_METHOD [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)name.as.object)->chars);
+                if (IS_OBJ(name) && AS_OBJ(name)->type == OBJ_STRING) {
+                    fprintf(file, "CALL_METHOD [%d]=(OBJ->Str)\"%s\"\n", instr.operand, ((ObjString*)AS_OBJ(name))->chars);
                 } else {
                     fprintf(file, "CALL_METHOD %d\n", instr.operand);
                 }
@@ -431,31 +945,37 @@ int bytecode_disasm(Bytecode* bytecode, const char* filename) {
     for (int i = 0; i < bytecode->const_count; i++) {
         Value constant = bytecode->constants[i];
         fprintf(file, "%04d: ", i);
-        if (constant.type == VAL_INT) {
-            fprintf(file, "INT %d\n", (int)constant.as.integer);
-        } else if (constant.type == VAL_FLOAT) {
-            fprintf(file, "FLOAT %f\n", constant.as.floating);
-        } else if (constant.type == VAL_BOOL) {
-            fprintf(file, "BOOL %s\n", constant.as.boolean ? "True" : "False");
-        } else if (constant.type == VAL_NONE) {
+        if (IS_INT(constant)) {
+            fprintf(file, "INT %d\n", (int)AS_INT(constant));
+        } else if (IS_FLOAT(constant)) {
+            fprintf(file, "FLOAT %f\n", AS_FLOAT(constant));
+        } else if (IS_BOOL(constant)) {
+            fprintf(file, "BOOL %s\n", AS_BOOL(constant) ? "True" : "False");
+        } else if (IS_NONE(constant)) {
             fprintf(file, "NONE\n");
-        } else if (constant.type == VAL_OBJ) {
+        } else if (IS_OBJ(constant)) {
             fprintf(file, "OBJ ");;
-            if (constant.as.object->type == OBJ_FUNCTION) {
-                int addr = ((ObjFunction*)constant.as.object)->addr;
+            if (AS_OBJ(constant)->type == OBJ_FUNCTION) {
+                int addr = ((ObjFunction*)AS_OBJ(constant))->addr;
                 fprintf(file, "Function@%04d\n", addr);
-            } else if (constant.as.object->type == OBJ_STRING) {
-                fprintf(file, "String: \"%s\"\n", ((ObjString*)constant.as.object)->chars);
-            } else if (constant.as.object->type == OBJ_LIST) {
+            } else if (AS_OBJ(constant)->type == OBJ_STRING) {
+                fprintf(file, "String: \"%s\"\n", ((ObjString*)AS_OBJ(constant))->chars);
+            } else if (AS_OBJ(constant)->type == OBJ_LIST) {
                 fprintf(file, "List\n");
             } else {
-                fprintf(file, "Unknown Object Type %d\n", constant.as.object->type);
+                fprintf(file, "Unknown Object Type %d\n", AS_OBJ(constant)->type);
             }
         } else {
-            fprintf(file, "Unknown Constant Type %d\n", constant.type);
+            fprintf(file, "Unknown Constant Type %d\n", VALUE_TYPE(constant));
         }
     }
 
+    fprintf(file, "\nGlobals:\n");
+    for (int i = 0; i < bytecode->global_count; i++) {
+        ObjString* name = (ObjString*)AS_OBJ(bytecode->constants[bytecode->globals[i]]);
+        fprintf(file, "%04d: \"%s\"\n", i, name->chars);
+    }
+
     fclose(file);
     free(jump_addresses);
     return 1; // Success
@@ -1,6 +1,10 @@
 #include "compiler.h"
 
+#include "bytecode.h"
+#include "ir.h"
 #include "lexer.h"
+#include "np_config.h"
+#include "optimizer.h"
 #include "parser.h"
 
 #include "stdlib.h"
@@ -16,9 +20,25 @@ void compiler_init(Compiler* compiler) {
     compiler->bytecode->capacity = code_cap;
     compiler->bytecode->constants = malloc(sizeof(Value) * const_cap);
     compiler->bytecode->const_count = 0;
+    compiler->bytecode->const_capacity = const_cap;
+    compiler->bytecode->globals = NULL;
+    compiler->bytecode->global_count = 0;
+    compiler->bytecode->global_capacity = 0;
+    compiler->bytecode->max_stack = 0;
     compiler->loop_count = 0;
+    compiler->function = NULL;
+    compiler->opt_level = NP_OPT_LEVEL;
+    compiler->ir_dump = NULL;
+    compiler->whole_program = 0;
+    compiler->fixed_builtins = 0;
+    compiler->inline_calls = 1;
+    compiler->inline_candidates = NULL;
+    compiler->inline_candidate_count = 0;
+    compiler->inline_site = NULL;
+    compiler->inline_growth = 0;
     hash_init(&compiler->imported_modules, 16);
     hash_init(&compiler->string_constants, 64);  // Initialize string constants hashmap
+    hash_init(&compiler->global_slots, 64);
 }
 
 static void emit(Compiler* compiler, Opcode op, int arg) {
@@ -46,22 +66,14 @@ static void patch_jump(Compiler* compiler, int jump_pos, int jump_target) {
 
 static int find_string(HashMap* map, const char* chars, int length) {
     if (map->count == 0 || length == 0) return -1;
-    uint32_t hash = hash_string(chars);
-    uint32_t index = hash & (map->capacity - 1);
-    HashNode* node = &map->nodes[index];
-
-    while (node != NULL) {
-        if (node->key && node->key->length == length && memcmp(node->key->chars, chars, length) == 0) {
-            return node->value.as.integer; // Return the constant pool index
-        }
-        node = node->next;
-    }
-    return -1;
+    int entry = hash_find_string(map, chars, length, hash_string(chars));
+    if (entry < 0) return -1;
+    return AS_INT(map->entries[entry].value); // Return the constant pool index
 }
 
-static int add_constant(Compiler* compiler, Value value) {
-    if (value.type == VAL_OBJ && value.as.object->type == OBJ_STRING) {
-        ObjString* str = (ObjString*)value.as.object;
+int add_constant(Compiler* compiler, Value value) {
+    if (IS_OBJ(value) && AS_OBJ(value)->type == OBJ_STRING) {
+        ObjString* str = (ObjString*)AS_OBJ(value);
         int existing_idx = find_string(&compiler->string_constants, str->chars, str->length);
         if (existing_idx != -1) {
             return existing_idx;
@@ -78,18 +90,18 @@ static int add_constant(Compiler* compiler, Value value) {
         }
     }
 
-    if (bytecode->const_count >= bytecode->capacity) {
-        bytecode->capacity *= 2;
+    if (bytecode->const_count >= bytecode->const_capacity) {
+        bytecode->const_capacity *= 2;
         bytecode->constants = realloc(
             bytecode->constants,
-            sizeof(Value) * bytecode->capacity
+            sizeof(Value) * bytecode->const_capacity
         );
     }
 
     bytecode->constants[bytecode->const_count] = value;
 
-    if (value.type == VAL_OBJ && value.as.object->type == OBJ_STRING) {
-        ObjString* str = (ObjString*)value.as.object;
+    if (IS_OBJ(value) && AS_OBJ(value)->type == OBJ_STRING) {
+        ObjString* str = (ObjString*)AS_OBJ(value);
         hash_set(&compiler->string_constants, str, make_number_int(bytecode->const_count));
     }
 
@@ -156,6 +168,351 @@ void patch_break_jumps(Compiler* compiler, int break_target) {
     }
 }
 
+// Return the global slot for a name, allocating the next one on first use
+int resolve_global(Compiler* compiler, const char* name) {
+    Bytecode* bytecode = compiler->bytecode;
+    int name_idx = add_constant(compiler, make_const_string(name));
+    ObjString* key = as_string(bytecode->constants[name_idx]);
+
+    Value slot;
+    if (hash_get(&compiler->global_slots, key, &slot)) {
+        return AS_INT(slot);
+    }
+
+    if (bytecode->global_count >= bytecode->global_capacity) {
+        bytecode->global_capacity = bytecode->global_capacity == 0 ? 64 : bytecode->global_capacity * 2;
+        bytecode->globals = realloc(bytecode->globals, sizeof(int) * bytecode->global_capacity);
+    }
+    bytecode->globals[bytecode->global_count] = name_idx;
+    hash_set(&compiler->global_slots, key, make_number_int(bytecode->global_count));
+    return bytecode->global_count++;
+}
+
+int resolve_local(Compiler* compiler, const char* name) {
+    FunctionContext* fn = compiler->function;
+    if (!fn || fn->uses_scope) return -1;
+    for (int i = 0; i < fn->local_count; i++) {
+        if (strcmp(fn->locals[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void declare_local(FunctionContext* fn, const char* name) {
+    for (int i = 0; i < fn->local_count; i++) {
+        if (strcmp(fn->locals[i], name) == 0) {
+            return;
+        }
+    }
+    if (fn->local_count >= fn->local_capacity) {
+        fn->local_capacity = fn->local_capacity == 0 ? 8 : fn->local_capacity * 2;
+        fn->locals = realloc(fn->locals, sizeof(char*) * fn->local_capacity);
+    }
+    fn->locals[fn->local_count++] = (char*)name;
+}
+
+// Resolver pass: collect every name assigned in a function body so it gets a
+// frame slot. Bodies that define nested functions or classes or import
+// modules keep their names in a Scope instead.
+static void resolve_locals(FunctionContext* fn, Ast* node) {
+    if (!node) return;
+    switch (node->type) {
+        case AST_ASSIGN:
+            declare_local(fn, node->Assign.name);
+            break;
+        case AST_BLOCK:
+            for (int i = 0; i < node->Block.count; i++) {
+                resolve_locals(fn, node->Block.statements[i]);
+            }
+            break;
+        case AST_IF:
+            resolve_locals(fn, node->If.then_branch);
+            resolve_locals(fn, node->If.else_branch);
+            break;
+        case AST_WHILE:
+            resolve_locals(fn, node->While.body);
+            break;
+        case AST_FOR:
+            declare_local(fn, node->For.var);
+            resolve_locals(fn, node->For.body);
+            break;
+        case AST_FUNCDEF:
+        case AST_CLASSDEF:
+        case AST_IMPORT:
+            fn->uses_scope = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+// Emit a variable load: frame slot, global slot, or a by-name lookup
+// through the Scope chain for scope-based and nested functions.
+static void emit_load_name(Compiler* compiler, const char* name) {
+    int slot = resolve_local(compiler, name);
+    if (slot >= 0) {
+        emit(compiler, OP_LOAD_LOCAL, slot);
+        return;
+    }
+    FunctionContext* fn = compiler->function;
+    InlineSite* site = compiler->inline_site;
+    if (!fn && site) {
+        for (int i = 0; i < site->callee->def->FuncDef.argc; i++) {
+            if (strcmp(site->callee->def->FuncDef.args[i], name) == 0) {
+                emit(compiler, OP_LOAD_GLOBAL, site->param_slots[i]);
+                return;
+            }
+        }
+    }
+    if (!fn || (!fn->uses_scope && !fn->nested)) {
+        emit(compiler, OP_LOAD_GLOBAL, resolve_global(compiler, name));
+        return;
+    }
+    emit(compiler, OP_LOAD, add_constant(compiler, make_const_string(name)));
+}
+
+static void emit_store_name(Compiler* compiler, const char* name) {
+    int slot = resolve_local(compiler, name);
+    if (slot >= 0) {
+        emit(compiler, OP_STORE_LOCAL, slot);
+        return;
+    }
+    if (!compiler->function) {
+        emit(compiler, OP_STORE_GLOBAL, resolve_global(compiler, name));
+        return;
+    }
+    emit(compiler, OP_STORE, add_constant(compiler, make_const_string(name)));
+}
+
+static void compile_node(Compiler* compiler, Ast* node);
+
+// args..., callee, then OP_CALL or OP_TAIL_CALL
+static void emit_call(Compiler* compiler, Ast* call, Opcode op) {
+    for (int i = 0; i < call->Call.argc; i++) {
+        compile_node(compiler, call->Call.args[i]);
+    }
+    emit_load_name(compiler, call->Call.name);
+    emit(compiler, op, call->Call.argc);
+}
+
+// Expand a call in module code whose callee returns a single expression:
+// the arguments go to hidden globals named "callee.param", the module code
+// having no frame slots, and the expression is compiled in place of the
+// call. Returns 0 when the call has to stay a call.
+static int inline_module_call(Compiler* compiler, Ast* node) {
+    if (compiler->function || !compiler->inline_calls || compiler->opt_level == 0) {
+        return 0;
+    }
+    InlineCandidate* callee = find_inline_candidate(compiler, node->Call.name);
+    if (!callee || !callee->expression || !callee->defined ||
+        callee->def->FuncDef.argc != node->Call.argc ||
+        compiler->inline_growth + callee->size > INLINE_BUDGET) {
+        return 0;
+    }
+    int size_limit = compiler->loop_count > 0 ? INLINE_MAX_SIZE_IN_LOOP : INLINE_MAX_SIZE;
+    if (callee->size > size_limit) {
+        return 0;
+    }
+    int depth = 0;
+    for (InlineSite* site = compiler->inline_site; site; site = site->caller, depth++) {
+        if (site->callee == callee) return 0;
+        for (int i = 0; i < site->callee->def->FuncDef.argc; i++) {
+            // The name is a parameter where the call is, not the function
+            if (strcmp(site->callee->def->FuncDef.args[i], node->Call.name) == 0) return 0;
+        }
+    }
+    if (depth >= INLINE_MAX_DEPTH) {
+        return 0;
+    }
+    for (int i = 0; i < node->Call.argc; i++) {
+        compile_node(compiler, node->Call.args[i]);
+    }
+    InlineSite site = { callee, malloc(sizeof(int) * (node->Call.argc + 1)), compiler->inline_site };
+    for (int i = node->Call.argc - 1; i >= 0; i--) {
+        char name[256];
+        snprintf(name, sizeof(name), "%s.%s", callee->def->FuncDef.name, callee->def->FuncDef.args[i]);
+        site.param_slots[i] = resolve_global(compiler, name);
+        emit(compiler, OP_STORE_GLOBAL, site.param_slots[i]);
+    }
+    compiler->inline_growth += callee->size;
+    compiler->inline_site = &site;
+    compile_node(compiler, callee->expression);
+    compiler->inline_site = site.caller;
+    // The slots are globals, so whatever they hold stays reachable: let
+    // the arguments go once the body has run, as a frame would
+    int none_idx = add_constant(compiler, make_none());
+    for (int i = 0; i < node->Call.argc; i++) {
+        emit(compiler, OP_CONST, none_idx);
+        emit(compiler, OP_STORE_GLOBAL, site.param_slots[i]);
+    }
+    free(site.param_slots);
+    return 1;
+}
+
+Opcode binary_opcode(TokenType op) {
+    switch (op) {
+        case TOKEN_PLUS:  return OP_ADD;
+        case TOKEN_MINUS: return OP_SUB;
+        case TOKEN_STAR:  return OP_MUL;
+        case TOKEN_SLASH: return OP_DIV;
+        case TOKEN_EQ:    return OP_EQ;
+        case TOKEN_LT:    return OP_LT;
+        case TOKEN_GT:    return OP_GT;
+        case TOKEN_LE:    return OP_LE;
+        case TOKEN_GE:    return OP_GE;
+        case TOKEN_NE:    return OP_NE;
+        default:
+            printf("Unsupported binary operator in compiler: %d\n", op);
+            exit(1);
+    }
+}
+
+Opcode unary_opcode(TokenType op) {
+    switch (op) {
+        case TOKEN_MINUS: return OP_NEG;
+        case TOKEN_NOT:   return OP_NOT;
+        default:
+            printf("Unsupported unary operator in compiler: %d\n", op);
+            exit(1);
+    }
+}
+
+static int is_expression(Ast* node) {
+    switch (node->type) {
+        case AST_NUMBER:
+        case AST_FLOAT:
+        case AST_STRING:
+        case AST_BINARY:
+        case AST_UNARY:
+        case AST_VAR:
+        case AST_LIST:
+        case AST_DICT:
+        case AST_TUPLE:
+        case AST_SET:
+        case AST_INDEX:
+        case AST_CALL:
+        case AST_METHOD_CALL:
+        case AST_ATTR_ACCESS:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Compile a statement, discarding the value of an expression statement
+// so loops and calls leave the stack balanced
+static void compile_statement(Compiler* compiler, Ast* node) {
+    compile_node(compiler, node);
+    if (is_expression(node)) {
+        emit(compiler, OP_POP, 0);
+    }
+}
+
+// for var in range(...) keeps the counter unboxed on the stack:
+//   args
+//   LOAD range
+//   FOR_RANGE_PREP loop_start  (builtin range: replace with [start, stop, step])
+//   NOP argc
+//   CALL argc                  (range was rebound: iterate whatever it returns)
+//   GET_ITER
+//   CONST None
+//   CONST None
+// loop_start:
+//   FOR_RANGE loop_exit
+//   STORE var
+//   body
+//   JUMP loop_start
+// loop_exit:
+//   POP x3                     (break jumps here too)
+static int is_range_call(Ast* node) {
+    return node->type == AST_CALL && strcmp(node->Call.name, "range") == 0 &&
+           node->Call.argc >= 1 && node->Call.argc <= 3;
+}
+
+static void compile_for_range(Compiler* compiler, Ast* node) {
+    Ast* call = node->For.iterable;
+    for (int i = 0; i < call->Call.argc; i++) {
+        compile_node(compiler, call->Call.args[i]);
+    }
+    emit_load_name(compiler, call->Call.name);
+    int prep_jump = emit_jump(compiler, OP_FOR_RANGE_PREP);
+    emit(compiler, OP_NOP, call->Call.argc);
+
+    emit(compiler, OP_CALL, call->Call.argc);
+    emit(compiler, OP_GET_ITER, 0);
+    int none_idx = add_constant(compiler, make_none());
+    emit(compiler, OP_CONST, none_idx);
+    emit(compiler, OP_CONST, none_idx);
+
+    int loop_start = compiler->bytecode->count;
+    patch_jump(compiler, prep_jump, loop_start);
+    push_loop(compiler, loop_start);
+
+    int exit_jump = emit_jump(compiler, OP_FOR_RANGE);
+    emit_store_name(compiler, node->For.var);
+
+    compile_node(compiler, node->For.body);
+    emit(compiler, OP_JUMP, loop_start);
+
+    int loop_exit = compiler->bytecode->count;
+    patch_jump(compiler, exit_jump, loop_exit);
+    patch_break_jumps(compiler, loop_exit);
+    pop_loop(compiler);
+    emit(compiler, OP_POP, 0);
+    emit(compiler, OP_POP, 0);
+    emit(compiler, OP_POP, 0);
+}
+
+static ObjFunction* new_function(Ast* def, int addr) {
+    ObjFunction* fn = malloc(sizeof(ObjFunction));
+    fn->obj.type = OBJ_FUNCTION;
+    fn->addr = addr;
+    fn->name = strdup(def->FuncDef.name);
+    fn->param_count = def->FuncDef.argc;
+
+    // Deep copy parameters
+    fn->params = malloc(sizeof(char*) * fn->param_count);
+    for (int i = 0; i < fn->param_count; i++) {
+        fn->params[i] = strdup(def->FuncDef.args[i]);
+    }
+
+    fn->local_count = fn->param_count;
+    fn->uses_scope = 0;
+    fn->call_count = 0;
+    fn->max_stack = 0;
+    fn->scope = NULL; // Closure scope will be set during execution
+    return fn;
+}
+
+// Compile a function body at the current position, ending with an implicit
+// "return None", and record how many frame slots it needs. With the
+// optimizer on, slotted bodies go through the SSA IR (ir.c).
+static void compile_function_body(Compiler* compiler, Ast* def, ObjFunction* fn) {
+    FunctionContext ctx = {0};
+    for (int i = 0; i < def->FuncDef.argc; i++) {
+        declare_local(&ctx, def->FuncDef.args[i]);
+    }
+    resolve_locals(&ctx, def->FuncDef.body);
+
+    FunctionContext* enclosing = compiler->function;
+    ctx.nested = enclosing != NULL;
+    compiler->function = &ctx;
+
+    fn->uses_scope = ctx.uses_scope;
+    fn->local_count = ctx.uses_scope ? fn->param_count : ctx.local_count;
+
+    int slotted = !ctx.uses_scope && !ctx.nested;
+    if (!slotted || compiler->opt_level == 0 || !ir_compile_function(compiler, def, fn)) {
+        compile_node(compiler, def->FuncDef.body);
+        emit(compiler, OP_CONST, add_constant(compiler, make_none()));
+        emit(compiler, OP_RET, 0);
+    }
+
+    compiler->function = enclosing;
+    free(ctx.locals);
+}
+
 static void compile_node(Compiler* compiler, Ast* node) {
     if (!node) {
         printf("ERROR: Trying to compile NULL node\n");
@@ -182,71 +539,14 @@ static void compile_node(Compiler* compiler, Ast* node) {
 
         case AST_UNARY: {
             compile_node(compiler, node->Unary.value);
-            switch (node->Unary.op) {
-                case TOKEN_MINUS: {
-                    // Unary minus: negate the value
-                    // Push -1 and multiply
-                    int neg_one = add_constant(compiler, make_number_int(-1));
-                    emit(compiler, OP_CONST, neg_one);
-                    emit(compiler, OP_MUL, 0);
-                    break;
-                }
-                case TOKEN_NOT: {
-                    // Logical NOT
-                    // For now, we'll implement it as: if value == 0 then 1 else 0
-                    // Push 0, compare for equality
-                    int zero = add_constant(compiler, make_number_int(0));
-                    emit(compiler, OP_CONST, zero);
-                    emit(compiler, OP_EQ, 0);
-                    break;
-                }
-                default:
-                    printf("Unsupported unary operator in compiler: %d\n", node->Unary.op);
-                    exit(1);
-                    break;
-            }
+            emit(compiler, unary_opcode(node->Unary.op), 0);
         }
         break;
 
         case AST_BINARY: {
             compile_node(compiler, node->Binary.left);
             compile_node(compiler, node->Binary.right);
-            switch (node->Binary.op) {
-                case TOKEN_PLUS:
-                    emit(compiler, OP_ADD, 0);
-                    break;
-                case TOKEN_MINUS:
-                    emit(compiler, OP_SUB, 0);
-                    break;
-                case TOKEN_STAR:
-                    emit(compiler, OP_MUL, 0);
-                    break;
-                case TOKEN_SLASH:
-                    emit(compiler, OP_DIV, 0);
-                    break;
-                case TOKEN_EQ:
-                    emit(compiler, OP_EQ, 0);
-                    break;
-                case TOKEN_LT:
-                    emit(compiler, OP_LT, 0);
-                    break;
-                case TOKEN_GT:
-                    emit(compiler, OP_GT, 0);
-                    break;
-                case TOKEN_LE:
-                    emit(compiler, OP_LE, 0);
-                    break;
-                case TOKEN_GE:
-                    emit(compiler, OP_GE, 0);
-                    break;
-                case TOKEN_NE:
-                    emit(compiler, OP_NE, 0);
-                    break;
-                default:
-                    printf("Unsupported binary operator in compiler: %d\n", node->Binary.op);
-                    exit(1);
-                break;
-            }
+            emit(compiler, binary_opcode(node->Binary.op), 0);
         }
         break;
 
@@ -285,55 +585,39 @@ static void compile_node(Compiler* compiler, Ast* node) {
         break;
 
         case AST_FOR: {
+            if (is_range_call(node->For.iterable)) {
+                compile_for_range(compiler, node);
+                break;
+            }
             // for var in iterable:
             //   body
             // Compiles to:
-            // iterable
-            // GET_ITER
+            //   iterable
+            //   GET_ITER
             // loop_start:
-            //   FOR_ITER exit_jump
+            //   FOR_ITER loop_exit
             //   STORE var
             //   body
             //   JUMP loop_start
-            // exit_jump:
-
-            // Add native function for making iterators to constants (if not already added)
-            // It's already in the global scope, so we can not emit OP_STORE
-            int fn_make_iter = add_constant(compiler, make_const_string("native_make_iterator"));
-            int fn_iter_next = add_constant(compiler, make_const_string("native_iterator_next"));
-
-            // Add loop variable name to constants
-            int for_var_idx = add_constant(compiler, make_const_string(node->For.var));
-            // Load loop variable name onto stack for use in native_make_iterator and loop initialization
-            emit(compiler, OP_CONST, for_var_idx);
-
-            // Compile iterable expression and call native_make_iterator on it before starting the loop
+            // loop_exit:
+            //   POP            (the iterator; break jumps here too)
             compile_node(compiler, node->For.iterable);
+            emit(compiler, OP_GET_ITER, 0);
 
-            // Call native_make_iterator(iterable, var_name) to get iterator object
-            emit(compiler, OP_LOAD, fn_make_iter);
-            emit(compiler, OP_CALL, 2); // Pass both the iterable and the loop variable for initialization
-            // The native_make_iterator function will create an iterator object and store it in the loop variable for use in the loop body
-            
-            // Start of loop
             int loop_start = compiler->bytecode->count;
             push_loop(compiler, loop_start);
 
-            // Pass loop variable name to native_iterator_next
-            emit(compiler, OP_CONST, for_var_idx); 
-            // Get next item and check if iteration is done
-            emit(compiler, OP_LOAD, fn_iter_next);
-            emit(compiler, OP_CALL, 1); // Pass the variable name to get the next item
-
-            int exit_jump = emit_jump(compiler, OP_JUMP_IF_ZERO);
+            int exit_jump = emit_jump(compiler, OP_FOR_ITER);
+            emit_store_name(compiler, node->For.var);
 
             compile_node(compiler, node->For.body);
             emit(compiler, OP_JUMP, loop_start);
 
-            int loop_end = compiler->bytecode->count;
-            patch_jump(compiler, exit_jump, loop_end);
-            patch_break_jumps(compiler, loop_end);
+            int loop_exit = compiler->bytecode->count;
+            patch_jump(compiler, exit_jump, loop_exit);
+            patch_break_jumps(compiler, loop_exit);
             pop_loop(compiler);
+            emit(compiler, OP_POP, 0);
         }
         break;
 
@@ -355,20 +639,18 @@ static void compile_node(Compiler* compiler, Ast* node) {
 
         case AST_ASSIGN: {
             compile_node(compiler, node->Assign.value);
-            int idx = add_constant(compiler, make_const_string(node->Assign.name));
-            emit(compiler, OP_STORE, idx);
+            emit_store_name(compiler, node->Assign.name);
         }
         break;
 
         case AST_VAR: {
-            int idx = add_constant(compiler, make_const_string(node->Variable.name));
-            emit(compiler, OP_LOAD, idx);
+            emit_load_name(compiler, node->Variable.name);
         }
         break;
 
         case AST_BLOCK: {
             for (int i = 0; i < node->Block.count; i++) {
-                compile_node(compiler, node->Block.statements[i]);
+                compile_statement(compiler, node->Block.statements[i]);
             }
         }
         break;
@@ -380,55 +662,42 @@ static void compile_node(Compiler* compiler, Ast* node) {
             // 4. Function body starts here
             int fn_addr = compiler->bytecode->count + 3;
 
-            ObjFunction* fn = malloc(sizeof(ObjFunction));
-            fn->addr = fn_addr;
-            fn->name = strdup(node->FuncDef.name);
-            fn->param_count = node->FuncDef.argc;
-            
-            // Deep copy parameters
-            fn->params = malloc(sizeof(char*) * fn->param_count);
-            for (int i = 0; i < fn->param_count; i++) {
-                fn->params[i] = strdup(node->FuncDef.args[i]);
-            }
-            
-            fn->scope = NULL; // Closure scope will be set during execution
-
-            Obj * obj_fn = (Obj*)fn;
-            obj_fn->type = OBJ_FUNCTION;
-            Value v = {.type = VAL_OBJ, .as.object = obj_fn};
+            ObjFunction* fn = new_function(node, fn_addr);
+            Value v = OBJ_VAL(fn);
             int fn_idx = add_constant(compiler, v);
             emit(compiler, OP_CONST, fn_idx);
 
-            int fn_idx_name = add_constant(compiler, make_const_string(node->FuncDef.name));
-            emit(compiler, OP_STORE, fn_idx_name);
+            emit_store_name(compiler, node->FuncDef.name);
 
             int jump_over_func = emit_jump(compiler, OP_JUMP);
             
-            compile_node(compiler, node->FuncDef.body);
-
-            // Ensure function ends with a return
-            emit(compiler, OP_CONST, add_constant(compiler, (Value){.type = VAL_NONE}));
-            emit(compiler, OP_RET, 0);
+            compile_function_body(compiler, node, fn);
 
             patch_jump(compiler, jump_over_func, compiler->bytecode->count);
+
+            InlineCandidate* candidate = find_inline_candidate(compiler, node->FuncDef.name);
+            if (!compiler->function && candidate && candidate->def == node) {
+                candidate->defined = 1;
+            }
         }
         break;
 
         case AST_CALL: {
-            for (int i = 0; i < node->Call.argc; i++) {
-                compile_node(compiler, node->Call.args[i]);
+            if (inline_module_call(compiler, node)) {
+                break;
             }
-            int fn_idx_name = add_constant(compiler, make_const_string(node->Call.name));
-            emit(compiler, OP_LOAD, fn_idx_name);
-            emit(compiler, OP_CALL, node->Call.argc);
+            emit_call(compiler, node, OP_CALL);
         }
         break;
 
         case AST_RETURN: {
-            if (node->Return.value) {
+            if (compiler->function && node->Return.value && node->Return.value->type == AST_CALL) {
+                // The RET only runs when the VM cannot reuse the frame
+                emit_call(compiler, node->Return.value, OP_TAIL_CALL);
+            } else if (node->Return.value) {
                 compile_node(compiler, node->Return.value);
             } else {
-                int none_idx = add_constant(compiler, (Value){.type = VAL_NONE});
+                int none_idx = add_constant(compiler, NONE_VAL);
                 emit(compiler, OP_CONST, none_idx);
             }
             emit(compiler, OP_RET, 0);
@@ -441,8 +710,7 @@ static void compile_node(Compiler* compiler, Ast* node) {
                 compile_node(compiler, node->List.elements[i]);
             }
             // Call native function to create list
-            int fn_idx_name = add_constant(compiler, make_const_string("native_make_list"));
-            emit(compiler, OP_LOAD, fn_idx_name);
+            emit_load_name(compiler, "native_make_list");
             emit(compiler, OP_CALL, node->List.count);
         }
         break;
@@ -452,8 +720,7 @@ static void compile_node(Compiler* compiler, Ast* node) {
                 compile_node(compiler, node->Tuple.elements[i]);
             }
             // Call native function to create tuple
-            int fn_idx_name = add_constant(compiler, make_const_string("native_make_tuple"));
-            emit(compiler, OP_LOAD, fn_idx_name);
+            emit_load_name(compiler, "native_make_tuple");
             emit(compiler, OP_CALL, node->Tuple.count);
         }
         break;
@@ -463,8 +730,7 @@ static void compile_node(Compiler* compiler, Ast* node) {
                 compile_node(compiler, node->Set.elements[i]);
             }
             // Call native function to create set
-            int fn_idx_name = add_constant(compiler, make_const_string("native_make_set"));
-            emit(compiler, OP_LOAD, fn_idx_name);
+            emit_load_name(compiler, "native_make_set");
             emit(compiler, OP_CALL, node->Set.count);
         }
         break;
@@ -475,9 +741,8 @@ static void compile_node(Compiler* compiler, Ast* node) {
                 compile_node(compiler, node->Dict.values[i]);
             }
             // Call native function to create dict
-            int fn_idx_name = add_constant(compiler, make_const_string("native_make_dict"));
-            emit(compiler, OP_LOAD, fn_idx_name);
-            emit(compiler, OP_CALL, node->Dict.count);
+            emit_load_name(compiler, "native_make_dict");
+            emit(compiler, OP_CALL, node->Dict.count * 2);
         }
         break;
 
@@ -501,8 +766,7 @@ static void compile_node(Compiler* compiler, Ast* node) {
             
             // Load parent class if specified
             if (node->ClassDef.parent) {
-                int parent_idx = add_constant(compiler, make_const_string(node->ClassDef.parent));
-                emit(compiler, OP_LOAD, parent_idx);
+                emit_load_name(compiler, node->ClassDef.parent);
             } else {
                 // No parent, push None
                 int none_idx = add_constant(compiler, make_none());
@@ -513,42 +777,34 @@ static void compile_node(Compiler* compiler, Ast* node) {
             emit(compiler, OP_MAKE_CLASS, class_name_idx);
             
             // Store the class so we can reload it
-            emit(compiler, OP_STORE, class_name_idx);
+            emit_store_name(compiler, node->ClassDef.name);
+
+            // Fix the instance layout before anything looks at the class
+            if (node->ClassDef.slots) {
+                emit_load_name(compiler, node->ClassDef.name);
+                compile_node(compiler, node->ClassDef.slots);
+                emit(compiler, OP_SET_ATTR, add_constant(compiler, make_const_string("__slots__")));
+            }
             
             // For each method: load class, push method, set attribute
             for (int i = 0; i < node->ClassDef.method_count; i++) {
                 Ast* method = node->ClassDef.methods[i];
                 
                 // Load the class
-                emit(compiler, OP_LOAD, class_name_idx);
+                emit_load_name(compiler, node->ClassDef.name);
                 
                 // Compile the method as a function
                 int method_addr = compiler->bytecode->count + 2;
                 
-                ObjFunction* fn = malloc(sizeof(ObjFunction));
-                fn->addr = method_addr;
-                fn->name = strdup(method->FuncDef.name);
-                fn->param_count = method->FuncDef.argc;
-                
-                // Deep copy parameters
-                fn->params = malloc(sizeof(char*) * fn->param_count);
-                for (int i = 0; i < fn->param_count; i++) {
-                    fn->params[i] = strdup(method->FuncDef.args[i]);
-                }
-                
-                fn->scope = NULL;
-                fn->obj.type = OBJ_FUNCTION;
-                
-                Value v = {.type = VAL_OBJ, .as.object = (Obj*)fn};
+                ObjFunction* fn = new_function(method, method_addr);
+                Value v = OBJ_VAL(fn);
                 int fn_idx = add_constant(compiler, v);
                 emit(compiler, OP_CONST, fn_idx);
                 
                 int jump_over_method = emit_jump(compiler, OP_JUMP);
                 
                 // Compile method body
-                compile_node(compiler, method->FuncDef.body);
-                emit(compiler, OP_CONST, add_constant(compiler, make_none()));
-                emit(compiler, OP_RET, 0);
+                compile_function_body(compiler, method, fn);
                 
                 patch_jump(compiler, jump_over_method, compiler->bytecode->count);
                 
@@ -599,6 +855,8 @@ static void compile_node(Compiler* compiler, Ast* node) {
             module_name->obj.type = OBJ_STRING;
             module_name->chars = strdup(node->Import.module_name);
             module_name->length = strlen(node->Import.module_name);
+            module_name->hash = hash_string(module_name->chars);
+            module_name->interned = 0;
             
             Value cached;
             if (hash_get(&compiler->imported_modules, module_name, &cached)) {
@@ -645,10 +903,10 @@ static void compile_node(Compiler* compiler, Ast* node) {
             // (Just compile its statements, don't add HALT)
             if (module_ast->type == AST_BLOCK) {
                 for (int i = 0; i < module_ast->Block.count; i++) {
-                    compile_node(compiler, module_ast->Block.statements[i]);
+                    compile_statement(compiler, module_ast->Block.statements[i]);
                 }
             } else {
-                compile_node(compiler, module_ast);
+                compile_statement(compiler, module_ast);
             }
             
             // Cleanup
@@ -679,20 +937,259 @@ void print_bytecode(Bytecode* bytecode) {
     }
 }
 
+static void drop_inline_candidates(Compiler* compiler) {
+    for (int i = 0; i < compiler->inline_candidate_count; i++) {
+        free(compiler->inline_candidates[i].context.locals);
+    }
+    free(compiler->inline_candidates);
+    compiler->inline_candidates = NULL;
+    compiler->inline_candidate_count = 0;
+}
+
 void compiler_free(Compiler* compiler) {
     free(compiler->bytecode->instructions);
     free(compiler->bytecode->constants);
+    free(compiler->bytecode->globals);
     free(compiler->bytecode);
     compiler->bytecode = NULL;
     hash_free(&compiler->imported_modules);
-    compiler->imported_modules.nodes = NULL;
     hash_free(&compiler->string_constants);
-    compiler->string_constants.nodes = NULL;
+    hash_free(&compiler->global_slots);
+    drop_inline_candidates(compiler);
+}
+
+static const char* builtin_name(Builtin builtin) {
+    switch (builtin) {
+        case BUILTIN_INT:   return "int";
+        case BUILTIN_FLOAT: return "float";
+        default:            return "range";
+    }
+}
+
+// Clear the bits of the builtins a statement of the program binds, and drop
+// the inline candidates bound by anything but their own def. What an
+// imported module binds is only known once it is compiled, so an import
+// clears them all.
+static void find_rebound_names(Compiler* compiler, Ast* node) {
+    if (!node) return;
+    const char* name = NULL;
+    switch (node->type) {
+        case AST_ASSIGN:
+            name = node->Assign.name;
+            break;
+        case AST_BLOCK:
+            for (int i = 0; i < node->Block.count; i++) {
+                find_rebound_names(compiler, node->Block.statements[i]);
+            }
+            break;
+        case AST_IF:
+            find_rebound_names(compiler, node->If.then_branch);
+            find_rebound_names(compiler, node->If.else_branch);
+            break;
+        case AST_WHILE:
+            find_rebound_names(compiler, node->While.body);
+            break;
+        case AST_FOR:
+            name = node->For.var;
+            find_rebound_names(compiler, node->For.body);
+            break;
+        case AST_FUNCDEF:
+            name = node->FuncDef.name;
+            find_rebound_names(compiler, node->FuncDef.body);
+            break;
+        case AST_CLASSDEF:
+            name = node->ClassDef.name;
+            for (int i = 0; i < node->ClassDef.method_count; i++) {
+                find_rebound_names(compiler, node->ClassDef.methods[i]);
+            }
+            break;
+        case AST_IMPORT:
+            compiler->fixed_builtins = 0;
+            drop_inline_candidates(compiler);
+            break;
+        default:
+            break;
+    }
+    for (int bit = BUILTIN_INT; name && bit <= BUILTIN_RANGE; bit <<= 1) {
+        if (strcmp(name, builtin_name(bit)) == 0) {
+            compiler->fixed_builtins &= ~bit;
+        }
+    }
+    InlineCandidate* candidate = name ? find_inline_candidate(compiler, name) : NULL;
+    if (candidate && candidate->def != node) {
+        candidate->def = NULL;
+    }
+}
+
+// AST nodes under node, -1 if it has a statement an inlined body cannot
+// contain: loops, definitions, imports or a call to the function itself
+static int inline_size(Ast* node, const char* self) {
+    if (!node) return 0;
+    int size = 1;
+    Ast** children = NULL;
+    int count = 0;
+    Ast* parts[3] = {NULL, NULL, NULL};
+    switch (node->type) {
+        case AST_NUMBER:
+        case AST_FLOAT:
+        case AST_STRING:
+        case AST_VAR:
+            return 1;
+        case AST_BINARY:
+            parts[0] = node->Binary.left;
+            parts[1] = node->Binary.right;
+            break;
+        case AST_UNARY:
+            parts[0] = node->Unary.value;
+            break;
+        case AST_ASSIGN:
+            parts[0] = node->Assign.value;
+            break;
+        case AST_IF:
+            parts[0] = node->If.condition;
+            parts[1] = node->If.then_branch;
+            parts[2] = node->If.else_branch;
+            break;
+        case AST_BLOCK:
+            children = node->Block.statements;
+            count = node->Block.count;
+            break;
+        case AST_LIST:
+            children = node->List.elements;
+            count = node->List.count;
+            break;
+        case AST_TUPLE:
+            children = node->Tuple.elements;
+            count = node->Tuple.count;
+            break;
+        case AST_SET:
+            children = node->Set.elements;
+            count = node->Set.count;
+            break;
+        case AST_DICT:
+            for (int i = 0; i < node->Dict.count; i++) {
+                int key = inline_size(node->Dict.keys[i], self);
+                int value = inline_size(node->Dict.values[i], self);
+                if (key < 0 || value < 0) return -1;
+                size += key + value;
+            }
+            return size;
+        case AST_INDEX:
+            parts[0] = node->Index.target;
+            parts[1] = node->Index.index;
+            break;
+        case AST_ASSIGN_INDEX:
+            parts[0] = node->AssignIndex.target;
+            parts[1] = node->AssignIndex.index;
+            parts[2] = node->AssignIndex.value;
+            break;
+        case AST_CALL:
+            if (strcmp(node->Call.name, self) == 0) return -1;
+            children = node->Call.args;
+            count = node->Call.argc;
+            break;
+        case AST_RETURN:
+            parts[0] = node->Return.value;
+            break;
+        case AST_METHOD_CALL:
+            parts[0] = node->MethodCall.object;
+            children = node->MethodCall.args;
+            count = node->MethodCall.argc;
+            break;
+        case AST_ATTR_ACCESS:
+            parts[0] = node->AttrAccess.object;
+            break;
+        case AST_ATTR_ASSIGN:
+            parts[0] = node->AttrAssign.object;
+            parts[1] = node->AttrAssign.value;
+            break;
+        default:
+            return -1;
+    }
+    for (int i = 0; i < 3 + count; i++) {
+        int part = inline_size(i < 3 ? parts[i] : children[i - 3], self);
+        if (part < 0) return -1;
+        size += part;
+    }
+    return size;
+}
+
+// Expression a body consists of returning, NULL if it does more
+static Ast* returned_expression(Ast* body) {
+    if (body->type == AST_BLOCK && body->Block.count == 1) {
+        body = body->Block.statements[0];
+    }
+    return body->type == AST_RETURN ? body->Return.value : NULL;
+}
+
+// Small functions defined at the top level of the program
+static void find_inline_candidates(Compiler* compiler, Ast* program) {
+    int capacity = 0;
+    for (int i = 0; program->type == AST_BLOCK && i < program->Block.count; i++) {
+        Ast* def = program->Block.statements[i];
+        if (def->type != AST_FUNCDEF || find_inline_candidate(compiler, def->FuncDef.name)) {
+            continue;
+        }
+        int size = inline_size(def->FuncDef.body, def->FuncDef.name);
+        if (size < 0 || size > INLINE_MAX_SIZE_IN_LOOP) {
+            continue;
+        }
+        InlineCandidate candidate = {0};
+        candidate.def = def;
+        candidate.size = size;
+        candidate.expression = returned_expression(def->FuncDef.body);
+        for (int j = 0; j < def->FuncDef.argc; j++) {
+            declare_local(&candidate.context, def->FuncDef.args[j]);
+        }
+        resolve_locals(&candidate.context, def->FuncDef.body);
+        if (compiler->inline_candidate_count >= capacity) {
+            capacity = capacity == 0 ? 8 : capacity * 2;
+            compiler->inline_candidates = realloc(compiler->inline_candidates, sizeof(InlineCandidate) * capacity);
+        }
+        compiler->inline_candidates[compiler->inline_candidate_count++] = candidate;
+    }
+}
+
+InlineCandidate* find_inline_candidate(Compiler* compiler, const char* name) {
+    for (int i = 0; i < compiler->inline_candidate_count; i++) {
+        InlineCandidate* candidate = &compiler->inline_candidates[i];
+        if (candidate->def && strcmp(candidate->def->FuncDef.name, name) == 0) {
+            return candidate;
+        }
+    }
+    return NULL;
+}
+
+int is_fixed_builtin(Compiler* compiler, int slot, Builtin builtin) {
+    if (!(compiler->fixed_builtins & builtin)) {
+        return 0;
+    }
+    Value name = compiler->bytecode->constants[compiler->bytecode->globals[slot]];
+    return strcmp(as_string(name)->chars, builtin_name(builtin)) == 0;
 }
 
 Bytecode* compile(Compiler* compiler, Ast* node) 
 {
+    int start = compiler->bytecode->count;
+    // Later REPL lines could rebind any builtin, only a whole program can
+    // be checked up front
+    compiler->fixed_builtins = 0;
+    drop_inline_candidates(compiler);
+    if (compiler->whole_program) {
+        compiler->fixed_builtins = BUILTIN_INT | BUILTIN_FLOAT | BUILTIN_RANGE;
+        if (compiler->inline_calls && compiler->opt_level > 0) {
+            find_inline_candidates(compiler, node);
+        }
+        find_rebound_names(compiler, node);
+    }
     compile_node(compiler, node);
+    if (compiler->opt_level > 0) {
+        optimize_bytecode(compiler, start);
+    }
     emit(compiler, OP_HALT, 0);
+    // Also records the stack depth each function needs
+    if (!bytecode_verify(compiler->bytecode, start)) {
+        return NULL;
+    }
     return compiler->bytecode;
 }
\ No newline at end of file
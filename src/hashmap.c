@@ -5,15 +5,17 @@
 #include "stdint.h"
 #include "stdio.h"
 
+// Entries a map of the given capacity can hold before it grows
+#define HASH_USABLE(capacity) ((int)((capacity) * HASH_MAX_LOAD_FACTOR))
+
 void hash_init(HashMap* map, int initial_capacity) {
     map->capacity = initial_capacity;
     map->count = 0;
-    map->nodes = malloc(sizeof(HashNode) * map->capacity);
+    map->indices = malloc(sizeof(int32_t) * map->capacity);
     for (int i = 0; i < map->capacity; i++) {
-        map->nodes[i].key = NULL;
-        map->nodes[i].value = (Value){0};
-        map->nodes[i].next = NULL;
+        map->indices[i] = HASH_EMPTY;
     }
+    map->entries = malloc(sizeof(HashEntry) * HASH_USABLE(map->capacity));
 }
 
 uint32_t hash_string(const char* str){
@@ -26,102 +28,109 @@ uint32_t hash_string(const char* str){
     return hash;
 }
 
-static void hash_resize(HashMap* map, int new_capacity) {
-    HashNode* old_nodes = map->nodes;
-    int old_capacity = map->capacity;
+// Interned strings are unique, so two of them are equal only if they are
+// the same object. Anything else compares cached hashes before the bytes.
+static inline int keys_equal(ObjString* a, ObjString* b) {
+    if (a == b) return 1;
+    if (a->interned && b->interned) return 0;
+    return a->hash == b->hash && a->length == b->length &&
+           memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+// Linear probe for key. Returns the slot holding it, or the empty slot
+// where it would be inserted.
+static uint32_t find_slot(HashMap* map, ObjString* key) {
+    uint32_t mask = map->capacity - 1;
+    uint32_t slot = key->hash & mask;
+    while (1) {
+        int32_t entry = map->indices[slot];
+        if (entry == HASH_EMPTY || keys_equal(map->entries[entry].key, key)) {
+            return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+}
 
+// Grow the index array and rebuild it from the entries using their cached
+// hashes. The entries array is only reallocated, never re-inserted.
+static void hash_resize(HashMap* map, int new_capacity) {
+    free(map->indices);
     map->capacity = new_capacity;
-    map->count = 0;
-    map->nodes = malloc(sizeof(HashNode) * new_capacity);
+    map->indices = malloc(sizeof(int32_t) * new_capacity);
     for (int i = 0; i < new_capacity; i++) {
-        map->nodes[i].key = NULL;
-        map->nodes[i].value = (Value){0};
-        map->nodes[i].next = NULL;
+        map->indices[i] = HASH_EMPTY;
     }
+    map->entries = realloc(map->entries, sizeof(HashEntry) * HASH_USABLE(new_capacity));
 
-    for (int i = 0; i < old_capacity; i++) {
-        HashNode* node = &old_nodes[i];
-        while (node != NULL && node->key != NULL) {
-            hash_set(map, node->key, node->value);
-            node = node->next;
+    uint32_t mask = new_capacity - 1;
+    for (int i = 0; i < map->count; i++) {
+        uint32_t slot = map->entries[i].key->hash & mask;
+        while (map->indices[slot] != HASH_EMPTY) {
+            slot = (slot + 1) & mask;
         }
+        map->indices[slot] = i;
     }
-    free(old_nodes);
 }
 
 void hash_set(HashMap* map, ObjString* key, Value value) {
-    uint32_t index = hash_string(key->chars) & (map->capacity - 1);
-    HashNode* node = &map->nodes[index];
-
-    // Handle collisions with chaining
-    while (node->key != NULL) {
-        if (strcmp(node->key->chars, key->chars) == 0) {
-            // Key already exists, update value
-            node->value = value;
-            return;
-        }
-        if (node->next == NULL) break;
-        node = node->next;
+    uint32_t slot = find_slot(map, key);
+    int32_t entry = map->indices[slot];
+    if (entry != HASH_EMPTY) {
+        // Key already exists, update value
+        map->entries[entry].value = value;
+        return;
     }
 
-    if (node->key == NULL) {
-        // New key
-        node->key = key;
-        node->value = value;
-        map->count++;
-    } else {
-        // Collision, add new node to the chain
-        HashNode* new_node = malloc(sizeof(HashNode));
-        new_node->key = key;
-        new_node->value = value;
-        new_node->next = NULL;
-        node->next = new_node;
-        map->count++;
-    }
-
-    if (map->count > map->capacity * HASH_MAX_LOAD_FACTOR) {
+    if (map->count + 1 > HASH_USABLE(map->capacity)) {
         hash_resize(map, map->capacity * 2);
+        slot = find_slot(map, key);
     }
+
+    map->entries[map->count] = (HashEntry){key, value};
+    map->indices[slot] = map->count++;
 }
 
 int hash_get(HashMap* map, ObjString* key, Value* out_value) {
-    uint32_t index = hash_string(key->chars) & (map->capacity - 1);
-    HashNode* node = &map->nodes[index];
+    int32_t entry = map->indices[find_slot(map, key)];
+    if (entry == HASH_EMPTY) {
+        return 0; // Not found
+    }
+    *out_value = map->entries[entry].value;
+    return 1; // Found
+}
 
-    while (node != NULL && node->key != NULL) {
-        if (node->key->length == key->length && strcmp(node->key->chars, key->chars) == 0) {
-            *out_value = node->value;
-            return 1; // Found
+int hash_find_string(HashMap* map, const char* chars, int length, uint32_t hash) {
+    uint32_t mask = map->capacity - 1;
+    uint32_t slot = hash & mask;
+    while (1) {
+        int32_t entry = map->indices[slot];
+        if (entry == HASH_EMPTY) {
+            return -1;
+        }
+        ObjString* key = map->entries[entry].key;
+        if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0) {
+            return entry;
         }
-        node = node->next;
+        slot = (slot + 1) & mask;
     }
-    return 0; // Not found
+}
+
+int hash_bytes(HashMap* map) {
+    return sizeof(int32_t) * map->capacity + sizeof(HashEntry) * HASH_USABLE(map->capacity);
 }
 
 void hash_print(HashMap* map) {
-    for (int i = 0; i < map->capacity; i++) {
-        HashNode* node = &map->nodes[i];
-        if (node->key != NULL) {
-            printf("Bucket %d: ", i);
-            while (node != NULL) {
-                printf("[Key: %s, Value Type: %d] -> ", node->key->chars, node->value.type);
-                node = node->next;
-            }
-            printf("NULL\n");
-        }
+    for (int i = 0; i < map->count; i++) {
+        HashEntry* entry = &map->entries[i];
+        printf("Entry %d: [Key: %s, Value Type: %d]\n", i, entry->key->chars, VALUE_TYPE(entry->value));
     }
 }
 
 void hash_free(HashMap* map) {
-    for (int i = 0; i < map->capacity; i++) {
-        HashNode* node = &map->nodes[i];
-        while (node != NULL) {
-            HashNode* next = node->next;
-            if (node != &map->nodes[i]) {
-                free(node);
-            }
-            node = next;
-        }
-    }
-    free(map->nodes);
-}
\ No newline at end of file
+    free(map->indices);
+    free(map->entries);
+    map->indices = NULL;
+    map->entries = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
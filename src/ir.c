@@ -0,0 +1,2179 @@
+#include "ir.h"
+
+#include "vars.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#define IR_MAX_SLOT_VALUES (4096) // Bigger bodies keep the direct AST walk
+#define IR_MAX_TYPE_ROUNDS (64)
+
+#define APPEND(array, count, capacity, value) do { \
+    if ((count) >= (capacity)) { \
+        (capacity) = (capacity) == 0 ? 8 : (capacity) * 2; \
+        (array) = realloc((array), sizeof(*(array)) * (capacity)); \
+    } \
+    (array)[(count)++] = (value); \
+} while (0)
+
+// Innermost loop while building: where continue and break go
+typedef struct {
+    int header;
+    int exit;
+} LoopTarget;
+
+// Call being expanded in place: the callee's locals are the variables from
+// first_var on, and its returns assign result_var and jump to continuation.
+// When the function returns the call's result, the callee's returns are
+// its returns instead, which keeps the calls they return tail calls.
+typedef struct InlineFrame {
+    InlineCandidate* callee;
+    int first_var;
+    int result_var;
+    int continuation;
+    int tail;
+    struct InlineFrame* caller;
+} InlineFrame;
+
+typedef struct {
+    IrFunction* ir;
+    Ast* def;
+    int current;
+    LoopTarget* loops;
+    int loop_count;
+    int loop_capacity;
+    InlineFrame* frame;
+    int failed;
+} Builder;
+
+static const char* ir_opcode_names[] = {
+    "CONST", "PARAM", "GLOBAL", "PHI", "COPY", "BINARY", "UNARY", "CALL",
+    "CALL_METHOD", "GET_ATTR", "SET_ATTR", "INDEX_GET", "INDEX_SET",
+    "RANGE_PREP", "GET_ITER", "LOOP_POP", "JUMP", "BRANCH", "FOR_RANGE",
+    "FOR_ITER", "RETURN",
+};
+
+static IrInstr* instr_at(IrFunction* ir, int value) {
+    return &ir->instrs[value];
+}
+
+static int new_value(IrFunction* ir, IrOpcode op, int arg, int block) {
+    IrInstr instr = {0};
+    instr.op = op;
+    instr.arg = arg;
+    instr.block = block;
+    instr.var = -1;
+    instr.user = -1;
+    instr.slot = -1;
+    APPEND(ir->instrs, ir->count, ir->capacity, instr);
+    return ir->count - 1;
+}
+
+static void add_operand(IrFunction* ir, int value, int operand) {
+    IrInstr* instr = instr_at(ir, value);
+    APPEND(instr->operands, instr->operand_count, instr->operand_capacity, operand);
+}
+
+static int new_block(IrFunction* ir) {
+    IrBlock block = {0};
+    block.idom = -1;
+    block.split_for = -1;
+    APPEND(ir->blocks, ir->block_count, ir->block_capacity, block);
+    return ir->block_count - 1;
+}
+
+static void add_edge(IrFunction* ir, int from, int to) {
+    IrBlock* block = &ir->blocks[from];
+    block->succ[block->succ_count++] = to;
+    IrBlock* succ = &ir->blocks[to];
+    APPEND(succ->preds, succ->pred_count, succ->pred_capacity, from);
+}
+
+static int pred_index(IrBlock* block, int pred) {
+    for (int i = 0; i < block->pred_count; i++) {
+        if (block->preds[i] == pred) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void remove_from(int* list, int* count, int value) {
+    int j = 0;
+    for (int i = 0; i < *count; i++) {
+        if (list[i] != value) {
+            list[j++] = list[i];
+        }
+    }
+    *count = j;
+}
+
+static int has_value(IrOpcode op) {
+    switch (op) {
+        case IR_SET_ATTR:
+        case IR_INDEX_SET:
+        case IR_RANGE_PREP:
+        case IR_GET_ITER:
+        case IR_LOOP_POP:
+        case IR_JUMP:
+        case IR_BRANCH:
+        case IR_RETURN:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+// No side effects: an unused result can be dropped unless it can fail
+static int is_pure(IrOpcode op) {
+    return op == IR_CONST || op == IR_PARAM || op == IR_GLOBAL || op == IR_PHI ||
+           op == IR_COPY || op == IR_BINARY || op == IR_UNARY;
+}
+
+// ---------------------------------------------------------------------------
+// SSA construction, on the fly while walking the AST (Braun et al.,
+// "Simple and Efficient Construction of Static Single Assignment Form").
+// Phis of a block whose predecessors are not all known yet are completed
+// when it is sealed. Trivial phis are left to copy propagation.
+// ---------------------------------------------------------------------------
+
+static int read_var(IrFunction* ir, int var, int b);
+
+// Current value of var in block b, growing the table for variables added
+// by inlining after the block was created
+static int* block_def(IrFunction* ir, int b, int var) {
+    IrBlock* block = &ir->blocks[b];
+    if (var >= block->def_count) {
+        block->defs = realloc(block->defs, sizeof(int) * ir->var_count);
+        for (int i = block->def_count; i < ir->var_count; i++) {
+            block->defs[i] = -1;
+        }
+        block->def_count = ir->var_count;
+    }
+    return &block->defs[var];
+}
+
+static int add_var(IrFunction* ir, char* name) {
+    APPEND(ir->var_names, ir->var_count, ir->var_capacity, name);
+    return ir->var_count - 1;
+}
+
+static int new_phi(IrFunction* ir, int b, int var) {
+    int phi = new_value(ir, IR_PHI, 0, b);
+    instr_at(ir, phi)->var = var;
+    IrBlock* block = &ir->blocks[b];
+    APPEND(block->phis, block->phi_count, block->phi_capacity, phi);
+    return phi;
+}
+
+static void add_phi_operands(IrFunction* ir, int phi) {
+    int b = instr_at(ir, phi)->block;
+    int var = instr_at(ir, phi)->var;
+    for (int i = 0; i < ir->blocks[b].pred_count; i++) {
+        add_operand(ir, phi, read_var(ir, var, ir->blocks[b].preds[i]));
+    }
+}
+
+static int read_var(IrFunction* ir, int var, int b) {
+    IrBlock* block = &ir->blocks[b];
+    if (*block_def(ir, b, var) >= 0) {
+        return *block_def(ir, b, var);
+    }
+    int value;
+    if (!block->sealed) {
+        value = new_phi(ir, b, var);
+        block = &ir->blocks[b];
+        APPEND(block->incomplete, block->incomplete_count, block->incomplete_capacity, value);
+    } else if (block->pred_count == 0) {
+        value = ir->undef;
+    } else if (block->pred_count == 1) {
+        value = read_var(ir, var, block->preds[0]);
+    } else {
+        value = new_phi(ir, b, var);
+        *block_def(ir, b, var) = value;
+        add_phi_operands(ir, value);
+    }
+    *block_def(ir, b, var) = value;
+    return value;
+}
+
+static void write_var(IrFunction* ir, int var, int b, int value) {
+    *block_def(ir, b, var) = value;
+    IrInstr* instr = instr_at(ir, value);
+    if (instr->var < 0 && instr->op != IR_CONST && instr->op != IR_GLOBAL) {
+        instr->var = var;
+    }
+}
+
+static void seal_block(IrFunction* ir, int b) {
+    IrBlock* block = &ir->blocks[b];
+    for (int i = 0; i < block->incomplete_count; i++) {
+        add_phi_operands(ir, ir->blocks[b].incomplete[i]);
+    }
+    block = &ir->blocks[b];
+    block->incomplete_count = 0;
+    block->sealed = 1;
+}
+
+static void switch_to(Builder* builder, int b) {
+    IrFunction* ir = builder->ir;
+    builder->current = b;
+    APPEND(ir->layout, ir->layout_count, ir->layout_capacity, b);
+}
+
+static int new_sealed_block(IrFunction* ir) {
+    int b = new_block(ir);
+    ir->blocks[b].sealed = 1;
+    return b;
+}
+
+static int emit_ir(Builder* builder, IrOpcode op, int arg) {
+    IrFunction* ir = builder->ir;
+    int value = new_value(ir, op, arg, builder->current);
+    IrBlock* block = &ir->blocks[builder->current];
+    APPEND(block->code, block->code_count, block->code_capacity, value);
+    return value;
+}
+
+static int emit_ir1(Builder* builder, IrOpcode op, int arg, int operand) {
+    int value = emit_ir(builder, op, arg);
+    add_operand(builder->ir, value, operand);
+    return value;
+}
+
+// End the current block, succ1 is -1 for a single successor
+static int terminate(Builder* builder, IrOpcode op, int operand, int succ0, int succ1) {
+    int value = emit_ir(builder, op, 0);
+    if (operand >= 0) {
+        add_operand(builder->ir, value, operand);
+    }
+    if (succ0 >= 0) {
+        add_edge(builder->ir, builder->current, succ0);
+    }
+    if (succ1 >= 0) {
+        add_edge(builder->ir, builder->current, succ1);
+    }
+    return value;
+}
+
+// Code after return, break and continue goes to a block nothing reaches
+static void start_unreachable(Builder* builder) {
+    switch_to(builder, new_sealed_block(builder->ir));
+}
+
+static int build_expr(Builder* builder, Ast* node);
+static void build_statement(Builder* builder, Ast* node);
+
+static int emit_const(Builder* builder, Value value) {
+    return emit_ir(builder, IR_CONST, add_constant(builder->ir->compiler, value));
+}
+
+// Variable of a local name, -1 for a global. In an inlined body the names
+// are the callee's: its locals or else globals.
+static int resolve_var(Builder* builder, const char* name) {
+    InlineFrame* frame = builder->frame;
+    if (!frame) {
+        return resolve_local(builder->ir->compiler, name);
+    }
+    FunctionContext* context = &frame->callee->context;
+    for (int i = 0; i < context->local_count; i++) {
+        if (strcmp(context->locals[i], name) == 0) {
+            return frame->first_var + i;
+        }
+    }
+    return -1;
+}
+
+static int load_name(Builder* builder, const char* name) {
+    IrFunction* ir = builder->ir;
+    int var = resolve_var(builder, name);
+    if (var >= 0) {
+        return read_var(ir, var, builder->current);
+    }
+    return emit_ir(builder, IR_GLOBAL, resolve_global(ir->compiler, name));
+}
+
+// Expand a call to a small top-level function in place. The arguments are
+// assigned to fresh variables standing for the parameters, which the
+// optimizer then propagates into the body like any other copy. Returns -1
+// when the call has to stay a call.
+static int inline_call(Builder* builder, Ast* node, int tail) {
+    IrFunction* ir = builder->ir;
+    if (!ir->compiler->inline_calls || resolve_var(builder, node->Call.name) >= 0) {
+        return -1;
+    }
+    InlineCandidate* callee = find_inline_candidate(ir->compiler, node->Call.name);
+    if (!callee || callee->def == builder->def || callee->def->FuncDef.argc != node->Call.argc ||
+        ir->inlined_size + callee->size > INLINE_BUDGET ||
+        callee->size > (builder->loop_count > 0 ? INLINE_MAX_SIZE_IN_LOOP : INLINE_MAX_SIZE)) {
+        return -1;
+    }
+    int depth = 0;
+    for (InlineFrame* frame = builder->frame; frame; frame = frame->caller, depth++) {
+        if (frame->callee == callee) return -1;
+    }
+    if (depth >= INLINE_MAX_DEPTH) {
+        return -1;
+    }
+
+    int argc = node->Call.argc;
+    int values[argc + 1];
+    for (int i = 0; i < argc; i++) {
+        values[i] = build_expr(builder, node->Call.args[i]);
+    }
+    const char* callee_name = callee->def->FuncDef.name;
+    InlineFrame frame = { callee, ir->var_count, -1, -1, tail, builder->frame };
+    for (int i = 0; i <= callee->context.local_count; i++) {
+        const char* local = i < callee->context.local_count ? callee->context.locals[i] : "return";
+        char* name = malloc(strlen(callee_name) + strlen(local) + 2);
+        sprintf(name, "%s.%s", callee_name, local);
+        add_var(ir, name);
+    }
+    frame.result_var = ir->var_count - 1;
+    // Locals start out None in every expansion, not with the last one's values
+    for (int i = 0; i < callee->context.local_count; i++) {
+        write_var(ir, frame.first_var + i, builder->current, i < argc ? values[i] : ir->undef);
+    }
+    ir->inlined_calls++;
+    ir->inlined_size += callee->size;
+
+    builder->frame = &frame;
+    int result;
+    if (callee->expression && !tail) {
+        result = build_expr(builder, callee->expression);
+    } else if (tail) {
+        build_statement(builder, callee->def->FuncDef.body);
+        terminate(builder, IR_RETURN, emit_const(builder, make_none()), -1, -1);
+        start_unreachable(builder);
+        result = ir->undef;
+    } else {
+        frame.continuation = new_block(ir);
+        build_statement(builder, callee->def->FuncDef.body);
+        write_var(ir, frame.result_var, builder->current, emit_const(builder, make_none()));
+        terminate(builder, IR_JUMP, -1, frame.continuation, -1);
+        seal_block(ir, frame.continuation);
+        switch_to(builder, frame.continuation);
+        result = read_var(ir, frame.result_var, builder->current);
+    }
+    builder->frame = frame.caller;
+    return result;
+}
+
+// args..., callee: the operand order of OP_CALL
+static int build_call(Builder* builder, Ast** args, int argc, const char* callee) {
+    int values[argc + 1];
+    for (int i = 0; i < argc; i++) {
+        values[i] = build_expr(builder, args[i]);
+    }
+    values[argc] = load_name(builder, callee);
+    int call = emit_ir(builder, IR_CALL, argc);
+    for (int i = 0; i <= argc; i++) {
+        add_operand(builder->ir, call, values[i]);
+    }
+    return call;
+}
+
+static int build_expr(Builder* builder, Ast* node) {
+    IrFunction* ir = builder->ir;
+    switch (node->type) {
+        case AST_NUMBER:
+            return emit_const(builder, make_number_int(node->NumberInt.value));
+        case AST_FLOAT:
+            return emit_const(builder, make_number_float(node->NumberFloat.value));
+        case AST_STRING:
+            return emit_const(builder, make_const_string(node->String.value));
+        case AST_UNARY: {
+            int value = build_expr(builder, node->Unary.value);
+            return emit_ir1(builder, IR_UNARY, unary_opcode(node->Unary.op), value);
+        }
+        case AST_BINARY: {
+            int left = build_expr(builder, node->Binary.left);
+            int right = build_expr(builder, node->Binary.right);
+            int value = emit_ir1(builder, IR_BINARY, binary_opcode(node->Binary.op), left);
+            add_operand(ir, value, right);
+            return value;
+        }
+        case AST_VAR:
+            return load_name(builder, node->Variable.name);
+        case AST_LIST:
+            return build_call(builder, node->List.elements, node->List.count, "native_make_list");
+        case AST_TUPLE:
+            return build_call(builder, node->Tuple.elements, node->Tuple.count, "native_make_tuple");
+        case AST_SET:
+            return build_call(builder, node->Set.elements, node->Set.count, "native_make_set");
+        case AST_DICT: {
+            int values[node->Dict.count * 2 + 1];
+            for (int i = 0; i < node->Dict.count; i++) {
+                values[2 * i] = build_expr(builder, node->Dict.keys[i]);
+                values[2 * i + 1] = build_expr(builder, node->Dict.values[i]);
+            }
+            values[node->Dict.count * 2] = load_name(builder, "native_make_dict");
+            int call = emit_ir(builder, IR_CALL, node->Dict.count * 2);
+            for (int i = 0; i <= node->Dict.count * 2; i++) {
+                add_operand(ir, call, values[i]);
+            }
+            return call;
+        }
+        case AST_INDEX: {
+            int target = build_expr(builder, node->Index.target);
+            int index = build_expr(builder, node->Index.index);
+            int value = emit_ir1(builder, IR_INDEX_GET, 0, target);
+            add_operand(ir, value, index);
+            return value;
+        }
+        case AST_CALL: {
+            int inlined = inline_call(builder, node, 0);
+            if (inlined >= 0) {
+                return inlined;
+            }
+            return build_call(builder, node->Call.args, node->Call.argc, node->Call.name);
+        }
+        case AST_METHOD_CALL: {
+            int values[node->MethodCall.argc + 1];
+            values[0] = build_expr(builder, node->MethodCall.object);
+            for (int i = 0; i < node->MethodCall.argc; i++) {
+                values[i + 1] = build_expr(builder, node->MethodCall.args[i]);
+            }
+            int name = add_constant(ir->compiler, make_const_string(node->MethodCall.method_name));
+            int call = emit_ir(builder, IR_CALL_METHOD, name);
+            for (int i = 0; i <= node->MethodCall.argc; i++) {
+                add_operand(ir, call, values[i]);
+            }
+            return call;
+        }
+        case AST_ATTR_ACCESS: {
+            int object = build_expr(builder, node->AttrAccess.object);
+            int name = add_constant(ir->compiler, make_const_string(node->AttrAccess.attr_name));
+            return emit_ir1(builder, IR_GET_ATTR, name, object);
+        }
+        default:
+            builder->failed = 1;
+            return ir->undef;
+    }
+}
+
+static LoopTarget* innermost_loop(Builder* builder, const char* statement) {
+    if (builder->loop_count == 0) {
+        printf("No active loop for %s statement\n", statement);
+        exit(1);
+    }
+    return &builder->loops[builder->loop_count - 1];
+}
+
+// Jump from the current block into a fresh preheader and from there to a
+// fresh, unsealed loop header
+static int enter_loop(Builder* builder, int exit) {
+    IrFunction* ir = builder->ir;
+    int pre = new_sealed_block(ir);
+    terminate(builder, IR_JUMP, -1, pre, -1);
+    switch_to(builder, pre);
+    int header = new_block(ir);
+    terminate(builder, IR_JUMP, -1, header, -1);
+    switch_to(builder, header);
+
+    IrLoop loop = {pre, header};
+    APPEND(ir->loops, ir->loop_count, ir->loop_capacity, loop);
+    LoopTarget target = {header, exit};
+    APPEND(builder->loops, builder->loop_count, builder->loop_capacity, target);
+    return header;
+}
+
+static void leave_loop(Builder* builder, int header, int exit) {
+    terminate(builder, IR_JUMP, -1, header, -1);
+    builder->loop_count--;
+    seal_block(builder->ir, header);
+    seal_block(builder->ir, exit);
+    switch_to(builder, exit);
+}
+
+// for var in range(...) / for var in iterable: the loop state stays on the
+// operand stack under everything the body computes, like in compile_node
+static void build_for(Builder* builder, Ast* node) {
+    IrFunction* ir = builder->ir;
+    Ast* iterable = node->For.iterable;
+    int prep = -1;
+    int is_range = iterable->type == AST_CALL && strcmp(iterable->Call.name, "range") == 0 &&
+                   iterable->Call.argc >= 1 && iterable->Call.argc <= 3;
+    if (is_range) {
+        int argc = iterable->Call.argc;
+        int values[argc + 1];
+        for (int i = 0; i < argc; i++) {
+            values[i] = build_expr(builder, iterable->Call.args[i]);
+        }
+        values[argc] = load_name(builder, iterable->Call.name);
+        prep = emit_ir(builder, IR_RANGE_PREP, argc);
+        for (int i = 0; i <= argc; i++) {
+            add_operand(ir, prep, values[i]);
+        }
+    } else {
+        emit_ir1(builder, IR_GET_ITER, 0, build_expr(builder, iterable));
+    }
+
+    int exit = new_block(ir);
+    int header = enter_loop(builder, exit);
+    int body = new_sealed_block(ir);
+    int item = terminate(builder, is_range ? IR_FOR_RANGE : IR_FOR_ITER, -1, body, exit);
+    instr_at(ir, item)->arg = prep;
+    switch_to(builder, body);
+    write_var(ir, resolve_var(builder, node->For.var), body, item);
+    build_statement(builder, node->For.body);
+    leave_loop(builder, header, exit);
+    emit_ir(builder, IR_LOOP_POP, is_range ? 3 : 1);
+}
+
+static void build_statement(Builder* builder, Ast* node) {
+    IrFunction* ir = builder->ir;
+    switch (node->type) {
+        case AST_BLOCK:
+            for (int i = 0; i < node->Block.count; i++) {
+                build_statement(builder, node->Block.statements[i]);
+            }
+            break;
+
+        case AST_ASSIGN: {
+            int value;
+            if (node->Assign.value->type == AST_VAR) {
+                value = emit_ir1(builder, IR_COPY, 0, build_expr(builder, node->Assign.value));
+            } else {
+                value = build_expr(builder, node->Assign.value);
+            }
+            write_var(ir, resolve_var(builder, node->Assign.name), builder->current, value);
+        }
+        break;
+
+        case AST_ASSIGN_INDEX: {
+            int target = build_expr(builder, node->AssignIndex.target);
+            int index = build_expr(builder, node->AssignIndex.index);
+            int value = build_expr(builder, node->AssignIndex.value);
+            int store = emit_ir1(builder, IR_INDEX_SET, 0, target);
+            add_operand(ir, store, index);
+            add_operand(ir, store, value);
+        }
+        break;
+
+        case AST_ATTR_ASSIGN: {
+            int object = build_expr(builder, node->AttrAssign.object);
+            int value = build_expr(builder, node->AttrAssign.value);
+            int name = add_constant(ir->compiler, make_const_string(node->AttrAssign.attr_name));
+            add_operand(ir, emit_ir1(builder, IR_SET_ATTR, name, object), value);
+        }
+        break;
+
+        case AST_IF: {
+            int condition = build_expr(builder, node->If.condition);
+            int then_block = new_sealed_block(ir);
+            int else_block = node->If.else_branch ? new_sealed_block(ir) : -1;
+            int join = new_block(ir);
+            terminate(builder, IR_BRANCH, condition, then_block, else_block >= 0 ? else_block : join);
+
+            switch_to(builder, then_block);
+            build_statement(builder, node->If.then_branch);
+            terminate(builder, IR_JUMP, -1, join, -1);
+            if (else_block >= 0) {
+                switch_to(builder, else_block);
+                build_statement(builder, node->If.else_branch);
+                terminate(builder, IR_JUMP, -1, join, -1);
+            }
+            seal_block(ir, join);
+            switch_to(builder, join);
+        }
+        break;
+
+        case AST_WHILE: {
+            int exit = new_block(ir);
+            int header = enter_loop(builder, exit);
+            int condition = build_expr(builder, node->While.condition);
+            int body = new_sealed_block(ir);
+            terminate(builder, IR_BRANCH, condition, body, exit);
+            switch_to(builder, body);
+            build_statement(builder, node->While.body);
+            leave_loop(builder, header, exit);
+        }
+        break;
+
+        case AST_FOR:
+            build_for(builder, node);
+            break;
+
+        case AST_BREAK:
+            terminate(builder, IR_JUMP, -1, innermost_loop(builder, "break")->exit, -1);
+            start_unreachable(builder);
+            break;
+
+        case AST_CONTINUE:
+            terminate(builder, IR_JUMP, -1, innermost_loop(builder, "continue")->header, -1);
+            start_unreachable(builder);
+            break;
+
+        case AST_RETURN: {
+            Ast* returned = node->Return.value;
+            int tail = !builder->frame || builder->frame->tail;
+            int value = tail && returned && returned->type == AST_CALL ? inline_call(builder, returned, 1) : -1;
+            if (value < 0) {
+                value = returned ? build_expr(builder, returned) : emit_const(builder, make_none());
+            }
+            if (!tail) {
+                write_var(ir, builder->frame->result_var, builder->current, value);
+                terminate(builder, IR_JUMP, -1, builder->frame->continuation, -1);
+            } else {
+                terminate(builder, IR_RETURN, value, -1, -1);
+            }
+            start_unreachable(builder);
+        }
+        break;
+
+        default:
+            // Expression statement, lowering pops the unused result
+            build_expr(builder, node);
+            break;
+    }
+}
+
+static void build_function(IrFunction* ir, Ast* def, Builder* builder) {
+    for (int i = 0; i < ir->context->local_count; i++) {
+        add_var(ir, ir->context->locals[i]);
+    }
+    int entry = new_sealed_block(ir);
+    switch_to(builder, entry);
+    for (int i = 0; i < def->FuncDef.argc; i++) {
+        int param = emit_ir(builder, IR_PARAM, i);
+        write_var(ir, i, entry, param);
+    }
+    ir->undef = emit_const(builder, make_none());
+
+    build_statement(builder, def->FuncDef.body);
+    terminate(builder, IR_RETURN, emit_const(builder, make_none()), -1, -1);
+}
+
+// ---------------------------------------------------------------------------
+// CFG cleanup
+// ---------------------------------------------------------------------------
+
+static void remove_unreachable(IrFunction* ir) {
+    char* reached = calloc(ir->block_count, 1);
+    int* worklist = malloc(sizeof(int) * ir->block_count);
+    int top = 0;
+    worklist[top++] = 0;
+    reached[0] = 1;
+    while (top > 0) {
+        IrBlock* block = &ir->blocks[worklist[--top]];
+        for (int i = 0; i < block->succ_count; i++) {
+            if (!reached[block->succ[i]]) {
+                reached[block->succ[i]] = 1;
+                worklist[top++] = block->succ[i];
+            }
+        }
+    }
+
+    for (int b = 0; b < ir->block_count; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (!reached[b]) {
+            block->dead = 1;
+            for (int i = 0; i < block->phi_count; i++) {
+                instr_at(ir, block->phis[i])->dead = 1;
+            }
+            for (int i = 0; i < block->code_count; i++) {
+                instr_at(ir, block->code[i])->dead = 1;
+            }
+            continue;
+        }
+        // Drop edges from unreachable predecessors with their phi operands
+        int kept = 0;
+        for (int i = 0; i < block->pred_count; i++) {
+            if (!reached[block->preds[i]]) {
+                continue;
+            }
+            for (int j = 0; j < block->phi_count; j++) {
+                IrInstr* phi = instr_at(ir, block->phis[j]);
+                phi->operands[kept] = phi->operands[i];
+            }
+            block->preds[kept++] = block->preds[i];
+        }
+        for (int j = 0; j < block->phi_count; j++) {
+            instr_at(ir, block->phis[j])->operand_count = kept;
+        }
+        block->pred_count = kept;
+    }
+    free(reached);
+    free(worklist);
+}
+
+// An edge from a block with two successors into a block with several
+// predecessors gets a block of its own, so the lowering always has a place
+// for the phi copies of an edge. It is laid out just before its successor.
+static void split_critical_edges(IrFunction* ir) {
+    int count = ir->block_count;
+    for (int b = 0; b < count; b++) {
+        if (ir->blocks[b].dead || ir->blocks[b].succ_count != 2) {
+            continue;
+        }
+        for (int i = 0; i < 2; i++) {
+            int succ = ir->blocks[b].succ[i];
+            if (ir->blocks[succ].pred_count < 2) {
+                continue;
+            }
+            int edge = new_sealed_block(ir);
+            int jump = new_value(ir, IR_JUMP, 0, edge);
+            IrBlock* block = &ir->blocks[edge];
+            APPEND(block->code, block->code_count, block->code_capacity, jump);
+            APPEND(block->preds, block->pred_count, block->pred_capacity, b);
+            block->succ[block->succ_count++] = succ;
+            block->split_for = succ;
+            ir->blocks[succ].preds[pred_index(&ir->blocks[succ], b)] = edge;
+            ir->blocks[b].succ[i] = edge;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Dominators (Cooper, Harvey and Kennedy, "A Simple, Fast Dominance
+// Algorithm") over the reverse postorder
+// ---------------------------------------------------------------------------
+
+static void compute_rpo(IrFunction* ir) {
+    int* order = malloc(sizeof(int) * ir->block_count);
+    int* stack = malloc(sizeof(int) * ir->block_count);
+    int* next = calloc(ir->block_count, sizeof(int));
+    char* seen = calloc(ir->block_count, 1);
+    int done = 0;
+    int top = 0;
+    stack[top++] = 0;
+    seen[0] = 1;
+    while (top > 0) {
+        int b = stack[top - 1];
+        IrBlock* block = &ir->blocks[b];
+        if (next[b] < block->succ_count) {
+            int succ = block->succ[next[b]++];
+            if (!seen[succ]) {
+                seen[succ] = 1;
+                stack[top++] = succ;
+            }
+        } else {
+            order[done++] = b;
+            top--;
+        }
+    }
+    free(ir->rpo);
+    ir->rpo = malloc(sizeof(int) * (done + 1));
+    for (int i = 0; i < done; i++) {
+        ir->rpo[i] = order[done - 1 - i];
+    }
+    ir->rpo_count = done;
+    free(order);
+    free(stack);
+    free(next);
+    free(seen);
+}
+
+static void compute_dominators(IrFunction* ir) {
+    compute_rpo(ir);
+    int* index = malloc(sizeof(int) * ir->block_count);
+    for (int b = 0; b < ir->block_count; b++) {
+        ir->blocks[b].idom = -1;
+    }
+    for (int i = 0; i < ir->rpo_count; i++) {
+        index[ir->rpo[i]] = i;
+    }
+    ir->blocks[0].idom = 0;
+
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 1; i < ir->rpo_count; i++) {
+            IrBlock* block = &ir->blocks[ir->rpo[i]];
+            int idom = -1;
+            for (int p = 0; p < block->pred_count; p++) {
+                int pred = block->preds[p];
+                if (ir->blocks[pred].idom < 0) {
+                    continue;
+                }
+                if (idom < 0) {
+                    idom = pred;
+                    continue;
+                }
+                int a = pred;
+                int c = idom;
+                while (a != c) {
+                    while (index[a] > index[c]) a = ir->blocks[a].idom;
+                    while (index[c] > index[a]) c = ir->blocks[c].idom;
+                }
+                idom = a;
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = 1;
+            }
+        }
+    }
+    free(index);
+}
+
+static int dominates(IrFunction* ir, int a, int b) {
+    while (b != a && b != 0) {
+        b = ir->blocks[b].idom;
+    }
+    return b == a;
+}
+
+// ---------------------------------------------------------------------------
+// Optimizations
+// ---------------------------------------------------------------------------
+
+static int resolve_copy(IrFunction* ir, int value) {
+    while (instr_at(ir, value)->op == IR_COPY) {
+        value = instr_at(ir, value)->operands[0];
+    }
+    return value;
+}
+
+static void drop_copies(IrFunction* ir, int* list, int* count) {
+    int j = 0;
+    for (int i = 0; i < *count; i++) {
+        IrInstr* instr = instr_at(ir, list[i]);
+        if (instr->op == IR_COPY) {
+            instr->dead = 1;
+            ir->copies++;
+        } else {
+            list[j++] = list[i];
+        }
+    }
+    *count = j;
+}
+
+// Phis whose operands are all one value (or the phi itself) become copies,
+// then every use of a copy is rewritten to the copied value
+static void propagate_copies(IrFunction* ir) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int b = 0; b < ir->block_count; b++) {
+            IrBlock* block = &ir->blocks[b];
+            if (block->dead) continue;
+            for (int i = 0; i < block->phi_count; i++) {
+                int phi = block->phis[i];
+                IrInstr* instr = instr_at(ir, phi);
+                if (instr->op != IR_PHI) continue;
+                int same = -1;
+                int trivial = 1;
+                for (int j = 0; j < instr->operand_count; j++) {
+                    int operand = resolve_copy(ir, instr->operands[j]);
+                    if (operand == phi || operand == same) continue;
+                    if (same >= 0) {
+                        trivial = 0;
+                        break;
+                    }
+                    same = operand;
+                }
+                if (trivial) {
+                    instr->op = IR_COPY;
+                    instr->operands[0] = same >= 0 ? same : ir->undef;
+                    instr->operand_count = 1;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    for (int v = 0; v < ir->count; v++) {
+        IrInstr* instr = instr_at(ir, v);
+        if (instr->dead || instr->op == IR_COPY) continue;
+        for (int j = 0; j < instr->operand_count; j++) {
+            instr->operands[j] = resolve_copy(ir, instr->operands[j]);
+        }
+    }
+    for (int b = 0; b < ir->block_count; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (block->dead) continue;
+        drop_copies(ir, block->phis, &block->phi_count);
+        drop_copies(ir, block->code, &block->code_count);
+    }
+}
+
+static unsigned expression_hash(IrInstr* instr) {
+    unsigned hash = (unsigned)instr->op * 31u + (unsigned)instr->arg;
+    for (int i = 0; i < instr->operand_count; i++) {
+        hash = hash * 16777619u ^ (unsigned)instr->operands[i];
+    }
+    return hash;
+}
+
+static int same_expression(IrInstr* a, IrInstr* b) {
+    if (a->op != b->op || a->arg != b->arg || a->operand_count != b->operand_count) {
+        return 0;
+    }
+    for (int i = 0; i < a->operand_count; i++) {
+        if (a->operands[i] != b->operands[i]) return 0;
+    }
+    return 1;
+}
+
+static int calls_special(IrFunction* ir, int value);
+
+// A BINARY or UNARY computed again where an identical one dominates it
+// becomes a copy of that one. It would give the same result and if the
+// first did not fail, neither would the second.
+static void eliminate_common_subexpressions(IrFunction* ir) {
+    int size = 16;
+    while (size < ir->count * 2) size *= 2;
+    int* table = malloc(sizeof(int) * size);
+    for (int i = 0; i < size; i++) table[i] = -1;
+
+    for (int r = 0; r < ir->rpo_count; r++) {
+        IrBlock* block = &ir->blocks[ir->rpo[r]];
+        for (int i = 0; i < block->code_count; i++) {
+            int v = block->code[i];
+            IrInstr* instr = instr_at(ir, v);
+            for (int j = 0; j < instr->operand_count; j++) {
+                instr->operands[j] = resolve_copy(ir, instr->operands[j]);
+            }
+            if ((instr->op != IR_BINARY && instr->op != IR_UNARY) || calls_special(ir, v)) continue;
+
+            unsigned slot = expression_hash(instr) & (size - 1);
+            int found = -1;
+            while (table[slot] >= 0) {
+                IrInstr* other = instr_at(ir, table[slot]);
+                if (same_expression(other, instr) && dominates(ir, other->block, instr->block)) {
+                    found = table[slot];
+                    break;
+                }
+                slot = (slot + 1) & (size - 1);
+            }
+            if (found >= 0) {
+                instr->op = IR_COPY;
+                instr->operands[0] = found;
+                instr->operand_count = 1;
+                ir->common++;
+            } else {
+                table[slot] = v;
+            }
+        }
+    }
+    free(table);
+    ir->copies -= ir->common; // Counted by propagate_copies as copies otherwise
+    propagate_copies(ir);
+}
+
+static IrType constant_type(Value value) {
+    if (IS_INT(value)) return IR_TYPE_INT;
+    if (IS_FLOAT(value)) return IR_TYPE_FLOAT;
+    if (IS_BOOL(value)) return IR_TYPE_BOOL;
+    if (IS_NONE(value)) return IR_TYPE_NONE;
+    if (is_obj_type(value, OBJ_STRING)) return IR_TYPE_STRING;
+    return IR_TYPE_ANY;
+}
+
+static int is_numeric(IrType type) {
+    return type == IR_TYPE_INT || type == IR_TYPE_FLOAT;
+}
+
+// Result types follow arith_numbers, op_add and op_compare in the VM
+static IrType binary_type(Opcode op, IrType a, IrType b) {
+    if (a == IR_TYPE_UNSET || b == IR_TYPE_UNSET) return IR_TYPE_UNSET;
+    switch (op) {
+        case OP_ADD:
+            if (a == IR_TYPE_STRING || b == IR_TYPE_STRING) return IR_TYPE_STRING;
+            // fall through
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+            if (a == IR_TYPE_INT && b == IR_TYPE_INT) return IR_TYPE_INT;
+            if (is_numeric(a) && is_numeric(b)) return IR_TYPE_FLOAT;
+            return IR_TYPE_ANY;
+        default:
+            return IR_TYPE_BOOL;
+    }
+}
+
+static IrType type_of(IrFunction* ir, int value) {
+    return instr_at(ir, value)->type;
+}
+
+// Whether value is the global holding builtin for the whole run
+static int is_builtin(IrFunction* ir, int value, Builtin builtin) {
+    IrInstr* instr = instr_at(ir, value);
+    return instr->op == IR_GLOBAL && is_fixed_builtin(ir->compiler, instr->arg, builtin);
+}
+
+static IrType compute_type(IrFunction* ir, IrInstr* instr) {
+    switch (instr->op) {
+        case IR_CONST:
+            return constant_type(ir->compiler->bytecode->constants[instr->arg]);
+        case IR_PHI: {
+            IrType type = IR_TYPE_UNSET;
+            for (int i = 0; i < instr->operand_count; i++) {
+                IrType operand = type_of(ir, instr->operands[i]);
+                if (operand == IR_TYPE_UNSET || operand == type) continue;
+                type = type == IR_TYPE_UNSET ? operand : IR_TYPE_ANY;
+            }
+            return type;
+        }
+        case IR_BINARY:
+            return binary_type(instr->arg, type_of(ir, instr->operands[0]),
+                               type_of(ir, instr->operands[1]));
+        case IR_UNARY: {
+            IrType type = type_of(ir, instr->operands[0]);
+            if (instr->arg == OP_NOT) return IR_TYPE_BOOL;
+            return type == IR_TYPE_UNSET || is_numeric(type) ? type : IR_TYPE_ANY;
+        }
+        case IR_CALL: {
+            // int() and float() return their type or stop the program
+            int callee = instr->operands[instr->operand_count - 1];
+            if (is_builtin(ir, callee, BUILTIN_INT)) return IR_TYPE_INT;
+            if (is_builtin(ir, callee, BUILTIN_FLOAT)) return IR_TYPE_FLOAT;
+            return IR_TYPE_ANY;
+        }
+        case IR_FOR_RANGE: {
+            // FOR_RANGE_PREP turns the builtin range into int counters
+            IrInstr* prep = instr_at(ir, instr->arg);
+            int callee = prep->operands[prep->operand_count - 1];
+            return is_builtin(ir, callee, BUILTIN_RANGE) ? IR_TYPE_INT : IR_TYPE_ANY;
+        }
+        default:
+            return IR_TYPE_ANY;
+    }
+}
+
+// Optimistic propagation over the phis of loops: everything starts unset
+// and only moves towards IR_TYPE_ANY
+static void infer_types(IrFunction* ir) {
+    for (int v = 0; v < ir->count; v++) {
+        instr_at(ir, v)->type = IR_TYPE_UNSET;
+    }
+    int changed = 1;
+    for (int round = 0; changed && round < IR_MAX_TYPE_ROUNDS; round++) {
+        changed = 0;
+        for (int r = 0; r < ir->rpo_count; r++) {
+            IrBlock* block = &ir->blocks[ir->rpo[r]];
+            for (int i = 0; i < block->phi_count + block->code_count; i++) {
+                int v = i < block->phi_count ? block->phis[i] : block->code[i - block->phi_count];
+                IrType type = compute_type(ir, instr_at(ir, v));
+                if (type != instr_at(ir, v)->type) {
+                    instr_at(ir, v)->type = type;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    for (int v = 0; v < ir->count; v++) {
+        if (changed || instr_at(ir, v)->type == IR_TYPE_UNSET) {
+            instr_at(ir, v)->type = IR_TYPE_ANY;
+        }
+    }
+}
+
+static int is_nonzero_int(IrFunction* ir, int value) {
+    IrInstr* instr = instr_at(ir, value);
+    if (instr->op != IR_CONST) return 0;
+    Value constant = ir->compiler->bytecode->constants[instr->arg];
+    return IS_INT(constant) && AS_INT(constant) != 0;
+}
+
+static int is_ordered(IrType type) {
+    return is_numeric(type) || type == IR_TYPE_BOOL;
+}
+
+// Whether a pure instruction can stop the program with an error for the
+// types it may see
+static int can_fail(IrFunction* ir, int value) {
+    IrInstr* instr = instr_at(ir, value);
+    if (instr->op == IR_UNARY) {
+        return instr->arg == OP_NEG && !is_numeric(type_of(ir, instr->operands[0]));
+    }
+    if (instr->op != IR_BINARY) {
+        return !is_pure(instr->op);
+    }
+    IrType a = type_of(ir, instr->operands[0]);
+    IrType b = type_of(ir, instr->operands[1]);
+    switch (instr->arg) {
+        case OP_ADD:
+            return !(is_numeric(a) && is_numeric(b)) && a != IR_TYPE_STRING && b != IR_TYPE_STRING;
+        case OP_SUB:
+        case OP_MUL:
+            return !(is_numeric(a) && is_numeric(b));
+        case OP_DIV:
+            if (!is_numeric(a) || !is_numeric(b)) return 1;
+            return a == IR_TYPE_INT && b == IR_TYPE_INT && !is_nonzero_int(ir, instr->operands[1]);
+        case OP_EQ:
+        case OP_NE:
+            return 0;
+        default:
+            return !(is_ordered(a) && is_ordered(b)) && !(a == IR_TYPE_STRING && b == IR_TYPE_STRING);
+    }
+}
+
+// Whether a BINARY may run a special method like __add__ or __eq__ of an
+// instance operand. That call can have side effects and return a new
+// object each time, so it is neither merged, moved nor dropped.
+static int calls_special(IrFunction* ir, int value) {
+    IrInstr* instr = instr_at(ir, value);
+    if (instr->op != IR_BINARY || instr->arg == OP_DIV || instr->arg == OP_LE || instr->arg == OP_GE) {
+        return 0;
+    }
+    // Only instances are left untyped
+    return type_of(ir, instr->operands[0]) == IR_TYPE_ANY || type_of(ir, instr->operands[1]) == IR_TYPE_ANY;
+}
+
+static void move_to_end(IrFunction* ir, int value, int to) {
+    IrInstr* instr = instr_at(ir, value);
+    IrBlock* from = &ir->blocks[instr->block];
+    remove_from(from->code, &from->code_count, value);
+    IrBlock* block = &ir->blocks[to];
+    int terminator = block->code[block->code_count - 1];
+    block->code[block->code_count - 1] = value;
+    APPEND(block->code, block->code_count, block->code_capacity, terminator);
+    instr->block = to;
+}
+
+// Nothing before value in the header can fail or has side effects, so
+// whenever the preheader runs the header would have computed it too
+static int first_in_header(IrFunction* ir, IrBlock* header, int value) {
+    for (int i = 0; i < header->code_count && header->code[i] != value; i++) {
+        int other = header->code[i];
+        if (!is_pure(instr_at(ir, other)->op) || can_fail(ir, other) || calls_special(ir, other)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Loop-invariant code motion. Inner loops go first, so what they hoist
+// into their preheader can move on out of the enclosing loop.
+static void hoist_loop_invariants(IrFunction* ir) {
+    char* in_loop = malloc(ir->block_count);
+    int* worklist = malloc(sizeof(int) * ir->block_count);
+
+    for (int l = ir->loop_count - 1; l >= 0; l--) {
+        IrLoop loop = ir->loops[l];
+        if (ir->blocks[loop.header].dead || ir->blocks[loop.pre].dead) continue;
+
+        // Natural loop: the header and whatever reaches a back edge without
+        // passing through the header
+        memset(in_loop, 0, ir->block_count);
+        in_loop[loop.header] = 1;
+        int top = 0;
+        IrBlock* header = &ir->blocks[loop.header];
+        for (int p = 0; p < header->pred_count; p++) {
+            int pred = header->preds[p];
+            if (pred != loop.pre && !in_loop[pred]) {
+                in_loop[pred] = 1;
+                worklist[top++] = pred;
+            }
+        }
+        while (top > 0) {
+            IrBlock* block = &ir->blocks[worklist[--top]];
+            for (int p = 0; p < block->pred_count; p++) {
+                if (!in_loop[block->preds[p]]) {
+                    in_loop[block->preds[p]] = 1;
+                    worklist[top++] = block->preds[p];
+                }
+            }
+        }
+
+        for (int r = 0; r < ir->rpo_count; r++) {
+            int b = ir->rpo[r];
+            if (!in_loop[b]) continue;
+            IrBlock* block = &ir->blocks[b];
+            for (int i = 0; i < block->code_count; i++) {
+                int v = block->code[i];
+                IrInstr* instr = instr_at(ir, v);
+                if ((instr->op != IR_BINARY && instr->op != IR_UNARY) || calls_special(ir, v)) continue;
+
+                int invariant = 1;
+                for (int j = 0; j < instr->operand_count; j++) {
+                    IrInstr* operand = instr_at(ir, instr->operands[j]);
+                    if (in_loop[operand->block] && operand->op != IR_CONST && operand->op != IR_GLOBAL) {
+                        invariant = 0;
+                    }
+                }
+                if (!invariant || (can_fail(ir, v) && (b != loop.header || !first_in_header(ir, block, v)))) {
+                    continue;
+                }
+                // Constants and globals it reads come along
+                for (int j = 0; j < instr->operand_count; j++) {
+                    int operand = instr->operands[j];
+                    if (in_loop[instr_at(ir, operand)->block]) {
+                        move_to_end(ir, operand, loop.pre);
+                    }
+                }
+                move_to_end(ir, v, loop.pre);
+                ir->hoisted++;
+                i = -1; // The block lost instructions before and at i
+            }
+        }
+    }
+    free(in_loop);
+    free(worklist);
+}
+
+// Mark and sweep from everything with an effect. Values that are never
+// read and cannot fail are dropped, assignments never read included.
+static void remove_dead_values(IrFunction* ir) {
+    char* live = calloc(ir->count, 1);
+    int* worklist = malloc(sizeof(int) * ir->count);
+    int top = 0;
+    for (int b = 0; b < ir->block_count; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (block->dead) continue;
+        for (int i = 0; i < block->code_count; i++) {
+            int v = block->code[i];
+            if (!is_pure(instr_at(ir, v)->op) || can_fail(ir, v) || calls_special(ir, v) ||
+                instr_at(ir, v)->op == IR_PARAM) {
+                live[v] = 1;
+                worklist[top++] = v;
+            }
+        }
+    }
+    while (top > 0) {
+        IrInstr* instr = instr_at(ir, worklist[--top]);
+        for (int j = 0; j < instr->operand_count; j++) {
+            int operand = instr->operands[j];
+            if (!live[operand]) {
+                live[operand] = 1;
+                worklist[top++] = operand;
+            }
+        }
+    }
+
+    for (int b = 0; b < ir->block_count; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (block->dead) continue;
+        int* lists[2] = {block->phis, block->code};
+        int* counts[2] = {&block->phi_count, &block->code_count};
+        for (int l = 0; l < 2; l++) {
+            int j = 0;
+            for (int i = 0; i < *counts[l]; i++) {
+                int v = lists[l][i];
+                if (live[v]) {
+                    lists[l][j++] = v;
+                    continue;
+                }
+                instr_at(ir, v)->dead = 1;
+                if (instr_at(ir, v)->var >= 0 && instr_at(ir, v)->op != IR_PHI) {
+                    ir->dead_values++;
+                }
+            }
+            *counts[l] = j;
+        }
+    }
+    free(live);
+    free(worklist);
+}
+
+// ---------------------------------------------------------------------------
+// Lowering: instructions keep their order. A value with a single user
+// later in its block stays on the operand stack when that works out with
+// the stack order, constants and globals are pushed again where they are
+// used and everything else gets a frame slot. Slots come from coalescing
+// phis with their operands and then coloring the interference graph,
+// preferring the slot of the local a value was assigned to.
+// ---------------------------------------------------------------------------
+
+typedef unsigned long Bits;
+#define BITS_WORD (sizeof(Bits) * 8)
+#define BIT_TEST(set, i) (((set)[(i) / BITS_WORD] >> ((i) % BITS_WORD)) & 1)
+#define BIT_SET(set, i) ((set)[(i) / BITS_WORD] |= 1UL << ((i) % BITS_WORD))
+#define BIT_CLEAR(set, i) ((set)[(i) / BITS_WORD] &= ~(1UL << ((i) % BITS_WORD)))
+
+typedef struct {
+    IrFunction* ir;
+    int* index;      // Value -> number among the slotted values, -1 if none
+    int* values;     // Number -> value
+    int count;
+    int words;       // Bits words per set
+    Bits* interfere; // count x count
+    Bits* live_in;   // Per block
+    Bits* live_out;
+} Allocation;
+
+static Bits* row(Allocation* alloc, Bits* sets, int i) {
+    return sets + (size_t)i * alloc->words;
+}
+
+static void demote(IrFunction* ir, int value) {
+    IrInstr* instr = instr_at(ir, value);
+    instr->place = instr->op == IR_CONST || instr->op == IR_GLOBAL ? IR_REMAT : IR_IN_SLOT;
+}
+
+// Number of operands up to the last one left on the stack by its own
+// instruction. The others among them are pushed early, see schedule_pushes.
+static int stacked_prefix(IrFunction* ir, IrInstr* instr) {
+    int k = 0;
+    for (int j = 0; j < instr->operand_count; j++) {
+        if (instr_at(ir, instr->operands[j])->place == IR_ON_STACK) {
+            k = j + 1;
+        }
+    }
+    return k;
+}
+
+typedef struct {
+    int pos;          // Pushed right before the instruction at this position
+    int consumer_pos;
+    int consumer;
+    int operand;      // Index in the consumer's operands
+} EarlyPush;
+
+static int compare_pushes(const void* a, const void* b) {
+    const EarlyPush* x = a;
+    const EarlyPush* y = b;
+    if (x->pos != y->pos) return x->pos - y->pos;
+    if (x->consumer_pos != y->consumer_pos) return y->consumer_pos - x->consumer_pos; // Outer first
+    return x->operand - y->operand;
+}
+
+// An operand that has to be under one computed on the stack, like total
+// in total + i * i, is pushed where the computation of that stacked operand
+// begins. Slots and constants can be read early: a slotted value is live up
+// to its use, so nothing else is stored to its slot in between. Returns the
+// pushes in emission order, or -1 after demoting a stacked operand whose
+// computation begins before the value under it is stored.
+static int schedule_pushes(IrFunction* ir, IrBlock* block, EarlyPush** pushes, int* capacity) {
+    int count = 0;
+    for (int i = 0; i < block->code_count; i++) {
+        IrInstr* instr = instr_at(ir, block->code[i]);
+        instr->start = instr->pos;
+        for (int j = 0; j < instr->operand_count; j++) {
+            IrInstr* operand = instr_at(ir, instr->operands[j]);
+            if (operand->place == IR_ON_STACK && operand->start < instr->start) {
+                instr->start = operand->start;
+            }
+        }
+    }
+    for (int i = 0; i < block->code_count; i++) {
+        IrInstr* instr = instr_at(ir, block->code[i]);
+        int k = stacked_prefix(ir, instr);
+        int next = -1;
+        for (int j = k - 1; j >= 0; j--) {
+            IrInstr* operand = instr_at(ir, instr->operands[j]);
+            if (operand->place == IR_ON_STACK) {
+                next = instr->operands[j];
+                continue;
+            }
+            int pos = instr_at(ir, next)->start;
+            if (operand->place == IR_IN_SLOT && operand->block == instr->block &&
+                operand->op != IR_PHI && operand->op != IR_PARAM && operand->pos >= pos) {
+                demote(ir, next);
+                return -1;
+            }
+            EarlyPush push = {pos, instr->pos, block->code[i], j};
+            APPEND(*pushes, count, *capacity, push);
+        }
+    }
+    if (count > 1) {
+        qsort(*pushes, count, sizeof(EarlyPush), compare_pushes);
+    }
+    return count;
+}
+
+static void choose_places(IrFunction* ir) {
+    for (int v = 0; v < ir->count; v++) {
+        instr_at(ir, v)->uses = 0;
+        instr_at(ir, v)->user = -1;
+    }
+    for (int b = 0; b < ir->block_count; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (block->dead) continue;
+        for (int i = 0; i < block->phi_count + block->code_count; i++) {
+            int v = i < block->phi_count ? block->phis[i] : block->code[i - block->phi_count];
+            IrInstr* instr = instr_at(ir, v);
+            instr->pos = i;
+            for (int j = 0; j < instr->operand_count; j++) {
+                IrInstr* operand = instr_at(ir, instr->operands[j]);
+                operand->uses++;
+                operand->user = v;
+            }
+        }
+    }
+    for (int v = 0; v < ir->count; v++) {
+        IrInstr* instr = instr_at(ir, v);
+        if (instr->dead) continue;
+        IrInstr* user = instr->user >= 0 ? instr_at(ir, instr->user) : NULL;
+        if (instr->op == IR_PARAM || instr->op == IR_PHI) {
+            instr->place = IR_IN_SLOT;
+        } else if (!has_value(instr->op) || instr->uses == 0) {
+            instr->place = IR_DISCARD;
+            if (instr->var >= 0) {
+                ir->dead_values++; // Still computed as it may fail, but not stored
+            }
+        } else if (instr->uses == 1 && user->block == instr->block && user->op != IR_PHI &&
+                   user->pos > instr->pos && instr->op != IR_FOR_RANGE && instr->op != IR_FOR_ITER) {
+            instr->place = IR_ON_STACK;
+        } else {
+            demote(ir, v);
+        }
+    }
+
+    // Replay every block with the operand stack it would have and send
+    // whatever is not on top in the right order to a slot instead
+    int* stack_value = malloc(sizeof(int) * (ir->count + 1));
+    int* stack_operand = malloc(sizeof(int) * (ir->count + 1)); // -1: stacked value
+    EarlyPush* pushes = NULL;
+    int push_capacity = 0;
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int b = 0; b < ir->block_count && !changed; b++) {
+            IrBlock* block = &ir->blocks[b];
+            if (block->dead) continue;
+            int push_count = schedule_pushes(ir, block, &pushes, &push_capacity);
+            if (push_count < 0) {
+                changed = 1;
+                break;
+            }
+            int depth = 0;
+            int next_push = 0;
+            for (int i = 0; i < block->code_count && !changed; i++) {
+                int v = block->code[i];
+                IrInstr* instr = instr_at(ir, v);
+                for (; next_push < push_count && pushes[next_push].pos == instr->pos; next_push++) {
+                    stack_value[depth] = pushes[next_push].consumer;
+                    stack_operand[depth++] = pushes[next_push].operand;
+                }
+                int k = stacked_prefix(ir, instr);
+                int matches = depth >= k;
+                for (int j = 0; j < k && matches; j++) {
+                    int entry = depth - k + j;
+                    if (instr_at(ir, instr->operands[j])->place == IR_ON_STACK) {
+                        matches = stack_operand[entry] < 0 && stack_value[entry] == instr->operands[j];
+                    } else {
+                        matches = stack_operand[entry] == j && stack_value[entry] == v;
+                    }
+                    if (!matches && stack_operand[entry] < 0) {
+                        // Usually enough: the operands above it move up
+                        demote(ir, stack_value[entry]);
+                        changed = 1;
+                    }
+                }
+                if (!matches && !changed) {
+                    for (int j = 0; j < depth; j++) {
+                        if (stack_operand[j] < 0) demote(ir, stack_value[j]);
+                    }
+                    for (int j = 0; j < k; j++) {
+                        if (instr_at(ir, instr->operands[j])->place == IR_ON_STACK) demote(ir, instr->operands[j]);
+                    }
+                    changed = 1;
+                    break;
+                }
+                depth -= k;
+                if (instr->place == IR_ON_STACK) {
+                    stack_value[depth] = v;
+                    stack_operand[depth++] = -1;
+                }
+            }
+        }
+    }
+    free(stack_value);
+    free(stack_operand);
+    free(pushes);
+}
+
+static int phi_operand_index(IrFunction* ir, int from, int to) {
+    return pred_index(&ir->blocks[to], from);
+}
+
+static void compute_liveness(Allocation* alloc) {
+    IrFunction* ir = alloc->ir;
+    int words = alloc->words;
+    Bits* use = calloc((size_t)ir->block_count * words, sizeof(Bits));
+    Bits* def = calloc((size_t)ir->block_count * words, sizeof(Bits));
+    alloc->live_in = calloc((size_t)ir->block_count * words, sizeof(Bits));
+    alloc->live_out = calloc((size_t)ir->block_count * words, sizeof(Bits));
+
+    for (int b = 0; b < ir->block_count; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (block->dead) continue;
+        Bits* block_use = row(alloc, use, b);
+        Bits* block_def = row(alloc, def, b);
+        for (int i = 0; i < block->phi_count; i++) {
+            BIT_SET(block_def, alloc->index[block->phis[i]]);
+        }
+        for (int i = 0; i < block->code_count; i++) {
+            IrInstr* instr = instr_at(ir, block->code[i]);
+            for (int j = 0; j < instr->operand_count; j++) {
+                int n = alloc->index[instr->operands[j]];
+                if (n >= 0 && !BIT_TEST(block_def, n)) BIT_SET(block_use, n);
+            }
+            int n = alloc->index[block->code[i]];
+            if (n >= 0) BIT_SET(block_def, n);
+        }
+        // Phi operands are read at the end of the predecessor
+        for (int s = 0; s < block->succ_count; s++) {
+            IrBlock* succ = &ir->blocks[block->succ[s]];
+            int p = phi_operand_index(ir, b, block->succ[s]);
+            for (int i = 0; i < succ->phi_count; i++) {
+                int n = alloc->index[instr_at(ir, succ->phis[i])->operands[p]];
+                if (n >= 0) BIT_SET(row(alloc, alloc->live_out, b), n);
+            }
+        }
+    }
+
+    Bits* out = malloc(sizeof(Bits) * words);
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int r = ir->rpo_count - 1; r >= 0; r--) {
+            int b = ir->rpo[r];
+            IrBlock* block = &ir->blocks[b];
+            Bits* block_out = row(alloc, alloc->live_out, b);
+            Bits* block_in = row(alloc, alloc->live_in, b);
+            memcpy(out, block_out, sizeof(Bits) * words);
+            for (int s = 0; s < block->succ_count; s++) {
+                Bits* succ_in = row(alloc, alloc->live_in, block->succ[s]);
+                for (int w = 0; w < words; w++) out[w] |= succ_in[w];
+            }
+            for (int w = 0; w < words; w++) {
+                Bits in = row(alloc, use, b)[w] | (out[w] & ~row(alloc, def, b)[w]);
+                if (in != block_in[w] || out[w] != block_out[w]) {
+                    block_in[w] = in;
+                    block_out[w] = out[w];
+                    changed = 1;
+                }
+            }
+        }
+    }
+    free(out);
+    free(use);
+    free(def);
+}
+
+static void add_interference(Allocation* alloc, int a, int b) {
+    if (a == b) return;
+    BIT_SET(row(alloc, alloc->interfere, a), b);
+    BIT_SET(row(alloc, alloc->interfere, b), a);
+}
+
+static void interfere_with_live(Allocation* alloc, int n, Bits* live) {
+    for (int w = 0; w < alloc->words; w++) {
+        Bits bits = live[w];
+        while (bits) {
+            int bit = __builtin_ctzl(bits);
+            add_interference(alloc, n, w * BITS_WORD + bit);
+            bits &= bits - 1;
+        }
+    }
+}
+
+static void build_interference(Allocation* alloc) {
+    IrFunction* ir = alloc->ir;
+    Bits* live = malloc(sizeof(Bits) * alloc->words);
+    for (int b = 0; b < ir->block_count; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (block->dead) continue;
+        memcpy(live, row(alloc, alloc->live_out, b), sizeof(Bits) * alloc->words);
+        for (int i = block->code_count - 1; i >= 0; i--) {
+            IrInstr* instr = instr_at(ir, block->code[i]);
+            int n = alloc->index[block->code[i]];
+            if (n >= 0) {
+                interfere_with_live(alloc, n, live);
+                BIT_CLEAR(live, n);
+            }
+            for (int j = 0; j < instr->operand_count; j++) {
+                int operand = alloc->index[instr->operands[j]];
+                if (operand >= 0) BIT_SET(live, operand);
+            }
+        }
+        // Phis are all defined at once on entry to the block
+        for (int i = 0; i < block->phi_count; i++) {
+            BIT_SET(live, alloc->index[block->phis[i]]);
+        }
+        for (int i = 0; i < block->phi_count; i++) {
+            interfere_with_live(alloc, alloc->index[block->phis[i]], live);
+        }
+    }
+    free(live);
+}
+
+static int find_class(int* parent, int n) {
+    while (parent[n] != n) {
+        parent[n] = parent[parent[n]];
+        n = parent[n];
+    }
+    return n;
+}
+
+static int sets_overlap(Bits* a, Bits* b, int words) {
+    for (int w = 0; w < words; w++) {
+        if (a[w] & b[w]) return 1;
+    }
+    return 0;
+}
+
+// Returns 0 if there are too many slotted values to allocate
+static int assign_slots(IrFunction* ir) {
+    Allocation alloc = {0};
+    alloc.ir = ir;
+    alloc.index = malloc(sizeof(int) * ir->count);
+    alloc.values = malloc(sizeof(int) * ir->count);
+    for (int v = 0; v < ir->count; v++) {
+        IrInstr* instr = instr_at(ir, v);
+        alloc.index[v] = -1;
+        if (!instr->dead && instr->place == IR_IN_SLOT) {
+            alloc.index[v] = alloc.count;
+            alloc.values[alloc.count++] = v;
+        }
+    }
+    if (alloc.count > IR_MAX_SLOT_VALUES) {
+        free(alloc.index);
+        free(alloc.values);
+        return 0;
+    }
+    int count = alloc.count;
+    int words = alloc.words = (count + BITS_WORD - 1) / BITS_WORD + 1;
+    alloc.interfere = calloc((size_t)count * words, sizeof(Bits));
+    compute_liveness(&alloc);
+    build_interference(&alloc);
+
+    // Coalesce phis with their operands, one class per slot
+    int* parent = malloc(sizeof(int) * count);
+    int* color = malloc(sizeof(int) * count);
+    Bits* members = calloc((size_t)count * words, sizeof(Bits));
+    for (int n = 0; n < count; n++) {
+        IrInstr* instr = instr_at(ir, alloc.values[n]);
+        parent[n] = n;
+        color[n] = instr->op == IR_PARAM ? instr->arg : -1;
+        BIT_SET(row(&alloc, members, n), n);
+    }
+    for (int n = 0; n < count; n++) {
+        IrInstr* instr = instr_at(ir, alloc.values[n]);
+        if (instr->op != IR_PHI) continue;
+        for (int j = 0; j < instr->operand_count; j++) {
+            int other = alloc.index[instr->operands[j]];
+            if (other < 0) continue;
+            int a = find_class(parent, n);
+            int b = find_class(parent, other);
+            if (a == b || (color[a] >= 0 && color[b] >= 0) ||
+                sets_overlap(row(&alloc, alloc.interfere, a), row(&alloc, members, b), words)) {
+                continue;
+            }
+            parent[b] = a;
+            if (color[a] < 0) color[a] = color[b];
+            for (int w = 0; w < words; w++) {
+                row(&alloc, alloc.interfere, a)[w] |= row(&alloc, alloc.interfere, b)[w];
+                row(&alloc, members, a)[w] |= row(&alloc, members, b)[w];
+            }
+        }
+    }
+
+    // Parameters keep their slots, other classes take the slot of their
+    // local when it is free, else the first free one
+    int param_count = ir->function->param_count;
+    int slot_capacity = count + ir->context->local_count + 1;
+    Bits* occupied = calloc((size_t)slot_capacity * words, sizeof(Bits));
+    int* class_slot = malloc(sizeof(int) * count);
+    int slot_count = param_count;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int n = 0; n < count; n++) {
+            if (find_class(parent, n) != n || (pass == 0) != (color[n] >= 0)) continue;
+            Bits* interfere = row(&alloc, alloc.interfere, n);
+            int slot = color[n];
+            if (slot < 0) {
+                int preferred = -1;
+                for (int m = 0; m < count && preferred < 0; m++) {
+                    if (BIT_TEST(row(&alloc, members, n), m)) {
+                        preferred = instr_at(ir, alloc.values[m])->var;
+                        if (preferred >= ir->context->local_count) preferred = -1; // Inlined
+                    }
+                }
+                if (preferred >= 0 && !sets_overlap(interfere, row(&alloc, occupied, preferred), words)) {
+                    slot = preferred;
+                }
+                for (int s = 0; s < slot_count && slot < 0; s++) {
+                    if (!sets_overlap(interfere, row(&alloc, occupied, s), words)) slot = s;
+                }
+                if (slot < 0) slot = slot_count;
+            }
+            if (slot >= slot_count) slot_count = slot + 1;
+            class_slot[n] = slot;
+            for (int w = 0; w < words; w++) {
+                row(&alloc, occupied, slot)[w] |= row(&alloc, members, n)[w];
+            }
+        }
+    }
+
+    // Close the gaps left by locals whose slot nothing ended up in
+    int* renumber = calloc(slot_count + 1, sizeof(int));
+    for (int n = 0; n < count; n++) {
+        renumber[class_slot[find_class(parent, n)]] = 1;
+    }
+    ir->slot_count = param_count;
+    for (int s = 0; s < slot_count; s++) {
+        if (s < param_count) {
+            renumber[s] = s;
+        } else if (renumber[s]) {
+            renumber[s] = ir->slot_count++;
+        }
+    }
+    for (int n = 0; n < count; n++) {
+        instr_at(ir, alloc.values[n])->slot = renumber[class_slot[find_class(parent, n)]];
+    }
+    free(renumber);
+
+    free(occupied);
+    free(class_slot);
+    free(parent);
+    free(color);
+    free(members);
+    free(alloc.interfere);
+    free(alloc.live_in);
+    free(alloc.live_out);
+    free(alloc.index);
+    free(alloc.values);
+    return 1;
+}
+
+typedef struct {
+    IrFunction* ir;
+    Bytecode* bytecode;
+    int* order;      // Blocks in the order they are emitted
+    int order_count;
+    int* fixups;     // Pairs of (instruction, block)
+    int fixup_count;
+    int fixup_capacity;
+} Lowering;
+
+// Statically typed opcode of a binary op whose operand types were proven,
+// OP_NOP when the VM has none for them
+static Opcode typed_opcode(IrFunction* ir, IrInstr* instr) {
+    IrType type = type_of(ir, instr->operands[0]);
+    if (type != type_of(ir, instr->operands[1]) || !is_numeric(type)) {
+        return OP_NOP;
+    }
+    int is_int = type == IR_TYPE_INT;
+    switch (instr->arg) {
+        case OP_ADD: return is_int ? OP_ADD_INT_STATIC : OP_ADD_FLOAT_STATIC;
+        case OP_SUB: return is_int ? OP_SUB_INT_STATIC : OP_SUB_FLOAT_STATIC;
+        case OP_MUL: return is_int ? OP_MUL_INT_STATIC : OP_MUL_FLOAT_STATIC;
+        case OP_DIV: return is_int ? OP_NOP : OP_DIV_FLOAT_STATIC; // Ints check for zero
+        case OP_EQ:  return is_int ? OP_EQ_INT_STATIC : OP_NOP;
+        case OP_NE:  return is_int ? OP_NE_INT_STATIC : OP_NOP;
+        case OP_LT:  return is_int ? OP_LT_INT_STATIC : OP_LT_FLOAT_STATIC;
+        case OP_GT:  return is_int ? OP_GT_INT_STATIC : OP_GT_FLOAT_STATIC;
+        case OP_LE:  return is_int ? OP_LE_INT_STATIC : OP_LE_FLOAT_STATIC;
+        default:     return is_int ? OP_GE_INT_STATIC : OP_GE_FLOAT_STATIC;
+    }
+}
+
+static void emit_code(Lowering* lower, Opcode op, int operand) {
+    Bytecode* bytecode = lower->bytecode;
+    if (bytecode->count >= bytecode->capacity) {
+        bytecode->capacity *= 2;
+        bytecode->instructions = realloc(bytecode->instructions, sizeof(Instruction) * bytecode->capacity);
+    }
+    bytecode->instructions[bytecode->count++] = (Instruction){op, operand};
+}
+
+static void emit_jump_to(Lowering* lower, Opcode op, int block) {
+    APPEND(lower->fixups, lower->fixup_count, lower->fixup_capacity, lower->bytecode->count);
+    APPEND(lower->fixups, lower->fixup_count, lower->fixup_capacity, block);
+    emit_code(lower, op, 0);
+}
+
+static void emit_value(Lowering* lower, int value) {
+    IrInstr* instr = instr_at(lower->ir, value);
+    if (instr->place == IR_IN_SLOT) {
+        emit_code(lower, OP_LOAD_LOCAL, instr->slot);
+    } else if (instr->op == IR_GLOBAL) {
+        emit_code(lower, OP_LOAD_GLOBAL, instr->arg);
+    } else {
+        emit_code(lower, OP_CONST, instr->arg);
+    }
+}
+
+static int needs_copy(IrFunction* ir, int phi, int operand) {
+    IrInstr* source = instr_at(ir, operand);
+    return source->place != IR_IN_SLOT || source->slot != instr_at(ir, phi)->slot;
+}
+
+static int has_phi_copies(IrFunction* ir, int from, int to) {
+    IrBlock* succ = &ir->blocks[to];
+    int p = phi_operand_index(ir, from, to);
+    for (int i = 0; i < succ->phi_count; i++) {
+        int phi = succ->phis[i];
+        if (needs_copy(ir, phi, instr_at(ir, phi)->operands[p])) return 1;
+    }
+    return 0;
+}
+
+// All phi copies of an edge at once: loaded in order and stored in reverse
+// when one copy would overwrite the source of another
+static void emit_phi_copies(Lowering* lower, int from, int to) {
+    IrFunction* ir = lower->ir;
+    IrBlock* succ = &ir->blocks[to];
+    int p = phi_operand_index(ir, from, to);
+    int parallel = 0;
+    for (int i = 0; i < succ->phi_count; i++) {
+        int phi = succ->phis[i];
+        if (!needs_copy(ir, phi, instr_at(ir, phi)->operands[p])) continue;
+        for (int j = 0; j < succ->phi_count; j++) {
+            IrInstr* source = instr_at(ir, instr_at(ir, succ->phis[j])->operands[p]);
+            if (j != i && source->place == IR_IN_SLOT && source->slot == instr_at(ir, phi)->slot) {
+                parallel = 1;
+            }
+        }
+    }
+    for (int i = 0; i < succ->phi_count; i++) {
+        int phi = succ->phis[i];
+        int operand = instr_at(ir, phi)->operands[p];
+        if (!needs_copy(ir, phi, operand)) continue;
+        emit_value(lower, operand);
+        if (!parallel) {
+            emit_code(lower, OP_STORE_LOCAL, instr_at(ir, phi)->slot);
+        }
+    }
+    for (int i = succ->phi_count - 1; i >= 0 && parallel; i--) {
+        int phi = succ->phis[i];
+        if (needs_copy(ir, phi, instr_at(ir, phi)->operands[p])) {
+            emit_code(lower, OP_STORE_LOCAL, instr_at(ir, phi)->slot);
+        }
+    }
+}
+
+// A block with nothing but a jump and no phi copies on the way is skipped,
+// jumps into it go where it goes
+static int is_forwarding(IrFunction* ir, int b) {
+    IrBlock* block = &ir->blocks[b];
+    return b != 0 && block->phi_count == 0 && block->code_count == 1 &&
+           instr_at(ir, block->code[0])->op == IR_JUMP && !has_phi_copies(ir, b, block->succ[0]);
+}
+
+static int jump_target(IrFunction* ir, int b) {
+    for (int hops = 0; hops < ir->block_count && is_forwarding(ir, b); hops++) {
+        b = ir->blocks[b].succ[0];
+    }
+    return b;
+}
+
+// Call whose result the next instruction returns
+static int is_tail_call(IrFunction* ir, int v) {
+    IrInstr* instr = instr_at(ir, v);
+    if (instr->place != IR_ON_STACK) {
+        return 0;
+    }
+    IrInstr* user = instr_at(ir, instr->user);
+    return user->op == IR_RETURN && user->block == instr->block && user->pos == instr->pos + 1;
+}
+
+static void emit_instruction(Lowering* lower, int v, int next) {
+    IrFunction* ir = lower->ir;
+    IrInstr* instr = instr_at(ir, v);
+    IrBlock* block = &ir->blocks[instr->block];
+    if (instr->op == IR_PARAM || instr->place == IR_REMAT) {
+        return;
+    }
+    for (int j = stacked_prefix(ir, instr); j < instr->operand_count; j++) {
+        emit_value(lower, instr->operands[j]);
+    }
+
+    switch (instr->op) {
+        case IR_CONST:       emit_code(lower, OP_CONST, instr->arg); break;
+        case IR_GLOBAL:      emit_code(lower, OP_LOAD_GLOBAL, instr->arg); break;
+        case IR_BINARY: {
+            Opcode typed = typed_opcode(lower->ir, instr);
+            lower->ir->binary_ops++;
+            lower->ir->typed_ops += typed != OP_NOP;
+            emit_code(lower, typed != OP_NOP ? typed : (Opcode)instr->arg, 0);
+            break;
+        }
+        case IR_UNARY:       emit_code(lower, instr->arg, 0); break;
+        case IR_CALL:        emit_code(lower, is_tail_call(ir, v) ? OP_TAIL_CALL : OP_CALL, instr->arg); break;
+        case IR_GET_ATTR:    emit_code(lower, OP_GET_ATTR, instr->arg); break;
+        case IR_SET_ATTR:    emit_code(lower, OP_SET_ATTR, instr->arg); break;
+        case IR_INDEX_GET:   emit_code(lower, OP_IDX_GET, 0); break;
+        case IR_INDEX_SET:   emit_code(lower, OP_IDX_SET, 0); break;
+        case IR_GET_ITER:    emit_code(lower, OP_GET_ITER, 0); break;
+        case IR_RETURN:      emit_code(lower, OP_RET, 0); break;
+        case IR_CALL_METHOD:
+            emit_code(lower, OP_CALL_METHOD, instr->arg);
+            emit_code(lower, OP_NOP, instr->operand_count - 1);
+            break;
+        case IR_RANGE_PREP: {
+            // Same sequence as compile_for_range, the builtin range case
+            // jumps over the fallback to the loop
+            int none = add_constant(ir->compiler, make_none());
+            emit_code(lower, OP_FOR_RANGE_PREP, lower->bytecode->count + 6);
+            emit_code(lower, OP_NOP, instr->arg);
+            emit_code(lower, OP_CALL, instr->arg);
+            emit_code(lower, OP_GET_ITER, 0);
+            emit_code(lower, OP_CONST, none);
+            emit_code(lower, OP_CONST, none);
+            break;
+        }
+        case IR_LOOP_POP:
+            for (int i = 0; i < instr->arg; i++) {
+                emit_code(lower, OP_POP, 0);
+            }
+            break;
+        case IR_JUMP:
+            if (ir->blocks[block->succ[0]].phi_count > 0) {
+                emit_phi_copies(lower, instr->block, block->succ[0]);
+            }
+            if (jump_target(ir, block->succ[0]) != next) {
+                emit_jump_to(lower, OP_JUMP, block->succ[0]);
+            }
+            return;
+        case IR_BRANCH:
+            emit_jump_to(lower, OP_JUMP_IF_ZERO, block->succ[1]);
+            if (jump_target(ir, block->succ[0]) != next) {
+                emit_jump_to(lower, OP_JUMP, block->succ[0]);
+            }
+            return;
+        case IR_FOR_RANGE:
+        case IR_FOR_ITER:
+            emit_jump_to(lower, instr->op == IR_FOR_RANGE ? OP_FOR_RANGE : OP_FOR_ITER, block->succ[1]);
+            if (instr->place == IR_IN_SLOT) {
+                emit_code(lower, OP_STORE_LOCAL, instr->slot);
+            } else {
+                emit_code(lower, OP_POP, 0);
+            }
+            if (jump_target(ir, block->succ[0]) != next) {
+                emit_jump_to(lower, OP_JUMP, block->succ[0]);
+            }
+            return;
+        default:
+            break;
+    }
+
+    if (instr->place == IR_IN_SLOT) {
+        emit_code(lower, OP_STORE_LOCAL, instr->slot);
+    } else if (instr->place == IR_DISCARD && has_value(instr->op)) {
+        emit_code(lower, OP_POP, 0);
+    }
+}
+
+static void lower_function(IrFunction* ir) {
+    Lowering lower = {0};
+    lower.ir = ir;
+    lower.bytecode = ir->compiler->bytecode;
+    lower.order = malloc(sizeof(int) * (ir->block_count + 1));
+
+    // Source order, edge blocks right before the block they lead to
+    for (int i = 0; i < ir->layout_count; i++) {
+        int b = ir->layout[i];
+        for (int e = 0; e < ir->block_count; e++) {
+            if (ir->blocks[e].split_for == b && !ir->blocks[e].dead && !is_forwarding(ir, e)) {
+                lower.order[lower.order_count++] = e;
+            }
+        }
+        if (!ir->blocks[b].dead && !is_forwarding(ir, b)) {
+            lower.order[lower.order_count++] = b;
+        }
+    }
+
+    EarlyPush* pushes = NULL;
+    int push_capacity = 0;
+    for (int i = 0; i < lower.order_count; i++) {
+        int b = lower.order[i];
+        int next = i + 1 < lower.order_count ? lower.order[i + 1] : -1;
+        IrBlock* block = &ir->blocks[b];
+        block->address = lower.bytecode->count;
+        int push_count = schedule_pushes(ir, block, &pushes, &push_capacity);
+        int next_push = 0;
+        for (int j = 0; j < block->code_count; j++) {
+            IrInstr* instr = instr_at(ir, block->code[j]);
+            for (; next_push < push_count && pushes[next_push].pos == instr->pos; next_push++) {
+                IrInstr* consumer = instr_at(ir, pushes[next_push].consumer);
+                emit_value(&lower, consumer->operands[pushes[next_push].operand]);
+            }
+            emit_instruction(&lower, block->code[j], next);
+        }
+    }
+    free(pushes);
+
+    for (int i = 0; i < lower.fixup_count; i += 2) {
+        int target = jump_target(ir, lower.fixups[i + 1]);
+        lower.bytecode->instructions[lower.fixups[i]].operand = ir->blocks[target].address;
+    }
+    free(lower.order);
+    free(lower.fixups);
+}
+
+// ---------------------------------------------------------------------------
+// --emit-ir
+// ---------------------------------------------------------------------------
+
+static const char* type_names[] = {"?", "int", "float", "bool", "str", "None", "any"};
+
+static const char* operator_name(Opcode op) {
+    switch (op) {
+        case OP_ADD: return "+";
+        case OP_SUB: return "-";
+        case OP_MUL: return "*";
+        case OP_DIV: return "/";
+        case OP_EQ:  return "==";
+        case OP_NE:  return "!=";
+        case OP_LT:  return "<";
+        case OP_GT:  return ">";
+        case OP_LE:  return "<=";
+        case OP_GE:  return ">=";
+        case OP_NEG: return "-";
+        default:     return "not";
+    }
+}
+
+static void dump_constant(FILE* file, Value value) {
+    if (IS_INT(value)) {
+        fprintf(file, "%ld", (long)AS_INT(value));
+    } else if (IS_FLOAT(value)) {
+        fprintf(file, "%g", AS_FLOAT(value));
+    } else if (IS_BOOL(value)) {
+        fprintf(file, AS_BOOL(value) ? "True" : "False");
+    } else if (IS_NONE(value)) {
+        fprintf(file, "None");
+    } else if (is_obj_type(value, OBJ_STRING)) {
+        fprintf(file, "\"%s\"", as_string(value)->chars);
+    } else {
+        fprintf(file, "<object>");
+    }
+}
+
+static void dump_instruction(IrFunction* ir, FILE* file, int v) {
+    IrInstr* instr = instr_at(ir, v);
+    Value* constants = ir->compiler->bytecode->constants;
+    fprintf(file, "    ");
+    if (has_value(instr->op)) {
+        fprintf(file, "v%d = ", v);
+    }
+    fprintf(file, "%s", ir_opcode_names[instr->op]);
+    switch (instr->op) {
+        case IR_CONST:
+            fprintf(file, " ");
+            dump_constant(file, constants[instr->arg]);
+            break;
+        case IR_PARAM:
+            fprintf(file, " %s", ir->function->params[instr->arg]);
+            break;
+        case IR_GLOBAL:
+            fprintf(file, " %s", as_string(constants[ir->compiler->bytecode->globals[instr->arg]])->chars);
+            break;
+        case IR_BINARY:
+        case IR_UNARY:
+            fprintf(file, " %s", operator_name(instr->arg));
+            break;
+        case IR_CALL_METHOD:
+        case IR_GET_ATTR:
+        case IR_SET_ATTR:
+            fprintf(file, " .%s", as_string(constants[instr->arg])->chars);
+            break;
+        case IR_LOOP_POP:
+            fprintf(file, " %d", instr->arg);
+            break;
+        default:
+            break;
+    }
+    for (int j = 0; j < instr->operand_count; j++) {
+        if (instr->op == IR_PHI) {
+            fprintf(file, " [b%d: v%d]", ir->blocks[instr->block].preds[j], instr->operands[j]);
+        } else {
+            fprintf(file, " v%d", instr->operands[j]);
+        }
+    }
+    IrBlock* block = &ir->blocks[instr->block];
+    if (instr->op == IR_BRANCH || instr->op == IR_FOR_RANGE || instr->op == IR_FOR_ITER) {
+        fprintf(file, " -> b%d, b%d", block->succ[0], block->succ[1]);
+    } else if (instr->op == IR_JUMP) {
+        fprintf(file, " -> b%d", block->succ[0]);
+    }
+    if (has_value(instr->op)) {
+        fprintf(file, "  ; %s", type_names[instr->type]);
+        if (instr->var >= 0) fprintf(file, " %s", ir->var_names[instr->var]);
+        switch (instr->place) {
+            case IR_IN_SLOT:  fprintf(file, " @%d", instr->slot); break;
+            case IR_ON_STACK: fprintf(file, " stack"); break;
+            case IR_REMAT:    fprintf(file, " remat"); break;
+            default:          fprintf(file, " unused"); break;
+        }
+    }
+    fprintf(file, "\n");
+}
+
+static void dump_function(IrFunction* ir, FILE* file) {
+    ObjFunction* fn = ir->function;
+    fprintf(file, "function %s(", fn->name);
+    for (int i = 0; i < fn->param_count; i++) {
+        fprintf(file, i > 0 ? ", %s" : "%s", fn->params[i]);
+    }
+    fprintf(file, "): %d slots, %d copies propagated, %d common subexpressions, "
+                  "%d hoisted, %d dead stores, %d/%d operators typed, %d calls inlined\n",
+            ir->slot_count, ir->copies, ir->common, ir->hoisted, ir->dead_values,
+            ir->typed_ops, ir->binary_ops, ir->inlined_calls);
+    for (int i = 0; i < ir->layout_count; i++) {
+        int b = ir->layout[i];
+        for (int e = 0; e <= ir->block_count; e++) {
+            int current = e < ir->block_count ? e : b;
+            IrBlock* block = &ir->blocks[current];
+            if (e < ir->block_count && block->split_for != b) continue;
+            if (block->dead) continue;
+            fprintf(file, "  b%d:", current);
+            if (block->pred_count > 0) {
+                fprintf(file, " preds");
+                for (int p = 0; p < block->pred_count; p++) fprintf(file, " b%d", block->preds[p]);
+            }
+            if (current != 0) fprintf(file, " idom b%d", block->idom);
+            fprintf(file, "\n");
+            for (int j = 0; j < block->phi_count; j++) dump_instruction(ir, file, block->phis[j]);
+            for (int j = 0; j < block->code_count; j++) dump_instruction(ir, file, block->code[j]);
+        }
+    }
+    fprintf(file, "\n");
+}
+
+static void free_function(IrFunction* ir) {
+    for (int v = 0; v < ir->count; v++) {
+        free(ir->instrs[v].operands);
+    }
+    for (int b = 0; b < ir->block_count; b++) {
+        IrBlock* block = &ir->blocks[b];
+        free(block->phis);
+        free(block->code);
+        free(block->preds);
+        free(block->defs);
+        free(block->incomplete);
+    }
+    for (int i = ir->context->local_count; i < ir->var_count; i++) {
+        free(ir->var_names[i]);
+    }
+    free(ir->var_names);
+    free(ir->instrs);
+    free(ir->blocks);
+    free(ir->layout);
+    free(ir->loops);
+    free(ir->rpo);
+}
+
+int ir_compile_function(Compiler* compiler, Ast* def, ObjFunction* fn) {
+    IrFunction ir = {0};
+    ir.compiler = compiler;
+    ir.context = compiler->function;
+    ir.function = fn;
+
+    Builder builder = {0};
+    builder.ir = &ir;
+    builder.def = def;
+    build_function(&ir, def, &builder);
+    free(builder.loops);
+
+    int ok = !builder.failed;
+    if (ok) {
+        remove_unreachable(&ir);
+        split_critical_edges(&ir);
+        propagate_copies(&ir);
+        compute_dominators(&ir);
+        infer_types(&ir); // For calls_special, again below with the copies gone
+        eliminate_common_subexpressions(&ir);
+        infer_types(&ir);
+        hoist_loop_invariants(&ir);
+        remove_dead_values(&ir);
+        choose_places(&ir);
+        ok = assign_slots(&ir);
+    }
+    if (ok) {
+        lower_function(&ir);
+        fn->local_count = ir.slot_count;
+        if (compiler->ir_dump) {
+            dump_function(&ir, compiler->ir_dump);
+        }
+    }
+    free_function(&ir);
+    return ok;
+}
@@ -3,6 +3,7 @@
 #include "ast.h"
 #include "bytecode.h"
 #include "compiler.h"
+#include "jit.h"
 #include "lexer.h"
 #include "native_func.h"
 #include "np_config.h"
@@ -13,19 +14,52 @@
 #include "stdlib.h"
 #include "stdio.h"
 
-static int mode_repl();
-static int mode_file(const char* source_file);
+#define JIT_DUMP_FILE "jit_dump.txt"
+#define IR_DUMP_FILE "ir_dump.txt"
+
+// Command line switches shared by the REPL and file mode
+typedef struct Options {
+    int jit;              // --jit: compile hot functions to native code
+    const char* jit_dump; // --jit-dump: also write the code to JIT_DUMP_FILE
+    int opt_level;        // -O<level>: compiler optimization level
+    const char* ir_dump;  // --emit-ir: write the SSA IR of each function to IR_DUMP_FILE
+    int no_inline;        // --no-inline: keep every call a call, for debugging
+} Options;
+
+static int mode_repl(Options* options);
+static int mode_file(const char* source_file, Options* options);
 
 int main(int argc, char** argv) {
-    if (argc == 1) {
-        return mode_repl();
-    } else if (argc == 2) {
-        return mode_file(argv[1]);
+    Options options = {0, NULL, NP_OPT_LEVEL, NULL, 0};
+    const char* source_file = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            options.jit = 1;
+        } else if (strcmp(argv[i], "--jit-dump") == 0) {
+            options.jit = 1;
+            options.jit_dump = JIT_DUMP_FILE;
+        } else if (strcmp(argv[i], "--emit-ir") == 0) {
+            options.ir_dump = IR_DUMP_FILE;
+        } else if (strcmp(argv[i], "--no-inline") == 0) {
+            options.no_inline = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] == 'O') {
+            options.opt_level = argv[i][2] ? atoi(argv[i] + 2) : 1;
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            printf("Usage: %s [--jit] [--jit-dump] [--emit-ir] [--no-inline] [-O0|-O1] [source_file]\n", argv[0]);
+            return 1;
+        } else {
+            source_file = argv[i];
+        }
     }
 
-    return 0;
+    if (source_file) {
+        return mode_file(source_file, &options);
+    }
+    return mode_repl(&options);
 }
-static int mode_repl() {
+
+static int mode_repl(Options* options) {
     printf("NanoPython REPL v%s\n", NP_VERSION);
     printf("Type 'exit()' to quit\n\n");
     
@@ -36,6 +70,8 @@ static int mode_repl() {
     
     // Initialize compiler once - it will accumulate bytecode
     compiler_init(&compiler);
+    compiler.opt_level = options->opt_level;
+    compiler.inline_calls = !options->no_inline;
     
     while (1) {
         printf(">>> ");
@@ -106,6 +142,9 @@ static int mode_repl() {
         if (!vm_initialized) {
             vm_init(&vm, bytecode);
             register_native_functions(&vm);
+            if (options->jit) {
+                jit_enable(&vm, options->jit_dump);
+            }
             vm_initialized = 1;
         } else {
             // VM already has reference to the same bytecode
@@ -127,11 +166,14 @@ static int mode_repl() {
         ast_free(tree);
     }
     
+    if (vm_initialized) {
+        vm_free(&vm);
+    }
     printf("Goodbye!\n");
     return 0;
 }
 
-static int mode_file(const char* source_file) {
+static int mode_file(const char* source_file, Options* options) {
     char* source = NULL;
     FILE* file = fopen(source_file, "r");
     if (file) {
@@ -166,7 +208,17 @@ static int mode_file(const char* source_file) {
     
     Compiler compiler;
     compiler_init(&compiler);
+    compiler.opt_level = options->opt_level;
+    compiler.inline_calls = !options->no_inline;
+    if (options->ir_dump) {
+        compiler.ir_dump = fopen(options->ir_dump, "w");
+    }
+    compiler.whole_program = 1;
     Bytecode* bytecode = compile(&compiler, tree);
+    if (compiler.ir_dump) {
+        fclose(compiler.ir_dump);
+        compiler.ir_dump = NULL;
+    }
     if (!bytecode) {
         printf("Error: Compilation failed.\n");
         return 1;
@@ -182,9 +234,13 @@ static int mode_file(const char* source_file) {
     VM vm;
     vm_init(&vm, bytecode);
     register_native_functions(&vm);
+    if (options->jit) {
+        jit_enable(&vm, options->jit_dump);
+    }
 
     vm_run(&vm);
 
+    vm_free(&vm);
     compiler_free(&compiler);
 
     return 0;
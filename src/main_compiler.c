@@ -4,6 +4,7 @@
 #include "bytecode.h"
 #include "compiler.h"
 #include "lexer.h"
+#include "np_config.h"
 #include "parser.h"
 #include "vm.h"
 
@@ -12,12 +13,28 @@
 #include "stdio.h"
 
 int main(int argc, char** argv) {
-    if (argc < 3) {
-        printf("Usage: %s <source_file> <bytecode_file>\n", argv[0]);
+    const char* files[2] = {NULL, NULL};
+    int file_count = 0;
+    int opt_level = NP_OPT_LEVEL;
+    const char* ir_dump = NULL;
+    int no_inline = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--emit-ir") == 0) {
+            ir_dump = "ir_dump.txt";
+        } else if (strcmp(argv[i], "--no-inline") == 0) {
+            no_inline = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] == 'O') {
+            opt_level = argv[i][2] ? atoi(argv[i] + 2) : 1;
+        } else if (file_count < 2) {
+            files[file_count++] = argv[i];
+        }
+    }
+    if (file_count < 2) {
+        printf("Usage: %s [--emit-ir] [--no-inline] [-O0|-O1] <source_file> <bytecode_file>\n", argv[0]);
         return 1;
     }
 
-    const char* source_file = argv[1];
+    const char* source_file = files[0];
     char* source = NULL;
     FILE* file = fopen(source_file, "r");
     if (file) {
@@ -48,13 +65,22 @@ int main(int argc, char** argv) {
     
     Compiler compiler;
     compiler_init(&compiler);
+    compiler.opt_level = opt_level;
+    compiler.inline_calls = !no_inline;
+    if (ir_dump) {
+        compiler.ir_dump = fopen(ir_dump, "w");
+    }
+    compiler.whole_program = 1;
     Bytecode* bytecode = compile(&compiler, tree);
+    if (compiler.ir_dump) {
+        fclose(compiler.ir_dump);
+    }
     if (!bytecode) {
         printf("Error: Compilation failed.\n");
         return 1;
     }
 
-    const char* bytecode_file = argv[2];
+    const char* bytecode_file = files[1];
     int serialize_success = bytecode_serialize(bytecode, bytecode_file);
     if (!serialize_success) {
         printf("Error: Failed to serialize bytecode.\n");
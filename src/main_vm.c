@@ -1,6 +1,7 @@
 #include "stdio.h"
 
 #include "bytecode.h"
+#include "jit.h"
 #include "native_func.h"
 #include "vm.h"
 
@@ -9,12 +10,25 @@
 #include "stdio.h"
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        printf("Usage: %s <source_file>\n", argv[0]);
-        return 1;
+    int jit = 0;
+    const char* jit_dump = NULL;
+    const char* source_file = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            jit = 1;
+        } else if (strcmp(argv[i], "--jit-dump") == 0) {
+            jit = 1;
+            jit_dump = "jit_dump.txt";
+        } else {
+            source_file = argv[i];
+        }
     }
 
-    const char* source_file = argv[1];
+    if (!source_file) {
+        printf("Usage: %s [--jit] [--jit-dump] <source_file>\n", argv[0]);
+        return 1;
+    }
 
     Bytecode* bytecode = bytecode_deserialize(source_file);
     if (!bytecode) {
@@ -25,10 +39,15 @@ int main(int argc, char** argv) {
     VM vm;
     vm_init(&vm, bytecode);
     register_native_functions(&vm);
+    if (jit) {
+        jit_enable(&vm, jit_dump);
+    }
     vm_run(&vm);
+    vm_free(&vm);
     
     free(bytecode->instructions);
     free(bytecode->constants);
+    free(bytecode->globals);
     free(bytecode);
 
     return 0;
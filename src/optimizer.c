@@ -0,0 +1,392 @@
+#include "optimizer.h"
+
+#include "vars.h"
+
+#include "math.h"
+#include "stdlib.h"
+#include "string.h"
+
+#define MAX_OPTIMIZE_PASSES (8) // Each pass can expose new patterns to the next
+
+typedef struct {
+    Compiler* compiler;
+    Bytecode* bytecode;
+    int start;
+    char* target; // Jumped to or a function entry, nothing may be merged into it
+    char* pinned; // JUMP over a function body, the JIT reads the body end from it
+    char* dead;   // Removed by the next compact()
+} Optimizer;
+
+// Opcodes whose operand is an instruction address
+static int is_jump(Opcode op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_ZERO || op == OP_FOR_ITER ||
+           op == OP_FOR_RANGE_PREP || op == OP_FOR_RANGE || IS_COMPARE_JUMP(op);
+}
+
+// Constants are deduplicated with ==, which would turn -0.0 into 0.0
+static int fold_float(double x, Value* result) {
+    if (x == 0 && signbit(x)) {
+        return 0;
+    }
+    *result = make_number_float(x);
+    return 1;
+}
+
+static ObjFunction* as_function(Value v) {
+    return is_obj_type(v, OBJ_FUNCTION) ? (ObjFunction*)AS_OBJ(v) : NULL;
+}
+
+static void mark_targets(Optimizer* opt) {
+    Bytecode* bytecode = opt->bytecode;
+    int count = bytecode->count;
+    memset(opt->target, 0, count + 1);
+    memset(opt->pinned, 0, count + 1);
+    for (int i = opt->start; i < count; i++) {
+        Instruction instr = bytecode->instructions[i];
+        if (is_jump(instr.opcode) && instr.operand >= opt->start && instr.operand <= count) {
+            opt->target[instr.operand] = 1;
+        }
+    }
+    for (int i = 0; i < bytecode->const_count; i++) {
+        ObjFunction* fn = as_function(bytecode->constants[i]);
+        if (fn && fn->addr > opt->start && fn->addr <= count) {
+            opt->target[fn->addr] = 1;
+            opt->pinned[fn->addr - 1] = 1;
+        }
+    }
+}
+
+// Same results as arith_numbers and op_compare in the VM, returns 0 for
+// anything that has to stay a runtime operation (errors included)
+static int fold_binary(Opcode op, Value a, Value b, Value* result) {
+    int cmp;
+    if (IS_INT(a) && IS_INT(b)) {
+        long x = AS_INT(a);
+        long y = AS_INT(b);
+        switch (op) {
+            case OP_ADD: *result = make_number_int(x + y); return 1;
+            case OP_SUB: *result = make_number_int(x - y); return 1;
+            case OP_MUL: *result = make_number_int(x * y); return 1;
+            case OP_DIV:
+                if (y == 0) return 0;
+                *result = make_number_int(x / y);
+                return 1;
+            default:
+                cmp = (x > y) - (x < y);
+                break;
+        }
+    } else if ((IS_INT(a) || IS_FLOAT(a)) && (IS_INT(b) || IS_FLOAT(b))) {
+        double x = IS_FLOAT(a) ? AS_FLOAT(a) : (double)AS_INT(a);
+        double y = IS_FLOAT(b) ? AS_FLOAT(b) : (double)AS_INT(b);
+        switch (op) {
+            case OP_ADD: return fold_float(x + y, result);
+            case OP_SUB: return fold_float(x - y, result);
+            case OP_MUL: return fold_float(x * y, result);
+            case OP_DIV: return fold_float(x / y, result);
+            default:
+                if (x != x || y != y) {
+                    *result = make_bool(op == OP_NE);
+                    return 1;
+                }
+                cmp = (x > y) - (x < y);
+                break;
+        }
+    } else if (is_obj_type(a, OBJ_STRING) && is_obj_type(b, OBJ_STRING)) {
+        ObjString* str_a = as_string(a);
+        ObjString* str_b = as_string(b);
+        if (op == OP_ADD) {
+            char* chars = malloc(str_a->length + str_b->length + 1);
+            memcpy(chars, str_a->chars, str_a->length);
+            memcpy(chars + str_a->length, str_b->chars, str_b->length);
+            chars[str_a->length + str_b->length] = '\0';
+            *result = make_const_string(chars);
+            free(chars);
+            return 1;
+        }
+        if (op == OP_SUB || op == OP_MUL || op == OP_DIV) {
+            return 0;
+        }
+        cmp = strcmp(str_a->chars, str_b->chars);
+    } else {
+        return 0;
+    }
+
+    switch (op) {
+        case OP_EQ: *result = make_bool(cmp == 0); return 1;
+        case OP_NE: *result = make_bool(cmp != 0); return 1;
+        case OP_LT: *result = make_bool(cmp < 0); return 1;
+        case OP_GT: *result = make_bool(cmp > 0); return 1;
+        case OP_LE: *result = make_bool(cmp <= 0); return 1;
+        case OP_GE: *result = make_bool(cmp >= 0); return 1;
+        default: return 0;
+    }
+}
+
+static int fold_unary(Opcode op, Value a, Value* result) {
+    if (op == OP_NOT) {
+        *result = make_bool(!is_true(a));
+        return 1;
+    }
+    if (IS_INT(a)) {
+        *result = make_number_int(-AS_INT(a));
+        return 1;
+    }
+    if (IS_FLOAT(a)) {
+        return fold_float(-AS_FLOAT(a), result);
+    }
+    return 0;
+}
+
+// Generic opcode of a statically typed one, the patterns below match on
+// those. Folding and fusing keep the semantics the typed form has.
+static Opcode generic_form(Opcode op) {
+    static const Opcode generic[] = {
+        [OP_ADD_INT] = OP_ADD, [OP_ADD_FLOAT] = OP_ADD,
+        [OP_SUB_INT] = OP_SUB, [OP_SUB_FLOAT] = OP_SUB,
+        [OP_MUL_INT] = OP_MUL, [OP_MUL_FLOAT] = OP_MUL,
+        [OP_DIV_FLOAT] = OP_DIV,
+        [OP_EQ_INT] = OP_EQ, [OP_NE_INT] = OP_NE,
+        [OP_LT_INT] = OP_LT, [OP_LT_FLOAT] = OP_LT,
+        [OP_GT_INT] = OP_GT, [OP_GT_FLOAT] = OP_GT,
+        [OP_LE_INT] = OP_LE, [OP_LE_FLOAT] = OP_LE,
+        [OP_GE_INT] = OP_GE, [OP_GE_FLOAT] = OP_GE,
+    };
+    return IS_STATIC_TYPED(op) ? generic[STATIC_TO_QUICK(op)] : op;
+}
+
+static int is_binary(Opcode op) {
+    return op == OP_ADD || op == OP_SUB || op == OP_MUL || op == OP_DIV ||
+           op == OP_EQ || op == OP_NE || op == OP_LT || op == OP_GT ||
+           op == OP_LE || op == OP_GE;
+}
+
+// Jumps whose target is an OP_JUMP go to where that one goes
+static int thread_jumps(Optimizer* opt) {
+    Instruction* code = opt->bytecode->instructions;
+    int count = opt->bytecode->count;
+    int changed = 0;
+    for (int i = opt->start; i < count; i++) {
+        if (!is_jump(code[i].opcode) || opt->pinned[i]) {
+            continue;
+        }
+        int dest = code[i].operand;
+        for (int hops = 0; hops < count; hops++) {
+            if (dest < opt->start || dest >= count || code[dest].opcode != OP_JUMP || dest == i) {
+                break;
+            }
+            dest = code[dest].operand;
+        }
+        if (dest != code[i].operand) {
+            code[i].operand = dest;
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// Two and three instruction patterns. Only the first instruction of a
+// pattern may be a jump target.
+static int fold_constants(Optimizer* opt) {
+    Compiler* compiler = opt->compiler;
+    Instruction* code = opt->bytecode->instructions;
+    Value* constants = opt->bytecode->constants;
+    int count = opt->bytecode->count;
+    int changed = 0;
+
+    for (int i = opt->start; i + 1 < count; i++) {
+        Instruction* instr = &code[i];
+        Instruction* next = &code[i + 1];
+        Value result;
+        if (opt->dead[i] || opt->target[i + 1]) {
+            continue;
+        }
+
+        if (instr->opcode == OP_CONST && next->opcode == OP_CONST && i + 2 < count &&
+            !opt->target[i + 2] && is_binary(generic_form(code[i + 2].opcode)) &&
+            fold_binary(generic_form(code[i + 2].opcode), constants[instr->operand],
+                        constants[next->operand], &result)) {
+            instr->operand = add_constant(compiler, result);
+            constants = opt->bytecode->constants;
+            opt->dead[i + 1] = opt->dead[i + 2] = 1;
+            changed = 1;
+            i += 2;
+            continue;
+        }
+
+        if (instr->opcode == OP_CONST && (next->opcode == OP_NEG || next->opcode == OP_NOT) &&
+            fold_unary(next->opcode, constants[instr->operand], &result)) {
+            instr->operand = add_constant(compiler, result);
+            constants = opt->bytecode->constants;
+            opt->dead[i + 1] = 1;
+            changed = 1;
+            i++;
+            continue;
+        }
+
+        if (instr->opcode == OP_CONST && next->opcode == OP_JUMP_IF_ZERO) {
+            if (is_true(constants[instr->operand])) {
+                opt->dead[i] = 1;
+            } else {
+                *instr = (Instruction){OP_JUMP, next->operand};
+            }
+            opt->dead[i + 1] = 1;
+            changed = 1;
+            i++;
+            continue;
+        }
+
+        if ((instr->opcode == OP_CONST || instr->opcode == OP_LOAD_LOCAL ||
+             instr->opcode == OP_LOAD_GLOBAL) && next->opcode == OP_POP) {
+            opt->dead[i] = opt->dead[i + 1] = 1;
+            changed = 1;
+            i++;
+            continue;
+        }
+    }
+    return changed;
+}
+
+// Instructions after an unconditional JUMP or RET up to the next jump
+// target never run, and neither does a JUMP to the next instruction
+static int remove_dead_code(Optimizer* opt) {
+    Instruction* code = opt->bytecode->instructions;
+    int count = opt->bytecode->count;
+    int changed = 0;
+    for (int i = opt->start; i < count; i++) {
+        if (opt->dead[i]) {
+            continue;
+        }
+        Opcode op = code[i].opcode;
+        if (op == OP_JUMP && code[i].operand == i + 1 && !opt->pinned[i]) {
+            opt->dead[i] = 1;
+            changed = 1;
+            continue;
+        }
+        if (op != OP_JUMP && op != OP_RET) {
+            continue;
+        }
+        for (int j = i + 1; j < count && !opt->target[j]; j++) {
+            changed |= !opt->dead[j];
+            opt->dead[j] = 1;
+            i = j;
+        }
+    }
+    return changed;
+}
+
+// Replace the most frequent sequences with one superinstruction each, see
+// the Opcode enum. Only the first instruction of a sequence may be a jump
+// target.
+static void fuse_superinstructions(Optimizer* opt) {
+    static const Opcode compare_jumps[] = {
+        [OP_EQ] = OP_EQ_JUMP_IF_FALSE, [OP_NE] = OP_NE_JUMP_IF_FALSE,
+        [OP_LT] = OP_LT_JUMP_IF_FALSE, [OP_GT] = OP_GT_JUMP_IF_FALSE,
+        [OP_LE] = OP_LE_JUMP_IF_FALSE, [OP_GE] = OP_GE_JUMP_IF_FALSE,
+    };
+    Instruction* code = opt->bytecode->instructions;
+    Value* constants = opt->bytecode->constants;
+    int count = opt->bytecode->count;
+
+    for (int i = opt->start; i + 1 < count; i++) {
+        Instruction* instr = &code[i];
+        Instruction* next = &code[i + 1];
+        if (opt->target[i + 1]) {
+            continue;
+        }
+
+        Opcode op = generic_form(instr->opcode);
+        if (op >= OP_EQ && op <= OP_NE && next->opcode == OP_JUMP_IF_ZERO) {
+            *instr = (Instruction){compare_jumps[op], next->operand};
+            opt->dead[i + 1] = 1;
+            i++;
+            continue;
+        }
+
+        // LOAD x; CONST k; ADD; STORE x
+        Opcode store = op == OP_LOAD_LOCAL ? OP_STORE_LOCAL : OP_STORE_GLOBAL;
+        if ((op == OP_LOAD_LOCAL || op == OP_LOAD_GLOBAL) && i + 3 < count &&
+            !opt->target[i + 2] && !opt->target[i + 3] &&
+            next->opcode == OP_CONST && IS_INT(constants[next->operand]) &&
+            generic_form(code[i + 2].opcode) == OP_ADD && code[i + 3].opcode == store &&
+            code[i + 3].operand == instr->operand &&
+            instr->operand <= SUPER_MAX && next->operand <= SUPER_MAX) {
+            Opcode inc = op == OP_LOAD_LOCAL ? OP_INC_LOCAL : OP_INC_GLOBAL;
+            *instr = (Instruction){inc, SUPER_OPERAND(instr->operand, next->operand)};
+            opt->dead[i + 1] = opt->dead[i + 2] = opt->dead[i + 3] = 1;
+            i += 3;
+            continue;
+        }
+
+        if (op == OP_CONST && generic_form(next->opcode) == OP_ADD) {
+            instr->opcode = OP_ADD_CONST;
+            opt->dead[i + 1] = 1;
+            i++;
+            continue;
+        }
+    }
+}
+
+// Drop dead instructions and renumber jumps and function addresses
+static void compact(Optimizer* opt) {
+    Bytecode* bytecode = opt->bytecode;
+    Instruction* code = bytecode->instructions;
+    int start = opt->start;
+    int count = bytecode->count;
+    int* remap = malloc(sizeof(int) * (count - start + 1));
+
+    int out = start;
+    for (int i = start; i < count; i++) {
+        remap[i - start] = out;
+        if (!opt->dead[i]) {
+            code[out++] = code[i];
+        }
+    }
+    remap[count - start] = out;
+
+    for (int i = start; i < out; i++) {
+        if (is_jump(code[i].opcode) && code[i].operand >= start && code[i].operand <= count) {
+            code[i].operand = remap[code[i].operand - start];
+        }
+    }
+    for (int i = 0; i < bytecode->const_count; i++) {
+        ObjFunction* fn = as_function(bytecode->constants[i]);
+        if (fn && fn->addr >= start && fn->addr <= count) {
+            fn->addr = remap[fn->addr - start];
+        }
+    }
+
+    bytecode->count = out;
+    memset(opt->dead, 0, count + 1);
+    free(remap);
+}
+
+void optimize_bytecode(Compiler* compiler, int start) {
+    Optimizer opt;
+    int size = compiler->bytecode->count + 1;
+    opt.compiler = compiler;
+    opt.bytecode = compiler->bytecode;
+    opt.start = start;
+    opt.target = malloc(size);
+    opt.pinned = malloc(size);
+    opt.dead = calloc(size, 1);
+
+    for (int pass = 0; pass < MAX_OPTIMIZE_PASSES; pass++) {
+        mark_targets(&opt);
+        int changed = thread_jumps(&opt);
+        mark_targets(&opt);
+        changed |= fold_constants(&opt);
+        changed |= remove_dead_code(&opt);
+        compact(&opt);
+        if (!changed) {
+            break;
+        }
+    }
+
+    mark_targets(&opt);
+    fuse_superinstructions(&opt);
+    compact(&opt);
+
+    free(opt.target);
+    free(opt.pinned);
+    free(opt.dead);
+}
@@ -50,13 +50,13 @@ static Ast* parse_factor(Parser* p) {
     TokenType op = p->current.type;
 
     if (op == TOKEN_NUMBER) {
-        Ast* ret = ast_new_number(p->current.value.as.integer);
+        Ast* ret = ast_new_number(AS_INT(p->current.value));
         parser_eat(p, TOKEN_NUMBER);
         return ret;
     }
 
     if (op == TOKEN_FLOAT) {
-        Ast* ret = ast_new_number_float(p->current.value.as.floating);
+        Ast* ret = ast_new_number_float(AS_FLOAT(p->current.value));
         parser_eat(p, TOKEN_FLOAT);
         return ret;
     }
@@ -564,9 +564,10 @@ static Ast* parse_class(Parser* p) {
     parser_eat(p, TOKEN_NEWLINE);
     parser_eat(p, TOKEN_INDENT);
 
-    // Parse methods
+    // Parse methods, and the layout of instances if it is given
     Ast** methods = NULL;
     int method_count = 0;
+    Ast* slots = NULL;
 
     while (p->current.type != TOKEN_DEDENT && p->current.type != TOKEN_EOF) {
         if (p->current.type == TOKEN_NEWLINE) {
@@ -578,8 +579,13 @@ static Ast* parse_class(Parser* p) {
             Ast* method = parse_def(p);
             methods = realloc(methods, sizeof(Ast*) * (method_count + 1));
             methods[method_count++] = method;
+        } else if (p->current.type == TOKEN_IDENT && strcmp(p->current.ident, "__slots__") == 0 &&
+                   p->next.type == TOKEN_ASSIGN && !slots) {
+            parser_eat(p, TOKEN_IDENT);
+            parser_eat(p, TOKEN_ASSIGN);
+            slots = parse_logic_or(p);
         } else {
-            printf("Expected method definition in class body\n");
+            printf("Expected method definition or __slots__ in class body\n");
             exit(1);
         }
 
@@ -592,7 +598,9 @@ static Ast* parse_class(Parser* p) {
         parser_eat(p, TOKEN_DEDENT);
     }
 
-    return ast_new_classdef(class_name, parent_name, methods, method_count);
+    Ast* node = ast_new_classdef(class_name, parent_name, methods, method_count);
+    node->ClassDef.slots = slots;
+    return node;
 }
 
 static Ast* parse_call(Parser* p, const char* func_name) {
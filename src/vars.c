@@ -12,7 +12,6 @@ Scope* new_scope(const char* name, Scope* parent) {
     scope->vars = malloc(sizeof(HashMap));
     hash_init(scope->vars, 16);
     scope->parent = parent;
-    scope->return_value = make_none();
     return scope;
 }
 
@@ -26,7 +25,7 @@ Value scope_find(Scope* scope, ObjString* name) {
         scope = scope->parent;
     }
 
-    return (Value){.type = VAL_NONE};
+    return NONE_VAL;
 }
 
 void scope_set(Scope* scope, ObjString* name, Value value) {
@@ -34,52 +33,47 @@ void scope_set(Scope* scope, ObjString* name, Value value) {
 }
 
 int is_true(Value v) {
-    switch (v.type) {
-        case VAL_BOOL: return v.as.boolean;
-        case VAL_FLOAT: return v.as.floating != 0;
+    switch (VALUE_TYPE(v)) {
+        case VAL_BOOL: return AS_BOOL(v);
+        case VAL_INT: return AS_INT(v) != 0;
+        case VAL_FLOAT: return AS_FLOAT(v) != 0;
         case VAL_NONE: return 0;
         default: return 1;
     }
 }
 
 Value make_number_int(int x) {
-    return (Value){.type = VAL_INT, .as.integer = x};
+    return INT_VAL(x);
 }
 
 Value make_number_float(double x) {
-    return (Value){.type = VAL_FLOAT, .as.floating = x};
+    return FLOAT_VAL(x);
 }
 
 Value make_bool(int b) {
-    return (Value){.type = VAL_BOOL, .as.boolean = b};
+    return BOOL_VAL(b);
 }
 
 int is_obj_type(Value v, ObjectType type) {
-    return v.type == VAL_OBJ && v.as.object->type == type;
+    return IS_OBJ(v) && AS_OBJ(v)->type == type;
 }
 
 ObjString* as_string(Value v) {
-    return (ObjString*)v.as.object;
+    return (ObjString*)AS_OBJ(v);
 }
 
 Value make_const_string(const char* s) {
-    Value v;
-    v.type = VAL_OBJ;
-
     ObjString* string = malloc(sizeof(ObjString));
     string->obj.type = OBJ_STRING;
     string->length = strlen(s);
     string->chars = strdup(s);
-
-    v.as.object = (Obj*)string;
-    return v;
+    string->hash = hash_string(s);
+    string->interned = 0;
+    return OBJ_VAL(string);
 }
 
 Value make_function(ObjFunction* fn) {
-    Value v;
-    v.type = VAL_OBJ;
-    v.as.object = (Obj*)fn;
-    return v;
+    return OBJ_VAL(fn);
 }
 
 Value make_native_function(const char* name, NativeFn function) {
@@ -87,14 +81,12 @@ Value make_native_function(const char* name, NativeFn function) {
     native_fn->obj.type = OBJ_NATIVE_FUNCTION;
     native_fn->function = function;
     native_fn->name = strdup(name);
-    Value v = {0};
-    v.type = VAL_OBJ;
-    v.as.object = (Obj*)native_fn;
-    return v;
+    native_fn->special = -1;
+    return OBJ_VAL(native_fn);
 }
 
 Value make_none() {
-    return (Value){.type = VAL_NONE};
+    return NONE_VAL;
 }
 
 void print_token_type(TokenType token) {
@@ -149,57 +141,33 @@ void print_token_type(TokenType token) {
     }
 }
 
-static void print_node(HashNode* node) {
-    if (node == NULL) return;
-    print_value((Value){.type=VAL_OBJ, .as.object=(Obj*)node->key});
+static void print_entry(HashEntry* entry) {
+    print_value(OBJ_VAL(entry->key));
     printf(": ");
-    print_value(node->value);
+    print_value(entry->value);
     printf(", ");
 }
 
 static void print_dict(ObjDict* dict) {
     printf("{");
-    for (int i = 0; i < dict->capacity; i++) {
-        HashNode* node = &dict->map->nodes[i];
-        if (node->key != NULL) {  // Check if bucket has data
-            print_node(node);
-        }
-        // Follow chain
-        node = node->next;
-        while (node) {
-            if (node->key != NULL) {
-                print_node(node);
-            }
-            node = node->next;
-        }
+    for (int i = 0; i < dict->map->count; i++) {
+        print_entry(&dict->map->entries[i]);
     }
     printf("}");
 }
 
 static void print_set(ObjSet* set) {
-    if (set->count == 0) {
+    if (set->map->count == 0) {
         printf("set()");
     } else {
         printf("{");
         int printed = 0;
         // Iterate through set's hashmap
         if (set->map) {
-            for (int i = 0; i < set->map->capacity; i++) {
-                HashNode* node = &set->map->nodes[i];
-                if (node->key != NULL) {
-                    if (printed > 0) printf(", ");
-                    print_value(node->value);
-                    printed++;
-                    
-                    // Follow the chain
-                    HashNode* next = node->next;
-                    while (next != NULL) {
-                        if (printed > 0) printf(", ");
-                        print_value(next->value);
-                        printed++;
-                        next = next->next;
-                    }
-                }
+            for (int i = 0; i < set->map->count; i++) {
+                if (printed > 0) printf(", ");
+                print_value(set->map->entries[i].value);
+                printed++;
             }
         }
         printf("}");
@@ -232,53 +200,70 @@ static void print_list(ObjList* list) {
     printf("]");
 }
 
+// Number of values a range yields, 0 when it is empty
+long range_length(ObjRange* range) {
+    if (range->step > 0 && range->start < range->stop) {
+        return (range->stop - range->start - 1) / range->step + 1;
+    }
+    if (range->step < 0 && range->start > range->stop) {
+        return (range->start - range->stop - 1) / -range->step + 1;
+    }
+    return 0;
+}
+
 void print_value(Value v) {
-    switch (v.type) {
+    switch (VALUE_TYPE(v)) {
         case VAL_INT:
-            printf("%ld", v.as.integer);
+            printf("%ld", AS_INT(v));
         break;
         case VAL_FLOAT:
-            printf("%g", v.as.floating);
+            printf("%g", AS_FLOAT(v));
         break;
         case VAL_BOOL:
-            printf("%s", v.as.boolean ? "True" : "False");
+            printf("%s", AS_BOOL(v) ? "True" : "False");
         break;
         case VAL_NONE:
             printf("None");
         break;
         case VAL_OBJ:
-            if (v.as.object->type == OBJ_STRING) {
-                ObjString* str = (ObjString*)v.as.object;
+            if (AS_OBJ(v)->type == OBJ_STRING) {
+                ObjString* str = (ObjString*)AS_OBJ(v);
                 printf("%s", str->chars);
                 break;
-            } else if (v.as.object->type == OBJ_LIST) {
-                ObjList* list = (ObjList*)v.as.object;
+            } else if (AS_OBJ(v)->type == OBJ_LIST) {
+                ObjList* list = (ObjList*)AS_OBJ(v);
                 print_list(list);
-            } else if (v.as.object->type == OBJ_DICT) {
-                ObjDict* dict = (ObjDict*)v.as.object;
+            } else if (AS_OBJ(v)->type == OBJ_DICT) {
+                ObjDict* dict = (ObjDict*)AS_OBJ(v);
                 print_dict(dict);
-            } else if (v.as.object->type == OBJ_TUPLE) {
-                ObjTuple* tuple = (ObjTuple*)v.as.object;
+            } else if (AS_OBJ(v)->type == OBJ_TUPLE) {
+                ObjTuple* tuple = (ObjTuple*)AS_OBJ(v);
                 print_tuple(tuple);
-            } else if (v.as.object->type == OBJ_SET) {
-                ObjSet* set = (ObjSet*)v.as.object;
+            } else if (AS_OBJ(v)->type == OBJ_SET) {
+                ObjSet* set = (ObjSet*)AS_OBJ(v);
                 print_set(set);
-            } else if (v.as.object->type == OBJ_NATIVE_FUNCTION) {
-                ObjNativeFunction* native_fn = (ObjNativeFunction*)v.as.object;
+            } else if (AS_OBJ(v)->type == OBJ_NATIVE_FUNCTION) {
+                ObjNativeFunction* native_fn = (ObjNativeFunction*)AS_OBJ(v);
                 printf("<native function %s>", native_fn->name);
-            } else if (v.as.object->type == OBJ_FUNCTION) {
+            } else if (AS_OBJ(v)->type == OBJ_FUNCTION) {
                 printf("<function>");
-            } else if (v.as.object->type == OBJ_CLASS) {
-                ObjClass* klass = (ObjClass*)v.as.object;
+            } else if (AS_OBJ(v)->type == OBJ_CLASS) {
+                ObjClass* klass = (ObjClass*)AS_OBJ(v);
                 printf("<class '%s'>", klass->name);
-            } else if (v.as.object->type == OBJ_INSTANCE) {
-                ObjInstance* instance = (ObjInstance*)v.as.object;
+            } else if (AS_OBJ(v)->type == OBJ_INSTANCE) {
+                ObjInstance* instance = (ObjInstance*)AS_OBJ(v);
                 printf("<%s instance>", instance->klass->name);
-            } else if (v.as.object->type == OBJ_ITERATOR) {
-                ObjIterator* iterator = (ObjIterator*)v.as.object;
-                print_value(iterator->current);
+            } else if (AS_OBJ(v)->type == OBJ_ITERATOR) {
+                printf("<iterator>");
+            } else if (AS_OBJ(v)->type == OBJ_RANGE) {
+                ObjRange* range = (ObjRange*)AS_OBJ(v);
+                if (range->step == 1) {
+                    printf("range(%ld, %ld)", range->start, range->stop);
+                } else {
+                    printf("range(%ld, %ld, %ld)", range->start, range->stop, range->step);
+                }
             } else {
-                printf("<unknown object type %d>", v.as.object->type);
+                printf("<unknown object type %d>", AS_OBJ(v)->type);
             }
 
         break;
@@ -289,23 +274,25 @@ void print_value(Value v) {
 }
 
 int value_equals(Value* a, Value* b) {
-    if (a->type != b->type) return 0;
+    if (VALUE_TYPE(*a) != VALUE_TYPE(*b)) return 0;
 
-    switch (a->type) {
+    switch (VALUE_TYPE(*a)) {
         case VAL_INT:
-            return a->as.integer == b->as.integer;
+            return AS_INT(*a) == AS_INT(*b);
         case VAL_FLOAT:
-            return a->as.floating == b->as.floating;
+            return AS_FLOAT(*a) == AS_FLOAT(*b);
         case VAL_BOOL:
-            return a->as.boolean == b->as.boolean;
+            return AS_BOOL(*a) == AS_BOOL(*b);
         case VAL_NONE:
             return 1; // Both are none
         case VAL_OBJ: {
-            if (a->as.object->type != b->as.object->type) return 0;
+            if (AS_OBJ(*a)->type != AS_OBJ(*b)->type) return 0;
 
-            if (a->as.object->type == OBJ_STRING) {
-                ObjString* str_a = (ObjString*)a->as.object;
-                ObjString* str_b = (ObjString*)b->as.object;
+            if (AS_OBJ(*a)->type == OBJ_STRING) {
+                ObjString* str_a = (ObjString*)AS_OBJ(*a);
+                ObjString* str_b = (ObjString*)AS_OBJ(*b);
+                if (str_a == str_b) return 1;
+                if (str_a->hash != str_b->hash) return 0;
                 return strcmp(str_a->chars, str_b->chars) == 0;
             }
 
@@ -14,29 +14,18 @@ void gc_free_object(VM* vm, Obj* obj);
 
 void mark_hashmap(VM* vm, HashMap* map) {
     if (map == NULL) return;
-    for (int i = 0; i < map->capacity; i++) {
-        HashNode* node = &map->nodes[i];
-        if (node->key != NULL) {  // Check if bucket has data
-            gc_mark(vm, (Value){.type=VAL_OBJ, .as.object=(Obj*)node->key});
-            gc_mark(vm, node->value);
-        }
-        // Follow chain
-        node = node->next;
-        while (node) {
-            if (node->key != NULL) {
-                gc_mark(vm, (Value){.type=VAL_OBJ, .as.object=(Obj*)node->key});
-                gc_mark(vm, node->value);
-            }
-            node = node->next;
-        }
+    for (int i = 0; i < map->count; i++) {
+        HashEntry* entry = &map->entries[i];
+        gc_mark(vm, OBJ_VAL(entry->key));
+        gc_mark(vm, entry->value);
     }
 }
 
 void gc_mark(VM* vm, Value value) {
-    if (value.type != VAL_OBJ) return;
-    if (value.as.object == NULL) return;
+    if (!IS_OBJ(value)) return;
+    if (AS_OBJ(value) == NULL) return;
 
-    Obj* obj = value.as.object;
+    Obj* obj = AS_OBJ(value);
     if (obj->marked) return; // Already marked
     
     obj->marked = 1;
@@ -45,6 +34,7 @@ void gc_mark(VM* vm, Value value) {
     switch (obj->type) {
         case OBJ_STRING:
         case OBJ_NATIVE_FUNCTION:
+        case OBJ_RANGE:
             // No child objects to mark
             break;
         case OBJ_LIST: {
@@ -84,18 +74,33 @@ void gc_mark(VM* vm, Value value) {
             ObjClass* klass = (ObjClass*)obj;
             // Don't mark klass->name - it's a char*, not an Obj*
             mark_hashmap(vm, klass->methods);
+            if (klass->table) {
+                mark_hashmap(vm, klass->table);
+            }
             if (klass->parent) {
-                gc_mark(vm, (Value){.type=VAL_OBJ, .as.object=(Obj*)klass->parent});
+                gc_mark(vm, OBJ_VAL(klass->parent));
             }
             break;
         }
 
         case OBJ_INSTANCE: {
-            ObjInstance* inst = (ObjInstance*)value.as.object;
+            ObjInstance* inst = (ObjInstance*)AS_OBJ(value);
             // Mark class
-            gc_mark(vm, (Value){.type=VAL_OBJ, .as.object=(Obj*)inst->klass});
-            // Mark fields in hashmap
-            mark_hashmap(vm, inst->fields);
+            gc_mark(vm, OBJ_VAL(inst->klass));
+            // Mark fields, in slots or in the hashmap of dictionary mode
+            if (inst->shape) {
+                for (int i = 0; i < inst->shape->slot_count; i++) {
+                    gc_mark(vm, inst->slots[i]);
+                }
+            } else {
+                mark_hashmap(vm, inst->fields);
+            }
+            break;
+        }
+
+        case OBJ_ITERATOR: {
+            ObjIterator* iterator = (ObjIterator*)obj;
+            gc_mark(vm, iterator->iterable);
             break;
         }
     }
@@ -107,16 +112,24 @@ void gc_mark_roots(VM* vm) {
         gc_mark(vm, vm->stack[i]);
     }
 
-    // Mark global variables in scope
+    // Mark global variables
+    for (int i = 0; i < vm->global_count; i++) {
+        gc_mark(vm, vm->globals[i]);
+    }
+    mark_hashmap(vm, &vm->named_globals);
+    gc_mark(vm, vm->stop_iteration);
+
+    // Mark variables of active scope-based functions
     Scope* scope = vm->scope;
     while (scope) {
         mark_hashmap(vm, scope->vars);
         scope = scope->parent;
     }
 
-    // Mark call frame scopes
+    // Mark call frame scopes and pending __init__ instances
     for (int i = 0; i < vm->frame_count; i++) {
         CallFrame* frame = &vm->call_stack[i];
+        gc_mark(vm, frame->init_instance);
         if (frame->scope) {
             Scope* s = frame->scope;
             while (s) {
@@ -139,20 +152,9 @@ void gc_mark_roots(VM* vm) {
 void gc_hash_free(VM* vm, HashMap* map) {
     if (!map) return;
     
-    // Free chain nodes (not the base nodes array itself)
-    for (int i = 0; i < map->capacity; i++) {
-        HashNode* node = map->nodes[i].next;
-        while (node != NULL) {
-            HashNode* next = node->next;
-            free(node);
-            vm->bytes_allocated -= sizeof(HashNode);
-            node = next;
-        }
-    }
-    
-    // Free the base array and HashMap struct
-    free(map->nodes);
-    vm->bytes_allocated -= sizeof(HashNode) * map->capacity;
+    // Free the index and entry arrays and the HashMap struct
+    vm->bytes_allocated -= hash_bytes(map);
+    hash_free(map);
     free(map);
     vm->bytes_allocated -= sizeof(HashMap);
 }
@@ -220,14 +222,20 @@ void gc_free_object(VM* vm, Obj* obj) {
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)obj;
             if (klass->name) {
-                free(klass->name);
                 vm->bytes_allocated -= strlen(klass->name) + 1;
+                free(klass->name);
             }
             if (klass->methods) {
                 gc_hash_free(vm, klass->methods);
             }
+            if (klass->table) {
+                gc_hash_free(vm, klass->table);
+            }
             free(klass);
             vm->bytes_allocated -= sizeof(ObjClass);
+            // Inline caches hold class and method pointers without marking
+            // them; a class allocated at this address must not hit them
+            vm->class_epoch++;
             break;
         }
         case OBJ_INSTANCE: {
@@ -235,8 +243,12 @@ void gc_free_object(VM* vm, Obj* obj) {
             if (inst->fields) {
                 gc_hash_free(vm, inst->fields);
             }
+            if (inst->slots != inst->inline_slots) {
+                free(inst->slots);
+                vm->bytes_allocated -= sizeof(Value) * inst->slot_capacity;
+            }
+            vm->bytes_allocated -= sizeof(ObjInstance) + sizeof(Value) * inst->inline_capacity;
             free(inst);
-            vm->bytes_allocated -= sizeof(ObjInstance);
             break;
         }
         case OBJ_NATIVE_FUNCTION: {
@@ -245,6 +257,16 @@ void gc_free_object(VM* vm, Obj* obj) {
             vm->bytes_allocated -= sizeof(ObjNativeFunction);
             break;
         }
+        case OBJ_ITERATOR: {
+            free(obj);
+            vm->bytes_allocated -= sizeof(ObjIterator);
+            break;
+        }
+        case OBJ_RANGE: {
+            free(obj);
+            vm->bytes_allocated -= sizeof(ObjRange);
+            break;
+        }
     }
 }
 
@@ -273,6 +295,9 @@ void gc_collect(VM* vm) {
 
     int after = vm->bytes_allocated;
     vm->next_gc = after * 2; // Set next GC threshold
+    if (vm->next_gc < VM_GC_THRESHOLD) {
+        vm->next_gc = VM_GC_THRESHOLD; // Don't collect again after a few small allocations
+    }
     printf("GC collected %d bytes, %d remaining\n", before - after, after);
 }
 
@@ -6,39 +6,33 @@
 #include "stdlib.h"
 #include "stdint.h"
 
-static ObjString* find_string(HashMap* map, const char* chars, int length) {
+static ObjString* find_string(HashMap* map, const char* chars, int length, uint32_t hash) {
     if (map->count == 0 || length == 0) return NULL;
-    uint32_t hash = hash_string(chars);
-    uint32_t index = hash & (map->capacity - 1);
-    HashNode* node = &map->nodes[index];
-
-    while (node != NULL && node->key != NULL && node->key->length > 0) {
-        if (memcmp(node->key->chars, chars, length) == 0) {
-            return node->key;
-        }
-        node = node->next;
-    }
-    return NULL;
+    int entry = hash_find_string(map, chars, length, hash);
+    return entry >= 0 ? map->entries[entry].key : NULL;
 }
 
-static ObjString* make_obj_string(const char* chars, int length) {
+static ObjString* make_obj_string(const char* chars, int length, uint32_t hash) {
     ObjString* string = malloc(sizeof(ObjString));
     string->obj.type = OBJ_STRING;
     string->length = length;
     string->chars = malloc(length + 1);
     memcpy(string->chars, chars, length);
     string->chars[length] = '\0';
+    string->hash = hash;
+    string->interned = 1;
     return string;
 }
 
 ObjString* intern_string(VM* map, char* chars, int length) {
-    ObjString* interned = find_string(&map->strings, chars, length);
+    uint32_t hash = hash_string(chars);
+    ObjString* interned = find_string(&map->strings, chars, length, hash);
     if (interned) {
         free(chars); // Free the input string since it's not used
         return interned;
     }
 
-    ObjString* new_str = make_obj_string(chars, length);
+    ObjString* new_str = make_obj_string(chars, length, hash);
 
     hash_set(&map->strings, new_str, make_none());
 
@@ -46,14 +40,30 @@ ObjString* intern_string(VM* map, char* chars, int length) {
 }
 
 ObjString* intern_const_string(VM* map, const char* chars, int length) {
-    ObjString* interned = find_string(&map->strings, chars, length);
+    uint32_t hash = hash_string(chars);
+    ObjString* interned = find_string(&map->strings, chars, length, hash);
     if (interned) {
         return interned;
     }
 
-    ObjString* new_str = make_obj_string(chars, length);
+    ObjString* new_str = make_obj_string(chars, length, hash);
 
     hash_set(&map->strings, new_str, make_none());
 
     return new_str;
+}
+
+ObjString* intern_adopt_string(VM* map, ObjString* str) {
+    if (str->interned) {
+        return str;
+    }
+    ObjString* interned = find_string(&map->strings, str->chars, str->length, str->hash);
+    if (interned) {
+        return interned;
+    }
+
+    str->interned = 1;
+    hash_set(&map->strings, str, make_none());
+
+    return str;
 }
\ No newline at end of file
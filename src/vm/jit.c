@@ -0,0 +1,694 @@
+#include "jit.h"
+
+#include "jit_internal.h"
+#include "vars.h"
+#include "vm.h"
+#include "vm_config.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#if VM_JIT_SUPPORTED
+
+#include "sys/mman.h"
+
+#define MAX_GUARDS (4)
+
+// rel32 at `at` that has to reach the native code of instruction `target`
+typedef struct JumpPatch {
+    int at;
+    int target;
+} JumpPatch;
+
+typedef struct FunctionCode {
+    CodeBuffer buf;
+    int start;    // First bytecode instruction of the function body
+    int end;      // One past the last
+    int* offsets; // Native offset per instruction, indexed from start
+    JumpPatch* patches;
+    int patch_count;
+    int patch_capacity;
+} FunctionCode;
+
+// Jumps from an inline fast path to its slow path
+typedef struct Guards {
+    int at[MAX_GUARDS];
+    int count;
+} Guards;
+
+static void add_patch(FunctionCode* fc, int at, int target) {
+    if (fc->patch_count >= fc->patch_capacity) {
+        fc->patch_capacity = fc->patch_capacity ? fc->patch_capacity * 2 : 16;
+        fc->patches = realloc(fc->patches, sizeof(JumpPatch) * fc->patch_capacity);
+    }
+    fc->patches[fc->patch_count].at = at;
+    fc->patches[fc->patch_count].target = target;
+    fc->patch_count++;
+}
+
+static int in_function(FunctionCode* fc, int target) {
+    return target >= fc->start && target < fc->end;
+}
+
+// handler(vm, operand) with vm->ip already past the instruction
+static void emit_call_handler(CodeBuffer* buf, Instruction instr, int ip) {
+    emit_set_ip(buf, ip + 1);
+    emit_call_vm(buf, (void*)vm_op_handler(instr.opcode), instr.operand);
+}
+
+// Continue at vm->ip: native code if it was compiled, otherwise exit
+static void emit_dispatch(CodeBuffer* buf) {
+    emit(buf, 3, 0x48, 0x63, 0x8B);           // movsxd rcx, [rbx + ip]
+    emit32(buf, OFF_IP);
+    emit(buf, 2, 0x3B, 0x8B);                 // cmp ecx, [rbx + jit_entry_count]
+    emit32(buf, OFF_ENTRY_COUNT);
+    patch_to(buf, emit_jcc(buf, CC_AE), 0);
+    emit(buf, 3, 0x48, 0x8B, 0x83);           // mov rax, [rbx + jit_entries]
+    emit32(buf, OFF_ENTRIES);
+    emit(buf, 4, 0x48, 0x8B, 0x04, 0xC8);     // mov rax, [rax + rcx * 8]
+    emit(buf, 3, 0x48, 0x85, 0xC0);           // test rax, rax
+    patch_to(buf, emit_jcc(buf, CC_E), 0);
+    emit(buf, 2, 0xFF, 0xE0);                 // jmp rax
+}
+
+// After a branching handler: jump to target if the handler went there
+static void emit_branch_taken(FunctionCode* fc, int target) {
+    emit(&fc->buf, 2, 0x81, 0xBB);            // cmp dword [rbx + ip], target
+    emit32(&fc->buf, OFF_IP);
+    emit32(&fc->buf, target);
+    add_patch(fc, emit_jcc(&fc->buf, CC_E), target);
+}
+
+#if !VM_NAN_BOXING
+
+#define VALUE_SIZE  ((int32_t)sizeof(Value))
+#define VALUE_AS    ((int32_t)offsetof(Value, as))
+
+// Stack slot relative to the top: slot(-1) is the top value at
+// [rbx + rcx + slot(-1)], rcx from emit_load_sp
+#define slot(k)     ((k) * VALUE_SIZE)
+
+// rcx = &vm->stack[sp] - vm. The stack lives on the heap and moves when it
+// grows, so it is loaded again for every instruction, and the templates
+// keep addressing it relative to rbx.
+static void emit_load_sp(CodeBuffer* buf) {
+    emit(buf, 3, 0x48, 0x63, 0x8B);           // movsxd rcx, [rbx + sp]
+    emit32(buf, OFF_SP);
+    emit(buf, 4, 0x48, 0xC1, 0xE1, 0x04);     // shl rcx, 4
+    emit(buf, 3, 0x48, 0x03, 0x8B);           // add rcx, [rbx + stack]
+    emit32(buf, OFF_STACK);
+    emit(buf, 3, 0x48, 0x29, 0xD9);           // sub rcx, rbx
+}
+
+// rax = &vm->stack[fp] - vm, locals are at [rbx + rax + slot * 16]
+static void emit_load_fp(CodeBuffer* buf) {
+    emit(buf, 3, 0x48, 0x63, 0x83);           // movsxd rax, [rbx + fp]
+    emit32(buf, OFF_FP);
+    emit(buf, 4, 0x48, 0xC1, 0xE0, 0x04);     // shl rax, 4
+    emit(buf, 3, 0x48, 0x03, 0x83);           // add rax, [rbx + stack]
+    emit32(buf, OFF_STACK);
+    emit(buf, 3, 0x48, 0x29, 0xD8);           // sub rax, rbx
+}
+
+static void add_guard(Guards* guards, int at) {
+    guards->at[guards->count++] = at;
+}
+
+// Slot at rcx + disp must hold a value of the given type, rcx from emit_load_sp
+static void emit_guard_type(CodeBuffer* buf, Guards* guards, int32_t disp, ValueType type) {
+    emit(buf, 3, 0x83, 0xBC, 0x0B);           // cmp dword [rbx + rcx + disp], type
+    emit32(buf, disp);
+    emit8(buf, type);
+    add_guard(guards, emit_jcc(buf, CC_NE));
+}
+
+static void emit_add_sp(CodeBuffer* buf, int delta) {
+    emit(buf, 2, 0x83, delta > 0 ? 0x83 : 0xAB); // add / sub dword [rbx + sp], |delta|
+    emit32(buf, OFF_SP);
+    emit8(buf, delta > 0 ? delta : -delta);
+}
+
+// Push xmm0
+static void emit_push_xmm0(CodeBuffer* buf) {
+    emit_load_sp(buf);
+    emit(buf, 5, 0xF3, 0x0F, 0x7F, 0x84, 0x0B); // movdqu [rbx + rcx], xmm0
+    emit32(buf, 0);
+    emit_add_sp(buf, 1);
+}
+
+// Pop into xmm0
+static void emit_pop_xmm0(CodeBuffer* buf) {
+    emit_add_sp(buf, -1);
+    emit_load_sp(buf);
+    emit(buf, 5, 0xF3, 0x0F, 0x6F, 0x84, 0x0B); // movdqu xmm0, [rbx + rcx]
+    emit32(buf, 0);
+}
+
+// Integer arithmetic and compares on the two top slots, result replaces
+// the left operand like VM_QUICK_BINARY
+static void emit_int_binary(CodeBuffer* buf, Guards* guards, Opcode op) {
+    static const int compare_cc[] = {
+        [OP_EQ_INT] = CC_E, [OP_NE_INT] = CC_NE, [OP_LT_INT] = CC_L,
+        [OP_GT_INT] = CC_G, [OP_LE_INT] = CC_LE, [OP_GE_INT] = CC_GE,
+    };
+
+    emit_load_sp(buf);
+    emit_guard_type(buf, guards, slot(-2), VAL_INT);
+    emit_guard_type(buf, guards, slot(-1), VAL_INT);
+    emit(buf, 4, 0x48, 0x8B, 0x84, 0x0B);     // mov rax, [a]
+    emit32(buf, slot(-2) + VALUE_AS);
+
+    switch (op) {
+        case OP_ADD_INT: emit(buf, 4, 0x48, 0x03, 0x84, 0x0B); break;        // add rax, [b]
+        case OP_SUB_INT: emit(buf, 4, 0x48, 0x2B, 0x84, 0x0B); break;        // sub rax, [b]
+        case OP_MUL_INT: emit(buf, 5, 0x48, 0x0F, 0xAF, 0x84, 0x0B); break;  // imul rax, [b]
+        default:         emit(buf, 4, 0x48, 0x3B, 0x84, 0x0B); break;        // cmp rax, [b]
+    }
+    emit32(buf, slot(-1) + VALUE_AS);
+
+    if (op == OP_ADD_INT || op == OP_SUB_INT || op == OP_MUL_INT) {
+        emit(buf, 3, 0x48, 0x63, 0xC0);       // movsxd rax, eax, the (int) cast
+    } else {
+        emit(buf, 3, 0x0F, 0x90 | compare_cc[op], 0xC0); // setcc al
+        emit(buf, 3, 0x0F, 0xB6, 0xC0);       // movzx eax, al
+        emit(buf, 3, 0xC7, 0x84, 0x0B);       // mov dword [a.type], VAL_BOOL
+        emit32(buf, slot(-2));
+        emit32(buf, VAL_BOOL);
+    }
+    emit(buf, 4, 0x48, 0x89, 0x84, 0x0B);     // mov [a.as], rax
+    emit32(buf, slot(-2) + VALUE_AS);
+    emit_add_sp(buf, -1);
+}
+
+// Int compare of the two top slots that jumps to target when it is false
+static void emit_int_compare_jump(FunctionCode* fc, Guards* guards, Opcode op, int target) {
+    static const int false_cc[] = {
+        [OP_EQ_JUMP_IF_FALSE] = CC_NE, [OP_NE_JUMP_IF_FALSE] = CC_E, [OP_LT_JUMP_IF_FALSE] = CC_GE,
+        [OP_GT_JUMP_IF_FALSE] = CC_LE, [OP_LE_JUMP_IF_FALSE] = CC_G, [OP_GE_JUMP_IF_FALSE] = CC_L,
+    };
+    CodeBuffer* buf = &fc->buf;
+    emit_load_sp(buf);
+    emit_guard_type(buf, guards, slot(-2), VAL_INT);
+    emit_guard_type(buf, guards, slot(-1), VAL_INT);
+    emit(buf, 4, 0x48, 0x8B, 0x84, 0x0B);     // mov rax, [a]
+    emit32(buf, slot(-2) + VALUE_AS);
+    emit_add_sp(buf, -2);                     // before the cmp, it changes the flags
+    emit(buf, 4, 0x48, 0x3B, 0x84, 0x0B);     // cmp rax, [b]
+    emit32(buf, slot(-1) + VALUE_AS);
+    add_patch(fc, emit_jcc(buf, false_cc[op]), target);
+}
+
+// Int value at [base + disp] += k, base is rax after emit_load_fp (locals,
+// with rbx) or the globals pointer
+static void emit_increment(CodeBuffer* buf, Guards* guards, int global, int32_t disp, int32_t k) {
+    if (global) {
+        emit(buf, 2, 0x83, 0xB8);             // cmp dword [rax + disp], VAL_INT
+    } else {
+        emit(buf, 3, 0x83, 0xBC, 0x03);       // cmp dword [rbx + rax + disp], VAL_INT
+    }
+    emit32(buf, disp);
+    emit8(buf, VAL_INT);
+    add_guard(guards, emit_jcc(buf, CC_NE));
+    if (global) {
+        emit(buf, 3, 0x48, 0x8B, 0x90);       // mov rdx, [rax + disp.as]
+    } else {
+        emit(buf, 4, 0x48, 0x8B, 0x94, 0x03); // mov rdx, [rbx + rax + disp.as]
+    }
+    emit32(buf, disp + VALUE_AS);
+    emit(buf, 3, 0x48, 0x81, 0xC2);           // add rdx, k
+    emit32(buf, k);
+    emit(buf, 3, 0x48, 0x63, 0xD2);           // movsxd rdx, edx, the (int) cast
+    if (global) {
+        emit(buf, 3, 0x48, 0x89, 0x90);       // mov [rax + disp.as], rdx
+    } else {
+        emit(buf, 4, 0x48, 0x89, 0x94, 0x03); // mov [rbx + rax + disp.as], rdx
+    }
+    emit32(buf, disp + VALUE_AS);
+}
+
+// Stack: [counter, stop, step] with an int counter, see op_for_range
+static void emit_for_range(FunctionCode* fc, Guards* guards, int exit_target) {
+    CodeBuffer* buf = &fc->buf;
+    emit_load_sp(buf);
+    emit_guard_type(buf, guards, slot(-3), VAL_INT);
+    emit(buf, 4, 0x48, 0x8B, 0x84, 0x0B);     // mov rax, [counter]
+    emit32(buf, slot(-3) + VALUE_AS);
+    emit(buf, 4, 0x48, 0x8B, 0x94, 0x0B);     // mov rdx, [step]
+    emit32(buf, slot(-1) + VALUE_AS);
+    emit(buf, 3, 0x48, 0x85, 0xD2);           // test rdx, rdx
+    int negative = emit_jcc(buf, CC_S);
+    emit(buf, 4, 0x48, 0x3B, 0x84, 0x0B);     // cmp rax, [stop]
+    emit32(buf, slot(-2) + VALUE_AS);
+    add_patch(fc, emit_jcc(buf, CC_GE), exit_target);
+    int next = emit_jmp(buf);
+    patch_here(buf, negative);
+    emit(buf, 4, 0x48, 0x3B, 0x84, 0x0B);     // cmp rax, [stop]
+    emit32(buf, slot(-2) + VALUE_AS);
+    add_patch(fc, emit_jcc(buf, CC_LE), exit_target);
+    patch_here(buf, next);
+    emit(buf, 3, 0x48, 0x01, 0xC2);           // add rdx, rax
+    emit(buf, 4, 0x48, 0x89, 0x94, 0x0B);     // mov [counter], rdx
+    emit32(buf, slot(-3) + VALUE_AS);
+    emit(buf, 3, 0xC7, 0x84, 0x0B);           // mov dword [top.type], VAL_INT
+    emit32(buf, slot(0));
+    emit32(buf, VAL_INT);
+    emit(buf, 4, 0x48, 0x89, 0x84, 0x0B);     // mov [top.as], rax
+    emit32(buf, slot(0) + VALUE_AS);
+    emit_add_sp(buf, 1);
+}
+
+// Inline template for the common case, returns 0 when the instruction
+// only has the handler call. Guard misses go to the handler.
+static int emit_fast_path(VM* vm, FunctionCode* fc, Instruction instr, Guards* guards) {
+    CodeBuffer* buf = &fc->buf;
+    Value* constants = vm->bytecode->constants;
+    if (IS_STATIC_TYPED(instr.opcode)) {
+        // The guards of the quickened template never fail here
+        instr.opcode = STATIC_TO_QUICK(instr.opcode);
+    }
+    switch (instr.opcode) {
+        case OP_LOAD_LOCAL:
+            emit_load_fp(buf);
+            emit(buf, 5, 0xF3, 0x0F, 0x6F, 0x84, 0x03); // movdqu xmm0, [rbx + rax + local]
+            emit32(buf, instr.operand * VALUE_SIZE);
+            emit_push_xmm0(buf);
+            return 1;
+        case OP_STORE_LOCAL:
+            emit_pop_xmm0(buf);
+            emit_load_fp(buf);
+            emit(buf, 5, 0xF3, 0x0F, 0x7F, 0x84, 0x03); // movdqu [rbx + rax + local], xmm0
+            emit32(buf, instr.operand * VALUE_SIZE);
+            return 1;
+        case OP_LOAD_GLOBAL:
+            emit(buf, 3, 0x48, 0x8B, 0x83);   // mov rax, [rbx + globals]
+            emit32(buf, OFF_GLOBALS);
+            emit(buf, 4, 0xF3, 0x0F, 0x6F, 0x80); // movdqu xmm0, [rax + slot]
+            emit32(buf, instr.operand * VALUE_SIZE);
+            emit_push_xmm0(buf);
+            return 1;
+        case OP_STORE_GLOBAL:
+            emit_pop_xmm0(buf);
+            emit(buf, 3, 0x48, 0x8B, 0x83);   // mov rax, [rbx + globals]
+            emit32(buf, OFF_GLOBALS);
+            emit(buf, 4, 0xF3, 0x0F, 0x7F, 0x80); // movdqu [rax + slot], xmm0
+            emit32(buf, instr.operand * VALUE_SIZE);
+            return 1;
+        case OP_CONST:
+            emit(buf, 3, 0x48, 0x8B, 0x83);   // mov rax, [rbx + bytecode]
+            emit32(buf, OFF_BYTECODE);
+            emit(buf, 3, 0x48, 0x8B, 0x80);   // mov rax, [rax + constants]
+            emit32(buf, OFF_CONSTANTS);
+            emit(buf, 4, 0xF3, 0x0F, 0x6F, 0x80); // movdqu xmm0, [rax + constant]
+            emit32(buf, instr.operand * VALUE_SIZE);
+            emit_push_xmm0(buf);
+            return 1;
+        case OP_POP:
+            emit_add_sp(buf, -1);
+            return 1;
+        case OP_ADD_INT:
+        case OP_SUB_INT:
+        case OP_MUL_INT:
+        case OP_EQ_INT:
+        case OP_NE_INT:
+        case OP_LT_INT:
+        case OP_GT_INT:
+        case OP_LE_INT:
+        case OP_GE_INT:
+            emit_int_binary(buf, guards, instr.opcode);
+            return 1;
+        case OP_JUMP_IF_ZERO:
+            // Bools from the compares, anything else through is_true
+            if (!in_function(fc, instr.operand)) {
+                return 0;
+            }
+            emit_load_sp(buf);
+            emit_guard_type(buf, guards, slot(-1), VAL_BOOL);
+            emit_add_sp(buf, -1);
+            emit(buf, 3, 0x83, 0xBC, 0x0B);   // cmp dword [top.as], 0
+            emit32(buf, slot(-1) + VALUE_AS);
+            emit8(buf, 0);
+            add_patch(fc, emit_jcc(buf, CC_E), instr.operand);
+            return 1;
+        case OP_FOR_RANGE:
+            if (!in_function(fc, instr.operand)) {
+                return 0;
+            }
+            emit_for_range(fc, guards, instr.operand);
+            return 1;
+        case OP_EQ_JUMP_IF_FALSE:
+        case OP_NE_JUMP_IF_FALSE:
+        case OP_LT_JUMP_IF_FALSE:
+        case OP_GT_JUMP_IF_FALSE:
+        case OP_LE_JUMP_IF_FALSE:
+        case OP_GE_JUMP_IF_FALSE:
+            if (!in_function(fc, instr.operand)) {
+                return 0;
+            }
+            emit_int_compare_jump(fc, guards, instr.opcode, instr.operand);
+            return 1;
+        case OP_INC_LOCAL:
+        case OP_INC_GLOBAL: {
+            Value k = constants[SUPER_CONST(instr.operand)];
+            int32_t disp = SUPER_SLOT(instr.operand) * VALUE_SIZE;
+            if (!IS_INT(k)) {
+                return 0;
+            }
+            if (instr.opcode == OP_INC_LOCAL) {
+                emit_load_fp(buf);
+            } else {
+                emit(buf, 3, 0x48, 0x8B, 0x83); // mov rax, [rbx + globals]
+                emit32(buf, OFF_GLOBALS);
+            }
+            emit_increment(buf, guards, instr.opcode == OP_INC_GLOBAL, disp, (int32_t)AS_INT(k));
+            return 1;
+        }
+        case OP_ADD_CONST: {
+            Value k = constants[instr.operand];
+            if (!IS_INT(k)) {
+                return 0;
+            }
+            emit_load_sp(buf);
+            emit_guard_type(buf, guards, slot(-1), VAL_INT);
+            emit(buf, 4, 0x48, 0x8B, 0x84, 0x0B); // mov rax, [top.as]
+            emit32(buf, slot(-1) + VALUE_AS);
+            emit(buf, 2, 0x48, 0x05);         // add rax, k
+            emit32(buf, (int32_t)AS_INT(k));
+            emit(buf, 3, 0x48, 0x63, 0xC0);   // movsxd rax, eax
+            emit(buf, 4, 0x48, 0x89, 0x84, 0x0B); // mov [top.as], rax
+            emit32(buf, slot(-1) + VALUE_AS);
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+#else
+
+// NaN-boxed values have no inline templates yet, every instruction calls
+// its handler
+static int emit_fast_path(VM* vm, FunctionCode* fc, Instruction instr, Guards* guards) {
+    (void)vm;
+    (void)fc;
+    (void)instr;
+    (void)guards;
+    return 0;
+}
+
+#endif // !VM_NAN_BOXING
+
+static void emit_instruction(VM* vm, FunctionCode* fc, int ip) {
+    CodeBuffer* buf = &fc->buf;
+    Instruction instr = vm->bytecode->instructions[ip];
+
+    if (!vm_op_handler(instr.opcode)) {
+        // Only vm_run can execute it
+        emit_set_ip(buf, ip);
+        emit_exit(buf);
+        return;
+    }
+
+    switch (instr.opcode) {
+        case OP_NOP:
+            return;
+        case OP_JUMP:
+            if (instr.operand <= ip) {
+                // Loop back-edge: the tracing tier counts it and may run
+                // a trace before we continue wherever it left vm->ip
+                emit_set_ip(buf, instr.operand);
+                emit_call_vm(buf, (void*)jit_loop_edge, ip);
+                emit_dispatch(buf);
+            } else if (in_function(fc, instr.operand)) {
+                add_patch(fc, emit_jmp(buf), instr.operand);
+            } else {
+                emit_set_ip(buf, instr.operand);
+                emit_dispatch(buf);
+            }
+            return;
+        default:
+            break;
+    }
+
+    Guards guards = {0};
+    int done = -1;
+    if (emit_fast_path(vm, fc, instr, &guards)) {
+        if (guards.count == 0) {
+            // Verified bytecode cannot overflow or underflow the stack, so
+            // loads, stores and pops have no slow path
+            return;
+        }
+        done = emit_jmp(buf);
+        for (int i = 0; i < guards.count; i++) {
+            patch_here(buf, guards.at[i]);
+        }
+    }
+
+    emit_call_handler(buf, instr, ip);
+
+    int dispatched = 0;
+    switch (instr.opcode) {
+        case OP_JUMP_IF_ZERO:
+        case OP_FOR_ITER:
+        case OP_FOR_RANGE_PREP:
+        case OP_FOR_RANGE:
+        case OP_EQ_JUMP_IF_FALSE:
+        case OP_NE_JUMP_IF_FALSE:
+        case OP_LT_JUMP_IF_FALSE:
+        case OP_GT_JUMP_IF_FALSE:
+        case OP_LE_JUMP_IF_FALSE:
+        case OP_GE_JUMP_IF_FALSE:
+            // Not taken falls through to the next instruction's code
+            if (in_function(fc, instr.operand)) {
+                emit_branch_taken(fc, instr.operand);
+            } else {
+                emit_dispatch(buf);
+                dispatched = 1;
+            }
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_METHOD:
+        case OP_RET:
+            emit_dispatch(buf);
+            dispatched = 1;
+            break;
+        default:
+            break;
+    }
+
+    if (!dispatched && vm_op_may_call(instr.opcode)) {
+        // The handler entered a special method of an instance operand
+        // unless vm->ip is at the next instruction
+        emit(buf, 2, 0x81, 0xBB);             // cmp dword [rbx + ip], ip + 1
+        emit32(buf, OFF_IP);
+        emit32(buf, ip + 1);
+        int next = emit_jcc(buf, CC_E);
+        emit_dispatch(buf);
+        patch_here(buf, next);
+    }
+
+    if (done >= 0) {
+        patch_here(buf, done);
+    }
+}
+
+static void ensure_entries(VM* vm, int count) {
+    if (vm->jit_entry_count >= count) {
+        return;
+    }
+    vm->jit_entries = realloc(vm->jit_entries, sizeof(void*) * count);
+    memset(vm->jit_entries + vm->jit_entry_count, 0, sizeof(void*) * (count - vm->jit_entry_count));
+    vm->jit_entry_count = count;
+}
+
+static void dump_function(Jit* jit, VM* vm, ObjFunction* fn, FunctionCode* fc, uint8_t* code) {
+    FILE* out = jit->dump;
+    fprintf(out, "; %s: bytecode %d..%d, %d bytes at %p\n",
+            fn->name, fc->start, fc->end - 1, fc->buf.count, (void*)code);
+    fprintf(out, "       %-14s           +0x0000 ", "<exit>");
+    for (int i = 0; i < fc->offsets[0]; i++) {
+        fprintf(out, " %02x", code[i]);
+    }
+    fprintf(out, "\n");
+
+    for (int ip = fc->start; ip < fc->end; ip++) {
+        Instruction instr = vm->bytecode->instructions[ip];
+        int from = fc->offsets[ip - fc->start];
+        int to = ip + 1 < fc->end ? fc->offsets[ip + 1 - fc->start] : fc->buf.count;
+        fprintf(out, "%04d   %-14s %8d  +0x%04x ", ip, get_opcode_name(instr.opcode), instr.operand, from);
+        for (int i = from; i < to; i++) {
+            fprintf(out, " %02x", code[i]);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+void* jit_map_code(Jit* jit, const uint8_t* code, int size) {
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+    memcpy(mem, code, size);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        return NULL;
+    }
+    if (jit->region_count == jit->region_capacity) {
+        jit->region_capacity = jit->region_capacity ? jit->region_capacity * 2 : 16;
+        jit->regions = realloc(jit->regions, sizeof(CodeRegion) * jit->region_capacity);
+    }
+    jit->regions[jit->region_count].code = mem;
+    jit->regions[jit->region_count].size = size;
+    jit->region_count++;
+    return mem;
+}
+
+void jit_ensure_loops(Jit* jit, int count) {
+    if (jit->loop_count >= count) {
+        return;
+    }
+    int added = count - jit->loop_count;
+    jit->loop_hits = realloc(jit->loop_hits, sizeof(int) * count);
+    jit->loop_aborts = realloc(jit->loop_aborts, sizeof(int) * count);
+    jit->traces = realloc(jit->traces, sizeof(void*) * count);
+    memset(jit->loop_hits + jit->loop_count, 0, sizeof(int) * added);
+    memset(jit->loop_aborts + jit->loop_count, 0, sizeof(int) * added);
+    memset(jit->traces + jit->loop_count, 0, sizeof(void*) * added);
+    jit->loop_count = count;
+}
+
+void jit_enable(VM* vm, const char* dump_path) {
+    // push rbx; push r12; push r13; push r14; push r15; mov rbx, rdi; jmp rsi
+    static const uint8_t enter_stub[] = {
+        0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x48, 0x89, 0xFB, 0xFF, 0xE6
+    };
+
+    Jit* jit = malloc(sizeof(Jit));
+    jit->regions = NULL;
+    jit->region_count = 0;
+    jit->region_capacity = 0;
+    void* enter = jit_map_code(jit, enter_stub, sizeof(enter_stub));
+    if (!enter) {
+        printf("JIT: could not map executable memory, using the interpreter\n");
+        free(jit);
+        return;
+    }
+
+    jit->enter = (void (*)(VM*, void*))enter;
+    jit->dump = NULL;
+    jit->loop_hits = NULL;
+    jit->loop_aborts = NULL;
+    jit->traces = NULL;
+    jit->loop_count = 0;
+    if (dump_path) {
+        jit->dump = fopen(dump_path, "w");
+        if (!jit->dump) {
+            printf("JIT: could not open %s for writing\n", dump_path);
+        }
+    }
+    vm->jit = jit;
+}
+
+void jit_free(VM* vm) {
+    Jit* jit = vm->jit;
+    if (!jit) {
+        return;
+    }
+    for (int i = 0; i < jit->region_count; i++) {
+        munmap(jit->regions[i].code, jit->regions[i].size);
+    }
+    if (jit->dump) {
+        fclose(jit->dump);
+    }
+    free(jit->regions);
+    free(jit->loop_hits);
+    free(jit->loop_aborts);
+    free(jit->traces);
+    free(jit);
+    vm->jit = NULL;
+}
+
+int jit_compile(VM* vm, ObjFunction* fn) {
+    Bytecode* bytecode = vm->bytecode;
+    int start = fn->addr;
+
+    // Function bodies are emitted behind a JUMP over them, its operand
+    // marks the end of the body
+    if (start <= 0 || start >= bytecode->count) {
+        return 0;
+    }
+    Instruction skip = bytecode->instructions[start - 1];
+    if (skip.opcode != OP_JUMP || skip.operand <= start || skip.operand > bytecode->count) {
+        return 0;
+    }
+
+    FunctionCode fc = {0};
+    fc.start = start;
+    fc.end = skip.operand;
+    fc.offsets = malloc(sizeof(int) * (fc.end - fc.start));
+
+    emit_exit_stub(&fc.buf);
+    for (int ip = fc.start; ip < fc.end; ip++) {
+        fc.offsets[ip - fc.start] = fc.buf.count;
+        emit_instruction(vm, &fc, ip);
+    }
+    emit_set_ip(&fc.buf, fc.end);
+    emit_exit(&fc.buf);
+
+    for (int i = 0; i < fc.patch_count; i++) {
+        JumpPatch* patch = &fc.patches[i];
+        patch_to(&fc.buf, patch->at, fc.offsets[patch->target - fc.start]);
+    }
+
+    uint8_t* code = jit_map_code(vm->jit, fc.buf.code, fc.buf.count);
+    if (code) {
+        ensure_entries(vm, bytecode->count);
+        for (int ip = fc.start; ip < fc.end; ip++) {
+            vm->jit_entries[ip] = code + fc.offsets[ip - fc.start];
+        }
+        if (vm->jit->dump) {
+            dump_function(vm->jit, vm, fn, &fc, code);
+        }
+    }
+
+    free(fc.buf.code);
+    free(fc.offsets);
+    free(fc.patches);
+    return code != NULL;
+}
+
+void jit_run(VM* vm) {
+    vm->jit->enter(vm, vm->jit_entries[vm->ip]);
+}
+
+#else
+
+void jit_enable(VM* vm, const char* dump_path) {
+    (void)vm;
+    (void)dump_path;
+    printf("JIT not supported on this platform, using the interpreter\n");
+}
+
+void jit_free(VM* vm) {
+    (void)vm;
+}
+
+int jit_compile(VM* vm, ObjFunction* fn) {
+    (void)vm;
+    (void)fn;
+    return 0;
+}
+
+void jit_run(VM* vm) {
+    (void)vm;
+}
+
+void jit_loop_edge(VM* vm, int jump_ip) {
+    (void)vm;
+    (void)jump_ip;
+}
+
+#endif // VM_JIT_SUPPORTED
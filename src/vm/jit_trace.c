@@ -0,0 +1,1037 @@
+#include "jit.h"
+
+#include "jit_internal.h"
+#include "vars.h"
+#include "vm.h"
+#include "vm_config.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Traces read and write Values in place, so they need the struct layout
+#if VM_JIT_SUPPORTED && !VM_NAN_BOXING
+
+#define MAX_TRACE_LENGTH    (512) // Instructions recorded per trace
+#define MAX_TRACE_ABORTS    (3)   // Failed recordings before a loop stays interpreted
+#define MAX_VSTACK          (16)  // Values the compiler keeps out of VM stack memory
+#define TYPE_UNKNOWN        (-1)
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Registers that live for the whole trace, r12-r15 are saved by jit_run's
+// entry stub
+#define LOCALS      R12 // &vm->stack[vm->fp], reloaded after every handler call
+#define STACK       R13 // &vm->stack[sp at loop entry], depth 0 of the trace, likewise
+#define GLOBALS     R14 // vm->globals, reloaded after every handler call
+#define ENTRY_SP    R15 // sp at loop entry
+
+// Unboxed ints and bools live in these, floats in xmm2-xmm7. rax, rcx, rdx,
+// xmm0 and xmm1 stay scratch.
+static const int int_pool[] = {RSI, RDI, R8, R9, R10, R11};
+#define INT_POOL_SIZE   ((int)(sizeof(int_pool) / sizeof(int_pool[0])))
+#define XMM_POOL_FIRST  (2)
+#define XMM_POOL_SIZE   (6)
+
+#define VALUE_SIZE  ((int32_t)sizeof(Value))
+#define VALUE_AS    ((int32_t)offsetof(Value, as))
+
+// x86-64 opcodes used with emit_op_mem / emit_op_reg
+#define X_ADD       (0x03)
+#define X_SUB       (0x2B)
+#define X_CMP       (0x3B)
+#define X_MOVSXD    (0x63)
+#define X_TEST      (0x85)
+#define X_STORE     (0x89)
+#define X_LOAD      (0x8B)
+#define X_LEA       (0x8D)
+#define X_IMUL      (0x0FAF)
+#define X_MOVZX8    (0x0FB6)
+#define X_MOVSD     (0x0F10) // F2 prefix, load
+#define X_MOVSD_ST  (0x0F11) // F2 prefix, store
+#define X_ADDSD     (0x0F58)
+#define X_MULSD     (0x0F59)
+#define X_SUBSD     (0x0F5C)
+#define X_DIVSD     (0x0F5E)
+#define X_UCOMISD   (0x0F2E) // 66 prefix
+#define X_MOVQ      (0x0F6E) // 66 prefix, REX.W: gpr to xmm
+#define X_MOVDQU    (0x0F6F) // F3 prefix, load
+#define X_MOVDQU_ST (0x0F7F) // F3 prefix, store
+
+// One instruction executed while recording
+typedef struct TraceRecord {
+    int ip;
+    Instruction instr;
+    int next_ip;     // Where execution continued
+    int depth;       // Stack height before it ran, relative to the loop entry
+    int depth_after;
+    int types[3];    // Types of the top stack values before it ran, [0] is the top
+    int load_type;   // LOAD_* / INC_*: type of the loaded value
+    long step;       // FOR_RANGE: step of an int range
+} TraceRecord;
+
+// Where a value on the compiler's virtual stack currently is
+typedef enum {
+    V_CONST, // A constant, written out when needed
+    V_SLOT,  // Still in a local, global or VM stack slot
+    V_INT,   // Unboxed int in a general register
+    V_BOOL,  // 0 or 1 in a general register
+    V_FLOAT, // Unboxed double in an xmm register
+} VKind;
+
+typedef struct VEntry {
+    VKind kind;
+    int type;     // VAL_* of the value, TYPE_UNKNOWN for unchecked slots
+    int reg;      // V_INT / V_BOOL / V_FLOAT
+    int base;     // V_SLOT: LOCALS, GLOBALS or STACK
+    int32_t disp; // V_SLOT: offset of the Value from base
+    Value value;  // V_CONST
+} VEntry;
+
+// Guard failure: write the virtual stack out, then resume the interpreter
+typedef struct SideExit {
+    int at;    // rel32 of the guard's jump
+    int ip;
+    int depth;
+    int count;
+    VEntry stack[MAX_VSTACK];
+} SideExit;
+
+typedef struct TraceCompiler {
+    VM* vm;
+    CodeBuffer buf;
+    TraceRecord* trace;
+    int length;
+    int* offsets; // Native offset per record, for the dump
+
+    VEntry stack[MAX_VSTACK]; // Values above `depth` not yet in VM stack memory
+    int count;
+    int depth;                // Values in VM stack memory above the loop entry sp
+
+    int int_used[INT_POOL_SIZE];
+    int xmm_used[XMM_POOL_SIZE];
+
+    int* local_types;  // Type a local is known to hold, TYPE_UNKNOWN if unchecked
+    int local_count;
+    int* global_types;
+    int global_count;
+
+    SideExit* exits;
+    int exit_count;
+    int exit_capacity;
+    int failed;        // Trace does not fit the compiler's model
+} TraceCompiler;
+
+// -- Encoding --------------------------------------------------------------
+
+static void emit_rex(CodeBuffer* buf, int w, int reg, int base) {
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if (rex != 0x40) {
+        emit8(buf, rex);
+    }
+}
+
+static void emit_opcode(CodeBuffer* buf, int prefix, int w, int opcode, int reg, int rm) {
+    if (prefix) {
+        emit8(buf, prefix);
+    }
+    emit_rex(buf, w, reg, rm);
+    if (opcode > 0xFF) {
+        emit8(buf, opcode >> 8);
+    }
+    emit8(buf, opcode & 0xFF);
+}
+
+// op reg, [base + disp32]
+static void emit_op_mem(CodeBuffer* buf, int prefix, int w, int opcode, int reg, int base, int32_t disp) {
+    emit_opcode(buf, prefix, w, opcode, reg, base);
+    emit8(buf, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit8(buf, 0x24); // SIB for r12
+    }
+    emit32(buf, disp);
+}
+
+// op reg, rm
+static void emit_op_reg(CodeBuffer* buf, int prefix, int w, int opcode, int reg, int rm) {
+    emit_opcode(buf, prefix, w, opcode, reg, rm);
+    emit8(buf, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// STACK and LOCALS from vm->stack, which moves when a handler grows it
+static void emit_load_bases(CodeBuffer* buf) {
+    emit_op_reg(buf, 0, 1, X_MOVSXD, RAX, ENTRY_SP);
+    emit(buf, 4, 0x48, 0xC1, 0xE0, 0x04);                      // shl rax, 4
+    emit_op_mem(buf, 0, 1, X_ADD, RAX, RBX, OFF_STACK);
+    emit_op_reg(buf, 0, 1, X_LOAD, STACK, RAX);
+    emit_op_mem(buf, 0, 1, X_MOVSXD, RAX, RBX, OFF_FP);
+    emit(buf, 4, 0x48, 0xC1, 0xE0, 0x04);                      // shl rax, 4
+    emit_op_mem(buf, 0, 1, X_ADD, RAX, RBX, OFF_STACK);
+    emit_op_reg(buf, 0, 1, X_LOAD, LOCALS, RAX);
+}
+
+static void emit_mov_imm64(CodeBuffer* buf, int reg, uint64_t value) {
+    emit_rex(buf, 1, 0, reg);
+    emit8(buf, 0xB8 | (reg & 7));
+    emit64(buf, value);
+}
+
+// mov dword [base + disp], imm32
+static void emit_store_imm32(CodeBuffer* buf, int base, int32_t disp, int32_t value) {
+    emit_op_mem(buf, 0, 0, 0xC7, 0, base, disp);
+    emit32(buf, value);
+}
+
+// cmp dword / qword [base + disp], imm8
+static void emit_cmp_mem_imm8(CodeBuffer* buf, int w, int base, int32_t disp, int value) {
+    emit_op_mem(buf, 0, w, 0x83, 7, base, disp);
+    emit8(buf, value);
+}
+
+// -- Registers and the virtual stack ---------------------------------------
+
+static int alloc_int(TraceCompiler* tc) {
+    for (int i = 0; i < INT_POOL_SIZE; i++) {
+        if (!tc->int_used[i]) {
+            tc->int_used[i] = 1;
+            return int_pool[i];
+        }
+    }
+    return -1;
+}
+
+static int alloc_xmm(TraceCompiler* tc) {
+    for (int i = 0; i < XMM_POOL_SIZE; i++) {
+        if (!tc->xmm_used[i]) {
+            tc->xmm_used[i] = 1;
+            return XMM_POOL_FIRST + i;
+        }
+    }
+    return -1;
+}
+
+static void free_entry(TraceCompiler* tc, VEntry* e) {
+    if (e->kind == V_INT || e->kind == V_BOOL) {
+        for (int i = 0; i < INT_POOL_SIZE; i++) {
+            if (int_pool[i] == e->reg) {
+                tc->int_used[i] = 0;
+            }
+        }
+    } else if (e->kind == V_FLOAT) {
+        tc->xmm_used[e->reg - XMM_POOL_FIRST] = 0;
+    }
+}
+
+static int32_t stack_disp(int depth) {
+    return depth * VALUE_SIZE;
+}
+
+// Write e as a whole Value to [base + disp], skipping the type when the
+// slot is known to hold that type already
+static void store_value(TraceCompiler* tc, VEntry* e, int base, int32_t disp, int known_type) {
+    CodeBuffer* buf = &tc->buf;
+    switch (e->kind) {
+        case V_CONST: {
+            uint64_t words[2];
+            memcpy(words, &e->value, sizeof(words));
+            emit_mov_imm64(buf, RAX, words[0]);
+            emit_op_mem(buf, 0, 1, X_STORE, RAX, base, disp);
+            emit_mov_imm64(buf, RAX, words[1]);
+            emit_op_mem(buf, 0, 1, X_STORE, RAX, base, disp + 8);
+            break;
+        }
+        case V_SLOT:
+            if (e->base == base && e->disp == disp) {
+                break;
+            }
+            emit_op_mem(buf, 0xF3, 0, X_MOVDQU, 0, e->base, e->disp);
+            emit_op_mem(buf, 0xF3, 0, X_MOVDQU_ST, 0, base, disp);
+            break;
+        case V_INT:
+        case V_BOOL:
+            if (known_type != e->type) {
+                emit_store_imm32(buf, base, disp, e->type);
+            }
+            emit_op_mem(buf, 0, 1, X_STORE, e->reg, base, disp + VALUE_AS);
+            break;
+        case V_FLOAT:
+            if (known_type != VAL_FLOAT) {
+                emit_store_imm32(buf, base, disp, VAL_FLOAT);
+            }
+            emit_op_mem(buf, 0xF2, 0, X_MOVSD_ST, e->reg, base, disp + VALUE_AS);
+            break;
+    }
+}
+
+// vm->sp = entry sp + depth
+static void emit_sync_sp(TraceCompiler* tc, int depth) {
+    emit_op_mem(&tc->buf, 0, 0, X_LEA, RAX, ENTRY_SP, depth);
+    emit_op_mem(&tc->buf, 0, 0, X_STORE, RAX, RBX, OFF_SP);
+}
+
+// Move every virtual value into VM stack memory
+static void flush(TraceCompiler* tc) {
+    for (int i = 0; i < tc->count; i++) {
+        store_value(tc, &tc->stack[i], STACK, stack_disp(tc->depth + i), TYPE_UNKNOWN);
+        free_entry(tc, &tc->stack[i]);
+    }
+    tc->depth += tc->count;
+    tc->count = 0;
+}
+
+// Flush unless there is room for one more value and a register of each kind
+static void reserve(TraceCompiler* tc) {
+    int int_free = 0;
+    int xmm_free = 0;
+    for (int i = 0; i < INT_POOL_SIZE; i++) {
+        int_free |= !tc->int_used[i];
+    }
+    for (int i = 0; i < XMM_POOL_SIZE; i++) {
+        xmm_free |= !tc->xmm_used[i];
+    }
+    if (!int_free || !xmm_free || tc->count >= MAX_VSTACK) {
+        flush(tc);
+    }
+}
+
+static void push(TraceCompiler* tc, VEntry e) {
+    tc->stack[tc->count++] = e;
+}
+
+static VEntry slot_entry(int base, int32_t disp, int type) {
+    VEntry e = {0};
+    e.kind = V_SLOT;
+    e.type = type;
+    e.base = base;
+    e.disp = disp;
+    return e;
+}
+
+static VEntry reg_entry(VKind kind, int type, int reg) {
+    VEntry e = {0};
+    e.kind = kind;
+    e.type = type;
+    e.reg = reg;
+    return e;
+}
+
+// The k-th value from the top without popping it
+static VEntry peek(TraceCompiler* tc, int k) {
+    if (k < tc->count) {
+        return tc->stack[tc->count - 1 - k];
+    }
+    return slot_entry(STACK, stack_disp(tc->depth - 1 - (k - tc->count)), TYPE_UNKNOWN);
+}
+
+// Pop the top value; values popped from VM stack memory stay readable
+// until the next flush
+static VEntry pop(TraceCompiler* tc) {
+    if (tc->count > 0) {
+        VEntry e = tc->stack[--tc->count];
+        free_entry(tc, &e);
+        return e;
+    }
+    tc->depth--;
+    return slot_entry(STACK, stack_disp(tc->depth), TYPE_UNKNOWN);
+}
+
+// -- Guards ----------------------------------------------------------------
+
+// Side exit with the current virtual stack, resuming the interpreter at ip
+static void side_exit(TraceCompiler* tc, int at, int ip) {
+    if (tc->exit_count >= tc->exit_capacity) {
+        tc->exit_capacity = tc->exit_capacity ? tc->exit_capacity * 2 : 16;
+        tc->exits = realloc(tc->exits, sizeof(SideExit) * tc->exit_capacity);
+    }
+    SideExit* exit = &tc->exits[tc->exit_count++];
+    exit->at = at;
+    exit->ip = ip;
+    exit->depth = tc->depth;
+    exit->count = tc->count;
+    memcpy(exit->stack, tc->stack, sizeof(VEntry) * tc->count);
+}
+
+// Slot values have to hold `type`, otherwise exit before ip runs
+static void guard_type(TraceCompiler* tc, VEntry* e, int type, int ip) {
+    if (e->kind != V_SLOT || e->type == type) {
+        return;
+    }
+    emit_cmp_mem_imm8(&tc->buf, 0, e->base, e->disp, type);
+    side_exit(tc, emit_jcc(&tc->buf, CC_NE), ip);
+    e->type = type;
+}
+
+// The recorded branch at r went one way: exit when cond (true when the
+// tested value is truthy) says the other
+static void guard_branch(TraceCompiler* tc, TraceRecord* r, int cond) {
+    int taken = r->next_ip == r->instr.operand && r->instr.operand != r->ip + 1;
+    if (taken) {
+        side_exit(tc, emit_jcc(&tc->buf, cond), r->ip + 1);
+    } else {
+        side_exit(tc, emit_jcc(&tc->buf, cond ^ 1), r->instr.operand);
+    }
+}
+
+// -- Instructions ----------------------------------------------------------
+
+static int is_int_arith(Opcode op) {
+    return op == OP_ADD_INT || op == OP_SUB_INT || op == OP_MUL_INT;
+}
+
+static int is_int_compare(Opcode op) {
+    return op == OP_EQ_INT || op == OP_NE_INT || op == OP_LT_INT ||
+           op == OP_GT_INT || op == OP_LE_INT || op == OP_GE_INT;
+}
+
+static int is_float_arith(Opcode op) {
+    return op == OP_ADD_FLOAT || op == OP_SUB_FLOAT || op == OP_MUL_FLOAT || op == OP_DIV_FLOAT;
+}
+
+static int is_float_compare(Opcode op) {
+    return op == OP_LT_FLOAT || op == OP_GT_FLOAT || op == OP_LE_FLOAT || op == OP_GE_FLOAT;
+}
+
+// Typed compare behind a compare-and-branch, OP_NOP if there is none
+static Opcode typed_compare(Opcode op, int type) {
+    int is_int = type == VAL_INT;
+    switch (op) {
+        case OP_EQ_JUMP_IF_FALSE: return is_int ? OP_EQ_INT : OP_NOP;
+        case OP_NE_JUMP_IF_FALSE: return is_int ? OP_NE_INT : OP_NOP;
+        case OP_LT_JUMP_IF_FALSE: return is_int ? OP_LT_INT : OP_LT_FLOAT;
+        case OP_GT_JUMP_IF_FALSE: return is_int ? OP_GT_INT : OP_GT_FLOAT;
+        case OP_LE_JUMP_IF_FALSE: return is_int ? OP_LE_INT : OP_LE_FLOAT;
+        default:                  return is_int ? OP_GE_INT : OP_GE_FLOAT;
+    }
+}
+
+static int fits_int32(long value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static void load_int(TraceCompiler* tc, int reg, VEntry* e) {
+    if (e->kind == V_CONST) {
+        emit_mov_imm64(&tc->buf, reg, (uint64_t)AS_INT(e->value));
+    } else if (e->kind == V_SLOT) {
+        emit_op_mem(&tc->buf, 0, 1, X_LOAD, reg, e->base, e->disp + VALUE_AS);
+    } else if (e->reg != reg) {
+        emit_op_reg(&tc->buf, 0, 1, X_LOAD, reg, e->reg);
+    }
+}
+
+// op reg, e for add / sub / cmp / imul
+static void int_alu(TraceCompiler* tc, int opcode, int reg, VEntry* e) {
+    CodeBuffer* buf = &tc->buf;
+    if (e->kind == V_CONST && fits_int32(AS_INT(e->value))) {
+        int32_t imm = (int32_t)AS_INT(e->value);
+        if (opcode == X_IMUL) {
+            emit_op_reg(buf, 0, 1, 0x69, reg, reg);
+        } else {
+            int ext = opcode == X_ADD ? 0 : opcode == X_SUB ? 5 : 7;
+            emit_op_reg(buf, 0, 1, 0x81, ext, reg);
+        }
+        emit32(buf, imm);
+    } else if (e->kind == V_SLOT) {
+        emit_op_mem(buf, 0, 1, opcode, reg, e->base, e->disp + VALUE_AS);
+    } else {
+        int src = e->reg;
+        if (e->kind == V_CONST) {
+            load_int(tc, RAX, e);
+            src = RAX;
+        }
+        emit_op_reg(buf, 0, 1, opcode, reg, src);
+    }
+}
+
+static void load_float(TraceCompiler* tc, int xmm, VEntry* e) {
+    if (e->kind == V_CONST) {
+        uint64_t bits;
+        double d = AS_FLOAT(e->value);
+        memcpy(&bits, &d, sizeof(bits));
+        emit_mov_imm64(&tc->buf, RAX, bits);
+        emit_op_reg(&tc->buf, 0x66, 1, X_MOVQ, xmm, RAX);
+    } else if (e->kind == V_SLOT) {
+        emit_op_mem(&tc->buf, 0xF2, 0, X_MOVSD, xmm, e->base, e->disp + VALUE_AS);
+    } else if (e->reg != xmm) {
+        emit_op_reg(&tc->buf, 0xF2, 0, X_MOVSD, xmm, e->reg);
+    }
+}
+
+// op xmm, e for the sd arithmetic and ucomisd
+static void float_alu(TraceCompiler* tc, int prefix, int opcode, int xmm, VEntry* e) {
+    if (e->kind == V_SLOT) {
+        emit_op_mem(&tc->buf, prefix, 0, opcode, xmm, e->base, e->disp + VALUE_AS);
+        return;
+    }
+    int src = e->reg;
+    if (e->kind == V_CONST) {
+        load_float(tc, 1, e);
+        src = 1;
+    }
+    emit_op_reg(&tc->buf, prefix, 0, opcode, xmm, src);
+}
+
+// The next record consumes this compare's result with a JUMP_IF_ZERO
+static TraceRecord* fused_branch(TraceCompiler* tc, int index) {
+    if (index + 1 < tc->length && tc->trace[index + 1].instr.opcode == OP_JUMP_IF_ZERO) {
+        return &tc->trace[index + 1];
+    }
+    return NULL;
+}
+
+// Push the flags as a bool, or guard on them for the branch that consumes
+// the result. Returns 1 when the branch was folded in.
+static int finish_compare(TraceCompiler* tc, TraceRecord* branch, int cc) {
+    if (branch) {
+        guard_branch(tc, branch, cc);
+        return 1;
+    }
+    int reg = alloc_int(tc);
+    emit(&tc->buf, 3, 0x0F, 0x90 | cc, 0xC0);                 // setcc al
+    emit_op_reg(&tc->buf, 0, 0, X_MOVZX8, reg, RAX);
+    push(tc, reg_entry(V_BOOL, VAL_BOOL, reg));
+    return 0;
+}
+
+// op is the typed form; branch is the JUMP_IF_ZERO (or the record itself
+// for a compare-and-branch) that consumes a compare, NULL if none
+static int compile_int_binary(TraceCompiler* tc, TraceRecord* r, Opcode op, TraceRecord* branch) {
+    reserve(tc);
+
+    VEntry b = peek(tc, 0);
+    VEntry a = peek(tc, 1);
+    guard_type(tc, &b, VAL_INT, r->ip);
+    guard_type(tc, &a, VAL_INT, r->ip);
+
+    if (is_int_arith(op)) {
+        // Allocated before the operands free their registers
+        int reg = alloc_int(tc);
+        pop(tc);
+        pop(tc);
+        load_int(tc, reg, &a);
+        int opcode = op == OP_ADD_INT ? X_ADD : op == OP_SUB_INT ? X_SUB : X_IMUL;
+        int_alu(tc, opcode, reg, &b);
+        emit_op_reg(&tc->buf, 0, 1, X_MOVSXD, reg, reg);      // the (int) cast
+        push(tc, reg_entry(V_INT, VAL_INT, reg));
+        return 0;
+    }
+
+    pop(tc);
+    pop(tc);
+    int reg = a.kind == V_INT ? a.reg : RCX;
+    load_int(tc, reg, &a);
+    int_alu(tc, X_CMP, reg, &b);
+    int cc = op == OP_EQ_INT ? CC_E : op == OP_NE_INT ? CC_NE : op == OP_LT_INT ? CC_L :
+             op == OP_GT_INT ? CC_G : op == OP_LE_INT ? CC_LE : CC_GE;
+    return finish_compare(tc, branch, cc);
+}
+
+static int compile_float_binary(TraceCompiler* tc, TraceRecord* r, Opcode op, TraceRecord* branch) {
+    reserve(tc);
+
+    VEntry b = peek(tc, 0);
+    VEntry a = peek(tc, 1);
+    guard_type(tc, &b, VAL_FLOAT, r->ip);
+    guard_type(tc, &a, VAL_FLOAT, r->ip);
+
+    if (is_float_arith(op)) {
+        int xmm = alloc_xmm(tc);
+        pop(tc);
+        pop(tc);
+        load_float(tc, xmm, &a);
+        int opcode = op == OP_ADD_FLOAT ? X_ADDSD : op == OP_SUB_FLOAT ? X_SUBSD :
+                     op == OP_MUL_FLOAT ? X_MULSD : X_DIVSD;
+        float_alu(tc, 0xF2, opcode, xmm, &b);
+        push(tc, reg_entry(V_FLOAT, VAL_FLOAT, xmm));
+        return 0;
+    }
+
+    pop(tc);
+    pop(tc);
+
+    // ucomisd x, y sets "above" for x > y and is false for NaN, so a < b
+    // and a <= b compare with the operands swapped
+    int swap = op == OP_LT_FLOAT || op == OP_LE_FLOAT;
+    VEntry* x = swap ? &b : &a;
+    VEntry* y = swap ? &a : &b;
+    load_float(tc, 0, x);
+    float_alu(tc, 0x66, X_UCOMISD, 0, y);
+    int cc = op == OP_LT_FLOAT || op == OP_GT_FLOAT ? CC_A : CC_AE;
+    return finish_compare(tc, branch, cc);
+}
+
+static void push_constant(TraceCompiler* tc, Value value) {
+    reserve(tc);
+    VEntry e = {0};
+    e.kind = V_CONST;
+    e.value = value;
+    e.type = VALUE_TYPE(value);
+    push(tc, e);
+}
+
+static void compile_load(TraceCompiler* tc, TraceRecord* r, int base, int* known) {
+    reserve(tc);
+    int slot = r->instr.operand;
+    VEntry e = slot_entry(base, slot * VALUE_SIZE, TYPE_UNKNOWN);
+    int type = r->load_type;
+    if (type == VAL_INT || type == VAL_FLOAT || type == VAL_BOOL) {
+        e.type = known[slot];
+        guard_type(tc, &e, type, r->ip);
+        known[slot] = type;
+    }
+    push(tc, e);
+}
+
+static void compile_store(TraceCompiler* tc, TraceRecord* r, int base, int* known) {
+    int32_t disp = r->instr.operand * VALUE_SIZE;
+
+    // Values below the top still reading this slot have to be taken out first
+    for (int i = 0; i < tc->count - 1; i++) {
+        VEntry* e = &tc->stack[i];
+        if (e->kind != V_SLOT || e->base != base || e->disp != disp) {
+            continue;
+        }
+        int reg = -1;
+        if (e->type == VAL_INT || e->type == VAL_BOOL) {
+            reg = alloc_int(tc);
+            if (reg >= 0) {
+                load_int(tc, reg, e);
+                *e = reg_entry(e->type == VAL_INT ? V_INT : V_BOOL, e->type, reg);
+            }
+        } else if (e->type == VAL_FLOAT) {
+            reg = alloc_xmm(tc);
+            if (reg >= 0) {
+                load_float(tc, reg, e);
+                *e = reg_entry(V_FLOAT, VAL_FLOAT, reg);
+            }
+        }
+        if (reg < 0) {
+            flush(tc);
+            break;
+        }
+    }
+
+    VEntry value = pop(tc);
+    int slot = r->instr.operand;
+    store_value(tc, &value, base, disp, known[slot]);
+    known[slot] = value.type;
+}
+
+// Sequences the compiler has no template for go through the interpreter's
+// handler, with the stack written out first
+static void compile_handler(TraceCompiler* tc, TraceRecord* r) {
+    CodeBuffer* buf = &tc->buf;
+    flush(tc);
+    if (tc->depth != r->depth) {
+        tc->failed = 1;
+        return;
+    }
+    emit_sync_sp(tc, tc->depth);
+    emit_set_ip(buf, r->ip + 1);
+    emit_call_vm(buf, (void*)vm_op_handler(r->instr.opcode), r->instr.operand);
+    emit_load_bases(buf);
+    emit_op_mem(buf, 0, 1, X_LOAD, GLOBALS, RBX, OFF_GLOBALS);
+    for (int i = 0; i < tc->global_count; i++) {
+        tc->global_types[i] = TYPE_UNKNOWN;
+    }
+    tc->depth = r->depth_after;
+
+    // A different branch, or a call into Python code: the handler left
+    // vm->ip and vm->sp where the interpreter continues. Operands of other
+    // types than recorded may make an operator run a special method.
+    switch (r->instr.opcode) {
+        case OP_JUMP_IF_ZERO:
+        case OP_EQ_JUMP_IF_FALSE:
+        case OP_NE_JUMP_IF_FALSE:
+        case OP_LT_JUMP_IF_FALSE:
+        case OP_GT_JUMP_IF_FALSE:
+        case OP_LE_JUMP_IF_FALSE:
+        case OP_GE_JUMP_IF_FALSE:
+        case OP_FOR_ITER:
+        case OP_FOR_RANGE_PREP:
+        case OP_FOR_RANGE:
+        case OP_CALL:
+        case OP_CALL_METHOD:
+            break;
+        default:
+            if (!vm_op_may_call(r->instr.opcode)) {
+                return;
+            }
+            break;
+    }
+    emit(buf, 2, 0x81, 0xBB);               // cmp dword [rbx + ip], next_ip
+    emit32(buf, OFF_IP);
+    emit32(buf, r->next_ip);
+    patch_to(buf, emit_jcc(buf, CC_NE), 0);
+}
+
+static int compile_jump_if_zero(TraceCompiler* tc, TraceRecord* r) {
+    VEntry e = peek(tc, 0);
+    if (e.kind == V_CONST) {
+        pop(tc); // Went the recorded way
+        return 1;
+    }
+    if (e.kind == V_INT || e.kind == V_BOOL) {
+        pop(tc);
+        emit_op_reg(&tc->buf, 0, 1, X_TEST, e.reg, e.reg);
+        guard_branch(tc, r, CC_NE);
+        return 1;
+    }
+    int type = e.type != TYPE_UNKNOWN ? e.type : r->types[0];
+    if (type != VAL_BOOL && type != VAL_INT) {
+        return 0;
+    }
+    guard_type(tc, &e, type, r->ip);
+    pop(tc);
+    emit_cmp_mem_imm8(&tc->buf, type == VAL_INT, e.base, e.disp + VALUE_AS, 0);
+    guard_branch(tc, r, CC_NE);
+    return 1;
+}
+
+// Int range loop with the state [counter, stop, step] in stack memory
+static int compile_for_range(TraceCompiler* tc, TraceRecord* r) {
+    if (r->types[2] != VAL_INT || r->next_ip != r->ip + 1) {
+        return 0;
+    }
+    flush(tc);
+    CodeBuffer* buf = &tc->buf;
+    VEntry counter = slot_entry(STACK, stack_disp(tc->depth - 3), TYPE_UNKNOWN);
+    int32_t stop = stack_disp(tc->depth - 2) + VALUE_AS;
+    int32_t step = stack_disp(tc->depth - 1) + VALUE_AS;
+
+    guard_type(tc, &counter, VAL_INT, r->ip);
+    emit_cmp_mem_imm8(buf, 1, STACK, step, 0);
+    side_exit(tc, emit_jcc(buf, r->step > 0 ? CC_LE : CC_GE), r->ip);
+
+    emit_op_mem(buf, 0, 1, X_LOAD, RAX, STACK, counter.disp + VALUE_AS);
+    emit_op_mem(buf, 0, 1, X_CMP, RAX, STACK, stop);
+    side_exit(tc, emit_jcc(buf, r->step > 0 ? CC_GE : CC_LE), r->instr.operand);
+
+    int reg = alloc_int(tc);
+    emit_op_reg(buf, 0, 1, X_LOAD, reg, RAX);
+    emit_op_mem(buf, 0, 1, X_ADD, RAX, STACK, step);
+    emit_op_mem(buf, 0, 1, X_STORE, RAX, STACK, counter.disp + VALUE_AS);
+    push(tc, reg_entry(V_INT, VAL_INT, reg));
+    return 1;
+}
+
+// INC_LOCAL / INC_GLOBAL of an int slot as the LOAD, CONST, ADD, STORE
+// it was fused from. Every guard comes before the store, so side exits
+// still resume at the superinstruction.
+static void compile_increment(TraceCompiler* tc, TraceRecord* r) {
+    int local = r->instr.opcode == OP_INC_LOCAL;
+    TraceRecord part = *r;
+    part.instr.operand = SUPER_SLOT(r->instr.operand);
+    compile_load(tc, &part, local ? LOCALS : GLOBALS, local ? tc->local_types : tc->global_types);
+    push_constant(tc, tc->vm->bytecode->constants[SUPER_CONST(r->instr.operand)]);
+    compile_int_binary(tc, r, OP_ADD_INT, NULL);
+    compile_store(tc, &part, local ? LOCALS : GLOBALS, local ? tc->local_types : tc->global_types);
+}
+
+// Compile trace[index], returns how many records it used
+static int compile_record(TraceCompiler* tc, int index) {
+    TraceRecord* r = &tc->trace[index];
+    Opcode op = IS_STATIC_TYPED(r->instr.opcode) ? STATIC_TO_QUICK(r->instr.opcode) : r->instr.opcode;
+    int both_int = r->types[0] == VAL_INT && r->types[1] == VAL_INT;
+    int both_float = r->types[0] == VAL_FLOAT && r->types[1] == VAL_FLOAT;
+
+    switch (op) {
+        case OP_NOP:
+        case OP_JUMP:
+            // The trace is straight-line code, jumps just lead to the next record
+            return 1;
+        case OP_CONST:
+            push_constant(tc, tc->vm->bytecode->constants[r->instr.operand]);
+            return 1;
+        case OP_POP:
+            pop(tc);
+            return 1;
+        case OP_LOAD_LOCAL:
+            compile_load(tc, r, LOCALS, tc->local_types);
+            return 1;
+        case OP_LOAD_GLOBAL:
+            compile_load(tc, r, GLOBALS, tc->global_types);
+            return 1;
+        case OP_STORE_LOCAL:
+            compile_store(tc, r, LOCALS, tc->local_types);
+            return 1;
+        case OP_STORE_GLOBAL:
+            compile_store(tc, r, GLOBALS, tc->global_types);
+            return 1;
+        case OP_JUMP_IF_ZERO:
+            if (compile_jump_if_zero(tc, r)) {
+                return 1;
+            }
+            break;
+        case OP_FOR_RANGE:
+            if (compile_for_range(tc, r)) {
+                return 1;
+            }
+            break;
+        case OP_INC_LOCAL:
+        case OP_INC_GLOBAL:
+            if (r->load_type == VAL_INT && IS_INT(tc->vm->bytecode->constants[SUPER_CONST(r->instr.operand)])) {
+                compile_increment(tc, r);
+                return 1;
+            }
+            break;
+        case OP_ADD_CONST: {
+            Value k = tc->vm->bytecode->constants[r->instr.operand];
+            if (r->types[0] == VAL_INT && IS_INT(k)) {
+                push_constant(tc, k);
+                compile_int_binary(tc, r, OP_ADD_INT, NULL);
+                return 1;
+            }
+            if (r->types[0] == VAL_FLOAT && IS_FLOAT(k)) {
+                push_constant(tc, k);
+                compile_float_binary(tc, r, OP_ADD_FLOAT, NULL);
+                return 1;
+            }
+            break;
+        }
+        default:
+            if (IS_COMPARE_JUMP(op)) {
+                // The record is its own branch
+                if (both_int) {
+                    compile_int_binary(tc, r, typed_compare(op, VAL_INT), r);
+                    return 1;
+                }
+                if (both_float && typed_compare(op, VAL_FLOAT) != OP_NOP) {
+                    compile_float_binary(tc, r, typed_compare(op, VAL_FLOAT), r);
+                    return 1;
+                }
+                break;
+            }
+            if ((is_int_arith(op) || is_int_compare(op)) && both_int) {
+                return 1 + compile_int_binary(tc, r, op, fused_branch(tc, index));
+            }
+            if ((is_float_arith(op) || is_float_compare(op)) && both_float) {
+                return 1 + compile_float_binary(tc, r, op, fused_branch(tc, index));
+            }
+            break;
+    }
+    compile_handler(tc, r);
+    return 1;
+}
+
+// -- Recording -------------------------------------------------------------
+
+// Run one iteration of the loop at header through the handlers and write
+// down what ran. Returns the trace length, -1 when the loop finished at its
+// header (try again on its next run), or 0 when the iteration left the loop
+// (header..loop_end), entered another loop, changed frames or reached an
+// opcode only vm_run executes. vm->ip is where the interpreter goes on.
+static int record_trace(VM* vm, int header, int loop_end, TraceRecord* trace) {
+    Instruction* code = vm->bytecode->instructions;
+    int entry_sp = vm->sp;
+    int frames = vm->frame_count;
+    int length = 0;
+
+    while (length < MAX_TRACE_LENGTH) {
+        int ip = vm->ip;
+        Instruction instr = code[ip];
+        VmOpHandler handler = vm_op_handler(instr.opcode);
+        if (!handler || instr.opcode == OP_RET || instr.opcode == OP_TAIL_CALL) {
+            return 0;
+        }
+
+        TraceRecord* r = &trace[length++];
+        r->ip = ip;
+        r->instr = instr;
+        r->depth = vm->sp - entry_sp;
+        for (int k = 0; k < 3; k++) {
+            r->types[k] = vm->sp - 1 - k >= 0 ? (int)VALUE_TYPE(vm->stack[vm->sp - 1 - k]) : TYPE_UNKNOWN;
+        }
+        r->load_type = TYPE_UNKNOWN;
+        r->step = 0;
+        if (instr.opcode == OP_LOAD_LOCAL) {
+            r->load_type = VALUE_TYPE(vm->stack[vm->fp + instr.operand]);
+        } else if (instr.opcode == OP_LOAD_GLOBAL) {
+            r->load_type = VALUE_TYPE(vm->globals[instr.operand]);
+        } else if (instr.opcode == OP_INC_LOCAL) {
+            r->load_type = VALUE_TYPE(vm->stack[vm->fp + SUPER_SLOT(instr.operand)]);
+        } else if (instr.opcode == OP_INC_GLOBAL) {
+            r->load_type = VALUE_TYPE(vm->globals[SUPER_SLOT(instr.operand)]);
+        } else if (instr.opcode == OP_FOR_RANGE && r->types[2] == VAL_INT) {
+            r->step = AS_INT(vm->stack[vm->sp - 1]);
+        }
+
+        vm->ip = ip + 1;
+        handler(vm, instr.operand);
+        r->next_ip = vm->ip;
+        r->depth_after = vm->sp - entry_sp;
+
+        if (vm->frame_count != frames || r->depth_after < 0) {
+            return 0;
+        }
+        if (vm->ip == header) {
+            return r->depth_after == 0 ? length : 0;
+        }
+        if (vm->ip < header || vm->ip > loop_end || (instr.opcode == OP_JUMP && vm->ip <= ip)) {
+            return length == 1 && vm->ip > loop_end ? -1 : 0;
+        }
+    }
+    return 0;
+}
+
+// -- Compilation -----------------------------------------------------------
+
+static void dump_trace(Jit* jit, VM* vm, TraceCompiler* tc, uint8_t* code, int exits_at) {
+    FILE* out = jit->dump;
+    fprintf(out, "; trace at %04d: %d instructions, %d side exits, %d bytes at %p\n",
+            tc->trace[0].ip, tc->length, tc->exit_count, tc->buf.count, (void*)code);
+    for (int i = 0; i < tc->length; i++) {
+        TraceRecord* r = &tc->trace[i];
+        int from = tc->offsets[i];
+        int to = i + 1 < tc->length ? tc->offsets[i + 1] : exits_at;
+        fprintf(out, "%04d   %-14s %8d  +0x%04x ", r->ip, get_opcode_name(r->instr.opcode), r->instr.operand, from);
+        for (int b = from; b < to; b++) {
+            fprintf(out, " %02x", code[b]);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "       %-14s           +0x%04x ", "<side exits>", exits_at);
+    for (int b = exits_at; b < tc->buf.count; b++) {
+        fprintf(out, " %02x", code[b]);
+    }
+    fprintf(out, "\n\n");
+    fflush(out);
+    (void)vm;
+}
+
+// Slots used by load, store and increment, one past the highest
+static int max_operand(TraceRecord* trace, int length, Opcode load, Opcode store, Opcode inc) {
+    int max = 0;
+    for (int i = 0; i < length; i++) {
+        Opcode op = trace[i].instr.opcode;
+        int slot = op == inc ? SUPER_SLOT(trace[i].instr.operand) : trace[i].instr.operand;
+        if ((op == load || op == store || op == inc) && slot + 1 > max) {
+            max = slot + 1;
+        }
+    }
+    return max;
+}
+
+static void* compile_trace(VM* vm, TraceRecord* trace, int length) {
+    TraceCompiler tc = {0};
+    tc.vm = vm;
+    tc.trace = trace;
+    tc.length = length;
+    tc.offsets = malloc(sizeof(int) * length);
+    tc.local_count = max_operand(trace, length, OP_LOAD_LOCAL, OP_STORE_LOCAL, OP_INC_LOCAL);
+    tc.global_count = max_operand(trace, length, OP_LOAD_GLOBAL, OP_STORE_GLOBAL, OP_INC_GLOBAL);
+    tc.local_types = malloc(sizeof(int) * (tc.local_count + 1));
+    tc.global_types = malloc(sizeof(int) * (tc.global_count + 1));
+
+    CodeBuffer* buf = &tc.buf;
+    emit_exit_stub(buf);
+
+    // Entry: the base registers. The trace stays within its frame, which
+    // reserved the verified stack depth of the whole function when it was
+    // entered, so there is no room to check.
+    emit_op_mem(buf, 0, 0, X_LOAD, ENTRY_SP, RBX, OFF_SP);
+    emit_load_bases(buf);
+    emit_op_mem(buf, 0, 1, X_LOAD, GLOBALS, RBX, OFF_GLOBALS);
+
+    int loop = buf->count;
+    for (int i = 0; i < tc.local_count; i++) {
+        tc.local_types[i] = TYPE_UNKNOWN;
+    }
+    for (int i = 0; i < tc.global_count; i++) {
+        tc.global_types[i] = TYPE_UNKNOWN;
+    }
+
+    int i = 0;
+    while (i < length && !tc.failed) {
+        int used;
+        tc.offsets[i] = buf->count;
+        used = compile_record(&tc, i);
+        for (int k = 1; k < used; k++) {
+            tc.offsets[i + k] = buf->count;
+        }
+        i += used;
+    }
+    flush(&tc);
+    if (tc.depth != 0) {
+        tc.failed = 1;
+    }
+    patch_to(buf, emit_jmp(buf), loop);
+
+    int exits_at = buf->count;
+    for (int e = 0; e < tc.exit_count; e++) {
+        SideExit* exit = &tc.exits[e];
+        patch_here(buf, exit->at);
+        for (int k = 0; k < exit->count; k++) {
+            store_value(&tc, &exit->stack[k], STACK, stack_disp(exit->depth + k), TYPE_UNKNOWN);
+        }
+        emit_sync_sp(&tc, exit->depth + exit->count);
+        emit_set_ip(buf, exit->ip);
+        emit_exit(buf);
+    }
+
+    uint8_t* code = NULL;
+    if (!tc.failed) {
+        code = jit_map_code(vm->jit, buf->code, buf->count);
+    }
+    if (code && vm->jit->dump) {
+        dump_trace(vm->jit, vm, &tc, code, exits_at);
+    }
+
+    free(buf->code);
+    free(tc.offsets);
+    free(tc.local_types);
+    free(tc.global_types);
+    free(tc.exits);
+    return code ? code + EXIT_STUB_SIZE : NULL;
+}
+
+// Last instruction that jumps back to header. Jump threading can give a
+// loop more than one back-edge, the trace has to cover all of them.
+static int loop_end(VM* vm, int header, int jump_ip) {
+    Instruction* code = vm->bytecode->instructions;
+    int end = jump_ip;
+    for (int i = jump_ip + 1; i < vm->bytecode->count; i++) {
+        Opcode op = code[i].opcode;
+        if ((op == OP_JUMP || op == OP_JUMP_IF_ZERO || IS_COMPARE_JUMP(op)) && code[i].operand == header) {
+            end = i;
+        }
+    }
+    return end;
+}
+
+void jit_loop_edge(VM* vm, int jump_ip) {
+    Jit* jit = vm->jit;
+    int header = vm->ip;
+    jit_ensure_loops(jit, vm->bytecode->count);
+
+    if (!jit->traces[header]) {
+        if (jit->loop_hits[header] < 0 || ++jit->loop_hits[header] < VM_TRACE_THRESHOLD) {
+            return;
+        }
+
+        // Recording runs the iteration, so on success we are back at header
+        TraceRecord* trace = malloc(sizeof(TraceRecord) * MAX_TRACE_LENGTH);
+        int length = record_trace(vm, header, loop_end(vm, header, jump_ip), trace);
+        if (length > 0) {
+            jit->traces[header] = compile_trace(vm, trace, length);
+        }
+        free(trace);
+
+        if (length < 0) {
+            return; // Still hot, recorded again on the next back-edge
+        }
+        if (!jit->traces[header]) {
+            jit->loop_hits[header] = ++jit->loop_aborts[header] >= MAX_TRACE_ABORTS ? -1 : 0;
+            return;
+        }
+    }
+    jit->enter(vm, jit->traces[header]);
+}
+
+#elif VM_JIT_SUPPORTED
+
+void jit_loop_edge(VM* vm, int jump_ip) {
+    (void)vm;
+    (void)jump_ip;
+}
+
+#endif // VM_JIT_SUPPORTED && !VM_NAN_BOXING
@@ -4,6 +4,7 @@
 #include "vm.h"
 #include "vm_objects.h"
 #include "gc.h"
+#include "intern_string.h"
 
 #include "stdlib.h"
 #include "string.h"
@@ -12,7 +13,8 @@
 
 void register_native_functions(VM* vm) {
     vm_register_native_functions(vm, "print", native_print);
-    vm_register_native_functions(vm, "len", native_len);
+    vm_register_special_native(vm, "len", native_len, SPECIAL_LEN);
+    vm_register_special_native(vm, "hash", native_hash, SPECIAL_HASH);
     vm_register_native_functions(vm, "time", native_clock);
     vm_register_native_functions(vm, "exit", native_exit);
     vm_register_native_functions(vm, "input", native_input);
@@ -20,14 +22,15 @@ void register_native_functions(VM* vm) {
     vm_register_native_functions(vm, "float", native_float);
     vm_register_native_functions(vm, "str", native_str);
     vm_register_native_functions(vm, "type", native_type);
+    vm_register_native_functions(vm, "hasattr", native_hasattr);
+    vm_register_native_functions(vm, "range", native_range);
     vm_register_native_functions(vm, "gc", native_gc_collect);
     vm_register_native_functions(vm, "mem", native_gc_stats);
+    vm_register_native_functions(vm, "quicken_stats", native_quicken_stats);
     vm_register_native_functions(vm, "native_make_dict", native_make_dict);
     vm_register_native_functions(vm, "native_make_list", native_make_list);
     vm_register_native_functions(vm, "native_make_set", native_make_set);
     vm_register_native_functions(vm, "native_make_tuple", native_make_tuple);
-    vm_register_native_functions(vm, "native_make_iterator", native_make_iterator);
-    vm_register_native_functions(vm, "native_iterator_next", native_iterator_next);
 }
 
 Value native_print(int arg_count, Value* args, VM* vm) {
@@ -47,39 +50,79 @@ Value native_len(int arg_count, Value* args, VM* vm) {
         exit(1);
     }
     Value arg = args[0];
-    if (arg.type != VAL_OBJ) {
+    if (!IS_OBJ(arg)) {
         printf("len() argument must be a container or string\n");
         exit(1);
     }
 
-    if (arg.as.object->type == OBJ_LIST) {
-        ObjList* list = (ObjList*)arg.as.object;
-        Value result = {0};
-        result.type = VAL_INT;
-        result.as.integer = list->count;
-        return result;
+    if (AS_OBJ(arg)->type == OBJ_LIST) {
+        ObjList* list = (ObjList*)AS_OBJ(arg);
+        return INT_VAL(list->count);
     }
 
-    if (arg.as.object->type == OBJ_STRING) {
-        ObjString* str = (ObjString*)arg.as.object;
-        Value result = {0};
-        result.type = VAL_INT;
-        result.as.integer = strlen(str->chars);
-        return result;
+    if (AS_OBJ(arg)->type == OBJ_TUPLE) {
+        return make_number_int(((ObjTuple*)AS_OBJ(arg))->count);
+    }
+
+    if (AS_OBJ(arg)->type == OBJ_DICT) {
+        return make_number_int(((ObjDict*)AS_OBJ(arg))->map->count);
+    }
+
+    if (AS_OBJ(arg)->type == OBJ_SET) {
+        return make_number_int(((ObjSet*)AS_OBJ(arg))->map->count);
+    }
+
+    if (AS_OBJ(arg)->type == OBJ_RANGE) {
+        return INT_VAL(range_length((ObjRange*)AS_OBJ(arg)));
+    }
+
+    if (AS_OBJ(arg)->type == OBJ_STRING) {
+        ObjString* str = (ObjString*)AS_OBJ(arg);
+        return INT_VAL(strlen(str->chars));
     }
     printf("len() argument must be a container or string\n");
     exit(1);
 }
 
+// Instances with __hash__ never get here, see vm_register_special_native
+Value native_hash(int arg_count, Value* args, VM* vm) {
+    if (arg_count != 1) {
+        printf("hash() takes exactly one argument (%d given)\n", arg_count);
+        exit(1);
+    }
+    Value arg = args[0];
+    if (IS_INT(arg)) {
+        return arg;
+    }
+    if (IS_BOOL(arg)) {
+        return INT_VAL(AS_BOOL(arg));
+    }
+    if (IS_FLOAT(arg)) {
+        // Equal numbers hash the same, like 2 and 2.0
+        double d = AS_FLOAT(arg);
+        if (d >= -2147483648.0 && d <= 2147483647.0 && d == (int)d) {
+            return INT_VAL((int)d);
+        }
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        return INT_VAL((int)(bits ^ (bits >> 32)));
+    }
+    if (is_obj_type(arg, OBJ_STRING)) {
+        return INT_VAL((int)as_string(arg)->hash);
+    }
+    if (IS_OBJ(arg)) {
+        // Anything else by identity
+        return INT_VAL((int)((uintptr_t)AS_OBJ(arg) >> 4));
+    }
+    return INT_VAL(0);
+}
+
 Value native_clock(int arg_count, Value* args, VM* vm) {
     if (arg_count != 0) {
         printf("clock() takes no arguments (%d given)\n", arg_count);
         exit(1);
     }
-    Value result = {0};
-    result.type = VAL_FLOAT;
-    result.as.floating = (double)clock() / CLOCKS_PER_SEC;
-    return result;
+    return FLOAT_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
 Value native_input(int arg_count, Value* args, VM* vm) {
@@ -115,30 +158,32 @@ Value native_type(int arg_count, Value* args, VM* vm) {
     }
     Value arg = args[0];
     const char* type_name;
-    switch (arg.type) {
+    switch (VALUE_TYPE(arg)) {
         case VAL_INT: type_name = "int"; break;
         case VAL_FLOAT: type_name = "float"; break;
         case VAL_BOOL: type_name = "bool"; break;
         case VAL_NONE: type_name = "NoneType"; break;
         case VAL_OBJ:
-            if (arg.as.object->type == OBJ_STRING) {
+            if (AS_OBJ(arg)->type == OBJ_STRING) {
                 type_name = "str";
-            } else if (arg.as.object->type == OBJ_LIST) {
+            } else if (AS_OBJ(arg)->type == OBJ_LIST) {
                 type_name = "list";
-            } else if (arg.as.object->type == OBJ_DICT) {
+            } else if (AS_OBJ(arg)->type == OBJ_DICT) {
                 type_name = "dict";
-            } else if (arg.as.object->type == OBJ_TUPLE) {
+            } else if (AS_OBJ(arg)->type == OBJ_TUPLE) {
                 type_name = "tuple";
-            } else if (arg.as.object->type == OBJ_SET) {
+            } else if (AS_OBJ(arg)->type == OBJ_SET) {
                 type_name = "set";
-            } else if (arg.as.object->type == OBJ_FUNCTION) {
+            } else if (AS_OBJ(arg)->type == OBJ_RANGE) {
+                type_name = "range";
+            } else if (AS_OBJ(arg)->type == OBJ_FUNCTION) {
                 type_name = "function";
-            } else if (arg.as.object->type == OBJ_NATIVE_FUNCTION) {
+            } else if (AS_OBJ(arg)->type == OBJ_NATIVE_FUNCTION) {
                 type_name = "native_function";
-            } else if (arg.as.object->type == OBJ_CLASS) {
+            } else if (AS_OBJ(arg)->type == OBJ_CLASS) {
                 type_name = "class";
-            } else if (arg.as.object->type == OBJ_INSTANCE) {
-                ObjInstance* instance = (ObjInstance*)arg.as.object;
+            } else if (AS_OBJ(arg)->type == OBJ_INSTANCE) {
+                ObjInstance* instance = (ObjInstance*)AS_OBJ(arg);
                 type_name = instance->klass->name;
             } else {
                 type_name = "<unknown object>";
@@ -151,16 +196,76 @@ Value native_type(int arg_count, Value* args, VM* vm) {
     return vm_make_string(vm, type_name);
 }
 
+Value native_hasattr(int arg_count, Value* args, VM* vm) {
+    if (arg_count != 2 || !is_obj_type(args[1], OBJ_STRING)) {
+        printf("hasattr() takes an object and an attribute name\n");
+        exit(1);
+    }
+    // Fields and methods are keyed by the interned name
+    ObjString* name = intern_adopt_string(vm, as_string(args[1]));
+    ObjClass* klass = NULL;
+    if (is_obj_type(args[0], OBJ_INSTANCE)) {
+        ObjInstance* instance = (ObjInstance*)AS_OBJ(args[0]);
+        if (instance_field(instance, name)) {
+            return make_bool(1);
+        }
+        klass = instance->klass;
+    } else if (is_obj_type(args[0], OBJ_CLASS)) {
+        klass = (ObjClass*)AS_OBJ(args[0]);
+    }
+    Value method;
+    for (; klass; klass = klass->parent) {
+        if (hash_get(klass->methods, name, &method)) {
+            return make_bool(1);
+        }
+    }
+    return make_bool(0);
+}
+
+void range_bounds(int arg_count, Value* args, long* start, long* stop, long* step) {
+    if (arg_count < 1 || arg_count > 3) {
+        printf("range() takes 1 to 3 arguments (%d given)\n", arg_count);
+        exit(1);
+    }
+    for (int i = 0; i < arg_count; i++) {
+        if (!IS_INT(args[i])) {
+            printf("range() arguments must be integers\n");
+            exit(1);
+        }
+    }
+    *start = 0;
+    *step = 1;
+    if (arg_count == 1) {
+        *stop = AS_INT(args[0]);
+    } else {
+        *start = AS_INT(args[0]);
+        *stop = AS_INT(args[1]);
+        if (arg_count == 3) {
+            *step = AS_INT(args[2]);
+        }
+    }
+    if (*step == 0) {
+        printf("range() arg 3 must not be zero\n");
+        exit(1);
+    }
+}
+
+Value native_range(int arg_count, Value* args, VM* vm) {
+    long start, stop, step;
+    range_bounds(arg_count, args, &start, &stop, &step);
+    return vm_make_range(vm, start, stop, step);
+}
+
 Value native_int(int arg_count, Value* args, VM* vm) {
     if (arg_count != 1) {
         printf("int() takes exactly one argument (%d given)\n", arg_count);
         exit(1);
     }
     Value arg = args[0];
-    if (arg.type == VAL_INT) {
+    if (IS_INT(arg)) {
         return arg;
-    } else if (arg.type == VAL_FLOAT) {
-        return make_number_int((int)arg.as.floating);
+    } else if (IS_FLOAT(arg)) {
+        return make_number_int((int)AS_FLOAT(arg));
     } else if (is_obj_type(arg, OBJ_STRING)) {
         ObjString* str = as_string(arg);
         char* endptr;
@@ -182,10 +287,10 @@ Value native_float(int arg_count, Value* args, VM* vm) {
         exit(1);
     }
     Value arg = args[0];
-    if (arg.type == VAL_FLOAT) {
+    if (IS_FLOAT(arg)) {
         return arg;
-    } else if (arg.type == VAL_INT) {
-        return make_number_float((double)arg.as.integer);
+    } else if (IS_INT(arg)) {
+        return make_number_float((double)AS_INT(arg));
     } else if (is_obj_type(arg, OBJ_STRING)) {
         ObjString* str = as_string(arg);
         char* endptr;
@@ -207,21 +312,21 @@ Value native_str(int arg_count, Value* args, VM* vm) {
         exit(1);
     }
     Value arg = args[0];
-    if (arg.type == VAL_OBJ && arg.as.object->type == OBJ_STRING) {
+    if (IS_OBJ(arg) && AS_OBJ(arg)->type == OBJ_STRING) {
         return arg;
-    } else if (arg.type == VAL_INT) {
+    } else if (IS_INT(arg)) {
         char buffer[32];
-        snprintf(buffer, sizeof(buffer), "%ld", arg.as.integer);
+        snprintf(buffer, sizeof(buffer), "%ld", AS_INT(arg));
         return vm_make_string(vm, buffer);
-    } else if (arg.type == VAL_FLOAT) {
+    } else if (IS_FLOAT(arg)) {
         char buffer[32];
-        snprintf(buffer, sizeof(buffer), "%g", arg.as.floating);
+        snprintf(buffer, sizeof(buffer), "%g", AS_FLOAT(arg));
         return vm_make_string(vm, buffer);
-    } else if (arg.type == VAL_BOOL) {
-        return vm_make_string(vm, arg.as.boolean ? "True" : "False");
-    } else if (arg.type == VAL_NONE) {
+    } else if (IS_BOOL(arg)) {
+        return vm_make_string(vm, AS_BOOL(arg) ? "True" : "False");
+    } else if (IS_NONE(arg)) {
         return vm_make_string(vm, "None");
-    } else if (arg.type == VAL_OBJ) {
+    } else if (IS_OBJ(arg)) {
         // For simplicity, just return a placeholder string for objects
         return vm_make_string(vm, "<object>");
     } else {
@@ -242,54 +347,71 @@ Value native_gc_collect(int arg_count, Value* args, VM* vm) {
 }
 
 Value native_gc_stats(int arg_count, Value* args, VM* vm) {
-    if (arg_count != 0) {
-        printf("gc_stats() takes no arguments (%d given)\n", arg_count);
+    // mem(instance) also reports what that one instance takes
+    if (arg_count > 1 || (arg_count == 1 && !is_obj_type(args[0], OBJ_INSTANCE))) {
+        printf("mem() takes no arguments or an instance\n");
         exit(1);
     }
-    Value result = {0};
-    result.type = VAL_OBJ;
-    ObjDict* dict = (ObjDict*)vm_make_dict(vm).as.object;
-    dict->obj.type = OBJ_DICT;
-    dict->count = 0;
-    dict->capacity = 4;
-    dict->map = malloc(sizeof(HashMap));
-    hash_init(dict->map, 4);
+    Value result = vm_make_dict(vm);
+    ObjDict* dict = (ObjDict*)AS_OBJ(result);
+    // Keep the dict reachable while its keys are allocated
+    vm_push(vm, result);
 
     // Add stats
-    Value allocated = {0};
-    allocated.type = VAL_INT;
-    allocated.as.integer = vm->bytes_allocated;
-    ObjString* key_allocated = (ObjString*)vm_make_string(vm, "allocated_bytes").as.object;
-    key_allocated->obj.type = OBJ_STRING;
-    key_allocated->chars = strdup("allocated_bytes");
-    key_allocated->length = strlen(key_allocated->chars);
+    Value allocated = INT_VAL(vm->bytes_allocated);
+    ObjString* key_allocated = (ObjString*)AS_OBJ(vm_make_string(vm, "allocated_bytes"));
     hash_set(dict->map, key_allocated, allocated);
 
-    Value next_gc = {0};
-    next_gc.type = VAL_INT;
     #if VM_USE_GC
-        next_gc.as.integer = vm->next_gc;
+        Value next_gc = INT_VAL(vm->next_gc);
     #else
-        next_gc.as.integer = -1; // GC not enabled
+        Value next_gc = INT_VAL(-1); // GC not enabled
     #endif
-    ObjString* key_next_gc = (ObjString*)vm_make_string(vm, "next_gc_bytes").as.object;
-    key_next_gc->obj.type = OBJ_STRING;
-    key_next_gc->chars = strdup("next_gc_bytes");
-    key_next_gc->length = strlen(key_next_gc->chars);
+    ObjString* key_next_gc = (ObjString*)AS_OBJ(vm_make_string(vm, "next_gc_bytes"));
     hash_set(dict->map, key_next_gc, next_gc);
 
-    result.as.object = (Obj*)dict;
+    if (arg_count == 1) {
+        Value size = INT_VAL(instance_bytes((ObjInstance*)AS_OBJ(args[0])));
+        ObjString* key_instance = (ObjString*)AS_OBJ(vm_make_string(vm, "instance_bytes"));
+        hash_set(dict->map, key_instance, size);
+    }
+
+    vm_pop(vm);
+    return result;
+}
+
+Value native_quicken_stats(int arg_count, Value* args, VM* vm) {
+    if (arg_count != 0) {
+        printf("quicken_stats() takes no arguments (%d given)\n", arg_count);
+        exit(1);
+    }
+    Value result = vm_make_dict(vm);
+    ObjDict* dict = (ObjDict*)AS_OBJ(result);
+    vm_push(vm, result);
+
+    Value quickened = INT_VAL(vm->quickened_sites);
+    ObjString* key_quickened = (ObjString*)AS_OBJ(vm_make_string(vm, "quickened"));
+    hash_set(dict->map, key_quickened, quickened);
+
+    Value deoptimized = INT_VAL(vm->deoptimized_sites);
+    ObjString* key_deoptimized = (ObjString*)AS_OBJ(vm_make_string(vm, "deoptimized"));
+    hash_set(dict->map, key_deoptimized, deoptimized);
+
+    Value cache_misses = INT_VAL(vm->cache_misses);
+    ObjString* key_cache_misses = (ObjString*)AS_OBJ(vm_make_string(vm, "cache_misses"));
+    hash_set(dict->map, key_cache_misses, cache_misses);
+
+    vm_pop(vm);
     return result;
 }
 
 Value native_make_list(int arg_count, Value* args, VM* vm) {
     Value list_val = vm_make_list(vm, arg_count);
-    ObjList* list = (ObjList*)list_val.as.object;
+    ObjList* list = (ObjList*)AS_OBJ(list_val);
     list->count = arg_count;
 
-    for (int i = arg_count - 1; i >= 0; i--) {
-        Value val = vm_pop(vm);
-        list->items[i] = val;
+    for (int i = 0; i < arg_count; i++) {
+        list->items[i] = args[i];
     }
 
     return list_val;
@@ -297,12 +419,13 @@ Value native_make_list(int arg_count, Value* args, VM* vm) {
 
 Value native_make_dict(int arg_count, Value* args, VM* vm) {
     Value dict_val = vm_make_dict(vm);
-    ObjDict* dict = (ObjDict*)dict_val.as.object;
-    dict->count = arg_count;
+    ObjDict* dict = (ObjDict*)AS_OBJ(dict_val);
 
-    for (int i = arg_count - 1; i >= 0; i--) {
-        Value val = vm_pop(vm);
-        Value key = vm_pop(vm);
+    // Arguments are key, value pairs. Insert in source order so
+    // iteration follows the literal
+    for (int i = 0; i + 1 < arg_count; i += 2) {
+        Value key = args[i];
+        Value val = args[i + 1];
 
         if (!is_obj_type(key, OBJ_STRING)) {
             printf("Dictionary keys must be strings\n");
@@ -316,182 +439,48 @@ Value native_make_dict(int arg_count, Value* args, VM* vm) {
 
 Value native_make_set(int arg_count, Value* args, VM* vm) {
     Value set_val = vm_make_set(vm);
-    ObjSet* set = (ObjSet*)set_val.as.object;
-    set->count = arg_count;
+    ObjSet* set = (ObjSet*)AS_OBJ(set_val);
 
-    for (int i = arg_count - 1; i >= 0; i--) {
-        Value val = vm_pop(vm);
+    // Insert in source order so iteration follows the literal
+    for (int i = 0; i < arg_count; i++) {
+        Value val = args[i];
 
         // Create string representation of the value to use as key
         char key[64];
-        if (val.type == VAL_INT) {
-            snprintf(key, sizeof(key), "%ld", val.as.integer);
-        } else if (val.type == VAL_FLOAT) {
-            snprintf(key, sizeof(key), "%g", val.as.floating);
+        if (IS_INT(val)) {
+            snprintf(key, sizeof(key), "%ld", AS_INT(val));
+        } else if (IS_FLOAT(val)) {
+            snprintf(key, sizeof(key), "%g", AS_FLOAT(val));
         } else if (is_obj_type(val, OBJ_STRING)) {
             snprintf(key, sizeof(key), "%s", as_string(val)->chars);
         } else {
-            snprintf(key, sizeof(key), "obj_%p", (void*)val.as.object);
+            snprintf(key, sizeof(key), "obj_%p", (void*)AS_OBJ(val));
         }
         
         ObjString* key_str = malloc(sizeof(ObjString));
         key_str->obj.type = OBJ_STRING;
         key_str->chars = strdup(key);
         key_str->length = strlen(key);
+        key_str->hash = hash_string(key);
+        key_str->interned = 0;
         vm->bytes_allocated += sizeof(ObjString) + strlen(key) + 1;
         
         hash_set(set->map, key_str, val);
     }
 
-    vm_push(vm, set_val);
     return set_val;
 }
 
 Value native_make_tuple(int arg_count, Value* args, VM* vm) {
     Value tuple_val = vm_make_tuple(vm);
-    ObjTuple* tuple = (ObjTuple*)tuple_val.as.object;
+    ObjTuple* tuple = (ObjTuple*)AS_OBJ(tuple_val);
     tuple->count = arg_count;
     tuple->items = malloc(sizeof(Value) * arg_count);
     vm->bytes_allocated += sizeof(Value) * arg_count;
 
-    for (int i = arg_count - 1; i >= 0; i--) {
-        Value val = vm_pop(vm);
-        tuple->items[i] = val;
+    for (int i = 0; i < arg_count; i++) {
+        tuple->items[i] = args[i];
     }
 
     return tuple_val;
 }
-
-Value native_make_iterator(int arg_count, Value* args, VM* vm) {
-    if (arg_count != 2) {
-        printf("native_make_iterator() takes exactly 2 arguments (iterable and loop variable name)\n");
-        exit(1);
-    }
-    
-    Value iterable = args[1];
-    if (!is_obj_type(iterable, OBJ_LIST) && 
-        !is_obj_type(iterable, OBJ_DICT) && 
-        !is_obj_type(iterable, OBJ_SET) && 
-        !is_obj_type(iterable, OBJ_TUPLE)) {
-        printf("native_make_iterator() first argument must be a list, dict, set, or tuple\n");
-        exit(1);
-    }
-    Value var_name_val = args[0];
-    if (!is_obj_type(var_name_val, OBJ_STRING)) {
-        printf("native_make_iterator() second argument must be a string (loop variable name)\n");
-        exit(1);
-    }
-    ObjString* var_name = as_string(var_name_val);
-
-    Value iterator = vm_make_iterator(vm, iterable);
-
-    // Store iterator in internal variable __iter_<varname>
-    char iter_var_name[256];
-    snprintf(iter_var_name, sizeof(iter_var_name), "__iter_%s", var_name->chars);
-    ObjString* iter_var = (ObjString*)vm_make_string(vm, iter_var_name).as.object;
-    scope_set(vm->scope, iter_var, iterator);
-    
-    return iterator;
-}
-
-static Value iterator_get_current(Value iterator_val) {
-    if (!is_obj_type(iterator_val, OBJ_ITERATOR)) {
-        printf("Expected an iterator object\n");
-        exit(1);
-    }
-    ObjIterator* iterator = (ObjIterator*)iterator_val.as.object;
-    Value iterable = iterator->iterable;
-
-    if (is_obj_type(iterable, OBJ_LIST)) {
-        ObjList* list = (ObjList*)iterable.as.object;
-        if (iterator->index >= list->count) {
-            return make_none(); // Signal end of iteration
-        }
-        Value item = list->items[iterator->index];
-        return item;
-    }
-
-    if (is_obj_type(iterable, OBJ_TUPLE)) {
-        ObjTuple* tuple = (ObjTuple*)iterable.as.object;
-        if (iterator->index >= tuple->count) {
-            return make_none(); // Signal end of iteration
-        }
-        Value item = tuple->items[iterator->index];
-        return item;
-    }
-
-    if (is_obj_type(iterable, OBJ_DICT)) {
-        ObjDict* dict = (ObjDict*)iterable.as.object;
-        if (iterator->index >= dict->count) {
-            return make_none(); // Signal end of iteration
-        }
-        // Iterate over keys in the dictionary
-        int count = 0;
-        for (int i = 0; i < dict->map->capacity; i++) {
-            HashNode* node = &dict->map->nodes[i];
-            while (node) {
-                if (count == iterator->index) {
-                    Value key_val = {.type = VAL_OBJ, .as.object = (Obj*)node->key};
-                    return key_val; // Return key as string
-                }
-                count++;
-                node = node->next;
-            }
-        }
-    }
-
-    if (is_obj_type(iterable, OBJ_SET)) {
-        ObjSet* set = (ObjSet*)iterable.as.object;
-        if (iterator->index >= set->count) {
-            return make_none(); // Signal end of iteration
-        }
-        // Iterate over keys in the set's underlying map
-        int count = 0;
-        for (int i = 0; i < set->map->capacity; i++) {
-            HashNode* node = &set->map->nodes[i];
-            while (node) {
-                if (count == iterator->index) {
-                    return node->value; // Return the value stored in the set
-                }
-                count++;
-                node = node->next;
-            }
-        }
-    }
-}
-
-Value native_iterator_next(int arg_count, Value* args, VM* vm) {
-    if (arg_count != 1) {
-        printf("native_iterator_next() takes exactly 1 argument (loop variable name)\n");
-        exit(1);
-    }
-    Value var_name_val = args[0];
-    if (!is_obj_type(var_name_val, OBJ_STRING)) {
-        printf("native_iterator_next() argument must be a string (loop variable name)\n");
-        exit(1);
-    }
-    ObjString* var_name = as_string(var_name_val);
-    
-    // Get iterator from __iter_<varname>
-    char iter_var_name[256];
-    snprintf(iter_var_name, sizeof(iter_var_name), "__iter_%s", var_name->chars);
-    ObjString* iter_var = (ObjString*)vm_make_string(vm, iter_var_name).as.object;
-    Value iter_val = scope_find(vm->scope, iter_var);
-    
-    if (!is_obj_type(iter_val, OBJ_ITERATOR)) {
-        printf("native_iterator_next() could not find iterator for variable %s\n", var_name->chars);
-        exit(1);
-    }
-    
-    ObjIterator* iterator = (ObjIterator*)iter_val.as.object;
-    iterator->current = iterator_get_current(iter_val);
-    if (iterator->current.type == VAL_NONE) {
-        return iterator->current; // Signal end of iteration
-    }
-    
-    // Store current value in the actual loop variable
-    scope_set(vm->scope, var_name, iterator->current);
-    
-    iterator->index++; // Move to next item for the next call
-    return iterator->current;
-}
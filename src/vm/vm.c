@@ -1,7 +1,10 @@
 #include "vm.h"
 
+#include "gc.h"
 #include "hashmap.h"
 #include "intern_string.h"
+#include "jit.h"
+#include "native_func.h"
 #include "vars.h"
 #include "vm_config.h"
 #include "vm_objects.h"
@@ -11,21 +14,17 @@
 #include "string.h"
 
 static Value vm_peek(VM* vm);
-static void op_const_to_stack(VM* vm, int operand);
 static void op_add(VM* vm);
 static void op_sub(VM* vm);
 static void op_mul(VM* vm);
 static void op_div(VM* vm);
-static void op_store_global(VM* vm, int operand);
-static void op_load_global(VM* vm, int operand);
-static void op_jump_if_zero(VM* vm, int operand);
-static void op_equal(VM* vm);
-static void op_less_than(VM* vm);
-static void op_greater_than(VM* vm);
-static void op_less_equal(VM* vm);
-static void op_greater_equal(VM* vm);
-static void op_not_equal(VM* vm);
+static void op_neg(VM* vm);
+static void op_store_name(VM* vm, int operand);
+static void op_load_name(VM* vm, int operand);
+static void op_compare(VM* vm, Opcode op);
+static void deoptimize(VM* vm, Opcode generic);
 static void op_call(VM* vm, int operand);
+static void op_tail_call(VM* vm, int operand);
 static void op_return(VM* vm);
 static void op_index_get(VM* vm);
 static void op_index_set(VM* vm);
@@ -34,6 +33,19 @@ static void op_make_instance(VM* vm);
 static void op_get_attr(VM* vm, int operand);
 static void op_set_attr(VM* vm, int operand);
 static void op_call_method(VM* vm, int operand);
+static int find_method(VM* vm, ObjClass* klass, ObjString* name, Value* method);
+static inline ObjFunction* class_special(VM* vm, ObjClass* klass, SpecialMethod which);
+static ObjFunction* instance_special(VM* vm, Value value, SpecialMethod which);
+static void call_special(VM* vm, ObjFunction* fn, int argc, ReturnAction action, int target);
+static void link_caches(VM* vm);
+static void op_get_iter(VM* vm);
+static void op_for_iter(VM* vm, int operand);
+static int iterator_next(VM* vm, ObjIterator* iterator, Value* item);
+static void op_for_range_prep(VM* vm, int operand);
+static inline void op_for_range(VM* vm, int operand);
+static inline void op_compare_jump(VM* vm, Opcode compare, int target);
+static inline void op_increment(VM* vm, Value* slot, int operand, ReturnAction store);
+static inline void op_add_const(VM* vm, int operand);
 
 typedef struct {
     Opcode opcode;
@@ -44,21 +56,75 @@ static const OpcodeInfo opcode_info[] = {
     {OP_NOP, "NOP"},
     {OP_LOAD, "LOAD"},
     {OP_STORE, "STORE"},
+    {OP_LOAD_LOCAL, "LOAD_LOCAL"},
+    {OP_STORE_LOCAL, "STORE_LOCAL"},
+    {OP_LOAD_GLOBAL, "LOAD_GLOBAL"},
+    {OP_STORE_GLOBAL, "STORE_GLOBAL"},
     {OP_ADD, "ADD"},
     {OP_SUB, "SUB"},
     {OP_MUL, "MUL"},
     {OP_DIV, "DIV"},
+    {OP_NEG, "NEG"},
+    {OP_NOT, "NOT"},
     {OP_EQ, "EQ"},
     {OP_LT, "LT"},
     {OP_GT, "GT"},
     {OP_GE, "GE"},
     {OP_LE, "LE"},
     {OP_NE, "NE"},
+    {OP_ADD_INT, "ADD_INT"},
+    {OP_ADD_FLOAT, "ADD_FLOAT"},
+    {OP_SUB_INT, "SUB_INT"},
+    {OP_SUB_FLOAT, "SUB_FLOAT"},
+    {OP_MUL_INT, "MUL_INT"},
+    {OP_MUL_FLOAT, "MUL_FLOAT"},
+    {OP_DIV_FLOAT, "DIV_FLOAT"},
+    {OP_EQ_INT, "EQ_INT"},
+    {OP_LT_INT, "LT_INT"},
+    {OP_GT_INT, "GT_INT"},
+    {OP_GE_INT, "GE_INT"},
+    {OP_LE_INT, "LE_INT"},
+    {OP_NE_INT, "NE_INT"},
+    {OP_LT_FLOAT, "LT_FLOAT"},
+    {OP_GT_FLOAT, "GT_FLOAT"},
+    {OP_GE_FLOAT, "GE_FLOAT"},
+    {OP_LE_FLOAT, "LE_FLOAT"},
+    {OP_ADD_INT_STATIC, "ADD_INT_STATIC"},
+    {OP_ADD_FLOAT_STATIC, "ADD_FLOAT_STATIC"},
+    {OP_SUB_INT_STATIC, "SUB_INT_STATIC"},
+    {OP_SUB_FLOAT_STATIC, "SUB_FLOAT_STATIC"},
+    {OP_MUL_INT_STATIC, "MUL_INT_STATIC"},
+    {OP_MUL_FLOAT_STATIC, "MUL_FLOAT_STATIC"},
+    {OP_DIV_FLOAT_STATIC, "DIV_FLOAT_STATIC"},
+    {OP_EQ_INT_STATIC, "EQ_INT_STATIC"},
+    {OP_LT_INT_STATIC, "LT_INT_STATIC"},
+    {OP_GT_INT_STATIC, "GT_INT_STATIC"},
+    {OP_GE_INT_STATIC, "GE_INT_STATIC"},
+    {OP_LE_INT_STATIC, "LE_INT_STATIC"},
+    {OP_NE_INT_STATIC, "NE_INT_STATIC"},
+    {OP_LT_FLOAT_STATIC, "LT_FLOAT_STATIC"},
+    {OP_GT_FLOAT_STATIC, "GT_FLOAT_STATIC"},
+    {OP_GE_FLOAT_STATIC, "GE_FLOAT_STATIC"},
+    {OP_LE_FLOAT_STATIC, "LE_FLOAT_STATIC"},
     {OP_JUMP, "JUMP"},
     {OP_JUMP_IF_ZERO, "JUMP_IF_ZERO"},
+    {OP_EQ_JUMP_IF_FALSE, "EQ_JUMP_IF_FALSE"},
+    {OP_NE_JUMP_IF_FALSE, "NE_JUMP_IF_FALSE"},
+    {OP_LT_JUMP_IF_FALSE, "LT_JUMP_IF_FALSE"},
+    {OP_GT_JUMP_IF_FALSE, "GT_JUMP_IF_FALSE"},
+    {OP_LE_JUMP_IF_FALSE, "LE_JUMP_IF_FALSE"},
+    {OP_GE_JUMP_IF_FALSE, "GE_JUMP_IF_FALSE"},
+    {OP_INC_LOCAL, "INC_LOCAL"},
+    {OP_INC_GLOBAL, "INC_GLOBAL"},
+    {OP_ADD_CONST, "ADD_CONST"},
     {OP_CONST, "CONST"},
     {OP_POP, "POP"},
+    {OP_GET_ITER, "GET_ITER"},
+    {OP_FOR_ITER, "FOR_ITER"},
+    {OP_FOR_RANGE_PREP, "FOR_RANGE_PREP"},
+    {OP_FOR_RANGE, "FOR_RANGE"},
     {OP_CALL, "CALL"},
+    {OP_TAIL_CALL, "TAIL_CALL"},
     {OP_RET, "RET"},
     {OP_IDX_GET, "IDX_GET"},
     {OP_IDX_SET, "IDX_SET"},
@@ -79,43 +145,414 @@ const char* get_opcode_name(Opcode opcode) {
     return "<unknown opcode>";
 }
 
+static const char* special_method_names[SPECIAL_COUNT] = {
+    [SPECIAL_INIT] = "__init__",
+    [SPECIAL_ADD] = "__add__",
+    [SPECIAL_SUB] = "__sub__",
+    [SPECIAL_MUL] = "__mul__",
+    [SPECIAL_EQ] = "__eq__",
+    [SPECIAL_LT] = "__lt__",
+    [SPECIAL_HASH] = "__hash__",
+    [SPECIAL_LEN] = "__len__",
+    [SPECIAL_GETITEM] = "__getitem__",
+    [SPECIAL_ITER] = "__iter__",
+    [SPECIAL_NEXT] = "__next__",
+};
+
+// Intern the string constants in place so names used as attribute, method
+// and scope keys compare by pointer in the hashmaps.
+static void intern_constants(VM* vm) {
+    Bytecode* bytecode = vm->bytecode;
+    for (int i = vm->interned_const_count; i < bytecode->const_count; i++) {
+        Value constant = bytecode->constants[i];
+        if (is_obj_type(constant, OBJ_STRING)) {
+            ObjString* str = intern_adopt_string(vm, as_string(constant));
+            bytecode->constants[i] = OBJ_VAL(str);
+        }
+    }
+    vm->interned_const_count = bytecode->const_count;
+}
+
+#if VM_USE_COMPUTED_GOTO
+// Direct-threaded dispatch: every handler jumps straight to the next one
+// through the label table, so each opcode gets its own indirect branch.
+#define VM_SWITCH(op)       goto *dispatch_table[op];
+#define VM_CASE(op)         L_##op
+#define VM_DEFAULT          L_UNKNOWN
+#define VM_NEXT()           do { VM_FETCH(); goto *dispatch_table[instr.opcode]; } while (0)
+#else
+#define VM_SWITCH(op)       switch (op)
+#define VM_CASE(op)         case op
+#define VM_DEFAULT          default
+#define VM_NEXT()           continue
+#endif
+
+#define VM_FETCH() do { \
+        instr = *pc++; \
+        if (VM_DEBUG > 1) { \
+            printf("Executing instruction at ip=%d: %s %d\n", (int)(pc - code) - 1, get_opcode_name(instr.opcode), instr.operand); \
+        } \
+    } while (0)
+
+// vm_run keeps the instruction pointer, the stack top and the frame's
+// locals in registers. Everything outside it (the op_* handlers, natives,
+// the collector and the JIT) works on vm->ip and vm->sp, so a case that
+// calls out stores them first and reloads them, and the frame, after.
+#define VM_SAVE() do { \
+        vm->ip = (int)(pc - code); \
+        vm->sp = (int)(sp - vm->stack); \
+    } while (0)
+
+#define VM_LOAD() do { \
+        pc = code + vm->ip; \
+        sp = vm->stack + vm->sp; \
+        locals = vm->stack + vm->fp; \
+        globals = vm->globals; \
+    } while (0)
+
+#define VM_OUT(...) do { VM_SAVE(); __VA_ARGS__; VM_LOAD(); } while (0)
+
+// Typed binary op: the result overwrites the left operand in place
+#define VM_QUICK_BINARY(op, static_op, is_operand_type, generic_op, generic_handler, make_result, expr) \
+    VM_CASE(op): { \
+        Value* a = sp - 2; \
+        Value* b = sp - 1; \
+        if (is_operand_type(*a) && is_operand_type(*b)) { \
+            *a = make_result(expr); \
+            sp--; \
+            VM_NEXT(); \
+        } \
+        VM_OUT(deoptimize(vm, generic_op); generic_handler); \
+        VM_NEXT(); \
+    }
+
+#define VM_STATIC_BINARY(op, static_op, is_operand_type, generic_op, generic_handler, make_result, expr) \
+    VM_CASE(static_op): { \
+        Value* a = sp - 2; \
+        Value* b = sp - 1; \
+        *a = make_result(expr); \
+        sp--; \
+        VM_NEXT(); \
+    }
+
+// Fused compare and branch on ints and floats, op_compare_jump for the
+// rest. C compares are false for NaN except !=, like op_compare.
+#define VM_COMPARE_JUMP(op, compare, c_op) \
+    VM_CASE(op): { \
+        Value a = sp[-2]; \
+        Value b = sp[-1]; \
+        if (IS_INT(a) && IS_INT(b)) { \
+            sp -= 2; \
+            if (!(AS_INT(a) c_op AS_INT(b))) { \
+                pc = code + instr.operand; \
+            } \
+            VM_NEXT(); \
+        } \
+        if (IS_FLOAT(a) && IS_FLOAT(b)) { \
+            sp -= 2; \
+            if (!(AS_FLOAT(a) c_op AS_FLOAT(b))) { \
+                pc = code + instr.operand; \
+            } \
+            VM_NEXT(); \
+        } \
+        VM_OUT(op_compare_jump(vm, compare, instr.operand)); \
+        VM_NEXT(); \
+    }
+
+// Quickened handlers: guard on the operand types seen when the site was
+// rewritten, fall back to the generic handler on a miss. The statically
+// typed form of each runs the same expression unguarded.
+#define VM_QUICK_OPS(X) \
+    X(OP_ADD_INT, OP_ADD_INT_STATIC, IS_INT, OP_ADD, op_add(vm), INT_VAL, (int)(AS_INT(*a) + AS_INT(*b))) \
+    X(OP_SUB_INT, OP_SUB_INT_STATIC, IS_INT, OP_SUB, op_sub(vm), INT_VAL, (int)(AS_INT(*a) - AS_INT(*b))) \
+    X(OP_MUL_INT, OP_MUL_INT_STATIC, IS_INT, OP_MUL, op_mul(vm), INT_VAL, (int)(AS_INT(*a) * AS_INT(*b))) \
+    X(OP_ADD_FLOAT, OP_ADD_FLOAT_STATIC, IS_FLOAT, OP_ADD, op_add(vm), FLOAT_VAL, AS_FLOAT(*a) + AS_FLOAT(*b)) \
+    X(OP_SUB_FLOAT, OP_SUB_FLOAT_STATIC, IS_FLOAT, OP_SUB, op_sub(vm), FLOAT_VAL, AS_FLOAT(*a) - AS_FLOAT(*b)) \
+    X(OP_MUL_FLOAT, OP_MUL_FLOAT_STATIC, IS_FLOAT, OP_MUL, op_mul(vm), FLOAT_VAL, AS_FLOAT(*a) * AS_FLOAT(*b)) \
+    X(OP_DIV_FLOAT, OP_DIV_FLOAT_STATIC, IS_FLOAT, OP_DIV, op_div(vm), FLOAT_VAL, AS_FLOAT(*a) / AS_FLOAT(*b)) \
+    X(OP_EQ_INT, OP_EQ_INT_STATIC, IS_INT, OP_EQ, op_compare(vm, OP_EQ), BOOL_VAL, AS_INT(*a) == AS_INT(*b)) \
+    X(OP_NE_INT, OP_NE_INT_STATIC, IS_INT, OP_NE, op_compare(vm, OP_NE), BOOL_VAL, AS_INT(*a) != AS_INT(*b)) \
+    X(OP_LT_INT, OP_LT_INT_STATIC, IS_INT, OP_LT, op_compare(vm, OP_LT), BOOL_VAL, AS_INT(*a) < AS_INT(*b)) \
+    X(OP_GT_INT, OP_GT_INT_STATIC, IS_INT, OP_GT, op_compare(vm, OP_GT), BOOL_VAL, AS_INT(*a) > AS_INT(*b)) \
+    X(OP_LE_INT, OP_LE_INT_STATIC, IS_INT, OP_LE, op_compare(vm, OP_LE), BOOL_VAL, AS_INT(*a) <= AS_INT(*b)) \
+    X(OP_GE_INT, OP_GE_INT_STATIC, IS_INT, OP_GE, op_compare(vm, OP_GE), BOOL_VAL, AS_INT(*a) >= AS_INT(*b)) \
+    X(OP_LT_FLOAT, OP_LT_FLOAT_STATIC, IS_FLOAT, OP_LT, op_compare(vm, OP_LT), BOOL_VAL, AS_FLOAT(*a) < AS_FLOAT(*b)) \
+    X(OP_GT_FLOAT, OP_GT_FLOAT_STATIC, IS_FLOAT, OP_GT, op_compare(vm, OP_GT), BOOL_VAL, AS_FLOAT(*a) > AS_FLOAT(*b)) \
+    X(OP_LE_FLOAT, OP_LE_FLOAT_STATIC, IS_FLOAT, OP_LE, op_compare(vm, OP_LE), BOOL_VAL, AS_FLOAT(*a) <= AS_FLOAT(*b)) \
+    X(OP_GE_FLOAT, OP_GE_FLOAT_STATIC, IS_FLOAT, OP_GE, op_compare(vm, OP_GE), BOOL_VAL, AS_FLOAT(*a) >= AS_FLOAT(*b))
+
+// Calls and returns can land on an instruction the JIT compiled, continue
+// there in native code until it reaches code that only vm_run can execute
+#if VM_JIT_SUPPORTED
+#define VM_ENTER_JIT() do { \
+        if (vm->ip < vm->jit_entry_count && vm->jit_entries[vm->ip]) { \
+            jit_run(vm); \
+        } \
+    } while (0)
+#else
+#define VM_ENTER_JIT() do { } while (0)
+#endif
+
 void vm_run(VM* vm) 
 {
+    Instruction* code = vm->bytecode->instructions;
+    Value* constants = vm->bytecode->constants;
+    Instruction instr;
+    Instruction* pc;
+    Value* sp;
+    Value* locals;
+    Value* globals;
+
+    // The REPL appends to the same bytecode, new constants and globals
+    // need to be interned and linked before they run
+    if (vm->interned_const_count < vm->bytecode->const_count) {
+        intern_constants(vm);
+    }
+    if (vm->global_count < vm->bytecode->global_count) {
+        vm_link_globals(vm);
+    }
+    if (vm->cache_site_count < vm->bytecode->count) {
+        link_caches(vm);
+    }
+    vm_reserve_stack(vm, vm->bytecode->max_stack);
+    VM_LOAD();
+
+#if VM_USE_COMPUTED_GOTO
+    static void* dispatch_table[] = {
+        // Opcodes without a handler below report an error like the switch
+        [0 ... OP_HALT] = &&L_UNKNOWN,
+        [OP_NOP] = &&L_OP_NOP,
+        [OP_LOAD] = &&L_OP_LOAD,
+        [OP_STORE] = &&L_OP_STORE,
+        [OP_LOAD_LOCAL] = &&L_OP_LOAD_LOCAL,
+        [OP_STORE_LOCAL] = &&L_OP_STORE_LOCAL,
+        [OP_LOAD_GLOBAL] = &&L_OP_LOAD_GLOBAL,
+        [OP_STORE_GLOBAL] = &&L_OP_STORE_GLOBAL,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUB] = &&L_OP_SUB,
+        [OP_MUL] = &&L_OP_MUL,
+        [OP_DIV] = &&L_OP_DIV,
+        [OP_NEG] = &&L_OP_NEG,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_EQ] = &&L_OP_EQ,
+        [OP_LT] = &&L_OP_LT,
+        [OP_GT] = &&L_OP_GT,
+        [OP_GE] = &&L_OP_GE,
+        [OP_LE] = &&L_OP_LE,
+        [OP_NE] = &&L_OP_NE,
+        [OP_ADD_INT] = &&L_OP_ADD_INT,
+        [OP_ADD_FLOAT] = &&L_OP_ADD_FLOAT,
+        [OP_SUB_INT] = &&L_OP_SUB_INT,
+        [OP_SUB_FLOAT] = &&L_OP_SUB_FLOAT,
+        [OP_MUL_INT] = &&L_OP_MUL_INT,
+        [OP_MUL_FLOAT] = &&L_OP_MUL_FLOAT,
+        [OP_DIV_FLOAT] = &&L_OP_DIV_FLOAT,
+        [OP_EQ_INT] = &&L_OP_EQ_INT,
+        [OP_LT_INT] = &&L_OP_LT_INT,
+        [OP_GT_INT] = &&L_OP_GT_INT,
+        [OP_GE_INT] = &&L_OP_GE_INT,
+        [OP_LE_INT] = &&L_OP_LE_INT,
+        [OP_NE_INT] = &&L_OP_NE_INT,
+        [OP_LT_FLOAT] = &&L_OP_LT_FLOAT,
+        [OP_GT_FLOAT] = &&L_OP_GT_FLOAT,
+        [OP_GE_FLOAT] = &&L_OP_GE_FLOAT,
+        [OP_LE_FLOAT] = &&L_OP_LE_FLOAT,
+        [OP_ADD_INT_STATIC] = &&L_OP_ADD_INT_STATIC,
+        [OP_ADD_FLOAT_STATIC] = &&L_OP_ADD_FLOAT_STATIC,
+        [OP_SUB_INT_STATIC] = &&L_OP_SUB_INT_STATIC,
+        [OP_SUB_FLOAT_STATIC] = &&L_OP_SUB_FLOAT_STATIC,
+        [OP_MUL_INT_STATIC] = &&L_OP_MUL_INT_STATIC,
+        [OP_MUL_FLOAT_STATIC] = &&L_OP_MUL_FLOAT_STATIC,
+        [OP_DIV_FLOAT_STATIC] = &&L_OP_DIV_FLOAT_STATIC,
+        [OP_EQ_INT_STATIC] = &&L_OP_EQ_INT_STATIC,
+        [OP_LT_INT_STATIC] = &&L_OP_LT_INT_STATIC,
+        [OP_GT_INT_STATIC] = &&L_OP_GT_INT_STATIC,
+        [OP_GE_INT_STATIC] = &&L_OP_GE_INT_STATIC,
+        [OP_LE_INT_STATIC] = &&L_OP_LE_INT_STATIC,
+        [OP_NE_INT_STATIC] = &&L_OP_NE_INT_STATIC,
+        [OP_LT_FLOAT_STATIC] = &&L_OP_LT_FLOAT_STATIC,
+        [OP_GT_FLOAT_STATIC] = &&L_OP_GT_FLOAT_STATIC,
+        [OP_GE_FLOAT_STATIC] = &&L_OP_GE_FLOAT_STATIC,
+        [OP_LE_FLOAT_STATIC] = &&L_OP_LE_FLOAT_STATIC,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_JUMP_IF_ZERO] = &&L_OP_JUMP_IF_ZERO,
+        [OP_EQ_JUMP_IF_FALSE] = &&L_OP_EQ_JUMP_IF_FALSE,
+        [OP_NE_JUMP_IF_FALSE] = &&L_OP_NE_JUMP_IF_FALSE,
+        [OP_LT_JUMP_IF_FALSE] = &&L_OP_LT_JUMP_IF_FALSE,
+        [OP_GT_JUMP_IF_FALSE] = &&L_OP_GT_JUMP_IF_FALSE,
+        [OP_LE_JUMP_IF_FALSE] = &&L_OP_LE_JUMP_IF_FALSE,
+        [OP_GE_JUMP_IF_FALSE] = &&L_OP_GE_JUMP_IF_FALSE,
+        [OP_INC_LOCAL] = &&L_OP_INC_LOCAL,
+        [OP_INC_GLOBAL] = &&L_OP_INC_GLOBAL,
+        [OP_ADD_CONST] = &&L_OP_ADD_CONST,
+        [OP_CONST] = &&L_OP_CONST,
+        [OP_POP] = &&L_OP_POP,
+        [OP_GET_ITER] = &&L_OP_GET_ITER,
+        [OP_FOR_ITER] = &&L_OP_FOR_ITER,
+        [OP_FOR_RANGE_PREP] = &&L_OP_FOR_RANGE_PREP,
+        [OP_FOR_RANGE] = &&L_OP_FOR_RANGE,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+        [OP_RET] = &&L_OP_RET,
+        [OP_IDX_GET] = &&L_OP_IDX_GET,
+        [OP_IDX_SET] = &&L_OP_IDX_SET,
+        [OP_MAKE_CLASS] = &&L_OP_MAKE_CLASS,
+        [OP_MAKE_INSTANCE] = &&L_OP_MAKE_INSTANCE,
+        [OP_GET_ATTR] = &&L_OP_GET_ATTR,
+        [OP_SET_ATTR] = &&L_OP_SET_ATTR,
+        [OP_CALL_METHOD] = &&L_OP_CALL_METHOD,
+        [OP_HALT] = &&L_OP_HALT,
+    };
+#endif
+
     while (1) {
-        Instruction instr = vm->bytecode->instructions[vm->ip++];
-        if (VM_DEBUG > 1) {
-            printf("Executing instruction at ip=%d: %s %d\n", vm->ip - 1, get_opcode_name(instr.opcode), instr.operand);
-        }
-        switch (instr.opcode) {
-            case OP_CONST: op_const_to_stack(vm, instr.operand); break;
-            case OP_POP: vm_pop(vm); break;
-            case OP_ADD: op_add(vm); break;
-            case OP_SUB: op_sub(vm); break;
-            case OP_MUL: op_mul(vm); break;
-            case OP_DIV: op_div(vm); break;
-            case OP_STORE: op_store_global(vm, instr.operand); break;
-            case OP_LOAD: op_load_global(vm, instr.operand); break;
-            case OP_JUMP_IF_ZERO: op_jump_if_zero(vm, instr.operand); break;
-            case OP_EQ: op_equal(vm); break;
-            case OP_LT: op_less_than(vm); break;
-            case OP_GT: op_greater_than(vm); break;
-            case OP_LE: op_less_equal(vm); break;
-            case OP_GE: op_greater_equal(vm); break;
-            case OP_NE: op_not_equal(vm); break;
-            case OP_JUMP: vm->ip = instr.operand; break;
-            case OP_NOP: break;
-            case OP_CALL: op_call(vm, instr.operand); break;
-            case OP_RET: op_return(vm); break;
-            case OP_IDX_GET: op_index_get(vm); break;
-            case OP_IDX_SET: op_index_set(vm); break;
-            case OP_MAKE_CLASS: op_make_class(vm, instr.operand); break;
-            case OP_MAKE_INSTANCE: op_make_instance(vm); break;
-            case OP_GET_ATTR: op_get_attr(vm, instr.operand); break;
-            case OP_SET_ATTR: op_set_attr(vm, instr.operand); break;
-            case OP_CALL_METHOD: op_call_method(vm, instr.operand); break;
-            case OP_HALT: return;
+        VM_FETCH();
+        VM_SWITCH(instr.opcode) {
+            VM_CASE(OP_CONST): {
+                *sp++ = constants[instr.operand];
+                VM_NEXT();
+            }
+            VM_CASE(OP_POP): {
+                sp--;
+                VM_NEXT();
+            }
+            VM_CASE(OP_GET_ITER): VM_OUT(op_get_iter(vm)); VM_NEXT();
+            VM_CASE(OP_FOR_ITER): {
+                // Iterator stays on the stack for the whole loop; lists and
+                // tuples step inline, other iterables go through op_for_iter
+                ObjIterator* iterator = (ObjIterator*)AS_OBJ(sp[-1]);
+                Obj* iterable = AS_OBJ(iterator->iterable);
+                if (iterable->type == OBJ_LIST) {
+                    ObjList* list = (ObjList*)iterable;
+                    if (iterator->index < list->count) {
+                        *sp++ = list->items[iterator->index++];
+                    } else {
+                        pc = code + instr.operand;
+                    }
+                    VM_NEXT();
+                }
+                if (iterable->type == OBJ_TUPLE) {
+                    ObjTuple* tuple = (ObjTuple*)iterable;
+                    if (iterator->index < tuple->count) {
+                        *sp++ = tuple->items[iterator->index++];
+                    } else {
+                        pc = code + instr.operand;
+                    }
+                    VM_NEXT();
+                }
+                VM_OUT(op_for_iter(vm, instr.operand));
+                VM_NEXT();
+            }
+            VM_CASE(OP_FOR_RANGE_PREP): VM_OUT(op_for_range_prep(vm, instr.operand)); VM_NEXT();
+            VM_CASE(OP_FOR_RANGE): {
+                // [counter, stop, step], see op_for_range for the iterator form
+                Value* state = sp - 3;
+                if (IS_INT(state[0])) {
+                    long current = AS_INT(state[0]);
+                    long step = AS_INT(state[2]);
+                    if (step > 0 ? current < AS_INT(state[1]) : current > AS_INT(state[1])) {
+                        state[0] = INT_VAL(current + step);
+                        *sp++ = INT_VAL(current);
+                    } else {
+                        pc = code + instr.operand;
+                    }
+                    VM_NEXT();
+                }
+                VM_OUT(op_for_range(vm, instr.operand));
+                VM_NEXT();
+            }
+            VM_CASE(OP_ADD): VM_OUT(op_add(vm)); VM_NEXT();
+            VM_CASE(OP_SUB): VM_OUT(op_sub(vm)); VM_NEXT();
+            VM_CASE(OP_MUL): VM_OUT(op_mul(vm)); VM_NEXT();
+            VM_CASE(OP_DIV): VM_OUT(op_div(vm)); VM_NEXT();
+            VM_CASE(OP_NEG): VM_OUT(op_neg(vm)); VM_NEXT();
+            VM_CASE(OP_NOT): {
+                sp[-1] = BOOL_VAL(!is_true(sp[-1]));
+                VM_NEXT();
+            }
 
-            default:
+            VM_QUICK_OPS(VM_QUICK_BINARY)
+            VM_QUICK_OPS(VM_STATIC_BINARY)
+
+            VM_CASE(OP_STORE): VM_OUT(op_store_name(vm, instr.operand)); VM_NEXT();
+            VM_CASE(OP_LOAD): VM_OUT(op_load_name(vm, instr.operand)); VM_NEXT();
+            VM_CASE(OP_LOAD_GLOBAL): *sp++ = globals[instr.operand]; VM_NEXT();
+            VM_CASE(OP_STORE_GLOBAL): globals[instr.operand] = *--sp; VM_NEXT();
+            VM_CASE(OP_LOAD_LOCAL): *sp++ = locals[instr.operand]; VM_NEXT();
+            VM_CASE(OP_STORE_LOCAL): locals[instr.operand] = *--sp; VM_NEXT();
+            VM_CASE(OP_JUMP_IF_ZERO): {
+                Value condition = *--sp;
+                if (IS_BOOL(condition) ? !AS_BOOL(condition) : !is_true(condition)) {
+                    pc = code + instr.operand;
+                }
+                VM_NEXT();
+            }
+            VM_COMPARE_JUMP(OP_EQ_JUMP_IF_FALSE, OP_EQ, ==)
+            VM_COMPARE_JUMP(OP_NE_JUMP_IF_FALSE, OP_NE, !=)
+            VM_COMPARE_JUMP(OP_LT_JUMP_IF_FALSE, OP_LT, <)
+            VM_COMPARE_JUMP(OP_GT_JUMP_IF_FALSE, OP_GT, >)
+            VM_COMPARE_JUMP(OP_LE_JUMP_IF_FALSE, OP_LE, <=)
+            VM_COMPARE_JUMP(OP_GE_JUMP_IF_FALSE, OP_GE, >=)
+            VM_CASE(OP_INC_LOCAL): {
+                Value* slot = &locals[SUPER_SLOT(instr.operand)];
+                Value k = constants[SUPER_CONST(instr.operand)];
+                if (IS_INT(*slot) && IS_INT(k)) {
+                    *slot = INT_VAL((int)(AS_INT(*slot) + AS_INT(k)));
+                    VM_NEXT();
+                }
+                VM_OUT(op_increment(vm, &vm->stack[vm->fp + SUPER_SLOT(instr.operand)], instr.operand, RETURN_STORE_LOCAL));
+                VM_NEXT();
+            }
+            VM_CASE(OP_INC_GLOBAL): {
+                Value* slot = &globals[SUPER_SLOT(instr.operand)];
+                Value k = constants[SUPER_CONST(instr.operand)];
+                if (IS_INT(*slot) && IS_INT(k)) {
+                    *slot = INT_VAL((int)(AS_INT(*slot) + AS_INT(k)));
+                    VM_NEXT();
+                }
+                VM_OUT(op_increment(vm, slot, instr.operand, RETURN_STORE_GLOBAL));
+                VM_NEXT();
+            }
+            VM_CASE(OP_ADD_CONST): {
+                Value k = constants[instr.operand];
+                if (IS_INT(sp[-1]) && IS_INT(k)) {
+                    sp[-1] = INT_VAL((int)(AS_INT(sp[-1]) + AS_INT(k)));
+                    VM_NEXT();
+                }
+                VM_OUT(op_add_const(vm, instr.operand));
+                VM_NEXT();
+            }
+            VM_CASE(OP_EQ): VM_OUT(op_compare(vm, OP_EQ)); VM_NEXT();
+            VM_CASE(OP_LT): VM_OUT(op_compare(vm, OP_LT)); VM_NEXT();
+            VM_CASE(OP_GT): VM_OUT(op_compare(vm, OP_GT)); VM_NEXT();
+            VM_CASE(OP_LE): VM_OUT(op_compare(vm, OP_LE)); VM_NEXT();
+            VM_CASE(OP_GE): VM_OUT(op_compare(vm, OP_GE)); VM_NEXT();
+            VM_CASE(OP_NE): VM_OUT(op_compare(vm, OP_NE)); VM_NEXT();
+            VM_CASE(OP_JUMP): {
+                int jump_ip = (int)(pc - code) - 1;
+                pc = code + instr.operand;
+#if VM_JIT_SUPPORTED
+                // Backward jumps close loops, the tracing tier counts them
+                if (vm->jit && instr.operand <= jump_ip) {
+                    VM_OUT(jit_loop_edge(vm, jump_ip));
+                }
+#endif
+                VM_NEXT();
+            }
+            VM_CASE(OP_NOP): VM_NEXT();
+            VM_CASE(OP_CALL): VM_OUT(op_call(vm, instr.operand); VM_ENTER_JIT()); VM_NEXT();
+            VM_CASE(OP_TAIL_CALL): VM_OUT(op_tail_call(vm, instr.operand); VM_ENTER_JIT()); VM_NEXT();
+            VM_CASE(OP_RET): VM_OUT(op_return(vm); VM_ENTER_JIT()); VM_NEXT();
+            VM_CASE(OP_IDX_GET): VM_OUT(op_index_get(vm)); VM_NEXT();
+            VM_CASE(OP_IDX_SET): VM_OUT(op_index_set(vm)); VM_NEXT();
+            VM_CASE(OP_MAKE_CLASS): VM_OUT(op_make_class(vm, instr.operand)); VM_NEXT();
+            VM_CASE(OP_MAKE_INSTANCE): VM_OUT(op_make_instance(vm)); VM_NEXT();
+            VM_CASE(OP_GET_ATTR): VM_OUT(op_get_attr(vm, instr.operand)); VM_NEXT();
+            VM_CASE(OP_SET_ATTR): VM_OUT(op_set_attr(vm, instr.operand)); VM_NEXT();
+            VM_CASE(OP_CALL_METHOD): VM_OUT(op_call_method(vm, instr.operand); VM_ENTER_JIT()); VM_NEXT();
+            VM_CASE(OP_HALT): VM_SAVE(); return;
+
+            VM_DEFAULT:
                 printf("VM: Unknown opcode %d\n", instr.opcode);
                 exit(1);
         }
@@ -124,24 +561,190 @@ void vm_run(VM* vm)
 
 void vm_init(VM* vm, Bytecode* bytecode) {
     vm->bytecode = bytecode;
+    vm->stack = malloc(sizeof(Value) * VM_STACK_INITIAL);
+    vm->stack_capacity = VM_STACK_INITIAL;
     vm->sp = 0;
     vm->ip = 0;
+    vm->fp = 0;
+    vm->call_stack = malloc(sizeof(CallFrame) * VM_CALL_STACK_INITIAL);
     vm->frame_count = 0;
-    Scope* global_scope = new_scope("Global", NULL);
-    vm->scope = global_scope;
+    vm->frame_capacity = VM_CALL_STACK_INITIAL;
+    vm->scope = NULL;
     hash_init(&vm->strings, 1024);
+    vm->interned_const_count = 0;
+
+    vm->globals = NULL;
+    vm->global_count = 0;
+    vm->global_capacity = 0;
+    hash_init(&vm->global_slots, 64);
+    hash_init(&vm->named_globals, 64);
+
+    vm->jit = NULL;
+    vm->jit_entries = NULL;
+    vm->jit_entry_count = 0;
+
+    vm->cache_sites = NULL;
+    vm->cache_site_count = 0;
+    vm->caches = NULL;
+    vm->cache_count = 0;
+    vm->cache_capacity = 0;
+    vm->class_epoch = 0;
+    vm->cache_misses = 0;
+    vm->quickened_sites = 0;
+    vm->deoptimized_sites = 0;
+    vm_init_shapes(vm);
 
     #if VM_USE_GC
     vm->objects = NULL;
     vm->bytes_allocated = 0;
     vm->next_gc = 1024 * 8; // 8KB initial threshold
     #endif
+
+    for (int i = 0; i < SPECIAL_COUNT; i++) {
+        vm->special_names[i] = intern_const_string(vm, special_method_names[i], strlen(special_method_names[i]));
+    }
+    // There are no exceptions: __next__ returns this class to end a loop.
+    // Registered before the globals are linked, so its slot starts with it.
+    ObjString* stop_name = intern_const_string(vm, "StopIteration", 13);
+    vm->stop_iteration = make_none(); // Marked by a collection during the allocation
+    vm->stop_iteration = vm_make_class(vm, stop_name->chars, NULL);
+    hash_set(&vm->named_globals, stop_name, vm->stop_iteration);
+
+    intern_constants(vm);
+    vm_link_globals(vm);
+    link_caches(vm);
+}
+
+// Release what the VM allocated, the bytecode stays with its owner
+void vm_free(VM* vm) {
+#if VM_USE_GC
+    // Nothing is marked, so the sweep frees every object
+    gc_sweep(vm);
+#endif
+    jit_free(vm);
+    free(vm->stack);
+    free(vm->call_stack);
+    free(vm->globals);
+    free(vm->jit_entries);
+    free(vm->cache_sites);
+    free(vm->caches);
+    hash_free(&vm->strings);
+    hash_free(&vm->global_slots);
+    hash_free(&vm->named_globals);
+    vm_free_shapes(vm);
+    vm->stack = NULL;
+    vm->call_stack = NULL;
+    vm->globals = NULL;
+    vm->jit_entries = NULL;
+    vm->cache_sites = NULL;
+    vm->caches = NULL;
+}
+
+// Make room for count more values above sp. The stack moves when it grows,
+// so no pointer into it may be held across a call to this.
+void vm_reserve_stack(VM* vm, int count) {
+    if (vm->sp + count <= vm->stack_capacity) {
+        return;
+    }
+    if (vm->sp + count > VM_STACK_MAX) {
+        printf("Stack overflow at ip=%d, %d values > %d\n", vm->ip - 1, vm->sp + count, VM_STACK_MAX);
+        exit(1);
+    }
+    int capacity = vm->stack_capacity;
+    while (capacity < vm->sp + count) {
+        capacity *= 2;
+    }
+    vm->stack_capacity = capacity < VM_STACK_MAX ? capacity : VM_STACK_MAX;
+    vm->stack = realloc(vm->stack, sizeof(Value) * vm->stack_capacity);
+}
+
+void vm_link_globals(VM* vm) {
+    Bytecode* bytecode = vm->bytecode;
+    if (bytecode->global_count > vm->global_capacity) {
+        vm->global_capacity = bytecode->global_count * 2;
+        vm->globals = realloc(vm->globals, sizeof(Value) * vm->global_capacity);
+    }
+
+    for (int i = vm->global_count; i < bytecode->global_count; i++) {
+        ObjString* name = as_string(bytecode->constants[bytecode->globals[i]]);
+        // Natives registered earlier (and names stored before the slot
+        // existed) seed the slot, everything else starts as None
+        Value value;
+        if (!hash_get(&vm->named_globals, name, &value)) {
+            value = make_none();
+        }
+        vm->globals[i] = value;
+        hash_set(&vm->global_slots, name, make_number_int(i));
+    }
+    vm->global_count = bytecode->global_count;
+}
+
+// Give every attribute and method site added to the bytecode since the
+// last call its own empty inline cache
+static void link_caches(VM* vm) {
+    Bytecode* bytecode = vm->bytecode;
+    vm->cache_sites = realloc(vm->cache_sites, sizeof(int) * bytecode->count);
+    for (int ip = vm->cache_site_count; ip < bytecode->count; ip++) {
+        Opcode op = bytecode->instructions[ip].opcode;
+        if (op != OP_GET_ATTR && op != OP_SET_ATTR && op != OP_CALL_METHOD) {
+            vm->cache_sites[ip] = -1;
+            continue;
+        }
+        if (vm->cache_count >= vm->cache_capacity) {
+            vm->cache_capacity = vm->cache_capacity ? vm->cache_capacity * 2 : 16;
+            vm->caches = realloc(vm->caches, sizeof(InlineCache) * vm->cache_capacity);
+        }
+        vm->caches[vm->cache_count].epoch = vm->class_epoch;
+        vm->caches[vm->cache_count].count = 0;
+        vm->cache_sites[ip] = vm->cache_count++;
+    }
+    vm->cache_site_count = bytecode->count;
+}
+
+Value vm_get_name(VM* vm, ObjString* name) {
+    Value value;
+    for (Scope* scope = vm->scope; scope; scope = scope->parent) {
+        if (hash_get(scope->vars, name, &value)) {
+            return value;
+        }
+    }
+    if (hash_get(&vm->global_slots, name, &value)) {
+        return vm->globals[AS_INT(value)];
+    }
+    if (hash_get(&vm->named_globals, name, &value)) {
+        return value;
+    }
+    return make_none();
+}
+
+void vm_set_name(VM* vm, ObjString* name, Value value) {
+    if (vm->scope) {
+        scope_set(vm->scope, name, value);
+        return;
+    }
+    Value slot;
+    if (hash_get(&vm->global_slots, name, &slot)) {
+        vm->globals[AS_INT(slot)] = value;
+        return;
+    }
+    hash_set(&vm->named_globals, name, value);
 }
 
 void vm_register_native_functions(VM* vm, const char* name, NativeFn function) {
+    vm_register_special_native(vm, name, function, -1);
+}
+
+void vm_register_special_native(VM* vm, const char* name, NativeFn function, SpecialMethod special) {
     Value native_fn_val = make_native_function(name, function);
+    ((ObjNativeFunction*)AS_OBJ(native_fn_val))->special = special;
     ObjString* name_str = intern_const_string(vm, name, strlen(name));
-    scope_set(vm->scope, name_str, native_fn_val);
+    hash_set(&vm->named_globals, name_str, native_fn_val);
+
+    // Patch the slot directly if the bytecode already refers to this name
+    Value slot;
+    if (hash_get(&vm->global_slots, name_str, &slot)) {
+        vm->globals[AS_INT(slot)] = native_fn_val;
+    }
 }
 
 void vm_debug_scope(VM* vm) {
@@ -149,19 +752,21 @@ void vm_debug_scope(VM* vm) {
     Scope* scope = vm->scope;
     while (scope) {
         printf("Scope: %s\n", scope->name);
-        for (int i = 0; i < scope->vars->capacity; i++) {
-            HashNode* node = &scope->vars->nodes[i];
-            while (node != NULL) {
-                if (node->key != NULL) {
-                    printf("  %s: ", node->key->chars);
-                    print_value(node->value);
-                    printf("\n");
-                }
-                node = node->next;
-            }
+        for (int i = 0; i < scope->vars->count; i++) {
+            HashEntry* entry = &scope->vars->entries[i];
+            printf("  %s: ", entry->key->chars);
+            print_value(entry->value);
+            printf("\n");
         }
         scope = scope->parent;
     }
+    printf("Globals:\n");
+    for (int i = 0; i < vm->global_count; i++) {
+        ObjString* name = as_string(vm->bytecode->constants[vm->bytecode->globals[i]]);
+        printf("  [%d] %s: ", i, name->chars);
+        print_value(vm->globals[i]);
+        printf("\n");
+    }
 }
 
 void vm_debug_stack(VM* vm) {
@@ -173,23 +778,13 @@ void vm_debug_stack(VM* vm) {
     }
 }
 
+// Unchecked: bytecode_verify proved how deep each function's stack gets
+// and enter_function reserved that much, and that nothing pops below it
 void vm_push(VM* vm, Value value) {
-    if (vm->sp >= VM_STACK_SIZE - 1) {
-        printf("Stack overflow at ip=%d\n", vm->ip - 1);
-        printf("Current stack size: %d\n", vm->sp);
-        vm_debug_stack(vm);
-        exit(1);
-    }
     vm->stack[vm->sp++] = value;
 }
 
 Value vm_pop(VM* vm) {
-    if (vm->sp <= 0) {
-        printf("Stack underflow at ip=%d\n", vm->ip - 1);
-        printf("Current stack size: %d\n", vm->sp);
-        vm_debug_stack(vm);
-        exit(1);
-    }
     return vm->stack[--vm->sp];
 }
 
@@ -197,43 +792,126 @@ static Value vm_peek(VM* vm) {
     return vm->stack[vm->sp - 1];
 }
 
-static void op_const_to_stack(VM* vm, int operand) {
-    Value constant = vm->bytecode->constants[operand];
-    vm_push(vm, constant);
-}
-
 static Value vm_to_string(VM* vm, Value v) {
     if (is_obj_type(v, OBJ_STRING)) {
         return v;
-    } else if (v.type == VAL_INT) {
+    } else if (IS_INT(v)) {
         char buffer[32];
-        int len = snprintf(buffer, sizeof(buffer), "%ld", v.as.integer);
+        int len = snprintf(buffer, sizeof(buffer), "%ld", AS_INT(v));
         return vm_make_string(vm, buffer);
-    } else if (v.type == VAL_FLOAT) {
+    } else if (IS_FLOAT(v)) {
         char buffer[32];
-        int len = snprintf(buffer, sizeof(buffer), "%f", v.as.floating);
+        int len = snprintf(buffer, sizeof(buffer), "%f", AS_FLOAT(v));
         return vm_make_string(vm, buffer);
-    } else if (v.type == VAL_BOOL) {
-        return vm_make_string(vm, v.as.boolean ? "True" : "False");
-    } else if (v.type == VAL_NONE) {
+    } else if (IS_BOOL(v)) {
+        return vm_make_string(vm, AS_BOOL(v) ? "True" : "False");
+    } else if (IS_NONE(v)) {
         return vm_make_string(vm, "None");
     } else {
         return vm_make_string(vm, "<object>");
     }
 }
 
+// Rewrite the instruction being executed into its typed form, unless the
+// site already deoptimized once. Superinstructions share the generic
+// handlers on their slow path but keep their own opcode.
+static void quicken(VM* vm, Opcode specialized) {
+#if VM_USE_QUICKENING
+    Instruction* instr = &vm->bytecode->instructions[vm->ip - 1];
+    if (instr->operand == 0 && instr->opcode >= OP_ADD && instr->opcode <= OP_NE) {
+        instr->opcode = specialized;
+        vm->quickened_sites++;
+    }
+#endif
+}
+
+// A typed instruction saw other operand types, put the generic opcode back
+// for good
+static void deoptimize(VM* vm, Opcode generic) {
+    Instruction* instr = &vm->bytecode->instructions[vm->ip - 1];
+    // JIT code keeps its typed template after the bytecode went back,
+    // only count the site once
+    if (instr->opcode == generic) {
+        return;
+    }
+    instr->opcode = generic;
+    instr->operand = 1;
+    vm->deoptimized_sites++;
+}
+
+static int is_number(Value v) {
+    return IS_INT(v) || IS_FLOAT(v) || IS_BOOL(v);
+}
+
+static double as_double(Value v) {
+    if (IS_FLOAT(v)) return AS_FLOAT(v);
+    if (IS_BOOL(v)) return AS_BOOL(v);
+    return (double)AS_INT(v);
+}
+
+// Shared numeric path of ADD, SUB, MUL and DIV, returns 0 if either
+// operand is not a number
+static int arith_numbers(VM* vm, Value a, Value b, Opcode op, Value* result) {
+    if (IS_INT(a) && IS_INT(b)) {
+        long x = AS_INT(a);
+        long y = AS_INT(b);
+        switch (op) {
+            case OP_ADD: quicken(vm, OP_ADD_INT); *result = make_number_int(x + y); return 1;
+            case OP_SUB: quicken(vm, OP_SUB_INT); *result = make_number_int(x - y); return 1;
+            case OP_MUL: quicken(vm, OP_MUL_INT); *result = make_number_int(x * y); return 1;
+            default:
+                if (y == 0) {
+                    printf("Division by zero\n");
+                    exit(1);
+                }
+                *result = make_number_int(x / y);
+                return 1;
+        }
+    }
+    if ((!IS_INT(a) && !IS_FLOAT(a)) || (!IS_INT(b) && !IS_FLOAT(b))) {
+        return 0;
+    }
+    if (IS_FLOAT(a) && IS_FLOAT(b)) {
+        switch (op) {
+            case OP_ADD: quicken(vm, OP_ADD_FLOAT); break;
+            case OP_SUB: quicken(vm, OP_SUB_FLOAT); break;
+            case OP_MUL: quicken(vm, OP_MUL_FLOAT); break;
+            default:     quicken(vm, OP_DIV_FLOAT); break;
+        }
+    }
+    double x = as_double(a);
+    double y = as_double(b);
+    switch (op) {
+        case OP_ADD: *result = make_number_float(x + y); break;
+        case OP_SUB: *result = make_number_float(x - y); break;
+        case OP_MUL: *result = make_number_float(x * y); break;
+        default:     *result = make_number_float(x / y); break;
+    }
+    return 1;
+}
+
+// a + b and friends on an instance a: run a.__add__(b) and the like,
+// whose result the frame pushes in place of the operator's. Returns 0 if
+// a's class does not define the method.
+static int binary_special(VM* vm, Value a, Value b, SpecialMethod which) {
+    ObjFunction* fn = instance_special(vm, a, which);
+    if (!fn) {
+        return 0;
+    }
+    vm_push(vm, a);
+    vm_push(vm, b);
+    call_special(vm, fn, 2, RETURN_VALUE, 0);
+    return 1;
+}
+
 static void op_add(VM* vm) {
     Value b = vm_pop(vm);
     Value a = vm_pop(vm);
     Value result;
-    if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-        result = make_number_float(a.as.floating + b.as.floating);
-    } else if (a.type == VAL_FLOAT && b.type == VAL_INT) {
-        result = make_number_float(a.as.floating + b.as.integer);
-    } else if (a.type == VAL_INT && b.type == VAL_FLOAT) {
-        result = make_number_float(a.as.integer + b.as.floating);
-    } else if (a.type == VAL_INT && b.type == VAL_INT) {
-        result = make_number_int(a.as.integer + b.as.integer);
+    if (arith_numbers(vm, a, b, OP_ADD, &result)) {
+        // Numbers handled above
+    } else if (binary_special(vm, a, b, SPECIAL_ADD)) {
+        return;
     } else if (is_obj_type(a, OBJ_STRING) || is_obj_type(b, OBJ_STRING)) {
         ObjString* str_a = as_string(vm_to_string(vm, a));
         ObjString* str_b = as_string(vm_to_string(vm, b));
@@ -241,10 +919,11 @@ static void op_add(VM* vm) {
         char* ch = malloc(str_a->length + str_b->length + 1);
         memcpy(ch, str_a->chars, str_a->length);
         memcpy(ch + str_a->length, str_b->chars, str_b->length);
+        ch[str_a->length + str_b->length] = '\0';
         result = vm_make_string(vm, ch);
         free(ch);
     } else {
-        printf("Unsupported types for ADD operation: %d and %d\n", a.type, b.type);
+        printf("Unsupported types for ADD operation: %d and %d\n", VALUE_TYPE(a), VALUE_TYPE(b));
         exit(1);
     }
     vm_push(vm, result);
@@ -254,14 +933,12 @@ static void op_sub(VM* vm) {
     Value b = vm_pop(vm);
     Value a = vm_pop(vm);
     Value result;
-    if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-        result = make_number_float(a.as.floating - b.as.floating);
-    } else if (a.type == VAL_FLOAT && b.type == VAL_INT) {
-        result = make_number_float(a.as.floating - b.as.integer);
-    } else if (a.type == VAL_INT && b.type == VAL_FLOAT) {
-        result = make_number_float(a.as.integer - b.as.floating);
-    } else if (a.type == VAL_INT && b.type == VAL_INT) {
-        result = make_number_int(a.as.integer - b.as.integer);
+    if (!arith_numbers(vm, a, b, OP_SUB, &result)) {
+        if (binary_special(vm, a, b, SPECIAL_SUB)) {
+            return;
+        }
+        printf("Unsupported types for SUB operation: %d and %d\n", VALUE_TYPE(a), VALUE_TYPE(b));
+        exit(1);
     }
     vm_push(vm, result);
 }
@@ -270,14 +947,12 @@ static void op_mul(VM* vm) {
     Value b = vm_pop(vm);
     Value a = vm_pop(vm);
     Value result;
-    if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-        result = make_number_float(a.as.floating * b.as.floating);
-    } else if (a.type == VAL_FLOAT && b.type == VAL_INT) {
-        result = make_number_float(a.as.floating * b.as.integer);
-    } else if (a.type == VAL_INT && b.type == VAL_FLOAT) {
-        result = make_number_float(a.as.integer * b.as.floating);
-    } else if (a.type == VAL_INT && b.type == VAL_INT) {
-        result = make_number_int(a.as.integer * b.as.integer);
+    if (!arith_numbers(vm, a, b, OP_MUL, &result)) {
+        if (binary_special(vm, a, b, SPECIAL_MUL)) {
+            return;
+        }
+        printf("Unsupported types for MUL operation: %d and %d\n", VALUE_TYPE(a), VALUE_TYPE(b));
+        exit(1);
     }
     vm_push(vm, result);
 }
@@ -286,126 +961,224 @@ static void op_div(VM* vm) {
     Value b = vm_pop(vm);
     Value a = vm_pop(vm);
     Value result;
-    if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-        result = make_number_float(a.as.floating / b.as.floating);
-    } else if (a.type == VAL_FLOAT && b.type == VAL_INT) {
-        result = make_number_float(a.as.floating / b.as.integer);
-    } else if (a.type == VAL_INT && b.type == VAL_FLOAT) {
-        result = make_number_float(a.as.integer / b.as.floating);
-    } else if (a.type == VAL_INT && b.type == VAL_INT) {
-        result = make_number_int(a.as.integer / b.as.integer);
+    if (!arith_numbers(vm, a, b, OP_DIV, &result)) {
+        printf("Unsupported types for DIV operation: %d and %d\n", VALUE_TYPE(a), VALUE_TYPE(b));
+        exit(1);
     }
     vm_push(vm, result);
 }
 
-static void op_store_global(VM* vm, int operand) {
+static void op_neg(VM* vm) {
+    Value* v = &vm->stack[vm->sp - 1];
+    if (IS_INT(*v)) {
+        *v = make_number_int(-AS_INT(*v));
+    } else if (IS_FLOAT(*v)) {
+        *v = make_number_float(-AS_FLOAT(*v));
+    } else {
+        printf("Unsupported type for NEG operation: %d\n", VALUE_TYPE(*v));
+        exit(1);
+    }
+}
+
+static void op_store_name(VM* vm, int operand) {
     Value v = vm_pop(vm);
     Value name_val = vm->bytecode->constants[operand];
     if (!is_obj_type(name_val, OBJ_STRING)) {
-        printf("STORE_GLOBAL expects a string constant as variable name, but got type %d\n", name_val.type);
+        printf("STORE expects a string constant as variable name, but got type %d\n", VALUE_TYPE(name_val));
         exit(1);
     }
-    scope_set(vm->scope, as_string(name_val), v);
+    vm_set_name(vm, as_string(name_val), v);
 }
 
-static void op_load_global(VM* vm, int operand) {
+static void op_load_name(VM* vm, int operand) {
     Value name_val = vm->bytecode->constants[operand];
     if (!is_obj_type(name_val, OBJ_STRING)) {
-        printf("LOAD_GLOBAL expects a string constant as variable name, but got type %d\n", name_val.type);
+        printf("LOAD expects a string constant as variable name, but got type %d\n", VALUE_TYPE(name_val));
         exit(1);
     }
-    Value value = scope_find(vm->scope, as_string(name_val));
+    Value value = vm_get_name(vm, as_string(name_val));
     vm_push(vm, value);
 }
 
-static void op_jump_if_zero(VM* vm, int operand) {
-    Value cond = vm_pop(vm);
-    if (!is_true(cond)) {
-        vm->ip = operand;
+// EQ/NE/LT/GT with an instance operand: a.__eq__(b), or b.__eq__(a) when
+// a's class has none, negated for NE; a.__lt__(b), and b.__lt__(a) for
+// a > b. Returns 0 if no such method applies.
+static int compare_special(VM* vm, Value a, Value b, Opcode op) {
+    ObjFunction* fn = NULL;
+    Value self = a;
+    Value other = b;
+    if (op == OP_EQ || op == OP_NE) {
+        fn = instance_special(vm, a, SPECIAL_EQ);
+        if (!fn && (fn = instance_special(vm, b, SPECIAL_EQ))) {
+            self = b;
+            other = a;
+        }
+    } else if (op == OP_LT) {
+        fn = instance_special(vm, a, SPECIAL_LT);
+    } else if (op == OP_GT) {
+        fn = instance_special(vm, b, SPECIAL_LT);
+        self = b;
+        other = a;
     }
+    if (!fn) {
+        return 0;
+    }
+    vm_push(vm, self);
+    vm_push(vm, other);
+    call_special(vm, fn, 2, op == OP_NE ? RETURN_NOT : RETURN_VALUE, 0);
+    return 1;
 }
 
-static void op_equal(VM* vm) {
+// Generic EQ/NE/LT/GT/LE/GE: ints compare as ints, other numbers as
+// doubles, strings by contents, instances through compare_special, anything
+// else only by identity for EQ/NE
+static void op_compare(VM* vm, Opcode op) {
     Value b = vm_pop(vm);
     Value a = vm_pop(vm);
-    Value result = make_bool(a.as.floating == b.as.floating);
-    vm_push(vm, result);
-}
+    int cmp; // <0, 0 or >0, like strcmp
 
-static void op_less_than(VM* vm) {
-    Value b = vm_pop(vm);
-    Value a = vm_pop(vm);
-    Value result = make_bool(a.as.floating < b.as.floating);
-    vm_push(vm, result);
-}
+    if (IS_INT(a) && IS_INT(b)) {
+        switch (op) {
+            case OP_EQ: quicken(vm, OP_EQ_INT); break;
+            case OP_NE: quicken(vm, OP_NE_INT); break;
+            case OP_LT: quicken(vm, OP_LT_INT); break;
+            case OP_GT: quicken(vm, OP_GT_INT); break;
+            case OP_LE: quicken(vm, OP_LE_INT); break;
+            default:    quicken(vm, OP_GE_INT); break;
+        }
+        cmp = (AS_INT(a) > AS_INT(b)) - (AS_INT(a) < AS_INT(b));
+    } else if (is_number(a) && is_number(b)) {
+        if (IS_FLOAT(a) && IS_FLOAT(b)) {
+            switch (op) {
+                case OP_LT: quicken(vm, OP_LT_FLOAT); break;
+                case OP_GT: quicken(vm, OP_GT_FLOAT); break;
+                case OP_LE: quicken(vm, OP_LE_FLOAT); break;
+                case OP_GE: quicken(vm, OP_GE_FLOAT); break;
+                default: break;
+            }
+        }
+        double x = as_double(a);
+        double y = as_double(b);
+        if (x != x || y != y) {
+            // NaN is unordered and unequal to everything
+            vm_push(vm, make_bool(op == OP_NE));
+            return;
+        }
+        cmp = (x > y) - (x < y);
+    } else if (is_obj_type(a, OBJ_STRING) && is_obj_type(b, OBJ_STRING)) {
+        cmp = AS_OBJ(a) == AS_OBJ(b) ? 0 : strcmp(as_string(a)->chars, as_string(b)->chars);
+    } else if (compare_special(vm, a, b, op)) {
+        return;
+    } else if (op == OP_EQ || op == OP_NE) {
+        int equal = (IS_OBJ(a) && IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b)) ||
+                    value_equals(&a, &b);
+        vm_push(vm, make_bool(op == OP_EQ ? equal : !equal));
+        return;
+    } else {
+        printf("Unsupported types for comparison: %d and %d\n", VALUE_TYPE(a), VALUE_TYPE(b));
+        exit(1);
+    }
 
-static void op_greater_than(VM* vm) {
-    Value b = vm_pop(vm);
-    Value a = vm_pop(vm);
-    Value result = make_bool(a.as.floating > b.as.floating);
-    vm_push(vm, result);
+    int result;
+    switch (op) {
+        case OP_EQ: result = cmp == 0; break;
+        case OP_NE: result = cmp != 0; break;
+        case OP_LT: result = cmp < 0; break;
+        case OP_GT: result = cmp > 0; break;
+        case OP_LE: result = cmp <= 0; break;
+        default:    result = cmp >= 0; break;
+    }
+    vm_push(vm, make_bool(result));
 }
 
-static void op_less_equal(VM* vm) 
-{
-    Value b = vm_pop(vm);
-    Value a = vm_pop(vm);
-    Value result = make_bool(a.as.floating <= b.as.floating);
-    vm_push(vm, result);
+// Start running fn in the current frame, its argc arguments at stack index
+// base and on top of the stack. Slotted functions keep the arguments in
+// place as locals 0..argc-1 and reserve the remaining local slots above
+// them; scope-based functions bind them by name in a fresh Scope. Either
+// way the stack gets room for the deepest point of the body here, the
+// only capacity check the frame needs.
+static void enter_function(VM* vm, ObjFunction* fn, int base, int argc) {
+    if (fn->uses_scope) {
+        Scope* scope = new_scope(fn->name, vm->scope);
+        for (int i = 0; i < argc; i++) {
+            ObjString* param_name = intern_const_string(vm, fn->params[i], strlen(fn->params[i]));
+            scope_set(scope, param_name, vm->stack[base + i]);
+        }
+        vm->sp = base;
+        vm->scope = scope;
+        vm_reserve_stack(vm, fn->max_stack);
+    } else {
+        vm->fp = base;
+        vm_reserve_stack(vm, fn->local_count - argc + fn->max_stack);
+        for (int i = argc; i < fn->local_count; i++) {
+            vm_push(vm, make_none());
+        }
+    }
+    vm->ip = fn->addr;
+
+#if VM_JIT_SUPPORTED
+    if (vm->jit && ++fn->call_count == VM_JIT_THRESHOLD) {
+        jit_compile(vm, fn);
+    }
+#endif
 }
 
-static void op_greater_equal(VM* vm) 
-{
-    Value b = vm_pop(vm);
-    Value a = vm_pop(vm);
-    Value result = make_bool(a.as.floating >= b.as.floating);
-    vm_push(vm, result);
+// Enter a bytecode function whose arguments are the top argc stack values
+static void push_frame(VM* vm, ObjFunction* fn, int argc, Value init_instance) {
+    if (vm->frame_count >= vm->frame_capacity) {
+        if (vm->frame_capacity >= VM_CALL_STACK_MAX) {
+            printf("Call stack overflow, %d > %d\n", vm->frame_count, VM_CALL_STACK_MAX);
+            exit(1);
+        }
+        vm->frame_capacity = vm->frame_capacity * 2 < VM_CALL_STACK_MAX ? vm->frame_capacity * 2 : VM_CALL_STACK_MAX;
+        vm->call_stack = realloc(vm->call_stack, sizeof(CallFrame) * vm->frame_capacity);
+    }
+
+    CallFrame* frame = &vm->call_stack[vm->frame_count++];
+    frame->return_address = vm->ip;
+    frame->base_sp = vm->sp - argc;
+    frame->fp = vm->fp;
+    frame->scope = vm->scope;
+    frame->init_instance = init_instance;
+    frame->on_return = RETURN_VALUE;
+    frame->target = 0;
+    enter_function(vm, fn, frame->base_sp, argc);
 }
 
-static void op_not_equal(VM* vm){
-    Value b = vm_pop(vm);
-    Value a = vm_pop(vm);
-    Value result = make_bool(a.as.floating != b.as.floating);
-    vm_push(vm, result);
+// Run a special method in place of the instruction before vm->ip, its
+// argc arguments, self first, on top of the stack. The frame returns
+// through action, see ReturnAction.
+static void call_special(VM* vm, ObjFunction* fn, int argc, ReturnAction action, int target) {
+    if (fn->param_count != argc) {
+        printf("Method '%s' expects %d arguments but got %d\n", fn->name, fn->param_count - 1, argc - 1);
+        exit(1);
+    }
+    push_frame(vm, fn, argc, make_none());
+    CallFrame* frame = &vm->call_stack[vm->frame_count - 1];
+    frame->on_return = action;
+    frame->target = target;
 }
 
 static void op_call(VM* vm, int operand) 
 {
     Value func_val = vm_pop(vm);
-    if (func_val.type != VAL_OBJ) {
-        printf("Attempted to call a non-function value. Type: %d\n", func_val.type);
-        exit(1);
-    }
-    if (vm->frame_count >= VM_CALL_STACK_SIZE) {
-        printf("Call stack overflow, %d > %d\n", vm->frame_count, VM_CALL_STACK_SIZE);
+    if (!IS_OBJ(func_val)) {
+        printf("Attempted to call a non-function value. Type: %d\n", VALUE_TYPE(func_val));
         exit(1);
     }
 
     // Handle class instantiation
-    if (func_val.as.object->type == OBJ_CLASS) {
-        ObjClass* klass = (ObjClass*)func_val.as.object;
+    if (AS_OBJ(func_val)->type == OBJ_CLASS) {
+        ObjClass* klass = (ObjClass*)AS_OBJ(func_val);
         
         // Create instance
         Value instance_val = vm_make_instance(vm, klass);
         
-        // Look for __init__ method in class and parent classes
-        ObjString* init_name = intern_const_string(vm, "__init__", 8);
-        Value init_method;
-        int has_init = hash_get(klass->methods, init_name, &init_method);
-        
-        // If not found in current class, search parent classes
-        if (!has_init) {
-            ObjClass* parent = klass->parent;
-            while (parent && !has_init) {
-                has_init = hash_get(parent->methods, init_name, &init_method);
-                if (has_init) break;
-                parent = parent->parent;
-            }
-        }
+        // __init__ of the class or its nearest parent that has one
+        ObjFunction* init_fn = class_special(vm, klass, SPECIAL_INIT);
         
-        if (has_init && is_obj_type(init_method, OBJ_FUNCTION)) {
+        if (init_fn) {
             // Call __init__ with instance as first argument
-            ObjFunction* init_fn = (ObjFunction*)init_method.as.object;
             
             // Check parameter count
             if (init_fn->param_count != operand + 1) { // +1 for self
@@ -414,32 +1187,15 @@ static void op_call(VM* vm, int operand)
                 exit(1);
             }
             
-            // Create scope for __init__
-            Scope* init_scope = new_scope("__init__", init_fn->scope ? init_fn->scope : vm->scope);
-            
-            // Bind self
-            ObjString* self_param = intern_const_string(vm, init_fn->params[0], strlen(init_fn->params[0]));
-            scope_set(init_scope, self_param, instance_val);
-            
-            // Bind other parameters
-            for (int i = init_fn->param_count - 1; i > 0; i--) {
-                Value arg_val = vm_pop(vm);
-                const char* param_name = init_fn->params[i];
-                ObjString* param_name_str = intern_const_string(vm, param_name, strlen(param_name));
-                scope_set(init_scope, param_name_str, arg_val);
+            // Slide the arguments up to make room for self below them
+            vm_push(vm, make_none());
+            for (int i = vm->sp - 1; i > vm->sp - 1 - operand; i--) {
+                vm->stack[i] = vm->stack[i - 1];
             }
-            
-            // Create call frame
-            CallFrame* frame = &vm->call_stack[vm->frame_count++];
-            frame->return_address = vm->ip;
-            frame->scope = vm->scope;
-            frame->base_sp = vm->sp;
-            
-            vm->scope = init_scope;
-            vm->ip = init_fn->addr;
-            
-            // Store instance to return after __init__ completes
-            vm->scope->return_value = instance_val;
+            vm->stack[vm->sp - 1 - operand] = instance_val;
+
+            // The frame returns the instance after __init__ completes
+            push_frame(vm, init_fn, operand + 1, instance_val);
         } else {
             // No __init__, just return the instance
             // Pop any arguments that were pushed
@@ -451,34 +1207,67 @@ static void op_call(VM* vm, int operand)
         return;
     }
 
-    if (func_val.as.object->type == OBJ_NATIVE_FUNCTION) {
-        ObjNativeFunction* native_fn = (ObjNativeFunction*)func_val.as.object;
-        // For simplicity, assume no arguments for native functions
+    if (AS_OBJ(func_val)->type == OBJ_NATIVE_FUNCTION) {
+        ObjNativeFunction* native_fn = (ObjNativeFunction*)AS_OBJ(func_val);
+        if (native_fn->special >= 0 && operand == 1) {
+            // len(v) and the like become v.__len__()
+            ObjFunction* fn = instance_special(vm, vm->stack[vm->sp - 1], native_fn->special);
+            if (fn) {
+                call_special(vm, fn, 1, RETURN_VALUE, 0);
+                return;
+            }
+        }
+        // Arguments stay on the stack (and reachable by the GC) during the
+        // call; the caller pops them and pushes the result
         int arg_count = operand;
         Value result = native_fn->function(arg_count, &vm->stack[vm->sp - arg_count], vm);
+        vm->sp -= arg_count;
         vm_push(vm, result);
         return;
     }
 
-    ObjFunction* fn = (ObjFunction*)func_val.as.object;
-    Scope* scope= new_scope(fn->name, fn->scope ? fn->scope : vm->scope);
-
-    for (int i = fn->param_count - 1; i >= 0; i--) {
-        Value arg_val = vm_pop(vm);
-        const char* param_name = fn->params[i];
-        ObjString* param_name_str = intern_const_string(vm, param_name, strlen(param_name));
-        scope_set(scope, param_name_str, arg_val);
+    if (AS_OBJ(func_val)->type != OBJ_FUNCTION) {
+        printf("Attempted to call a non-function object. Type: %d\n", AS_OBJ(func_val)->type);
+        exit(1);
     }
+    ObjFunction* fn = (ObjFunction*)AS_OBJ(func_val);
+    if (fn->param_count != operand) {
+        printf("Function '%s' expects %d arguments but got %d\n", fn->name, fn->param_count, operand);
+        exit(1);
+    }
+    push_frame(vm, fn, operand, make_none());
+}
 
-    CallFrame* frame = &vm->call_stack[vm->frame_count++];
-    frame->return_address = vm->ip;
-    frame->scope = vm->scope;
-    frame->base_sp = vm->sp;
-
-    vm->scope = scope;
-    vm->ip = fn->addr;
+// Call whose result the running function returns. A slotted function
+// calling a slotted function hands its frame over: the arguments replace
+// its locals and the callee returns straight to the caller's caller, so
+// self and mutual tail recursion run in constant stack space. Any other
+// call is a plain CALL and the RET after this instruction returns its
+// result.
+static void op_tail_call(VM* vm, int operand) {
+    Value func_val = vm->stack[vm->sp - 1];
+    if (vm->frame_count == 0 || !is_obj_type(func_val, OBJ_FUNCTION)) {
+        op_call(vm, operand);
+        return;
+    }
+    ObjFunction* fn = (ObjFunction*)AS_OBJ(func_val);
+    CallFrame* frame = &vm->call_stack[vm->frame_count - 1];
+    // A scope-based function runs with its own Scope, the callee would
+    // have it as its parent
+    if (fn->uses_scope || vm->scope != frame->scope || fn->param_count != operand) {
+        op_call(vm, operand);
+        return;
+    }
+    int args = vm->sp - 1 - operand;
+    for (int i = 0; i < operand; i++) {
+        vm->stack[frame->base_sp + i] = vm->stack[args + i];
+    }
+    vm->sp = frame->base_sp + operand;
+    enter_function(vm, fn, frame->base_sp, operand);
 }
 
+static Value wrap_iterator(VM* vm, Value iterable);
+
 void op_return(VM* vm) {
     if (vm->frame_count <= 0) {
         printf("Call stack underflow\n");
@@ -490,19 +1279,48 @@ void op_return(VM* vm) {
     
     // Check if this is returning from __init__
     // In that case, return the instance instead of None
-    if (vm->scope->return_value.type != VAL_NONE) {
-        ret_val = vm->scope->return_value;
+    if (!IS_NONE(frame->init_instance)) {
+        ret_val = frame->init_instance;
     }
     
-    if (vm->scope != frame->scope && frame->scope != NULL) {
-        // Free current scope
-        // free_scope(vm->scope);
-        // Restore previous frame state
-        vm->scope = frame->scope;
-    }
+    // Restore previous frame state
+    vm->scope = frame->scope;
     vm->sp = frame->base_sp;
+    vm->fp = frame->fp;
     vm->ip = frame->return_address;
-    vm_push(vm, ret_val);
+
+    switch (frame->on_return) {
+        case RETURN_VALUE:
+            vm_push(vm, ret_val);
+            break;
+        case RETURN_NOT:
+            vm_push(vm, make_bool(!is_true(ret_val)));
+            break;
+        case RETURN_JUMP_IF_FALSE:
+            if (!is_true(ret_val)) vm->ip = frame->target;
+            break;
+        case RETURN_JUMP_IF_TRUE:
+            if (is_true(ret_val)) vm->ip = frame->target;
+            break;
+        case RETURN_STORE_LOCAL:
+            vm->stack[vm->fp + frame->target] = ret_val;
+            break;
+        case RETURN_STORE_GLOBAL:
+            vm->globals[frame->target] = ret_val;
+            break;
+        case RETURN_ITER:
+            // On the stack while the iterator is allocated
+            vm_push(vm, ret_val);
+            vm->stack[vm->sp - 1] = wrap_iterator(vm, ret_val);
+            break;
+        case RETURN_NEXT:
+            if (IS_OBJ(ret_val) && AS_OBJ(ret_val) == AS_OBJ(vm->stop_iteration)) {
+                vm->ip = frame->target;
+            } else {
+                vm_push(vm, ret_val);
+            }
+            break;
+    }
 }
 
 static void op_index_get(VM* vm) {
@@ -510,8 +1328,8 @@ static void op_index_get(VM* vm) {
     Value list_val = vm_pop(vm);
     if (is_obj_type(list_val, OBJ_LIST)) {
 
-        ObjList* list = (ObjList*)list_val.as.object;
-        int index = (int)index_val.as.integer;
+        ObjList* list = (ObjList*)AS_OBJ(list_val);
+        int index = (int)AS_INT(index_val);
         if (index < 0 || index >= list->count) {
             printf("LIST_GET index out of bounds. Index: %d, List count: %d\n", index, list->count);
             exit(1);
@@ -522,8 +1340,8 @@ static void op_index_get(VM* vm) {
     }
 
     if (is_obj_type(list_val, OBJ_TUPLE)) {
-        ObjTuple* tuple = (ObjTuple*)list_val.as.object;
-        int index = (int)index_val.as.integer;
+        ObjTuple* tuple = (ObjTuple*)AS_OBJ(list_val);
+        int index = (int)AS_INT(index_val);
         if (index < 0 || index >= tuple->count) {
             printf("TUPLE_GET index out of bounds. Index: %d, Tuple count: %d\n", index, tuple->count);
             exit(1);
@@ -534,9 +1352,9 @@ static void op_index_get(VM* vm) {
     }
 
     if (is_obj_type(list_val, OBJ_DICT)) {
-        ObjDict* dict = (ObjDict*)list_val.as.object;
+        ObjDict* dict = (ObjDict*)AS_OBJ(list_val);
         if (!is_obj_type(index_val, OBJ_STRING)) {
-            printf("DICT_GET expects a string key, but got type %d\n", index_val.type);
+            printf("DICT_GET expects a string key, but got type %d\n", VALUE_TYPE(index_val));
             exit(1);
         }
         ObjString* key = as_string(index_val);
@@ -549,7 +1367,34 @@ static void op_index_get(VM* vm) {
         exit(1);
     }
 
-    printf("IDX_GET expects a list, tuple, or dictionary value\n");
+    if (is_obj_type(list_val, OBJ_RANGE)) {
+        ObjRange* range = (ObjRange*)AS_OBJ(list_val);
+        if (!IS_INT(index_val)) {
+            printf("RANGE_GET expects an integer index, but got type %d\n", VALUE_TYPE(index_val));
+            exit(1);
+        }
+        long length = range_length(range);
+        long index = AS_INT(index_val);
+        if (index < 0) {
+            index += length;
+        }
+        if (index < 0 || index >= length) {
+            printf("RANGE_GET index out of bounds. Index: %ld, Range length: %ld\n", AS_INT(index_val), length);
+            exit(1);
+        }
+        vm_push(vm, INT_VAL(range->start + index * range->step));
+        return;
+    }
+
+    ObjFunction* getitem = instance_special(vm, list_val, SPECIAL_GETITEM);
+    if (getitem) {
+        vm_push(vm, list_val);
+        vm_push(vm, index_val);
+        call_special(vm, getitem, 2, RETURN_VALUE, 0);
+        return;
+    }
+
+    printf("IDX_GET expects a list, tuple, range, dictionary or instance with __getitem__\n");
     exit(1);
 }
 
@@ -559,8 +1404,8 @@ static void op_index_set(VM* vm) {
     Value container = vm_pop(vm);
     if (is_obj_type(container, OBJ_LIST)) {
 
-        ObjList* list = (ObjList*)container.as.object;
-        int index = (int)index_val.as.integer;
+        ObjList* list = (ObjList*)AS_OBJ(container);
+        int index = (int)AS_INT(index_val);
         if (index < 0 || index >= list->count) {
             printf("LIST_SET index out of bounds. Index: %d, List count: %d\n", index, list->count);
             exit(1);
@@ -570,7 +1415,7 @@ static void op_index_set(VM* vm) {
     }
 
     if (is_obj_type(container, OBJ_DICT)) {
-        ObjDict* dict = (ObjDict*)container.as.object;
+        ObjDict* dict = (ObjDict*)AS_OBJ(container);
         if (!is_obj_type(index_val, OBJ_STRING)) {
             printf("DICT_SET expects a string key\n");
             exit(1);
@@ -592,8 +1437,8 @@ static void op_make_class(VM* vm, int operand) {
     Value parent_val = vm_pop(vm);
     ObjClass* parent = NULL;
     
-    if (parent_val.type == VAL_OBJ && parent_val.as.object->type == OBJ_CLASS) {
-        parent = (ObjClass*)parent_val.as.object;
+    if (IS_OBJ(parent_val) && AS_OBJ(parent_val)->type == OBJ_CLASS) {
+        parent = (ObjClass*)AS_OBJ(parent_val);
     }
     
     ObjString* class_name = as_string(vm->bytecode->constants[operand]);
@@ -611,12 +1456,129 @@ static void op_make_instance(VM* vm) {
         exit(1);
     }
     
-    ObjClass* klass = (ObjClass*)class_val.as.object;
+    ObjClass* klass = (ObjClass*)AS_OBJ(class_val);
     Value instance_val = vm_make_instance(vm, klass);
     
     vm_push(vm, instance_val);
 }
 
+// Methods of klass and all its parents in one map, so a lookup costs the
+// same at any depth. Assigning an attribute of a class with subclasses
+// bumps class_epoch, and each table is rebuilt from its parent's on first
+// use after that; a class without subclasses updates its own table.
+static HashMap* class_table(VM* vm, ObjClass* klass) {
+    if (klass->table && klass->table_epoch == vm->class_epoch) {
+        return klass->table;
+    }
+    HashMap* parent = klass->parent ? class_table(vm, klass->parent) : NULL;
+    if (klass->table) {
+        vm->bytes_allocated -= hash_bytes(klass->table);
+        hash_free(klass->table);
+    } else {
+        klass->table = malloc(sizeof(HashMap));
+        vm->bytes_allocated += sizeof(HashMap);
+    }
+    HashMap* table = klass->table;
+    hash_init(table, 8);
+    // Inherited methods first, so the class's own ones replace them
+    for (int i = 0; parent && i < parent->count; i++) {
+        hash_set(table, parent->entries[i].key, parent->entries[i].value);
+    }
+    for (int i = 0; i < klass->methods->count; i++) {
+        hash_set(table, klass->methods->entries[i].key, klass->methods->entries[i].value);
+    }
+    vm->bytes_allocated += hash_bytes(table);
+    klass->table_epoch = vm->class_epoch;
+
+    // Special methods are cached as functions, anything else assigned under
+    // their names is ignored by the operators
+    for (int i = 0; i < SPECIAL_COUNT; i++) {
+        Value method;
+        klass->special[i] = NULL;
+        if (hash_get(table, vm->special_names[i], &method) && is_obj_type(method, OBJ_FUNCTION)) {
+            klass->special[i] = (ObjFunction*)AS_OBJ(method);
+        }
+    }
+    return table;
+}
+
+// Assign name in the table of a class without subclasses, whose table
+// is the only one holding it. Cache entries for the class miss from now.
+static void class_table_set(VM* vm, ObjClass* klass, ObjString* name, Value value) {
+    if (klass->table_epoch != vm->class_epoch) {
+        class_table(vm, klass);
+    } else {
+        vm->bytes_allocated -= hash_bytes(klass->table);
+        hash_set(klass->table, name, value);
+        vm->bytes_allocated += hash_bytes(klass->table);
+        for (int i = 0; i < SPECIAL_COUNT; i++) {
+            if (vm->special_names[i] == name) {
+                klass->special[i] = is_obj_type(value, OBJ_FUNCTION) ? (ObjFunction*)AS_OBJ(value) : NULL;
+            }
+        }
+    }
+    klass->version++;
+}
+
+// Look name up in klass and its parents
+static int find_method(VM* vm, ObjClass* klass, ObjString* name, Value* method) {
+    return hash_get(class_table(vm, klass), name, method);
+}
+
+// Special method of klass or its nearest parent defining it, NULL if none.
+// The slots are filled with the method table and stay valid until it is
+// rebuilt, so this is one compare and one load.
+static inline ObjFunction* class_special(VM* vm, ObjClass* klass, SpecialMethod which) {
+    if (!klass->table || klass->table_epoch != vm->class_epoch) {
+        class_table(vm, klass);
+    }
+    return klass->special[which];
+}
+
+// Special method of value's class, NULL if value is not an instance
+static ObjFunction* instance_special(VM* vm, Value value, SpecialMethod which) {
+    if (!is_obj_type(value, OBJ_INSTANCE)) {
+        return NULL;
+    }
+    return class_special(vm, ((ObjInstance*)AS_OBJ(value))->klass, which);
+}
+
+#if VM_USE_INLINE_CACHES
+// Cache of the attribute site at ip, emptied if classes changed since it was filled
+static InlineCache* site_cache(VM* vm, int ip) {
+    InlineCache* cache = &vm->caches[vm->cache_sites[ip]];
+    if (cache->epoch != vm->class_epoch) {
+        cache->epoch = vm->class_epoch;
+        cache->count = 0;
+    }
+    return cache;
+}
+
+static void cache_add(InlineCache* cache, ObjClass* klass, Shape* shape, int field, Shape* new_shape, Value method) {
+    InlineCacheEntry* entry = NULL;
+    for (int i = 0; i < cache->count; i++) {
+        // An entry left behind by an older version of the class is refreshed
+        if (cache->entries[i].klass == klass && cache->entries[i].shape == shape && cache->entries[i].field == field) {
+            entry = &cache->entries[i];
+            break;
+        }
+    }
+    if (!entry && cache->count == VM_INLINE_CACHE_SIZE) {
+        // Megamorphic, the site keeps its first layouts
+        return;
+    }
+    if (!entry) {
+        entry = &cache->entries[cache->count++];
+    }
+    entry->klass = klass;
+    entry->version = klass->version;
+    entry->shape = shape;
+    entry->field = field;
+    entry->new_shape = new_shape;
+    entry->method = method;
+}
+#endif
+
 static void op_get_attr(VM* vm, int operand) {
     // Stack: [object]
     // operand: index of attribute name in constants
@@ -624,40 +1586,61 @@ static void op_get_attr(VM* vm, int operand) {
     ObjString* attr_name = as_string(vm->bytecode->constants[operand]);
     
     if (is_obj_type(obj_val, OBJ_INSTANCE)) {
-        ObjInstance* instance = (ObjInstance*)obj_val.as.object;
-        
-        // Try to find field
-        Value field_val;
-        if (hash_get(instance->fields, attr_name, &field_val)) {
-            vm_push(vm, field_val);
-            return;
+        ObjInstance* instance = (ObjInstance*)AS_OBJ(obj_val);
+        Value value;
+
+#if VM_USE_INLINE_CACHES
+        // The shape says which fields the instance has, so a hit needs no
+        // lookup at all. Instances in dictionary mode are never cached.
+        InlineCache* cache = site_cache(vm, vm->ip - 1);
+        for (int i = 0; i < cache->count; i++) {
+            InlineCacheEntry* entry = &cache->entries[i];
+            if (entry->shape == instance->shape && entry->klass == instance->klass &&
+                entry->version == instance->klass->version) {
+                value = entry->field >= 0 ? instance->slots[entry->field] : entry->method;
+                // A declared slot shares its shape before it is assigned
+                if (IS_UNASSIGNED(value)) {
+                    break;
+                }
+                vm_push(vm, value);
+                return;
+            }
         }
-        
-        // Try to find method in class
-        Value method_val;
-        if (hash_get(instance->klass->methods, attr_name, &method_val)) {
-            vm_push(vm, method_val);
+        vm->cache_misses++;
+#endif
+
+        // Try to find field
+        Value* field = instance_field(instance, attr_name);
+        if (field) {
+#if VM_USE_INLINE_CACHES
+            if (instance->shape) {
+                cache_add(cache, instance->klass, instance->shape,
+                          shape_slot(instance->shape, attr_name), NULL, make_none());
+            }
+#endif
+            vm_push(vm, *field);
             return;
         }
         
-        // Try parent classes
-        ObjClass* parent = instance->klass->parent;
-        while (parent) {
-            if (hash_get(parent->methods, attr_name, &method_val)) {
-                vm_push(vm, method_val);
-                return;
+        // Then methods in the class and its parents
+        if (find_method(vm, instance->klass, attr_name, &value)) {
+#if VM_USE_INLINE_CACHES
+            if (instance->shape) {
+                cache_add(cache, instance->klass, instance->shape, -1, NULL, value);
             }
-            parent = parent->parent;
+#endif
+            vm_push(vm, value);
+            return;
         }
         
         printf("Attribute '%s' not found on instance\n", attr_name->chars);
         exit(1);
     } else if (is_obj_type(obj_val, OBJ_CLASS)) {
-        ObjClass* klass = (ObjClass*)obj_val.as.object;
+        ObjClass* klass = (ObjClass*)AS_OBJ(obj_val);
         
-        // Try to find method
+        // Try to find method, also one it inherits
         Value method_val;
-        if (hash_get(klass->methods, attr_name, &method_val)) {
+        if (find_method(vm, klass, attr_name, &method_val)) {
             vm_push(vm, method_val);
             return;
         }
@@ -666,7 +1649,7 @@ static void op_get_attr(VM* vm, int operand) {
         exit(1);
     }
     
-    printf("VM GET_ATTR expects an instance or class. Got %d. IP=%d\n", obj_val.type, vm->ip - 1);
+    printf("VM GET_ATTR expects an instance or class. Got %d. IP=%d\n", VALUE_TYPE(obj_val), vm->ip - 1);
     exit(1);
 }
 
@@ -678,17 +1661,57 @@ static void op_set_attr(VM* vm, int operand) {
     ObjString* attr_name = as_string(vm->bytecode->constants[operand]);
     
     if (is_obj_type(obj_val, OBJ_INSTANCE)) {
-        ObjInstance* instance = (ObjInstance*)obj_val.as.object;
-        hash_set(instance->fields, attr_name, value);
+        ObjInstance* instance = (ObjInstance*)AS_OBJ(obj_val);
+#if VM_USE_INLINE_CACHES
+        // Either an assignment to an existing slot, or the transition that
+        // adds the field when the slot array already has room for it
+        InlineCache* cache = site_cache(vm, vm->ip - 1);
+        for (int i = 0; i < cache->count; i++) {
+            InlineCacheEntry* entry = &cache->entries[i];
+            if (entry->shape != instance->shape || entry->klass != instance->klass) {
+                continue;
+            }
+            if (!entry->new_shape) {
+                instance->slots[entry->field] = value;
+                return;
+            }
+            if (entry->field < instance->slot_capacity) {
+                instance->slots[entry->field] = value;
+                instance->shape = entry->new_shape;
+                return;
+            }
+        }
+        vm->cache_misses++;
+        Shape* shape = instance->shape;
+#endif
+        int field = instance_set_field(vm, instance, attr_name, value);
+#if VM_USE_INLINE_CACHES
+        if (shape && field >= 0) {
+            cache_add(cache, instance->klass, shape, field,
+                      instance->shape != shape ? instance->shape : NULL, make_none());
+        }
+#else
+        (void)field;
+#endif
         return;
     } else if (is_obj_type(obj_val, OBJ_CLASS)) {
-        ObjClass* klass = (ObjClass*)obj_val.as.object;
-        // Setting methods on class
+        ObjClass* klass = (ObjClass*)AS_OBJ(obj_val);
+        // Setting methods on class, which may change what any cached
+        // lookup on it or its subclasses finds. Until its table is built
+        // nothing has looked at it, as while its class body runs.
+        if (strcmp(attr_name->chars, "__slots__") == 0) {
+            class_set_slots(vm, klass, value);
+        }
         hash_set(klass->methods, attr_name, value);
+        if (klass->table && klass->subclassed) {
+            vm->class_epoch++;
+        } else if (klass->table) {
+            class_table_set(vm, klass, attr_name, value);
+        }
         return;
     }
     
-    printf("VM SET_ATTR expects an instance or class. Got %d. IP=%d\n", obj_val.type, vm->ip - 1);
+    printf("VM SET_ATTR expects an instance or class. Got %d. IP=%d\n", VALUE_TYPE(obj_val), vm->ip - 1);
     exit(1);
 }
 
@@ -698,6 +1721,7 @@ static void op_call_method(VM* vm, int operand) {
     // Next instruction should be NOP with argc
     
     ObjString* method_name = as_string(vm->bytecode->constants[operand]);
+    int site = vm->ip - 1;
     
     // Get argc from next instruction  
     Instruction next_instr = vm->bytecode->instructions[vm->ip++];
@@ -711,27 +1735,25 @@ static void op_call_method(VM* vm, int operand) {
         exit(1);
     }
     
-    ObjInstance* instance = (ObjInstance*)obj_val.as.object;
-    
-    // Look up method
-    Value method_val;
-    int found = 0;
-    
-    if (hash_get(instance->klass->methods, method_name, &method_val)) {
-        found = 1;
-    } else {
-        // Try parent classes
-        ObjClass* parent = instance->klass->parent;
-        while (parent && !found) {
-            if (hash_get(parent->methods, method_name, &method_val)) {
-                found = 1;
-                break;
-            }
-            parent = parent->parent;
+    ObjInstance* instance = (ObjInstance*)AS_OBJ(obj_val);
+
+#if VM_USE_INLINE_CACHES
+    // Entries only hold methods already checked to take argc arguments
+    InlineCache* cache = site_cache(vm, site);
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].klass == instance->klass && cache->entries[i].version == instance->klass->version) {
+            push_frame(vm, (ObjFunction*)AS_OBJ(cache->entries[i].method), argc + 1, make_none());
+            return;
         }
     }
+    vm->cache_misses++;
+#else
+    (void)site;
+#endif
     
-    if (!found) {
+    // Look up method
+    Value method_val;
+    if (!find_method(vm, instance->klass, method_name, &method_val)) {
         printf("Method '%s' not found\n", method_name->chars);
         exit(1);
     }
@@ -741,7 +1763,7 @@ static void op_call_method(VM* vm, int operand) {
         exit(1);
     }
     
-    ObjFunction* fn = (ObjFunction*)method_val.as.object;
+    ObjFunction* fn = (ObjFunction*)AS_OBJ(method_val);
     
     // Check parameter count (should be argc + 1 for 'self')
     if (fn->param_count != argc + 1) {
@@ -749,24 +1771,403 @@ static void op_call_method(VM* vm, int operand) {
                method_name->chars, fn->param_count - 1, argc);
         exit(1);
     }
+
+#if VM_USE_INLINE_CACHES
+    cache_add(cache, instance->klass, NULL, -1, NULL, method_val);
+#endif
     
-    // Create new call frame - object is already on stack as first arg
-    CallFrame* frame = &vm->call_stack[vm->frame_count++];
-    frame->return_address = vm->ip;
-    frame->base_sp = vm->sp - argc - 1; // Points to object
-    frame->scope = vm->scope;  // Save current scope to restore later
-    
-    // Create new scope for the method
-    Scope* method_scope = new_scope(fn->name, vm->scope);
-    
-    // Bind parameters to arguments
-    for (int i = 0; i < fn->param_count; i++) {
-        Value arg = vm->stack[frame->base_sp + i];
-        ObjString* param_name = intern_const_string(vm, fn->params[i], strlen(fn->params[i]));
-        scope_set(method_scope, param_name, arg);
+    // Object is already on stack as first arg
+    push_frame(vm, fn, argc + 1, make_none());
+}
+
+// Iterator over a container, or over an instance whose __next__ gives
+// the items
+static Value wrap_iterator(VM* vm, Value iterable) {
+    if (!is_obj_type(iterable, OBJ_LIST) &&
+        !is_obj_type(iterable, OBJ_TUPLE) &&
+        !is_obj_type(iterable, OBJ_DICT) &&
+        !is_obj_type(iterable, OBJ_SET) &&
+        !is_obj_type(iterable, OBJ_RANGE) &&
+        !instance_special(vm, iterable, SPECIAL_NEXT)) {
+        printf("Object is not iterable. Type: %d\n", VALUE_TYPE(iterable));
+        exit(1);
     }
-    
-    vm->scope = method_scope;
-    vm->sp = frame->base_sp; // Reset stack to base
-    vm->ip = fn->addr; // Jump to function
-}
\ No newline at end of file
+    return vm_make_iterator(vm, iterable);
+}
+
+static void op_get_iter(VM* vm) {
+    // Stack: [iterable] -> [iterator]. An instance is asked for its
+    // iterator with __iter__, often itself, and the frame wraps it.
+    Value iterable = vm_pop(vm);
+    if (is_obj_type(iterable, OBJ_INSTANCE)) {
+        ObjFunction* iter = instance_special(vm, iterable, SPECIAL_ITER);
+        if (!iter) {
+            printf("'%s' object is not iterable\n", ((ObjInstance*)AS_OBJ(iterable))->klass->name);
+            exit(1);
+        }
+        vm_push(vm, iterable);
+        call_special(vm, iter, 1, RETURN_ITER, 0);
+        return;
+    }
+    vm_push(vm, wrap_iterator(vm, iterable));
+}
+
+// Step an iterator over an instance: call its __next__, which pushes the
+// item or jumps to target once it returns StopIteration
+static void next_special(VM* vm, ObjIterator* iterator, int target) {
+    ObjFunction* next = instance_special(vm, iterator->iterable, SPECIAL_NEXT);
+    if (!next) {
+        printf("'%s' object is not an iterator\n", ((ObjInstance*)AS_OBJ(iterator->iterable))->klass->name);
+        exit(1);
+    }
+    vm_push(vm, iterator->iterable);
+    call_special(vm, next, 1, RETURN_NEXT, target);
+}
+
+// Advance an iterator, returns 0 once it is exhausted
+static int iterator_next(VM* vm, ObjIterator* iterator, Value* item) {
+    Value iterable = iterator->iterable;
+
+    if (is_obj_type(iterable, OBJ_LIST)) {
+        ObjList* list = (ObjList*)AS_OBJ(iterable);
+        if (iterator->index >= list->count) return 0;
+        *item = list->items[iterator->index++];
+        return 1;
+    }
+
+    if (is_obj_type(iterable, OBJ_TUPLE)) {
+        ObjTuple* tuple = (ObjTuple*)AS_OBJ(iterable);
+        if (iterator->index >= tuple->count) return 0;
+        *item = tuple->items[iterator->index++];
+        return 1;
+    }
+
+    if (is_obj_type(iterable, OBJ_RANGE)) {
+        ObjRange* range = (ObjRange*)AS_OBJ(iterable);
+        if (iterator->index >= range_length(range)) return 0;
+        *item = INT_VAL(range->start + iterator->index++ * range->step);
+        return 1;
+    }
+
+    if (is_obj_type(iterable, OBJ_DICT)) {
+        HashMap* map = ((ObjDict*)AS_OBJ(iterable))->map;
+        if (map->count != iterator->size) {
+            printf("Dictionary changed size during iteration\n");
+            exit(1);
+        }
+        if (iterator->index >= map->count) return 0;
+        // Dicts iterate over their keys in insertion order
+        ObjString* key = map->entries[iterator->index++].key;
+        *item = OBJ_VAL(key);
+        return 1;
+    }
+
+    if (is_obj_type(iterable, OBJ_SET)) {
+        HashMap* map = ((ObjSet*)AS_OBJ(iterable))->map;
+        if (map->count != iterator->size) {
+            printf("Set changed size during iteration\n");
+            exit(1);
+        }
+        if (iterator->index >= map->count) return 0;
+        *item = map->entries[iterator->index++].value;
+        return 1;
+    }
+
+    printf("FOR_ITER expects an iterator over a list, tuple, range, dict or set\n");
+    exit(1);
+}
+
+static void op_for_iter(VM* vm, int operand) {
+    // Stack: [iterator] -> [iterator, item], or jump to operand when done
+    ObjIterator* iterator = (ObjIterator*)AS_OBJ(vm->stack[vm->sp - 1]);
+    if (is_obj_type(iterator->iterable, OBJ_INSTANCE)) {
+        next_special(vm, iterator, operand);
+        return;
+    }
+    Value item;
+    if (iterator_next(vm, iterator, &item)) {
+        vm_push(vm, item);
+    } else {
+        vm->ip = operand;
+    }
+}
+
+static void op_for_range_prep(VM* vm, int operand) {
+    // Stack: [args..., callee], next instruction is a NOP holding argc.
+    // When callee is the builtin range, replace everything with the loop
+    // state [start, stop, step] and jump to operand (the FOR_RANGE), so
+    // the loop never allocates. Otherwise fall through to the generic
+    // CALL / GET_ITER sequence the compiler emitted after the NOP.
+    int argc = vm->bytecode->instructions[vm->ip++].operand;
+    Value callee = vm->stack[vm->sp - 1];
+    if (!is_obj_type(callee, OBJ_NATIVE_FUNCTION) ||
+        ((ObjNativeFunction*)AS_OBJ(callee))->function != native_range) {
+        return;
+    }
+
+    long start, stop, step;
+    Value* args = &vm->stack[vm->sp - 1 - argc];
+    range_bounds(argc, args, &start, &stop, &step);
+    vm->sp -= argc + 1;
+    vm_push(vm, INT_VAL(start));
+    vm_push(vm, INT_VAL(stop));
+    vm_push(vm, INT_VAL(step));
+    vm->ip = operand;
+}
+
+static inline void op_for_range(VM* vm, int operand) {
+    // Stack: [counter, stop, step], the counter is an unboxed int or, when
+    // range was rebound, an iterator with two None pads
+    Value* state = &vm->stack[vm->sp - 3];
+    if (IS_INT(state[0])) {
+        long current = AS_INT(state[0]);
+        long step = AS_INT(state[2]);
+        if (step > 0 ? current < AS_INT(state[1]) : current > AS_INT(state[1])) {
+            state[0] = INT_VAL(current + step);
+            vm_push(vm, INT_VAL(current));
+        } else {
+            vm->ip = operand;
+        }
+        return;
+    }
+    ObjIterator* iterator = (ObjIterator*)AS_OBJ(state[0]);
+    if (is_obj_type(iterator->iterable, OBJ_INSTANCE)) {
+        next_special(vm, iterator, operand);
+        return;
+    }
+    Value item;
+    if (iterator_next(vm, iterator, &item)) {
+        vm_push(vm, item);
+    } else {
+        vm->ip = operand;
+    }
+}
+
+// Superinstructions, see the Opcode enum. Ints (and floats for the
+// compares) are handled inline, everything else goes through the generic
+// handlers with the stack they expect.
+
+static inline void op_compare_jump(VM* vm, Opcode compare, int target) {
+    Value a = vm->stack[vm->sp - 2];
+    Value b = vm->stack[vm->sp - 1];
+    int result;
+    if (IS_INT(a) && IS_INT(b)) {
+        long x = AS_INT(a);
+        long y = AS_INT(b);
+        result = compare == OP_EQ ? x == y : compare == OP_NE ? x != y : compare == OP_LT ? x < y :
+                 compare == OP_GT ? x > y : compare == OP_LE ? x <= y : x >= y;
+        vm->sp -= 2;
+    } else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+        // C compares are false for NaN except !=, like op_compare
+        double x = AS_FLOAT(a);
+        double y = AS_FLOAT(b);
+        result = compare == OP_EQ ? x == y : compare == OP_NE ? x != y : compare == OP_LT ? x < y :
+                 compare == OP_GT ? x > y : compare == OP_LE ? x <= y : x >= y;
+        vm->sp -= 2;
+    } else {
+        int frames = vm->frame_count;
+        op_compare(vm, compare);
+        if (vm->frame_count != frames) {
+            // A special method compares, the frame branches when it returns
+            CallFrame* frame = &vm->call_stack[frames];
+            frame->on_return = frame->on_return == RETURN_NOT ? RETURN_JUMP_IF_TRUE : RETURN_JUMP_IF_FALSE;
+            frame->target = target;
+            return;
+        }
+        result = is_true(vm_pop(vm));
+    }
+    if (!result) {
+        vm->ip = target;
+    }
+}
+
+static inline void op_increment(VM* vm, Value* slot, int operand, ReturnAction store) {
+    Value k = vm->bytecode->constants[SUPER_CONST(operand)];
+    if (IS_INT(*slot) && IS_INT(k)) {
+        *slot = INT_VAL((int)(AS_INT(*slot) + AS_INT(k)));
+        return;
+    }
+    int frames = vm->frame_count;
+    vm_push(vm, *slot);
+    vm_push(vm, k);
+    op_add(vm);
+    if (vm->frame_count != frames) {
+        // __add__ runs, the frame stores its result
+        vm->call_stack[frames].on_return = store;
+        vm->call_stack[frames].target = SUPER_SLOT(operand);
+        return;
+    }
+    *slot = vm_pop(vm);
+}
+
+static inline void op_add_const(VM* vm, int operand) {
+    Value* a = &vm->stack[vm->sp - 1];
+    Value k = vm->bytecode->constants[operand];
+    if (IS_INT(*a) && IS_INT(k)) {
+        *a = INT_VAL((int)(AS_INT(*a) + AS_INT(k)));
+        return;
+    }
+    if (IS_FLOAT(*a) && IS_FLOAT(k)) {
+        *a = FLOAT_VAL(AS_FLOAT(*a) + AS_FLOAT(k));
+        return;
+    }
+    vm_push(vm, k);
+    op_add(vm);
+}
+
+// Handlers behind vm_op_handler, one per opcode, mirroring the vm_run cases
+#define VM_HANDLER(op, body) \
+    static void handle_##op(VM* vm, int operand) { (void)operand; body; }
+
+#define VM_QUICK_HANDLER(op, static_op, is_operand_type, generic_op, generic_handler, make_result, expr) \
+    static void handle_##op(VM* vm, int operand) { \
+        (void)operand; \
+        Value* a = &vm->stack[vm->sp - 2]; \
+        Value* b = &vm->stack[vm->sp - 1]; \
+        if (is_operand_type(*a) && is_operand_type(*b)) { \
+            *a = make_result(expr); \
+            vm->sp--; \
+            return; \
+        } \
+        deoptimize(vm, generic_op); \
+        generic_handler; \
+    }
+
+#define VM_STATIC_HANDLER(op, static_op, is_operand_type, generic_op, generic_handler, make_result, expr) \
+    static void handle_##static_op(VM* vm, int operand) { \
+        (void)operand; \
+        Value* a = &vm->stack[vm->sp - 2]; \
+        Value* b = &vm->stack[vm->sp - 1]; \
+        *a = make_result(expr); \
+        vm->sp--; \
+    }
+
+VM_HANDLER(OP_NOP, )
+VM_HANDLER(OP_LOAD, op_load_name(vm, operand))
+VM_HANDLER(OP_STORE, op_store_name(vm, operand))
+VM_HANDLER(OP_LOAD_LOCAL, vm_push(vm, vm->stack[vm->fp + operand]))
+VM_HANDLER(OP_STORE_LOCAL, vm->stack[vm->fp + operand] = vm_pop(vm))
+VM_HANDLER(OP_LOAD_GLOBAL, vm_push(vm, vm->globals[operand]))
+VM_HANDLER(OP_STORE_GLOBAL, vm->globals[operand] = vm_pop(vm))
+VM_HANDLER(OP_ADD, op_add(vm))
+VM_HANDLER(OP_SUB, op_sub(vm))
+VM_HANDLER(OP_MUL, op_mul(vm))
+VM_HANDLER(OP_DIV, op_div(vm))
+VM_HANDLER(OP_NEG, op_neg(vm))
+VM_HANDLER(OP_NOT, vm->stack[vm->sp - 1] = make_bool(!is_true(vm->stack[vm->sp - 1])))
+VM_HANDLER(OP_EQ, op_compare(vm, OP_EQ))
+VM_HANDLER(OP_LT, op_compare(vm, OP_LT))
+VM_HANDLER(OP_GT, op_compare(vm, OP_GT))
+VM_HANDLER(OP_GE, op_compare(vm, OP_GE))
+VM_HANDLER(OP_LE, op_compare(vm, OP_LE))
+VM_HANDLER(OP_NE, op_compare(vm, OP_NE))
+VM_QUICK_OPS(VM_QUICK_HANDLER)
+VM_QUICK_OPS(VM_STATIC_HANDLER)
+VM_HANDLER(OP_JUMP, vm->ip = operand)
+VM_HANDLER(OP_JUMP_IF_ZERO, if (!is_true(vm_pop(vm))) vm->ip = operand)
+VM_HANDLER(OP_EQ_JUMP_IF_FALSE, op_compare_jump(vm, OP_EQ, operand))
+VM_HANDLER(OP_NE_JUMP_IF_FALSE, op_compare_jump(vm, OP_NE, operand))
+VM_HANDLER(OP_LT_JUMP_IF_FALSE, op_compare_jump(vm, OP_LT, operand))
+VM_HANDLER(OP_GT_JUMP_IF_FALSE, op_compare_jump(vm, OP_GT, operand))
+VM_HANDLER(OP_LE_JUMP_IF_FALSE, op_compare_jump(vm, OP_LE, operand))
+VM_HANDLER(OP_GE_JUMP_IF_FALSE, op_compare_jump(vm, OP_GE, operand))
+VM_HANDLER(OP_INC_LOCAL, op_increment(vm, &vm->stack[vm->fp + SUPER_SLOT(operand)], operand, RETURN_STORE_LOCAL))
+VM_HANDLER(OP_INC_GLOBAL, op_increment(vm, &vm->globals[SUPER_SLOT(operand)], operand, RETURN_STORE_GLOBAL))
+VM_HANDLER(OP_ADD_CONST, op_add_const(vm, operand))
+VM_HANDLER(OP_CONST, vm_push(vm, vm->bytecode->constants[operand]))
+VM_HANDLER(OP_POP, vm_pop(vm))
+VM_HANDLER(OP_GET_ITER, op_get_iter(vm))
+VM_HANDLER(OP_FOR_ITER, op_for_iter(vm, operand))
+VM_HANDLER(OP_FOR_RANGE_PREP, op_for_range_prep(vm, operand))
+VM_HANDLER(OP_FOR_RANGE, op_for_range(vm, operand))
+VM_HANDLER(OP_CALL, op_call(vm, operand))
+VM_HANDLER(OP_TAIL_CALL, op_tail_call(vm, operand))
+VM_HANDLER(OP_RET, op_return(vm))
+VM_HANDLER(OP_IDX_GET, op_index_get(vm))
+VM_HANDLER(OP_IDX_SET, op_index_set(vm))
+VM_HANDLER(OP_MAKE_CLASS, op_make_class(vm, operand))
+VM_HANDLER(OP_MAKE_INSTANCE, op_make_instance(vm))
+VM_HANDLER(OP_GET_ATTR, op_get_attr(vm, operand))
+VM_HANDLER(OP_SET_ATTR, op_set_attr(vm, operand))
+VM_HANDLER(OP_CALL_METHOD, op_call_method(vm, operand))
+
+#define VM_HANDLER_ENTRY(op, ...) [op] = handle_##op,
+#define VM_STATIC_HANDLER_ENTRY(op, static_op, ...) [static_op] = handle_##static_op,
+
+static const VmOpHandler op_handlers[OP_HALT + 1] = {
+    [OP_NOP] = handle_OP_NOP,
+    [OP_LOAD] = handle_OP_LOAD,
+    [OP_STORE] = handle_OP_STORE,
+    [OP_LOAD_LOCAL] = handle_OP_LOAD_LOCAL,
+    [OP_STORE_LOCAL] = handle_OP_STORE_LOCAL,
+    [OP_LOAD_GLOBAL] = handle_OP_LOAD_GLOBAL,
+    [OP_STORE_GLOBAL] = handle_OP_STORE_GLOBAL,
+    [OP_ADD] = handle_OP_ADD,
+    [OP_SUB] = handle_OP_SUB,
+    [OP_MUL] = handle_OP_MUL,
+    [OP_DIV] = handle_OP_DIV,
+    [OP_NEG] = handle_OP_NEG,
+    [OP_NOT] = handle_OP_NOT,
+    [OP_EQ] = handle_OP_EQ,
+    [OP_LT] = handle_OP_LT,
+    [OP_GT] = handle_OP_GT,
+    [OP_GE] = handle_OP_GE,
+    [OP_LE] = handle_OP_LE,
+    [OP_NE] = handle_OP_NE,
+    VM_QUICK_OPS(VM_HANDLER_ENTRY)
+    VM_QUICK_OPS(VM_STATIC_HANDLER_ENTRY)
+    [OP_JUMP] = handle_OP_JUMP,
+    [OP_JUMP_IF_ZERO] = handle_OP_JUMP_IF_ZERO,
+    [OP_EQ_JUMP_IF_FALSE] = handle_OP_EQ_JUMP_IF_FALSE,
+    [OP_NE_JUMP_IF_FALSE] = handle_OP_NE_JUMP_IF_FALSE,
+    [OP_LT_JUMP_IF_FALSE] = handle_OP_LT_JUMP_IF_FALSE,
+    [OP_GT_JUMP_IF_FALSE] = handle_OP_GT_JUMP_IF_FALSE,
+    [OP_LE_JUMP_IF_FALSE] = handle_OP_LE_JUMP_IF_FALSE,
+    [OP_GE_JUMP_IF_FALSE] = handle_OP_GE_JUMP_IF_FALSE,
+    [OP_INC_LOCAL] = handle_OP_INC_LOCAL,
+    [OP_INC_GLOBAL] = handle_OP_INC_GLOBAL,
+    [OP_ADD_CONST] = handle_OP_ADD_CONST,
+    [OP_CONST] = handle_OP_CONST,
+    [OP_POP] = handle_OP_POP,
+    [OP_GET_ITER] = handle_OP_GET_ITER,
+    [OP_FOR_ITER] = handle_OP_FOR_ITER,
+    [OP_FOR_RANGE_PREP] = handle_OP_FOR_RANGE_PREP,
+    [OP_FOR_RANGE] = handle_OP_FOR_RANGE,
+    [OP_CALL] = handle_OP_CALL,
+    [OP_TAIL_CALL] = handle_OP_TAIL_CALL,
+    [OP_RET] = handle_OP_RET,
+    [OP_IDX_GET] = handle_OP_IDX_GET,
+    [OP_IDX_SET] = handle_OP_IDX_SET,
+    [OP_MAKE_CLASS] = handle_OP_MAKE_CLASS,
+    [OP_MAKE_INSTANCE] = handle_OP_MAKE_INSTANCE,
+    [OP_GET_ATTR] = handle_OP_GET_ATTR,
+    [OP_SET_ATTR] = handle_OP_SET_ATTR,
+    [OP_CALL_METHOD] = handle_OP_CALL_METHOD,
+    [OP_HALT] = NULL, // Leaves vm_run, the JIT exits to the interpreter instead
+};
+
+VmOpHandler vm_op_handler(Opcode op) {
+    if (op < 0 || op > OP_HALT) {
+        return NULL;
+    }
+    return op_handlers[op];
+}
+
+int vm_op_may_call(Opcode op) {
+    switch (op) {
+        case OP_ADD: case OP_SUB: case OP_MUL:
+        case OP_EQ: case OP_NE: case OP_LT: case OP_GT:
+        // Typed forms go back to the generic handlers on other operands
+        case OP_ADD_INT: case OP_ADD_FLOAT: case OP_SUB_INT: case OP_SUB_FLOAT:
+        case OP_MUL_INT: case OP_MUL_FLOAT:
+        case OP_EQ_INT: case OP_NE_INT: case OP_LT_INT: case OP_GT_INT:
+        case OP_LT_FLOAT: case OP_GT_FLOAT:
+        case OP_EQ_JUMP_IF_FALSE: case OP_NE_JUMP_IF_FALSE:
+        case OP_LT_JUMP_IF_FALSE: case OP_GT_JUMP_IF_FALSE:
+        case OP_INC_LOCAL: case OP_INC_GLOBAL: case OP_ADD_CONST:
+        case OP_IDX_GET: case OP_GET_ITER: case OP_FOR_ITER: case OP_FOR_RANGE:
+            return 1;
+        default:
+            return 0;
+    }
+}
@@ -1,6 +1,7 @@
 #include "vm_objects.h"
 
 #include "gc.h"
+#include "intern_string.h"
 #include "vm.h"
 
 #include "string.h"
@@ -28,11 +29,10 @@ Value vm_make_string(VM* vm, const char* s) {
     ObjString* string = (ObjString*)vm_alloc_object(vm, sizeof(ObjString), OBJ_STRING);
     string->length = strlen(s);
     string->chars = strdup(s);
+    string->hash = hash_string(s);
+    string->interned = 0;
     vm->bytes_allocated += string->length + 1;  // Track string data
-    Value v;
-    v.type = VAL_OBJ;
-    v.as.object = (Obj*)string;
-    return v;
+    return OBJ_VAL(string);
 }
 
 Value vm_make_list(VM* vm, int count) {
@@ -42,46 +42,30 @@ Value vm_make_list(VM* vm, int count) {
     list->capacity = capacity;
     list->items = malloc(sizeof(Value) * capacity);
     vm->bytes_allocated += sizeof(Value) * capacity;
-    Value v;
-    v.type = VAL_OBJ;
-    v.as.object = (Obj*)list;
-    return v;
+    return OBJ_VAL(list);
 }
 
 Value vm_make_dict(VM* vm) {
     ObjDict* dict = (ObjDict*)vm_alloc_object(vm, sizeof(ObjDict), OBJ_DICT);
-    dict->count = 0;
-    dict->capacity = 4;
     dict->map = malloc(sizeof(HashMap));
     hash_init(dict->map, 4);
-    vm->bytes_allocated += sizeof(HashMap) + sizeof(HashNode) * 4;
-    Value v;
-    v.type = VAL_OBJ;
-    v.as.object = (Obj*)dict;
-    return v;
+    vm->bytes_allocated += sizeof(HashMap) + hash_bytes(dict->map);
+    return OBJ_VAL(dict);
 }
 
 Value vm_make_tuple(VM* vm) {
     ObjTuple* tuple = (ObjTuple*)vm_alloc_object(vm, sizeof(ObjTuple), OBJ_TUPLE);
     tuple->count = 0;
     tuple->items = NULL;
-    Value v;
-    v.type = VAL_OBJ;
-    v.as.object = (Obj*)tuple;
-    return v;
+    return OBJ_VAL(tuple);
 }
 
 Value vm_make_set(VM* vm) {
     ObjSet* set = (ObjSet*)vm_alloc_object(vm, sizeof(ObjSet), OBJ_SET);
-    set->count = 0;
-    set->capacity = 4;
     set->map = malloc(sizeof(HashMap));
     hash_init(set->map, 4);
-    vm->bytes_allocated += sizeof(HashMap) + sizeof(HashNode) * 4;
-    Value v;
-    v.type = VAL_OBJ;
-    v.as.object = (Obj*)set;
-    return v;
+    vm->bytes_allocated += sizeof(HashMap) + hash_bytes(set->map);
+    return OBJ_VAL(set);
 }
 
 Value vm_make_class(VM* vm, const char* name, ObjClass* parent) {
@@ -90,32 +74,250 @@ Value vm_make_class(VM* vm, const char* name, ObjClass* parent) {
     vm->bytes_allocated += strlen(name) + 1;  // Track name string
     klass->methods = malloc(sizeof(HashMap));
     hash_init(klass->methods, 8);
-    vm->bytes_allocated += sizeof(HashMap) + sizeof(HashNode) * 8;
+    vm->bytes_allocated += sizeof(HashMap) + hash_bytes(klass->methods);
     klass->parent = parent;
-    Value v;
-    v.type = VAL_OBJ;
-    v.as.object = (Obj*)klass;
-    return v;
+    klass->table = NULL;
+    klass->table_epoch = 0;
+    klass->version = 0;
+    klass->subclassed = 0;
+    if (parent) {
+        parent->subclassed = 1;
+    }
+    // A subclass keeps the slots of its parent where they are, so code
+    // cached or compiled against the parent's layout still reads them
+    klass->base_shape = parent ? parent->base_shape : vm->root_shape;
+    klass->slot_hint = klass->base_shape->slot_count;
+    klass->closed = 0;
+    memset(klass->special, 0, sizeof(klass->special));
+    return OBJ_VAL(klass);
 }
 
 Value vm_make_instance(VM* vm, ObjClass* klass) {
-    ObjInstance* instance = (ObjInstance*)vm_alloc_object(vm, sizeof(ObjInstance), OBJ_INSTANCE);
+    // Room for as many fields as instances of the class have had, so
+    // most never allocate their slots separately
+    int inline_capacity = klass->slot_hint;
+    size_t size = sizeof(ObjInstance) + sizeof(Value) * inline_capacity;
+    ObjInstance* instance = (ObjInstance*)vm_alloc_object(vm, size, OBJ_INSTANCE);
     instance->klass = klass;
-    instance->fields = malloc(sizeof(HashMap));
-    hash_init(instance->fields, 8);
-    vm->bytes_allocated += sizeof(HashMap) + sizeof(HashNode) * 8;
-    Value v;
-    v.type = VAL_OBJ;
-    v.as.object = (Obj*)instance;
-    return v;
+    instance->shape = klass->base_shape;
+    instance->slots = instance->inline_slots;
+    instance->slot_capacity = inline_capacity;
+    instance->inline_capacity = inline_capacity;
+    instance->fields = NULL;
+    // Declared slots stay unset until they are assigned; reading one
+    // before that is an error, as if the field did not exist
+    for (int i = 0; i < klass->base_shape->slot_count; i++) {
+        instance->slots[i] = UNASSIGNED_VAL;
+    }
+    return OBJ_VAL(instance);
+}
+
+static Shape* new_shape(VM* vm, Shape* parent, ObjString* name) {
+    Shape* shape = malloc(sizeof(Shape));
+    shape->parent = parent;
+    shape->name = name;
+    shape->slot_count = parent ? parent->slot_count + 1 : 0;
+    shape->children = NULL;
+    shape->child_count = 0;
+    shape->child_capacity = 0;
+    shape->next = vm->shapes;
+    vm->shapes = shape;
+    return shape;
+}
+
+void vm_init_shapes(VM* vm) {
+    vm->shapes = NULL;
+    vm->root_shape = new_shape(vm, NULL, NULL);
+}
+
+void vm_free_shapes(VM* vm) {
+    Shape* shape = vm->shapes;
+    while (shape) {
+        Shape* next = shape->next;
+        free(shape->children);
+        free(shape);
+        shape = next;
+    }
+    vm->shapes = NULL;
+    vm->root_shape = NULL;
+}
+
+int shape_slot(Shape* shape, ObjString* name) {
+    // Names are interned, and shapes are shallow enough that walking back
+    // to the root beats a map per shape
+    for (; shape->name; shape = shape->parent) {
+        if (shape->name == name) {
+            return shape->slot_count - 1;
+        }
+    }
+    return -1;
+}
+
+// Shape reached from shape by adding the field name, made on first use
+static Shape* shape_transition(VM* vm, Shape* shape, ObjString* name) {
+    for (int i = 0; i < shape->child_count; i++) {
+        if (shape->children[i]->name == name) {
+            return shape->children[i];
+        }
+    }
+    if (shape->child_count == shape->child_capacity) {
+        shape->child_capacity = shape->child_capacity ? shape->child_capacity * 2 : 2;
+        shape->children = realloc(shape->children, sizeof(Shape*) * shape->child_capacity);
+    }
+    Shape* child = new_shape(vm, shape, name);
+    shape->children[shape->child_count++] = child;
+    return child;
+}
+
+// Move the fields of an instance with a full shape into a hashmap
+static void instance_to_dictionary(VM* vm, ObjInstance* instance) {
+    HashMap* fields = malloc(sizeof(HashMap));
+    hash_init(fields, VM_SHAPE_MAX_FIELDS * 2);
+    ObjString** names = malloc(sizeof(ObjString*) * instance->shape->slot_count);
+    for (Shape* shape = instance->shape; shape->name; shape = shape->parent) {
+        names[shape->slot_count - 1] = shape->name;
+    }
+    // In slot order, which is the order the fields were added
+    for (int i = 0; i < instance->shape->slot_count; i++) {
+        if (!IS_UNASSIGNED(instance->slots[i])) {
+            hash_set(fields, names[i], instance->slots[i]);
+        }
+    }
+    free(names);
+    vm->bytes_allocated += sizeof(HashMap) + hash_bytes(fields);
+    if (instance->slots != instance->inline_slots) {
+        free(instance->slots);
+        vm->bytes_allocated -= sizeof(Value) * instance->slot_capacity;
+    }
+    instance->slots = NULL;
+    instance->slot_capacity = 0;
+    instance->shape = NULL;
+    instance->fields = fields;
+}
+
+void class_set_slots(VM* vm, ObjClass* klass, Value slots) {
+    if (klass->table) {
+        printf("__slots__ of class '%s' must be set in its class body\n", klass->name);
+        exit(1);
+    }
+    Value* names = &slots;
+    int count = 1;
+    if (is_obj_type(slots, OBJ_TUPLE)) {
+        names = ((ObjTuple*)AS_OBJ(slots))->items;
+        count = ((ObjTuple*)AS_OBJ(slots))->count;
+    } else if (is_obj_type(slots, OBJ_LIST)) {
+        names = ((ObjList*)AS_OBJ(slots))->items;
+        count = ((ObjList*)AS_OBJ(slots))->count;
+    }
+
+    // The declared names follow the slots of the parent
+    Shape* shape = klass->parent ? klass->parent->base_shape : vm->root_shape;
+    for (int i = 0; i < count; i++) {
+        if (!is_obj_type(names[i], OBJ_STRING)) {
+            printf("__slots__ of class '%s' must be strings\n", klass->name);
+            exit(1);
+        }
+        ObjString* name = as_string(names[i]);
+        name = intern_const_string(vm, name->chars, name->length);
+        if (shape_slot(shape, name) >= 0) {
+            printf("Duplicate slot '%s' in class '%s'\n", name->chars, klass->name);
+            exit(1);
+        }
+        shape = shape_transition(vm, shape, name);
+    }
+    klass->base_shape = shape;
+    if (shape->slot_count > klass->slot_hint) {
+        klass->slot_hint = shape->slot_count;
+    }
+    // Python gives a subclass of a class without __slots__ a __dict__ anyway
+    klass->closed = !klass->parent || klass->parent->closed;
+}
+
+int instance_bytes(ObjInstance* instance) {
+    int bytes = sizeof(ObjInstance) + sizeof(Value) * instance->inline_capacity;
+    if (instance->slots && instance->slots != instance->inline_slots) {
+        bytes += sizeof(Value) * instance->slot_capacity;
+    }
+    if (instance->fields) {
+        bytes += sizeof(HashMap) + hash_bytes(instance->fields);
+    }
+    return bytes;
+}
+
+Value* instance_field(ObjInstance* instance, ObjString* name) {
+    if (!instance->shape) {
+        int index = hash_find_string(instance->fields, name->chars, name->length, name->hash);
+        return index >= 0 ? &instance->fields->entries[index].value : NULL;
+    }
+    int slot = shape_slot(instance->shape, name);
+    return slot >= 0 && !IS_UNASSIGNED(instance->slots[slot]) ? &instance->slots[slot] : NULL;
+}
+
+int instance_set_field(VM* vm, ObjInstance* instance, ObjString* name, Value value) {
+    if (instance->shape) {
+        int slot = shape_slot(instance->shape, name);
+        if (slot >= 0) {
+            instance->slots[slot] = value;
+            return slot;
+        }
+        if (instance->klass->closed) {
+            printf("'%s' object has no attribute '%s'\n", instance->klass->name, name->chars);
+            exit(1);
+        }
+        if (instance->shape->slot_count >= VM_SHAPE_MAX_FIELDS) {
+            instance_to_dictionary(vm, instance);
+        }
+    }
+    if (!instance->shape) {
+        hash_set(instance->fields, name, value);
+        return -1;
+    }
+
+    Shape* shape = shape_transition(vm, instance->shape, name);
+    int slot = shape->slot_count - 1;
+    if (slot >= instance->slot_capacity) {
+        int capacity = instance->slot_capacity ? instance->slot_capacity * 2 : 2;
+        if (capacity < instance->klass->slot_hint) {
+            capacity = instance->klass->slot_hint;
+        }
+        if (capacity > VM_SHAPE_MAX_FIELDS) {
+            capacity = VM_SHAPE_MAX_FIELDS;
+        }
+        Value* slots = malloc(sizeof(Value) * capacity);
+        memcpy(slots, instance->slots, sizeof(Value) * slot);
+        if (instance->slots != instance->inline_slots) {
+            free(instance->slots);
+            vm->bytes_allocated -= sizeof(Value) * instance->slot_capacity;
+        }
+        vm->bytes_allocated += sizeof(Value) * capacity;
+        instance->slots = slots;
+        instance->slot_capacity = capacity;
+    }
+    instance->slots[slot] = value;
+    instance->shape = shape;
+    if (shape->slot_count > instance->klass->slot_hint) {
+        instance->klass->slot_hint = shape->slot_count;
+    }
+    return slot;
 }
 
 Value vm_make_iterator(VM* vm, Value iterable) {
     ObjIterator* iterator = (ObjIterator*)vm_alloc_object(vm, sizeof(ObjIterator), OBJ_ITERATOR);
     iterator->iterable = iterable;
     iterator->index = 0;
-    Value v;
-    v.type = VAL_OBJ;
-    v.as.object = (Obj*)iterator;
-    return v;
-}
\ No newline at end of file
+    iterator->size = 0;
+    if (is_obj_type(iterable, OBJ_DICT)) {
+        iterator->size = ((ObjDict*)AS_OBJ(iterable))->map->count;
+    } else if (is_obj_type(iterable, OBJ_SET)) {
+        iterator->size = ((ObjSet*)AS_OBJ(iterable))->map->count;
+    }
+    return OBJ_VAL(iterator);
+}
+
+Value vm_make_range(VM* vm, long start, long stop, long step) {
+    ObjRange* range = (ObjRange*)vm_alloc_object(vm, sizeof(ObjRange), OBJ_RANGE);
+    range->start = start;
+    range->stop = stop;
+    range->step = step;
+    return OBJ_VAL(range);
+}
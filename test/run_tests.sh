@@ -2,6 +2,7 @@
 
 # Test runner for NanoPython
 # Compiles and runs all test files in the test directory
+# Extra arguments are passed to NanoPython, e.g. ./run_tests.sh --jit
 
 # Colors for output
 GREEN='\033[0;32m'
@@ -45,7 +46,7 @@ for test_file in test_*.py; do
         echo "---------------------------------------"
         
         # Run with integrated NanoPython
-        $NANOPYTHON "$test_file" 2>&1
+        $NANOPYTHON "$@" "$test_file" 2>&1
         run_status=$?
         
         if [ $run_status -eq 0 ]; then
@@ -32,3 +32,32 @@ print("(a + b) * 2 =", result)
 
 result = a + b * 2
 print("a + b * 2 =", result)
+
+# One call site seeing ints, floats and strings
+def plus(p, q):
+    return p + q
+
+print("plus ints =", plus(2, 3))
+print("plus floats =", plus(0.5, 0.25))
+print("plus strings =", plus("ab", "cd"))
+print("plus ints again =", plus(4, 5))
+
+# Comparisons use the operand types
+print("-3 < 2 =", -3 < 2)
+print("1 == 1.0 =", 1 == 1.0)
+print("2.5 >= 3 =", 2.5 >= 3)
+print("concat equal =", "ab" == "a" + "b")
+print("not 0 =", not 0)
+
+# Constant expressions are folded at compile time, with the runtime's results
+day = 60 * 60 * 24
+print("60 * 60 * 24 =", day)
+print("7 / 2 =", 7 / 2)
+print("7.0 / 2 =", 7.0 / 2)
+half = -0.5
+print("-0.5 =", half)
+neg_zero = -0.0
+print("-0.0 =", neg_zero)
+print("-a =", -a)
+print("not a =", not a)
+print("greeting =", "hello" + ", " + "world")
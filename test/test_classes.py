@@ -50,3 +50,484 @@ class Dog(Animal):
 dog = Dog("Buddy")
 dog.speak()
 print("Dog's name:", dog.name)
+
+# Attribute and method sites seeing several classes
+class Square:
+    def __init__(self, side):
+        self.side = side
+    def area(self):
+        return self.side * self.side
+
+class Rect:
+    def __init__(self, w, h):
+        self.w = w
+        self.h = h
+        self.side = w
+    def area(self):
+        return self.w * self.h
+
+class Cube(Square):
+    def volume(self):
+        return self.area() * self.side
+
+shapes = [Square(2), Rect(2, 3), Cube(3), Square(4), Rect(5, 1)]
+total = 0
+for s in shapes:
+    total = total + s.area() + s.side
+print("areas and sides:", total)
+cube = shapes[2]
+print("cube volume:", cube.volume())
+
+# Fields in a different order on instances of the same class
+class Pair:
+    def __init__(self, first):
+        if first:
+            self.a = 1
+            self.b = 2
+        else:
+            self.b = 20
+            self.a = 10
+
+pairs = [Pair(1), Pair(0), Pair(1), Pair(0)]
+sums = 0
+for q in pairs:
+    q.a = q.a + 1
+    sums = sums + q.a * 100 + q.b
+print("pair sums:", sums)
+
+# Redefining a method, also on a base class, reaches cached call sites
+def loud_area(self):
+    return 1000
+
+def describe(shape):
+    return shape.area()
+
+print("before:", describe(Square(3)), describe(Cube(2)))
+Square.area = loud_area
+print("after:", describe(Square(3)), describe(Cube(2)))
+
+# A field shadows a method the site found on the class before
+class Greeter:
+    def hello(self):
+        return "method"
+
+g1 = Greeter()
+g2 = Greeter()
+g2.hello = "field"
+for g in [g1, g2, g1]:
+    print("hello:", g.hello)
+
+# More classes than a site caches
+class K1:
+    def f(self):
+        return 1
+class K2:
+    def f(self):
+        return 2
+class K3:
+    def f(self):
+        return 3
+class K4:
+    def f(self):
+        return 4
+class K5:
+    def f(self):
+        return 5
+class K6:
+    def f(self):
+        return 6
+
+ks = [K1(), K2(), K3(), K4(), K5(), K6()]
+kt = 0
+for r in range(3):
+    for k in ks:
+        kt = kt + k.f()
+print("megamorphic:", kt)
+
+# A monomorphic site misses its cache once
+before = quicken_stats()
+pt = Point(1, 2)
+acc = 0
+for i in range(1000):
+    acc = acc + pt.x + pt.y
+after = quicken_stats()
+print("monomorphic:", acc, after["cache_misses"] - before["cache_misses"] < 5)
+
+# Instances given the same fields in another order have another shape
+class Bag:
+    def __init__(self):
+        self.n = 0
+
+b1 = Bag()
+b1.x = 1
+b1.y = 2
+b2 = Bag()
+b2.y = 30
+b2.x = 40
+b3 = Bag()
+b3.y = 500
+bt = 0
+for b in [b1, b2, b1, b2]:
+    bt = bt + b.x * 10 + b.y
+print("orders:", bt, b3.y)
+
+# Later instances of a class get more fields than the first one had
+gt = 0
+for i in range(50):
+    g = Bag()
+    g.a = i
+    if i > 10:
+        g.b = i * 2
+        g.c = i * 3
+        g.d = i * 4
+    gt = gt + g.a
+    if g.a > 10:
+        gt = gt + g.b + g.c + g.d
+print("grown:", gt)
+
+# An instance with many fields moves them to a dictionary
+w = Bag()
+w.f0 = 0
+w.f1 = 1
+w.f2 = 2
+w.f3 = 3
+w.f4 = 4
+w.f5 = 5
+w.f6 = 6
+w.f7 = 7
+w.f8 = 8
+w.f9 = 9
+w.f10 = 10
+w.f11 = 11
+w.f12 = 12
+w.f13 = 13
+w.f14 = 14
+w.f15 = 15
+w.f16 = 16
+w.f17 = 17
+w.f18 = 18
+w.f19 = 19
+w.f20 = 20
+w.f21 = 21
+w.f22 = 22
+w.f23 = 23
+w.f24 = 24
+w.f25 = 25
+w.f26 = 26
+w.f27 = 27
+w.f28 = 28
+w.f29 = 29
+w.f30 = 30
+w.f31 = 31
+w.f32 = 32
+w.f33 = 33
+w.f34 = 34
+w.f35 = 35
+w.f36 = 36
+w.f37 = 37
+w.f38 = 38
+w.f39 = 39
+w.f3 = 300
+ws = w.n
+ws = ws + w.f0
+ws = ws + w.f1
+ws = ws + w.f2
+ws = ws + w.f3
+ws = ws + w.f4
+ws = ws + w.f5
+ws = ws + w.f6
+ws = ws + w.f7
+ws = ws + w.f8
+ws = ws + w.f9
+ws = ws + w.f10
+ws = ws + w.f11
+ws = ws + w.f12
+ws = ws + w.f13
+ws = ws + w.f14
+ws = ws + w.f15
+ws = ws + w.f16
+ws = ws + w.f17
+ws = ws + w.f18
+ws = ws + w.f19
+ws = ws + w.f20
+ws = ws + w.f21
+ws = ws + w.f22
+ws = ws + w.f23
+ws = ws + w.f24
+ws = ws + w.f25
+ws = ws + w.f26
+ws = ws + w.f27
+ws = ws + w.f28
+ws = ws + w.f29
+ws = ws + w.f30
+ws = ws + w.f31
+ws = ws + w.f32
+ws = ws + w.f33
+ws = ws + w.f34
+ws = ws + w.f35
+ws = ws + w.f36
+ws = ws + w.f37
+ws = ws + w.f38
+ws = ws + w.f39
+print("wide:", ws, w.f39)
+
+# Building instances takes the cached transitions
+before = quicken_stats()
+built = 0
+for i in range(1000):
+    made = Point(i, 1)
+    built = built + made.x
+after = quicken_stats()
+print("construct:", built, after["cache_misses"] - before["cache_misses"] < 10)
+
+# Inherited lookups through a deep hierarchy, and methods changed later
+class D0:
+    def __init__(self, v):
+        self.v = v
+    def who(self):
+        return "D0"
+    def val(self):
+        return self.v
+class D1(D0):
+    def who(self):
+        return "D1"
+class D2(D1):
+    def extra(self):
+        return 2
+class D3(D2):
+    def extra(self):
+        return 3
+class D4(D3):
+    def more(self):
+        return 4
+
+d4 = D4(40)
+print("deep:", d4.who(), d4.val(), d4.extra(), d4.more())
+def d_who(self):
+    return "D2 now"
+D2.who = d_who
+d3 = D3(3)
+d1 = D1(1)
+print("deep after:", d4.who(), d3.who(), d1.who())
+def d_val(self):
+    return self.v * 1000
+D0.val = d_val
+print("root after:", d4.val(), d1.val())
+inherited = D4.val
+print("class attr:", inherited(d4))
+
+class D5(D4):
+    def who(self):
+        return "D5"
+d5 = D5(5)
+print("late subclass:", d5.who(), d5.val(), d4.who())
+
+# __slots__ fixes the layout of instances
+class Slotted:
+    __slots__ = ("x", "y")
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+    def total(self):
+        return self.x + self.y
+
+class Slotted3(Slotted):
+    __slots__ = ["z"]
+    def __init__(self, x, y, z):
+        self.z = z
+        self.y = y
+        self.x = x
+
+class Unslotted(Slotted):
+    def more(self):
+        return self.total() * 10
+
+class Named:
+    __slots__ = "name"
+
+s2 = Slotted(1, 2)
+s3 = Slotted3(3, 4, 5)
+su = Unslotted(6, 7)
+su.extra = 8
+nm = Named()
+print("slots:", s2.total(), s3.total(), s3.z, su.more(), su.extra, hasattr(nm, "name"), Slotted.__slots__)
+nm.name = "set"
+print("slot assigned:", hasattr(nm, "name"), nm.name, hasattr(nm, "total"), hasattr(s2, "total"))
+s3.x = 30
+print("slots set:", s3.total())
+m2 = mem(s2)
+m3 = mem(s3)
+mp = mem(Point(1, 2))
+print("slot bytes:", m2["instance_bytes"] <= mp["instance_bytes"], m3["instance_bytes"] > m2["instance_bytes"])
+
+# Special methods: operators, len(), hash(), indexing and loops
+class Vec:
+    def __init__(self, x, y):
+        self.x = x
+        self.y = y
+    def __add__(self, other):
+        return Vec(self.x + other.x, self.y + other.y)
+    def __sub__(self, other):
+        return Vec(self.x - other.x, self.y - other.y)
+    def __mul__(self, k):
+        return Vec(self.x * k, self.y * k)
+    def __eq__(self, other):
+        if self.x == other.x:
+            return self.y == other.y
+        return False
+    def __lt__(self, other):
+        return self.x * self.x + self.y * self.y < other.x * other.x + other.y * other.y
+    def __len__(self):
+        return 2
+    def __getitem__(self, i):
+        if i == 0:
+            return self.x
+        return self.y
+    def __hash__(self):
+        return self.x * 31 + self.y
+    def show(self):
+        return "Vec(" + str(self.x) + ", " + str(self.y) + ")"
+
+a = Vec(1, 2)
+b = Vec(3, 4)
+c = a + b
+d = b - a
+e = a * 3
+print("vec ops:", c.show(), d.show(), e.show(), len(c), c[0], c[1], hash(a))
+print("vec compare:", a == Vec(1, 2), a != b, a != Vec(1, 2), a < b, b < a, b > a, a > b)
+if a < b:
+    print("vec branch: less")
+if a != b:
+    print("vec branch: differ")
+if b == a:
+    print("vec branch: wrong")
+total = Vec(0, 0)
+for i in range(3):
+    total = total + a
+print("vec sum:", total.show())
+print("hash builtin:", hash(7), hash(True), hash(2.0), hash("ab") == hash("a" + "b"), hash(a) == hash(Vec(1, 2)))
+
+class Countdown:
+    def __init__(self, n):
+        self.n = n
+    def __iter__(self):
+        return self
+    def __next__(self):
+        if self.n == 0:
+            return StopIteration
+        self.n = self.n - 1
+        return self.n + 1
+
+class Bag:
+    def __init__(self):
+        self.items = [10, 20, 30]
+    def __iter__(self):
+        return self.items
+    def __len__(self):
+        return len(self.items)
+
+for n in Countdown(3):
+    print("countdown:", n)
+seen = 0
+for item in Bag():
+    seen = seen + item
+print("bag:", seen, len(Bag()))
+
+class Matrix:
+    def __init__(self, a, b, c, d):
+        self.a = a
+        self.b = b
+        self.c = c
+        self.d = d
+    def __mul__(self, m):
+        return Matrix(self.a * m.a + self.b * m.c, self.a * m.b + self.b * m.d, self.c * m.a + self.d * m.c, self.c * m.b + self.d * m.d)
+    def __getitem__(self, i):
+        if i == 0:
+            return self.a
+        return self.b
+
+def fib_matrix(n):
+    result = Matrix(1, 0, 0, 1)
+    step = Matrix(1, 1, 1, 0)
+    while n > 0:
+        result = result * step
+        n = n - 1
+    return result[1]
+
+print("matrix fib:", fib_matrix(10), fib_matrix(20))
+
+class Loud(Vec):
+    def __add__(self, other):
+        print("loud add")
+        return Vec(self.x + other.x, 0)
+
+def twice(p, q):
+    first = p + q
+    second = p + q
+    return first == second
+
+loud = Loud(1, 1) + a
+print("special in subclass:", twice(Loud(1, 1), a), loud.show(), Loud(5, 5) == Vec(5, 5))
+
+class Meter:
+    def __init__(self, n):
+        self.n = n
+    def __add__(self, k):
+        return Meter(self.n + k)
+
+def bump(m):
+    m = m + 5
+    step = m + 1
+    return step.n
+
+m = Meter(1)
+for i in range(3):
+    m = m + 2
+print("meter:", m.n, bump(m))
+
+def grow(m):
+    for i in range(2):
+        m = m + 3
+    return m.n
+
+print("meter grown:", grow(Meter(0)))
+
+# A class collected and another allocated in its place must not hit the
+# caches filled for the first
+def who_first(self):
+    return "first"
+def who_second(self):
+    return "second"
+def make_class(f):
+    class Made:
+        def __init__(self):
+            self.v = 1
+    Made.who = f
+    return Made
+
+def call_who(o):
+    return o.who()
+
+Made = make_class(who_first)
+print("made:", call_who(Made()))
+Made = None
+gc()
+Made = make_class(who_second)
+print("made again:", call_who(Made()))
+
+# A store on a class without subclasses is seen by the sites that cached
+# the class, including the value it replaces and a special method
+class Tally:
+    def count(self):
+        return self.n
+
+def tally_add(self, other):
+    return self.count() + other.count()
+
+Tally.n = 0
+tly = Tally()
+for i in range(3):
+    Tally.n = Tally.n + 1
+    print("tally:", tly.count(), tly.n)
+Tally.__add__ = tally_add
+print("tally added:", tly + tly)
@@ -41,3 +41,13 @@ print("After age update:", person)
 nested = [[1, 2], [3, 4], [5, 6]]
 print("Nested list:", nested)
 print("nested[1][0] =", nested[1][0])
+
+# Dicts keep insertion order across growth
+grow = {"k1": 1, "k2": 2, "k3": 3}
+grow["k4"] = 4
+grow["k5"] = 5
+grow["k6"] = 6
+grow["k7"] = 7
+grow["k2"] = 20
+print("Grown dict:", grow)
+print("grow[k7] =", grow["k7"])
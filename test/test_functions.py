@@ -47,3 +47,228 @@ def no_return():
 
 result = no_return()
 print("no_return() returned:", result)
+
+# Locals live in frame slots and shadow globals of the same name
+x = "global"
+def shadow(a):
+    x = a * 2
+    y = x + 1
+    return y
+
+print("shadow(5) =", shadow(5))
+print("global x after shadow:", x)
+
+# Locals of one call do not leak into the next
+def counter(n):
+    total = 0
+    i = 0
+    while i < n:
+        total = total + i
+        i = i + 1
+    return total
+
+print("counter(4) =", counter(4))
+print("counter(10) =", counter(10))
+
+# Hot functions: past the JIT threshold when run with --jit, results must
+# match the interpreter (including type changes at a quickened site)
+def fib(n):
+    if n < 2:
+        return n
+    return fib(n - 1) + fib(n - 2)
+
+print("fib(15) =", fib(15))
+
+def scale(v, k):
+    total = 0
+    for i in range(3):
+        total = total + v * k
+    return total
+
+i = 0
+ints = 0
+while i < 200:
+    ints = ints + scale(i, 2)
+    i = i + 1
+print("scale ints:", ints)
+print("scale floats:", scale(1.5, 2))
+print("scale negative:", scale(-4, 3))
+
+# Function bodies go through the SSA IR at -O1: swaps through phis, values
+# that may be undefined on one path, loop invariants and early exits
+def swap_steps(a, b, n):
+    i = 0
+    while i < n:
+        t = a
+        a = b
+        b = t
+        i = i + 1
+    return a - b
+
+print("swap_steps:", swap_steps(1, 2, 3), swap_steps(1, 2, 4))
+
+def invariant(n, k):
+    total = 0
+    for i in range(n):
+        if i > 5:
+            break
+        total = total + (k * 2 + 1) * i
+    return total
+
+print("invariant:", invariant(10, 3), invariant(2, 3))
+
+def first_over(n, limit):
+    for i in range(n):
+        for j in range(n):
+            if i * j > limit:
+                return i * 100 + j
+    return 0
+
+print("first_over:", first_over(10, 20), first_over(3, 20))
+
+def maybe(flag):
+    if flag:
+        x = 1
+    y = 2
+    if flag:
+        return x + y
+    return y
+
+print("maybe:", maybe(1), maybe(0))
+
+def unused_division(a, b):
+    c = a / b
+    return a
+print("unused_division:", unused_division(6, 3))
+
+# Proven int and float arithmetic runs as statically typed opcodes
+def typed_sum(n):
+    total = 0
+    for i in range(n):
+        total = total + i * i - 1
+    return total
+
+def typed_mean(a, b, n):
+    x = float(a)
+    y = int(b)
+    s = 0.0
+    i = 0
+    while i < n:
+        s = s + x / 2.0
+        if s > 10.0:
+            s = s - 1.5
+        i = i + y
+    return s
+
+print("typed_sum:", typed_sum(10), typed_sum(0))
+print("typed_mean:", typed_mean(3, 1, 8), typed_mean(5, 2, 4))
+print("typed compares:", typed_sum(3) < typed_sum(4), typed_sum(2) == 3)
+
+# Small top-level functions are expanded at their call sites
+def sq(x):
+    return x * x
+
+def bounded(v, lo, hi):
+    if v < lo:
+        return lo
+    if v > hi:
+        return hi
+    return v
+
+def hypot2(a, b):
+    return sq(a) + sq(b)
+
+def sign_word(v):
+    if v < 0:
+        word = "negative"
+    else:
+        word = "positive"
+
+def inlined_loop(n):
+    total = 0
+    for i in range(n):
+        total = total + hypot2(i, 2) + bounded(i, 1, 4)
+    return total
+
+def shadowed(sq):
+    return sq + 1
+
+def recount(n):
+    x = n
+    return sq(x) + x
+
+print("inlined:", sq(9), hypot2(3, 4), bounded(sq(3), 0, 5))
+print("inlined_loop:", inlined_loop(6), inlined_loop(0))
+print("no return:", sign_word(-1), sign_word(1))
+print("shadowed:", shadowed(4), recount(3))
+
+def helper(a):
+    return a + 1
+
+def uses_helper(n):
+    return helper(n) * 2
+
+print("before rebinding:", uses_helper(3))
+helper = sq
+print("after rebinding:", uses_helper(3))
+
+def scale(x):
+    return x * 2
+
+def use_scale(n):
+    return scale(n) + 1
+
+print("scale:", use_scale(5), scale(5))
+def scale(x):
+    return x * 3
+print("scale redefined:", use_scale(5), scale(5))
+
+# Calls in tail position reuse the caller's frame, far deeper than the
+# call stack allows
+def count_down(n, acc):
+    if n == 0:
+        return acc
+    return count_down(n - 1, acc + n)
+
+def is_even(n):
+    if n == 0:
+        return 1
+    return is_odd(n - 1)
+
+def is_odd(n):
+    if n == 0:
+        return 0
+    return is_even(n - 1)
+
+def sum_items(items, i, total):
+    if i == len(items):
+        return total
+    return sum_items(items, i + 1, total + items[i])
+
+def tail_native(items):
+    return len(items)
+
+def tail_nested(n):
+    def add_one(x):
+        return x + 1
+    return add_one(n)
+
+print("count_down:", count_down(50000, 0))
+print("even/odd:", is_even(10001), is_odd(7777))
+print("sum_items:", sum_items([1, 2, 3, 4], 0, 0))
+print("tail_native:", tail_native([1, 2, 3]), "tail_nested:", tail_nested(4))
+
+# Non-tail recursion deeper than the initial call stack grows it
+def depth(n):
+    if n == 0:
+        return 0
+    return 1 + depth(n - 1)
+
+def build_nested(n):
+    if n == 0:
+        return [0]
+    return [n, build_nested(n - 1)]
+
+print("depth:", depth(5000))
+nested = build_nested(300)
+print("nested:", nested[0], nested[1][0], nested[1][1][1][0])
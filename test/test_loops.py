@@ -20,6 +20,26 @@ count = [0, 1, 2, 3, 4]
 for c in count:
     print("count:", c)
 
+# For loop over range()
+print("For loop over range:")
+for i in range(3):
+    print("i =", i)
+for i in range(10, 0, -4):
+    print("down:", i)
+r = range(2, 9, 3)
+print(r, len(r), r[1], r[-1])
+for x in r:
+    print("x =", x)
+
+# For loop over dict keys, in insertion order
+print("For loop over dict:")
+ages = {"ann": 31, "bob": 25, "cid": 40}
+ages["dan"] = 19
+for name in ages:
+    print(name, "is", ages[name])
+n = len(ages)
+print("len(ages) =", n)
+
 # Break statement
 print("Break test:")
 i = 0
@@ -38,3 +58,55 @@ while i < 5:
     if i == 3:
         continue
     print("i =", i)
+
+# Hot loops whose types change after many iterations (tracing JIT guards)
+print("Hot loop tests:")
+acc = 0
+for i in range(100):
+    if i == 70:
+        acc = acc + 0.5
+    acc = acc + i
+print("acc =", acc)
+w = 1
+n = 0
+while n < 80:
+    w = w * 3
+    if n == 60:
+        w = 2.5
+    n = n + 1
+print("w > 1e9:", w > 1000000000.0)
+total = 0
+for i in range(10):
+    for j in range(0, 90, 3):
+        total = total + i * j
+print("total =", total)
+
+# Counters and loop conditions that leave the int fast paths part way
+print("Superinstruction tests:")
+x = 0
+k = 0
+while k < 120:
+    x = x + 1
+    if k == 90:
+        x = x + 0.25
+    k = k + 1
+print("x =", x)
+s = "a"
+while s < "aaaaa":
+    s = s + "a"
+print("s =", s)
+f = 0.0
+while f <= 3.0:
+    f = f + 0.5
+print("f =", f)
+def count_down(n):
+    steps = 0
+    while n > 0:
+        n = n + -1
+        steps = steps + 1
+    return steps
+print("count_down:", count_down(150))
+m = 0
+while m != 100:
+    m = m + 4
+print("m =", m)
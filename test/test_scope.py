@@ -37,3 +37,22 @@ def outer():
     inner()
 
 outer()
+
+# Globals defined after a function are visible when it runs
+def read_later():
+    return later_value * 2
+
+later_value = 21
+print("read_later() =", read_later())
+later_value = 50
+print("read_later() after rebinding =", read_later())
+
+# A global that shadows a builtin is seen by functions compiled before it,
+# the compiler must not assume int() returns an int
+def to_number(x):
+    return int(x) + 1
+
+def int(x):
+    return "int:"
+
+print("to_number(3) =", to_number(3))